@@ -8,14 +8,46 @@
 
 #include "nautilus-animated-paintable.h"
 
+/* Frames of all animations together may take this much memory. Animations
+ * that don't fit anymore only show their first frame. */
+#define FRAME_MEMORY_BUDGET (128 * 1024 * 1024)
+
+/* Bounds on decoding loops that are too long, or of unknown length. */
+#define MAX_FRAMES 256
+#define MAX_DURATION_USEC (60 * G_USEC_PER_SEC)
+
+/* Like browsers do, treat shorter delays as a mistake of the encoder. */
+#define MIN_FRAME_DELAY_MSEC 20
+
+typedef struct
+{
+    GdkTexture *texture;
+    gint64 duration;
+    gsize size;
+} Frame;
+
+/* Ticks the animations of all widgets that share a frame clock at once. */
+typedef struct
+{
+    GdkFrameClock *frame_clock;
+    gulong update_handler_id;
+    GPtrArray *paintables;
+} FrameClockDriver;
+
 struct _NautilusAnimatedPaintable
 {
     GObject parent_instance;
 
-    GdkPixbufAnimation *animation;
-    GdkPixbufAnimationIter *iter;
-    GdkTexture *current_texture;
-    guint timeout_id;
+    /* Shared with copies, never changed once decoded */
+    GArray *frames;
+    guint current_frame;
+    gint64 next_frame_time;
+    int size;
+    int width;
+    int height;
+
+    GtkWidget *widget;
+    FrameClockDriver *driver;
     gboolean is_playing;
 };
 
@@ -25,51 +57,221 @@ G_DEFINE_TYPE_WITH_CODE (NautilusAnimatedPaintable, nautilus_animated_paintable,
                           G_IMPLEMENT_INTERFACE (GDK_TYPE_PAINTABLE,
                                                  nautilus_animated_paintable_paintable_init))
 
+/* GdkFrameClock → FrameClockDriver */
+static GHashTable *drivers = NULL;
+
+/* Animations may be decoded in threads. */
+G_LOCK_DEFINE_STATIC (total_frame_bytes);
+static gsize total_frame_bytes = 0;
+
+static void
+frame_clear (Frame *frame)
+{
+    g_clear_object (&frame->texture);
+
+    G_LOCK (total_frame_bytes);
+    total_frame_bytes -= frame->size;
+    G_UNLOCK (total_frame_bytes);
+}
+
+static void
+on_frame_clock_update (GdkFrameClock    *frame_clock,
+                       FrameClockDriver *driver)
+{
+    gint64 now = gdk_frame_clock_get_frame_time (frame_clock);
+    g_autoptr (GPtrArray) paintables = g_ptr_array_new_full (driver->paintables->len,
+                                                             g_object_unref);
+
+    /* Redrawing may stop animations, and with the last one the driver goes
+     * away, so walk a copy of its paintables instead. */
+    for (guint i = 0; i < driver->paintables->len; i++)
+    {
+        g_ptr_array_add (paintables, g_object_ref (driver->paintables->pdata[i]));
+    }
+
+    for (guint i = 0; i < paintables->len; i++)
+    {
+        NautilusAnimatedPaintable *self = paintables->pdata[i];
+        guint previous_frame = self->current_frame;
+
+        if (self->driver == NULL)
+        {
+            continue;
+        }
+
+        while (now >= self->next_frame_time)
+        {
+            self->current_frame = (self->current_frame + 1) % self->frames->len;
+            self->next_frame_time += g_array_index (self->frames, Frame, self->current_frame).duration;
+
+            /* After a stall, like a suspend, pick up from now on instead
+             * of catching up frame by frame. */
+            if (now - self->next_frame_time > G_USEC_PER_SEC)
+            {
+                self->next_frame_time = now;
+            }
+        }
+
+        if (self->current_frame != previous_frame)
+        {
+            gdk_paintable_invalidate_contents (GDK_PAINTABLE (self));
+        }
+    }
+}
+
 static void
-update_texture (NautilusAnimatedPaintable *self)
+detach_from_frame_clock (NautilusAnimatedPaintable *self)
 {
-    GdkPixbuf *pixbuf;
+    FrameClockDriver *driver = self->driver;
 
-    if (self->iter == NULL)
+    if (driver == NULL)
     {
         return;
     }
 
-    pixbuf = gdk_pixbuf_animation_iter_get_pixbuf (self->iter);
+    self->driver = NULL;
+    g_ptr_array_remove_fast (driver->paintables, self);
 
-    if (pixbuf != NULL)
+    if (driver->paintables->len == 0)
     {
-        g_clear_object (&self->current_texture);
-        self->current_texture = gdk_texture_new_for_pixbuf (pixbuf);
-        gdk_paintable_invalidate_contents (GDK_PAINTABLE (self));
+        gdk_frame_clock_end_updating (driver->frame_clock);
+        g_clear_signal_handler (&driver->update_handler_id, driver->frame_clock);
+        g_hash_table_remove (drivers, driver->frame_clock);
     }
 }
 
-static gboolean
-advance_frame (gpointer data)
+static void
+frame_clock_driver_free (FrameClockDriver *driver)
+{
+    g_object_unref (driver->frame_clock);
+    g_ptr_array_unref (driver->paintables);
+    g_free (driver);
+}
+
+/* Ticks only run for animations that play in a mapped widget, so that rows
+ * scrolled out of view cost nothing. */
+static void
+attach_to_frame_clock (NautilusAnimatedPaintable *self)
 {
-    NautilusAnimatedPaintable *self = NAUTILUS_ANIMATED_PAINTABLE (data);
-    GTimeVal current_time;
-    int delay;
+    GdkFrameClock *frame_clock;
+    FrameClockDriver *driver;
+
+    if (self->driver != NULL ||
+        !self->is_playing ||
+        self->frames->len < 2 ||
+        self->widget == NULL ||
+        !gtk_widget_get_mapped (self->widget))
+    {
+        return;
+    }
 
-    if (!self->is_playing || self->iter == NULL)
+    frame_clock = gtk_widget_get_frame_clock (self->widget);
+    if (frame_clock == NULL)
     {
-        self->timeout_id = 0;
-        return G_SOURCE_REMOVE;
+        return;
     }
 
-    g_get_current_time (&current_time);
-    gdk_pixbuf_animation_iter_advance (self->iter, &current_time);
+    if (drivers == NULL)
+    {
+        drivers = g_hash_table_new_full (NULL, NULL, NULL,
+                                         (GDestroyNotify) frame_clock_driver_free);
+    }
 
-    update_texture (self);
+    driver = g_hash_table_lookup (drivers, frame_clock);
+    if (driver == NULL)
+    {
+        driver = g_new0 (FrameClockDriver, 1);
+        driver->frame_clock = g_object_ref (frame_clock);
+        driver->paintables = g_ptr_array_new ();
+        driver->update_handler_id = g_signal_connect (frame_clock, "update",
+                                                      G_CALLBACK (on_frame_clock_update), driver);
+        gdk_frame_clock_begin_updating (frame_clock);
+        g_hash_table_insert (drivers, frame_clock, driver);
+    }
 
-    delay = gdk_pixbuf_animation_iter_get_delay_time (self->iter);
-    if (delay >= 0)
+    g_ptr_array_add (driver->paintables, self);
+    self->driver = driver;
+    self->next_frame_time = gdk_frame_clock_get_frame_time (frame_clock) +
+                            g_array_index (self->frames, Frame, self->current_frame).duration;
+}
+
+static GdkPixbuf *
+scale_frame (GdkPixbuf *pixbuf,
+             int        size)
+{
+    int width = gdk_pixbuf_get_width (pixbuf);
+    int height = gdk_pixbuf_get_height (pixbuf);
+    double scale;
+
+    if (size <= 0 || MAX (width, height) <= size)
     {
-        self->timeout_id = g_timeout_add (delay, advance_frame, self);
+        /* Iterators may reuse their pixbuf for the next frame. */
+        return gdk_pixbuf_copy (pixbuf);
     }
 
-    return G_SOURCE_REMOVE;
+    scale = (double) size / MAX (width, height);
+
+    return gdk_pixbuf_scale_simple (pixbuf,
+                                    MAX (width * scale, 1),
+                                    MAX (height * scale, 1),
+                                    GDK_INTERP_BILINEAR);
+}
+
+/* Steps through one loop of @animation, scaling each frame to @size and
+ * uploading it once. GdkPixbufAnimation has no notion of frames or of a loop,
+ * only of the image shown at a given time, so the loop is @n_frames long, as
+ * counted from the headers of the file. Frames that look the same may well
+ * be different frames of the loop. */
+static void
+decode_frames (NautilusAnimatedPaintable *self,
+               GdkPixbufAnimation        *animation,
+               guint                      n_frames,
+               int                        size)
+{
+    g_autoptr (GdkPixbufAnimationIter) iter = NULL;
+    GTimeVal time = { 0, 0 };
+    gint64 elapsed = 0;
+    guint max_frames = (n_frames > 0) ? MIN (n_frames, MAX_FRAMES) : MAX_FRAMES;
+
+    iter = gdk_pixbuf_animation_get_iter (animation, &time);
+
+    while (self->frames->len < max_frames && elapsed < MAX_DURATION_USEC)
+    {
+        g_autoptr (GdkPixbuf) pixbuf = scale_frame (gdk_pixbuf_animation_iter_get_pixbuf (iter), size);
+        int delay = gdk_pixbuf_animation_iter_get_delay_time (iter);
+        Frame frame = { 0 };
+        gboolean over_budget;
+
+        frame.duration = (gint64) MAX (delay, MIN_FRAME_DELAY_MSEC) * 1000;
+        frame.texture = gdk_texture_new_for_pixbuf (pixbuf);
+        frame.size = gdk_pixbuf_get_byte_length (pixbuf);
+
+        G_LOCK (total_frame_bytes);
+        total_frame_bytes += frame.size;
+        over_budget = total_frame_bytes > FRAME_MEMORY_BUDGET;
+        G_UNLOCK (total_frame_bytes);
+
+        self->width = gdk_pixbuf_get_width (pixbuf);
+        self->height = gdk_pixbuf_get_height (pixbuf);
+        g_array_append_val (self->frames, frame);
+
+        if (self->frames->len > 1 && over_budget)
+        {
+            g_debug ("No memory left for the frames of an animation, showing it still");
+            g_array_set_size (self->frames, 1);
+            break;
+        }
+
+        if (delay < 0)
+        {
+            /* A still image, or the end of an animation that doesn't loop */
+            break;
+        }
+
+        elapsed += frame.duration;
+        g_time_val_add (&time, (glong) delay * 1000);
+        gdk_pixbuf_animation_iter_advance (iter, &time);
+    }
 }
 
 static void
@@ -80,9 +282,11 @@ nautilus_animated_paintable_snapshot (GdkPaintable *paintable,
 {
     NautilusAnimatedPaintable *self = NAUTILUS_ANIMATED_PAINTABLE (paintable);
 
-    if (self->current_texture != NULL)
+    if (self->frames->len > 0)
     {
-        gdk_paintable_snapshot (GDK_PAINTABLE (self->current_texture),
+        Frame *frame = &g_array_index (self->frames, Frame, self->current_frame);
+
+        gdk_paintable_snapshot (GDK_PAINTABLE (frame->texture),
                                  snapshot, width, height);
     }
 }
@@ -92,12 +296,7 @@ nautilus_animated_paintable_get_intrinsic_width (GdkPaintable *paintable)
 {
     NautilusAnimatedPaintable *self = NAUTILUS_ANIMATED_PAINTABLE (paintable);
 
-    if (self->animation != NULL)
-    {
-        return gdk_pixbuf_animation_get_width (self->animation);
-    }
-
-    return 0;
+    return self->width;
 }
 
 static int
@@ -105,12 +304,7 @@ nautilus_animated_paintable_get_intrinsic_height (GdkPaintable *paintable)
 {
     NautilusAnimatedPaintable *self = NAUTILUS_ANIMATED_PAINTABLE (paintable);
 
-    if (self->animation != NULL)
-    {
-        return gdk_pixbuf_animation_get_height (self->animation);
-    }
-
-    return 0;
+    return self->height;
 }
 
 static void
@@ -122,15 +316,21 @@ nautilus_animated_paintable_paintable_init (GdkPaintableInterface *iface)
 }
 
 static void
-nautilus_animated_paintable_finalize (GObject *object)
+nautilus_animated_paintable_dispose (GObject *object)
 {
     NautilusAnimatedPaintable *self = NAUTILUS_ANIMATED_PAINTABLE (object);
 
-    nautilus_animated_paintable_stop (self);
+    nautilus_animated_paintable_set_widget (self, NULL);
+
+    G_OBJECT_CLASS (nautilus_animated_paintable_parent_class)->dispose (object);
+}
+
+static void
+nautilus_animated_paintable_finalize (GObject *object)
+{
+    NautilusAnimatedPaintable *self = NAUTILUS_ANIMATED_PAINTABLE (object);
 
-    g_clear_object (&self->animation);
-    g_clear_object (&self->iter);
-    g_clear_object (&self->current_texture);
+    g_array_unref (self->frames);
 
     G_OBJECT_CLASS (nautilus_animated_paintable_parent_class)->finalize (object);
 }
@@ -140,71 +340,185 @@ nautilus_animated_paintable_class_init (NautilusAnimatedPaintableClass *klass)
 {
     GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
+    object_class->dispose = nautilus_animated_paintable_dispose;
     object_class->finalize = nautilus_animated_paintable_finalize;
 }
 
 static void
 nautilus_animated_paintable_init (NautilusAnimatedPaintable *self)
 {
-    self->is_playing = FALSE;
-    self->timeout_id = 0;
+    self->frames = g_array_new (FALSE, TRUE, sizeof (Frame));
+    g_array_set_clear_func (self->frames, (GDestroyNotify) frame_clear);
 }
 
+/**
+ * nautilus_animated_paintable_new:
+ * @animation: the animation to play
+ * @n_frames: the number of frames of one loop, as given by
+ *   nautilus_animated_thumbnail_count_frames(), or 0 if unknown
+ * @size: the largest width or height to show it at, or 0 for its own size
+ *
+ * Decodes the frames of @animation at @size up front, so that playing it only
+ * swaps textures. Without @n_frames, frames are decoded until the animation
+ * ends or gets too long, which may be several loops. Once the frames of all
+ * animations take too much memory, new ones only get their first frame.
+ *
+ * This may be called in a thread, unlike the rest of the functions here.
+ */
 NautilusAnimatedPaintable *
-nautilus_animated_paintable_new (GdkPixbufAnimation *animation)
+nautilus_animated_paintable_new (GdkPixbufAnimation *animation,
+                                 guint               n_frames,
+                                 int                 size)
 {
     NautilusAnimatedPaintable *self;
-    GTimeVal time;
 
     g_return_val_if_fail (GDK_IS_PIXBUF_ANIMATION (animation), NULL);
 
     self = g_object_new (NAUTILUS_TYPE_ANIMATED_PAINTABLE, NULL);
-    self->animation = g_object_ref (animation);
+    self->size = size;
+    decode_frames (self, animation, n_frames, size);
+
+    return self;
+}
+
+/**
+ * nautilus_animated_paintable_copy:
+ * @self: a #NautilusAnimatedPaintable
+ *
+ * Returns: (transfer full): a stopped paintable showing the same frames as
+ * @self, without decoding or uploading them again.
+ */
+NautilusAnimatedPaintable *
+nautilus_animated_paintable_copy (NautilusAnimatedPaintable *self)
+{
+    NautilusAnimatedPaintable *copy;
 
-    g_get_current_time (&time);
-    self->iter = gdk_pixbuf_animation_get_iter (animation, &time);
+    g_return_val_if_fail (NAUTILUS_IS_ANIMATED_PAINTABLE (self), NULL);
 
-    update_texture (self);
+    copy = g_object_new (NAUTILUS_TYPE_ANIMATED_PAINTABLE, NULL);
+    g_array_unref (copy->frames);
+    copy->frames = g_array_ref (self->frames);
+    copy->size = self->size;
+    copy->width = self->width;
+    copy->height = self->height;
 
-    return self;
+    return copy;
 }
 
-void
-nautilus_animated_paintable_start (NautilusAnimatedPaintable *self)
+/* The size passed to nautilus_animated_paintable_new(). */
+int
+nautilus_animated_paintable_get_size (NautilusAnimatedPaintable *self)
+{
+    g_return_val_if_fail (NAUTILUS_IS_ANIMATED_PAINTABLE (self), 0);
+
+    return self->size;
+}
+
+guint
+nautilus_animated_paintable_get_n_frames (NautilusAnimatedPaintable *self)
+{
+    g_return_val_if_fail (NAUTILUS_IS_ANIMATED_PAINTABLE (self), 0);
+
+    return self->frames->len;
+}
+
+/* Memory taken by the decoded frames, which copies share. */
+gsize
+nautilus_animated_paintable_get_frame_bytes (NautilusAnimatedPaintable *self)
+{
+    gsize frame_bytes = 0;
+
+    g_return_val_if_fail (NAUTILUS_IS_ANIMATED_PAINTABLE (self), 0);
+
+    for (guint i = 0; i < self->frames->len; i++)
+    {
+        frame_bytes += g_array_index (self->frames, Frame, i).size;
+    }
+
+    return frame_bytes;
+}
+
+static void
+on_widget_map_changed (NautilusAnimatedPaintable *self)
 {
-    int delay;
+    if (gtk_widget_get_mapped (self->widget))
+    {
+        attach_to_frame_clock (self);
+    }
+    else
+    {
+        detach_from_frame_clock (self);
+    }
+}
 
+/**
+ * nautilus_animated_paintable_set_widget:
+ * @self: a #NautilusAnimatedPaintable
+ * @widget: (nullable): the widget showing @self
+ *
+ * Animations are driven by the frame clock of @widget, and pause while it is
+ * not mapped.
+ */
+void
+nautilus_animated_paintable_set_widget (NautilusAnimatedPaintable *self,
+                                        GtkWidget                 *widget)
+{
     g_return_if_fail (NAUTILUS_IS_ANIMATED_PAINTABLE (self));
+    g_return_if_fail (widget == NULL || GTK_IS_WIDGET (widget));
 
-    if (self->is_playing)
+    if (self->widget == widget)
     {
         return;
     }
 
-    self->is_playing = TRUE;
+    detach_from_frame_clock (self);
 
-    if (self->iter != NULL)
+    if (self->widget != NULL)
     {
-        delay = gdk_pixbuf_animation_iter_get_delay_time (self->iter);
-        if (delay >= 0)
-        {
-            self->timeout_id = g_timeout_add (delay, advance_frame, self);
-        }
+        g_signal_handlers_disconnect_by_func (self->widget, on_widget_map_changed, self);
+    }
+
+    g_set_weak_pointer (&self->widget, widget);
+
+    if (widget != NULL)
+    {
+        g_signal_connect_object (widget, "map",
+                                 G_CALLBACK (on_widget_map_changed), self, G_CONNECT_SWAPPED);
+        g_signal_connect_object (widget, "unmap",
+                                 G_CALLBACK (on_widget_map_changed), self, G_CONNECT_SWAPPED);
+        attach_to_frame_clock (self);
     }
 }
 
+/**
+ * nautilus_animated_paintable_start:
+ * @self: a #NautilusAnimatedPaintable
+ *
+ * Plays @self from its current frame, once it has a mapped widget set with
+ * nautilus_animated_paintable_set_widget(). Until then, it stays on that
+ * frame.
+ */
 void
-nautilus_animated_paintable_stop (NautilusAnimatedPaintable *self)
+nautilus_animated_paintable_start (NautilusAnimatedPaintable *self)
 {
     g_return_if_fail (NAUTILUS_IS_ANIMATED_PAINTABLE (self));
 
-    self->is_playing = FALSE;
-
-    if (self->timeout_id != 0)
+    if (self->is_playing)
     {
-        g_source_remove (self->timeout_id);
-        self->timeout_id = 0;
+        return;
     }
+
+    self->is_playing = TRUE;
+    attach_to_frame_clock (self);
+}
+
+void
+nautilus_animated_paintable_stop (NautilusAnimatedPaintable *self)
+{
+    g_return_if_fail (NAUTILUS_IS_ANIMATED_PAINTABLE (self));
+
+    self->is_playing = FALSE;
+    detach_from_frame_clock (self);
 }
 
 gboolean
@@ -20,7 +20,17 @@ G_BEGIN_DECLS
 
 G_DECLARE_FINAL_TYPE (NautilusAnimatedPaintable, nautilus_animated_paintable, NAUTILUS, ANIMATED_PAINTABLE, GObject)
 
-NautilusAnimatedPaintable *nautilus_animated_paintable_new (GdkPixbufAnimation *animation);
+NautilusAnimatedPaintable *nautilus_animated_paintable_new (GdkPixbufAnimation *animation,
+                                                            guint               n_frames,
+                                                            int                 size);
+
+NautilusAnimatedPaintable *nautilus_animated_paintable_copy (NautilusAnimatedPaintable *self);
+int nautilus_animated_paintable_get_size (NautilusAnimatedPaintable *self);
+guint nautilus_animated_paintable_get_n_frames (NautilusAnimatedPaintable *self);
+gsize nautilus_animated_paintable_get_frame_bytes (NautilusAnimatedPaintable *self);
+
+void nautilus_animated_paintable_set_widget (NautilusAnimatedPaintable *self,
+                                             GtkWidget                 *widget);
 
 void nautilus_animated_paintable_start (NautilusAnimatedPaintable *self);
 void nautilus_animated_paintable_stop (NautilusAnimatedPaintable *self);
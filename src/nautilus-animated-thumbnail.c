@@ -21,14 +21,61 @@
 
 #include "nautilus-animated-thumbnail.h"
 #include "nautilus-global-preferences.h"
+#include "nautilus-hash-queue.h"
 #include <gtk/gtk.h>
 #include <string.h>
 
-/* Animation cache to avoid loading same animations multiple times */
-static GHashTable *animation_cache = NULL;
+/* Default for how much memory the frames of cached animations may take. */
+#define DEFAULT_ANIMATION_CACHE_SIZE (64 * 1024 * 1024)
 
-/* Maximum number of cached animations (memory management) */
-#define MAX_CACHED_ANIMATIONS 50
+typedef struct
+{
+    char *uri;
+    NautilusAnimatedPaintable *paintable;
+    gsize size;
+} CachedAnimation;
+
+/* uri → CachedAnimation, least recently used first, so that animations
+ * don't have to be loaded and decoded again. Animations are kept decoded at
+ * the size they are shown at, and accounted by the memory of their frames. */
+static NautilusHashQueue *animation_cache = NULL;
+static gsize animation_cache_size = 0;
+static gsize animation_cache_max_size = DEFAULT_ANIMATION_CACHE_SIZE;
+static guint64 animation_cache_hits = 0;
+static guint64 animation_cache_misses = 0;
+static guint64 animation_cache_evictions = 0;
+static GMemoryMonitor *memory_monitor = NULL;
+
+/* How far into a file probing looks at most. Only GIFs may need that much,
+ * to get past their first frame. */
+#define PROBE_MAX_BYTES (1024 * 1024)
+
+/* Maximum number of remembered probe results. They are small, so this is
+ * about folders worth of files. */
+#define MAX_CACHED_PROBES 8192
+
+typedef struct
+{
+    char *uri;
+    guint64 mtime;
+    gboolean is_animated;
+} ProbeResult;
+
+/* uri → ProbeResult, least recently used first. Probes run in threads. */
+static NautilusHashQueue *probe_cache = NULL;
+static GMutex probe_cache_mutex;
+
+typedef struct
+{
+    GInputStream *stream;
+    GCancellable *cancellable;
+    gsize offset;
+    gsize max_bytes;
+    /* Counting stops there */
+    guint max_frames;
+    /* Whether probing stopped at max_bytes */
+    gboolean truncated;
+} Probe;
 
 /* Supported animated formats */
 static const char *animated_mime_types[] = {
@@ -45,26 +92,85 @@ struct _NautilusAnimationIterator {
     GTimeVal time;
 };
 
+static void
+cached_animation_free (CachedAnimation *cached)
+{
+    animation_cache_size -= cached->size;
+    g_free (cached->uri);
+    g_object_unref (cached->paintable);
+    g_free (cached);
+}
+
+static void
+animation_cache_trim (gsize max_size)
+{
+    while (animation_cache_size > max_size)
+    {
+        CachedAnimation *oldest = nautilus_hash_queue_peek_head (animation_cache);
+
+        animation_cache_evictions++;
+        nautilus_hash_queue_remove (animation_cache, oldest->uri);
+    }
+}
+
+static void
+on_low_memory_warning (GMemoryMonitor             *monitor,
+                       GMemoryMonitorWarningLevel  level,
+                       gpointer                    user_data)
+{
+    /* Cached animations can always be decoded again. Give back half of them
+     * at first, everything once memory gets scarce. */
+    if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM)
+    {
+        animation_cache_trim (0);
+    }
+    else
+    {
+        animation_cache_trim (animation_cache_size / 2);
+    }
+
+    g_debug ("Low memory warning, animation cache trimmed to %" G_GSIZE_FORMAT " bytes",
+             animation_cache_size);
+}
+
 void
 nautilus_animated_thumbnail_init (void)
 {
     if (animation_cache == NULL)
     {
-        animation_cache = g_hash_table_new_full (g_str_hash,
-                                                   g_str_equal,
-                                                   g_free,
-                                                   g_object_unref);
+        animation_cache = nautilus_hash_queue_new (g_str_hash, g_str_equal, NULL,
+                                                   (GDestroyNotify) cached_animation_free);
     }
+
+    if (memory_monitor == NULL)
+    {
+        memory_monitor = g_memory_monitor_dup_default ();
+        g_signal_connect (memory_monitor, "low-memory-warning",
+                          G_CALLBACK (on_low_memory_warning), NULL);
+    }
+}
+
+static void
+probe_result_free (ProbeResult *result)
+{
+    g_free (result->uri);
+    g_free (result);
 }
 
 void
 nautilus_animated_thumbnail_shutdown (void)
 {
-    if (animation_cache != NULL)
+    if (memory_monitor != NULL)
     {
-        g_hash_table_destroy (animation_cache);
-        animation_cache = NULL;
+        g_signal_handlers_disconnect_by_func (memory_monitor, on_low_memory_warning, NULL);
+        g_clear_object (&memory_monitor);
     }
+
+    g_clear_pointer (&animation_cache, nautilus_hash_queue_destroy);
+
+    g_mutex_lock (&probe_cache_mutex);
+    g_clear_pointer (&probe_cache, nautilus_hash_queue_destroy);
+    g_mutex_unlock (&probe_cache_mutex);
 }
 
 gboolean
@@ -88,18 +194,508 @@ nautilus_animated_thumbnail_is_supported (const char *mime_type)
     return FALSE;
 }
 
+static guint32
+read_uint32_be (const guchar *bytes)
+{
+    return ((guint32) bytes[0] << 24) | ((guint32) bytes[1] << 16) |
+           ((guint32) bytes[2] << 8) | (guint32) bytes[3];
+}
+
+static gboolean
+probe_read (Probe     *probe,
+            gpointer   buffer,
+            gsize      count,
+            GError   **error)
+{
+    gsize n_read;
+
+    if (probe->offset + count > probe->max_bytes)
+    {
+        probe->truncated = TRUE;
+        return FALSE;
+    }
+
+    if (!g_input_stream_read_all (probe->stream, buffer, count, &n_read,
+                                  probe->cancellable, error))
+    {
+        return FALSE;
+    }
+
+    probe->offset += n_read;
+
+    return n_read == count;
+}
+
+static gboolean
+probe_skip (Probe   *probe,
+            gsize    count,
+            GError **error)
+{
+    if (probe->offset + count > probe->max_bytes)
+    {
+        probe->truncated = TRUE;
+        return FALSE;
+    }
+
+    while (count > 0)
+    {
+        gssize skipped = g_input_stream_skip (probe->stream, count, probe->cancellable, error);
+
+        if (skipped <= 0)
+        {
+            return FALSE;
+        }
+
+        count -= skipped;
+        probe->offset += skipped;
+    }
+
+    return TRUE;
+}
+
+/* Data sub-blocks end with an empty one. */
+static gboolean
+probe_skip_gif_sub_blocks (Probe   *probe,
+                           GError **error)
+{
+    guchar size;
+
+    while (probe_read (probe, &size, 1, error))
+    {
+        if (size == 0)
+        {
+            return TRUE;
+        }
+
+        if (!probe_skip (probe, size, error))
+        {
+            return FALSE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* GIFs have no frame count, so count the image descriptors. */
+static guint
+probe_gif (Probe   *probe,
+           GError **error)
+{
+    guchar screen_descriptor[7];
+    guint n_images = 0;
+    gboolean loops = FALSE;
+    guchar introducer;
+
+    if (!probe_read (probe, screen_descriptor, sizeof (screen_descriptor), error))
+    {
+        return 0;
+    }
+
+    if ((screen_descriptor[4] & 0x80) &&
+        !probe_skip (probe, 3 << ((screen_descriptor[4] & 0x07) + 1), error))
+    {
+        return 0;
+    }
+
+    while (probe_read (probe, &introducer, 1, error))
+    {
+        if (introducer == 0x21)
+        {
+            guchar label;
+            guchar application[12];
+
+            if (!probe_read (probe, &label, 1, error))
+            {
+                break;
+            }
+
+            if (label == 0xff)
+            {
+                if (!probe_read (probe, application, sizeof (application), error))
+                {
+                    break;
+                }
+
+                loops = loops || (application[0] == 11 &&
+                                  (memcmp (application + 1, "NETSCAPE2.0", 11) == 0 ||
+                                   memcmp (application + 1, "ANIMEXTS1.0", 11) == 0));
+            }
+
+            if (!probe_skip_gif_sub_blocks (probe, error))
+            {
+                break;
+            }
+        }
+        else if (introducer == 0x2c)
+        {
+            guchar image_descriptor[9];
+
+            if (++n_images >= probe->max_frames)
+            {
+                return n_images;
+            }
+
+            if (!probe_read (probe, image_descriptor, sizeof (image_descriptor), error) ||
+                ((image_descriptor[8] & 0x80) &&
+                 !probe_skip (probe, 3 << ((image_descriptor[8] & 0x07) + 1), error)) ||
+                !probe_skip (probe, 1, error) ||
+                !probe_skip_gif_sub_blocks (probe, error))
+            {
+                break;
+            }
+        }
+        else
+        {
+            /* Trailer, or garbage */
+            break;
+        }
+    }
+
+    /* A first frame too large to look past: trust the looping extension,
+     * which only animations carry. */
+    if (probe->truncated && n_images == 1 && loops)
+    {
+        return 2;
+    }
+
+    return n_images;
+}
+
+/* The frame count of APNGs is in their acTL chunk, which must come before
+ * the image data. */
+static guint
+probe_png (Probe   *probe,
+           GError **error)
+{
+    guchar chunk_header[8];
+
+    while (probe_read (probe, chunk_header, sizeof (chunk_header), error))
+    {
+        guint32 length = read_uint32_be (chunk_header);
+
+        if (memcmp (chunk_header + 4, "acTL", 4) == 0)
+        {
+            guchar n_frames[4];
+
+            if (length < 8 || !probe_read (probe, n_frames, sizeof (n_frames), error))
+            {
+                return 0;
+            }
+
+            return MAX (read_uint32_be (n_frames), 1);
+        }
+
+        if (memcmp (chunk_header + 4, "IDAT", 4) == 0)
+        {
+            return 1;
+        }
+
+        if (!probe_skip (probe, (gsize) length + 4, error))
+        {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static guint32
+read_uint32_le (const guchar *bytes)
+{
+    return ((guint32) bytes[3] << 24) | ((guint32) bytes[2] << 16) |
+           ((guint32) bytes[1] << 8) | (guint32) bytes[0];
+}
+
+/* Animated WebPs use the extended format, whose VP8X header announces the
+ * ANIM chunk with a flag. Only counting goes on to the ANMF chunks, one per
+ * frame. */
+static guint
+probe_webp (Probe   *probe,
+            GError **error)
+{
+    guchar chunk_header[8];
+    guchar flags;
+    guint32 length;
+    guint n_frames = 0;
+
+    if (!probe_read (probe, chunk_header, sizeof (chunk_header), error))
+    {
+        return 0;
+    }
+
+    if (memcmp (chunk_header, "VP8X", 4) != 0)
+    {
+        return 1;
+    }
+
+    if (!probe_read (probe, &flags, 1, error))
+    {
+        return 0;
+    }
+
+    if ((flags & 0x02) == 0)
+    {
+        return 1;
+    }
+
+    if (probe->max_frames <= 2)
+    {
+        return 2;
+    }
+
+    /* Chunks are padded to an even size. */
+    length = read_uint32_le (chunk_header + 4);
+    if (length < 1 || !probe_skip (probe, (length - 1) + (length & 1), error))
+    {
+        return 0;
+    }
+
+    while (n_frames < probe->max_frames &&
+           probe_read (probe, chunk_header, sizeof (chunk_header), error))
+    {
+        length = read_uint32_le (chunk_header + 4);
+
+        if (memcmp (chunk_header, "ANMF", 4) == 0)
+        {
+            n_frames++;
+        }
+
+        if (!probe_skip (probe, (gsize) length + (length & 1), error))
+        {
+            break;
+        }
+    }
+
+    return n_frames;
+}
+
+static guint
+probe_frames (GInputStream  *stream,
+              gsize          max_bytes,
+              guint          max_frames,
+              GCancellable  *cancellable,
+              GError       **error)
+{
+    g_autoptr (GInputStream) buffered = g_buffered_input_stream_new (stream);
+    Probe probe =
+    {
+        .stream = buffered,
+        .cancellable = cancellable,
+        .max_bytes = max_bytes,
+        .max_frames = max_frames,
+    };
+    guchar magic[12];
+    GError *local_error = NULL;
+    guint n_frames = 0;
+
+    g_filter_input_stream_set_close_base_stream (G_FILTER_INPUT_STREAM (buffered), FALSE);
+
+    /* The signatures have different lengths, so only read as much as the
+     * next one to check needs. */
+    if (probe_read (&probe, magic, 6, &local_error))
+    {
+        if (memcmp (magic, "GIF87a", 6) == 0 || memcmp (magic, "GIF89a", 6) == 0)
+        {
+            n_frames = probe_gif (&probe, &local_error);
+        }
+        else if (probe_read (&probe, magic + 6, 2, &local_error))
+        {
+            if (memcmp (magic, "\x89PNG\r\n\x1a\n", 8) == 0)
+            {
+                n_frames = probe_png (&probe, &local_error);
+            }
+            else if (probe_read (&probe, magic + 8, 4, &local_error) &&
+                     memcmp (magic, "RIFF", 4) == 0 &&
+                     memcmp (magic + 8, "WEBP", 4) == 0)
+            {
+                n_frames = probe_webp (&probe, &local_error);
+            }
+        }
+    }
+
+    if (local_error != NULL)
+    {
+        g_propagate_error (error, local_error);
+        return 0;
+    }
+
+    return n_frames;
+}
+
+/**
+ * nautilus_animated_thumbnail_probe_stream:
+ * @stream: a stream positioned at the start of an image
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Tells whether a GIF, APNG or WebP image has more than one frame, from its
+ * headers alone. At most 1 MiB of @stream is read, and usually a few bytes.
+ * Other formats are reported as not animated. This blocks.
+ *
+ * Returns: whether the image is animated; %FALSE with @error set when
+ *   @stream could not be read
+ */
+gboolean
+nautilus_animated_thumbnail_probe_stream (GInputStream  *stream,
+                                          GCancellable  *cancellable,
+                                          GError       **error)
+{
+    return probe_frames (stream, PROBE_MAX_BYTES, 2, cancellable, error) > 1;
+}
+
+/**
+ * nautilus_animated_thumbnail_count_frames:
+ * @stream: a stream positioned at the start of an image
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Counts the frames of a GIF, APNG or WebP image from its headers, skipping
+ * over the image data. Unlike nautilus_animated_thumbnail_probe_stream(),
+ * this reads through the whole of a GIF or WebP. This blocks.
+ *
+ * Returns: the number of frames of one loop, or 0 for other formats and
+ *   when @stream could not be read
+ */
+guint
+nautilus_animated_thumbnail_count_frames (GInputStream  *stream,
+                                          GCancellable  *cancellable,
+                                          GError       **error)
+{
+    return probe_frames (stream, G_MAXSIZE, G_MAXUINT, cancellable, error);
+}
+
+static gboolean
+probe_cache_lookup (const char *uri,
+                    guint64     mtime,
+                    gboolean   *is_animated)
+{
+    ProbeResult *result = NULL;
+
+    g_mutex_lock (&probe_cache_mutex);
+
+    if (probe_cache != NULL)
+    {
+        result = nautilus_hash_queue_find_item (probe_cache, uri);
+    }
+
+    if (result != NULL && result->mtime == mtime)
+    {
+        *is_animated = result->is_animated;
+        nautilus_hash_queue_move_existing_to_tail (probe_cache, uri);
+    }
+    else
+    {
+        result = NULL;
+    }
+
+    g_mutex_unlock (&probe_cache_mutex);
+
+    return result != NULL;
+}
+
+static void
+probe_cache_add (const char *uri,
+                 guint64     mtime,
+                 gboolean    is_animated)
+{
+    ProbeResult *result = g_new0 (ProbeResult, 1);
+
+    result->uri = g_strdup (uri);
+    result->mtime = mtime;
+    result->is_animated = is_animated;
+
+    g_mutex_lock (&probe_cache_mutex);
+
+    if (probe_cache == NULL)
+    {
+        probe_cache = nautilus_hash_queue_new (g_str_hash, g_str_equal, NULL,
+                                               (GDestroyNotify) probe_result_free);
+    }
+
+    nautilus_hash_queue_remove (probe_cache, uri);
+    nautilus_hash_queue_enqueue (probe_cache, result->uri, result);
+
+    if (nautilus_hash_queue_get_length (probe_cache) > MAX_CACHED_PROBES)
+    {
+        ProbeResult *oldest = nautilus_hash_queue_peek_head (probe_cache);
+
+        nautilus_hash_queue_remove (probe_cache, oldest->uri);
+    }
+
+    g_mutex_unlock (&probe_cache_mutex);
+}
+
+/* @mtime is read from the file when 0. */
+static gboolean
+probe_file (GFile         *location,
+            guint64        mtime,
+            GCancellable  *cancellable,
+            GError       **error)
+{
+    g_autofree char *uri = g_file_get_uri (location);
+    g_autoptr (GFileInputStream) stream = NULL;
+    GError *local_error = NULL;
+    gboolean is_animated;
+
+    if (mtime != 0 && probe_cache_lookup (uri, mtime, &is_animated))
+    {
+        return is_animated;
+    }
+
+    stream = g_file_read (location, cancellable, error);
+    if (stream == NULL)
+    {
+        return FALSE;
+    }
+
+    if (mtime == 0)
+    {
+        g_autoptr (GFileInfo) info = g_file_input_stream_query_info (stream,
+                                                                     G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                                                     cancellable, NULL);
+
+        if (info != NULL)
+        {
+            mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+        }
+
+        if (mtime != 0 && probe_cache_lookup (uri, mtime, &is_animated))
+        {
+            return is_animated;
+        }
+    }
+
+    is_animated = nautilus_animated_thumbnail_probe_stream (G_INPUT_STREAM (stream),
+                                                            cancellable, &local_error);
+
+    if (local_error != NULL)
+    {
+        g_propagate_error (error, local_error);
+        return FALSE;
+    }
+
+    if (mtime != 0)
+    {
+        probe_cache_add (uri, mtime, is_animated);
+    }
+
+    return is_animated;
+}
+
 gboolean
 nautilus_animated_thumbnail_is_animated (const char *file_path)
 {
-    g_autoptr (GdkPixbufAnimation) animation = NULL;
+    g_autoptr (GFile) location = NULL;
     g_autoptr (GError) error = NULL;
+    gboolean is_animated;
 
     if (file_path == NULL)
     {
         return FALSE;
     }
 
-    animation = gdk_pixbuf_animation_new_from_file (file_path, &error);
+    location = g_file_new_for_path (file_path);
+    is_animated = probe_file (location, 0, NULL, &error);
 
     if (error != NULL)
     {
@@ -107,13 +703,72 @@ nautilus_animated_thumbnail_is_animated (const char *file_path)
         return FALSE;
     }
 
-    if (animation == NULL)
+    return is_animated;
+}
+
+static void
+probe_thread (GTask        *task,
+              gpointer      source_object,
+              gpointer      task_data,
+              GCancellable *cancellable)
+{
+    guint64 *mtime = task_data;
+    GError *error = NULL;
+    gboolean is_animated = probe_file (source_object, *mtime, cancellable, &error);
+
+    if (error != NULL)
+    {
+        g_task_return_error (task, error);
+    }
+    else
+    {
+        g_task_return_boolean (task, is_animated);
+    }
+}
+
+/**
+ * nautilus_animated_thumbnail_probe_async:
+ * @location: the image to probe
+ * @mtime: its modification time, or 0 to read it
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: called when done
+ * @user_data: data for @callback
+ *
+ * Finds out in a thread whether @location is animated, like
+ * nautilus_animated_thumbnail_probe_stream() does. Results are remembered
+ * per uri and modification time, so asking again is free.
+ */
+void
+nautilus_animated_thumbnail_probe_async (GFile               *location,
+                                         guint64              mtime,
+                                         GCancellable        *cancellable,
+                                         GAsyncReadyCallback  callback,
+                                         gpointer             user_data)
+{
+    g_autoptr (GTask) task = g_task_new (location, cancellable, callback, user_data);
+    g_autofree char *uri = g_file_get_uri (location);
+    gboolean is_animated;
+
+    g_task_set_source_tag (task, nautilus_animated_thumbnail_probe_async);
+
+    if (mtime != 0 && probe_cache_lookup (uri, mtime, &is_animated))
     {
-        return FALSE;
+        g_task_return_boolean (task, is_animated);
+        return;
     }
 
-    /* Check if animation has multiple frames */
-    return !gdk_pixbuf_animation_is_static_image (animation);
+    g_task_set_task_data (task, g_memdup2 (&mtime, sizeof (mtime)), g_free);
+    g_task_run_in_thread (task, probe_thread);
+}
+
+gboolean
+nautilus_animated_thumbnail_probe_finish (GFile         *location,
+                                          GAsyncResult  *result,
+                                          GError       **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, location), FALSE);
+
+    return g_task_propagate_boolean (G_TASK (result), error);
 }
 
 GdkPixbufAnimation *
@@ -164,51 +819,77 @@ nautilus_animated_thumbnail_get_mode (void)
     return NAUTILUS_ANIMATION_MODE_ON_SELECT;
 }
 
+/**
+ * nautilus_animated_thumbnail_cache_add:
+ * @uri: the uri of the animated file
+ * @paintable: its decoded animation
+ *
+ * Remembers the frames of @paintable, evicting the least recently used
+ * animations to stay within the cache size. Animations larger than the
+ * whole cache are not kept.
+ */
 void
-nautilus_animated_thumbnail_cache_add (const char *uri,
-                                        GdkPixbufAnimation *animation)
+nautilus_animated_thumbnail_cache_add (const char                *uri,
+                                       NautilusAnimatedPaintable *paintable)
 {
+    CachedAnimation *cached;
+    gsize size;
+
     g_return_if_fail (uri != NULL);
-    g_return_if_fail (GDK_IS_PIXBUF_ANIMATION (animation));
+    g_return_if_fail (NAUTILUS_IS_ANIMATED_PAINTABLE (paintable));
 
-    if (animation_cache == NULL)
-    {
-        nautilus_animated_thumbnail_init ();
-    }
+    nautilus_animated_thumbnail_init ();
 
-    /* Check cache size and evict if necessary */
-    if (g_hash_table_size (animation_cache) >= MAX_CACHED_ANIMATIONS)
+    nautilus_hash_queue_remove (animation_cache, uri);
+
+    size = nautilus_animated_paintable_get_frame_bytes (paintable);
+    if (size > animation_cache_max_size)
     {
-        /* Simple LRU: just clear cache when full */
-        g_hash_table_remove_all (animation_cache);
-        g_debug ("Animation cache full, cleared all entries");
+        return;
     }
 
-    g_hash_table_insert (animation_cache,
-                          g_strdup (uri),
-                          g_object_ref (animation));
+    animation_cache_trim (animation_cache_max_size - size);
+
+    cached = g_new0 (CachedAnimation, 1);
+    cached->uri = g_strdup (uri);
+    cached->paintable = nautilus_animated_paintable_copy (paintable);
+    cached->size = size;
+
+    animation_cache_size += cached->size;
+    nautilus_hash_queue_enqueue (animation_cache, cached->uri, cached);
 }
 
-GdkPixbufAnimation *
-nautilus_animated_thumbnail_cache_get (const char *uri)
+/**
+ * nautilus_animated_thumbnail_cache_get:
+ * @uri: the uri of the animated file
+ * @size: the size it is going to be shown at
+ *
+ * Returns: (transfer full) (nullable): a stopped paintable with the frames
+ * cached for @uri at @size, or %NULL.
+ */
+NautilusAnimatedPaintable *
+nautilus_animated_thumbnail_cache_get (const char *uri,
+                                       int         size)
 {
-    GdkPixbufAnimation *animation;
+    CachedAnimation *cached = NULL;
 
     g_return_val_if_fail (uri != NULL, NULL);
 
-    if (animation_cache == NULL)
+    if (animation_cache != NULL)
     {
-        return NULL;
+        cached = nautilus_hash_queue_find_item (animation_cache, uri);
     }
 
-    animation = g_hash_table_lookup (animation_cache, uri);
-
-    if (animation != NULL)
+    if (cached == NULL || nautilus_animated_paintable_get_size (cached->paintable) != size)
     {
-        g_object_ref (animation);
+        animation_cache_misses++;
+        return NULL;
     }
 
-    return animation;
+    animation_cache_hits++;
+    nautilus_hash_queue_move_existing_to_tail (animation_cache, uri);
+
+    return nautilus_animated_paintable_copy (cached->paintable);
 }
 
 void
@@ -218,7 +899,7 @@ nautilus_animated_thumbnail_cache_remove (const char *uri)
 
     if (animation_cache != NULL)
     {
-        g_hash_table_remove (animation_cache, uri);
+        nautilus_hash_queue_remove (animation_cache, uri);
     }
 }
 
@@ -227,10 +908,35 @@ nautilus_animated_thumbnail_cache_clear (void)
 {
     if (animation_cache != NULL)
     {
-        g_hash_table_remove_all (animation_cache);
+        animation_cache_trim (0);
+    }
+}
+
+void
+nautilus_animated_thumbnail_cache_set_max_size (gsize max_size)
+{
+    animation_cache_max_size = max_size;
+
+    if (animation_cache != NULL)
+    {
+        animation_cache_trim (max_size);
     }
 }
 
+void
+nautilus_animated_thumbnail_cache_get_stats (NautilusAnimationCacheStats *stats)
+{
+    g_return_if_fail (stats != NULL);
+
+    stats->n_animations = (animation_cache != NULL) ?
+                          nautilus_hash_queue_get_length (animation_cache) : 0;
+    stats->size = animation_cache_size;
+    stats->max_size = animation_cache_max_size;
+    stats->hits = animation_cache_hits;
+    stats->misses = animation_cache_misses;
+    stats->evictions = animation_cache_evictions;
+}
+
 /* Animation iterator implementation */
 
 NautilusAnimationIterator *
@@ -19,7 +19,10 @@
 
 #pragma once
 
+#include "nautilus-animated-paintable.h"
+
 #include <gdk-pixbuf/gdk-pixbuf.h>
+#include <gio/gio.h>
 #include <glib-object.h>
 
 G_BEGIN_DECLS
@@ -37,6 +40,20 @@ gboolean nautilus_animated_thumbnail_is_supported (const char *mime_type);
 
 /* Check if a file is actually animated (not just a static image in animated format) */
 gboolean nautilus_animated_thumbnail_is_animated (const char *file_path);
+gboolean nautilus_animated_thumbnail_probe_stream (GInputStream  *stream,
+                                                   GCancellable  *cancellable,
+                                                   GError       **error);
+guint nautilus_animated_thumbnail_count_frames (GInputStream  *stream,
+                                                GCancellable  *cancellable,
+                                                GError       **error);
+void nautilus_animated_thumbnail_probe_async (GFile               *location,
+                                              guint64              mtime,
+                                              GCancellable        *cancellable,
+                                              GAsyncReadyCallback  callback,
+                                              gpointer             user_data);
+gboolean nautilus_animated_thumbnail_probe_finish (GFile         *location,
+                                                   GAsyncResult  *result,
+                                                   GError       **error);
 
 /* Load animated thumbnail from file */
 GdkPixbufAnimation *nautilus_animated_thumbnail_load (const char *file_path,
@@ -46,11 +63,27 @@ GdkPixbufAnimation *nautilus_animated_thumbnail_load (const char *file_path,
 NautilusAnimationMode nautilus_animated_thumbnail_get_mode (void);
 
 /* Animation cache management */
+typedef struct
+{
+    guint n_animations;
+    /* Memory taken by decoded frames, in bytes */
+    gsize size;
+    gsize max_size;
+
+    /* Since startup */
+    guint64 hits;
+    guint64 misses;
+    guint64 evictions;
+} NautilusAnimationCacheStats;
+
 void nautilus_animated_thumbnail_cache_add (const char *uri,
-                                             GdkPixbufAnimation *animation);
-GdkPixbufAnimation *nautilus_animated_thumbnail_cache_get (const char *uri);
+                                             NautilusAnimatedPaintable *paintable);
+NautilusAnimatedPaintable *nautilus_animated_thumbnail_cache_get (const char *uri,
+                                                                  int size);
 void nautilus_animated_thumbnail_cache_remove (const char *uri);
 void nautilus_animated_thumbnail_cache_clear (void);
+void nautilus_animated_thumbnail_cache_set_max_size (gsize max_size);
+void nautilus_animated_thumbnail_cache_get_stats (NautilusAnimationCacheStats *stats);
 
 /* Animation playback control */
 typedef struct _NautilusAnimationIterator NautilusAnimationIterator;
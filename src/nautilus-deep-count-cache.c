@@ -0,0 +1,837 @@
+/*
+ * nautilus-deep-count-cache.c: Persistent per-directory totals for deep counts
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "nautilus-deep-count-cache"
+
+#include <config.h>
+#include "nautilus-deep-count-cache.h"
+
+#include <errno.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/**
+ * The cache remembers, for each local directory a deep count has read, the
+ * totals of its own entries and the names of the subdirectories the count
+ * went on into. A later count that finds a directory with the same device,
+ * inode, mtime and ctime takes those instead of reading the directory again,
+ * so counting an unchanged tree costs one lstat() per directory rather than
+ * one per file. Totals of whole subtrees are never stored, because a change
+ * deep down does not touch the mtime of the directories above it; each
+ * directory on the way is checked on its own.
+ *
+ * Changing a file in place does not change its directory either. Monitor
+ * events for changed files drop the record of their directory, but sizes of
+ * files rewritten in directories nobody watches are only picked up once the
+ * directory itself changes.
+ *
+ * Directories holding files with more than one hard link are not cached, as
+ * links are only told apart within a single traversal.
+ *
+ * Everything is kept in one little-endian file, which is mapped rather than
+ * read and searched in place:
+ *
+ *   header:  "NDCC", u32 version, u32 generation, u32 record count,
+ *            u64 names length
+ *   records: for each directory, sorted by device and inode,
+ *            u64 device, u64 inode, i64 mtime (ns), i64 ctime (ns),
+ *            u64 size, u32 file count, u32 directory count,
+ *            u32 names offset, u32 names length, u32 generation, u32 unused
+ *   names:   the subdirectories of each record, each nul-terminated
+ *
+ * Records stored since the file was written are kept in memory and merged in
+ * the next time it is saved. Each save bumps the generation, and once there
+ * are too many records the ones stored longest ago are left out.
+ */
+
+#define CACHE_MAGIC "NDCC"
+#define CACHE_VERSION 1
+#define HEADER_SIZE 24
+#define RECORD_SIZE 64
+#define CACHE_MAX_RECORDS 200000
+
+/* Seconds to wait for more changes before writing the cache out. */
+#define SAVE_DELAY 10
+
+typedef struct
+{
+    NautilusDeepCountStamp stamp;
+    guint64 size;
+    guint32 file_count;
+    guint32 directory_count;
+    guint32 generation;
+
+    /* Nul-terminated names, back to back. */
+    char *names;
+    guint32 names_length;
+} Record;
+
+/* Everything below is protected by cache_mutex, except save_timeout_id which
+ * is only used from the main thread.
+ */
+static GMutex cache_mutex;
+static gboolean cache_loaded;
+
+static GMappedFile *mapped_file;
+static const guint8 *mapped_records;
+static guint32 n_mapped_records;
+static const char *mapped_names;
+static guint64 mapped_names_length;
+static guint32 generation;
+
+/* Records stored since the file was mapped, keyed by their stamp. */
+static GHashTable *new_records;
+/* Mapped records that are no longer valid, with the generation they were
+ * dropped in. */
+static GHashTable *dropped_records;
+/* Paths of directories whose records are to be dropped, each with the
+ * serial it was last invalidated with. They stay until the saved file no
+ * longer holds the records. */
+static GHashTable *stale_paths;
+static guint stale_serial;
+
+static gboolean dirty;
+static gboolean saving;
+
+static guint save_timeout_id;
+
+static guint
+stamp_key_hash (gconstpointer key)
+{
+    const NautilusDeepCountStamp *stamp = key;
+
+    return g_int64_hash (&stamp->inode) ^ g_int64_hash (&stamp->device);
+}
+
+static gboolean
+stamp_key_equal (gconstpointer a,
+                 gconstpointer b)
+{
+    const NautilusDeepCountStamp *stamp_a = a;
+    const NautilusDeepCountStamp *stamp_b = b;
+
+    return stamp_a->inode == stamp_b->inode && stamp_a->device == stamp_b->device;
+}
+
+static void
+record_free (Record *record)
+{
+    g_free (record->names);
+    g_free (record);
+}
+
+static char *
+get_cache_dir (void)
+{
+    return g_build_filename (g_get_user_cache_dir (), "nautilus", NULL);
+}
+
+static char *
+get_cache_path (void)
+{
+    return g_build_filename (g_get_user_cache_dir (), "nautilus", "deep-counts", NULL);
+}
+
+static guint32
+get_u32 (const guint8 *data)
+{
+    guint32 value;
+
+    memcpy (&value, data, sizeof (value));
+    return GUINT32_FROM_LE (value);
+}
+
+static guint64
+get_u64 (const guint8 *data)
+{
+    guint64 value;
+
+    memcpy (&value, data, sizeof (value));
+    return GUINT64_FROM_LE (value);
+}
+
+static void
+append_u32 (GByteArray *buffer,
+            guint32     value)
+{
+    value = GUINT32_TO_LE (value);
+    g_byte_array_append (buffer, (const guint8 *) &value, sizeof (value));
+}
+
+static void
+append_u64 (GByteArray *buffer,
+            guint64     value)
+{
+    value = GUINT64_TO_LE (value);
+    g_byte_array_append (buffer, (const guint8 *) &value, sizeof (value));
+}
+
+static void
+unmap_cache_file_locked (void)
+{
+    g_clear_pointer (&mapped_file, g_mapped_file_unref);
+    mapped_records = NULL;
+    n_mapped_records = 0;
+    mapped_names = NULL;
+    mapped_names_length = 0;
+}
+
+static gboolean
+map_cache_file_locked (const char *path)
+{
+    g_autoptr (GMappedFile) file = NULL;
+    const guint8 *data;
+    guint32 n_records;
+    guint64 names_length;
+    gsize length;
+
+    file = g_mapped_file_new (path, FALSE, NULL);
+    if (file == NULL)
+    {
+        return FALSE;
+    }
+
+    data = (const guint8 *) g_mapped_file_get_contents (file);
+    length = g_mapped_file_get_length (file);
+    if (length < HEADER_SIZE ||
+        memcmp (data, CACHE_MAGIC, strlen (CACHE_MAGIC)) != 0 ||
+        get_u32 (data + 4) != CACHE_VERSION)
+    {
+        g_debug ("Ignoring deep count cache with unknown format");
+        return FALSE;
+    }
+
+    n_records = get_u32 (data + 12);
+    names_length = get_u64 (data + 16);
+    if ((guint64) n_records * RECORD_SIZE > length - HEADER_SIZE ||
+        names_length != length - HEADER_SIZE - (guint64) n_records * RECORD_SIZE)
+    {
+        g_debug ("Ignoring truncated deep count cache");
+        return FALSE;
+    }
+
+    unmap_cache_file_locked ();
+    generation = get_u32 (data + 8);
+    mapped_records = data + HEADER_SIZE;
+    n_mapped_records = n_records;
+    mapped_names = (const char *) mapped_records + (gsize) n_records * RECORD_SIZE;
+    mapped_names_length = names_length;
+    mapped_file = g_steal_pointer (&file);
+
+    return TRUE;
+}
+
+static void
+ensure_loaded_locked (void)
+{
+    g_autofree char *path = NULL;
+
+    if (cache_loaded)
+    {
+        return;
+    }
+
+    cache_loaded = TRUE;
+    new_records = g_hash_table_new_full (stamp_key_hash, stamp_key_equal,
+                                         NULL, (GDestroyNotify) record_free);
+    dropped_records = g_hash_table_new_full (stamp_key_hash, stamp_key_equal, g_free, NULL);
+    stale_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    path = get_cache_path ();
+    map_cache_file_locked (path);
+}
+
+static gboolean
+read_mapped_record (guint32  index,
+                    Record  *record)
+{
+    const guint8 *data = mapped_records + (gsize) index * RECORD_SIZE;
+    guint32 names_offset;
+
+    record->stamp.device = get_u64 (data);
+    record->stamp.inode = get_u64 (data + 8);
+    record->stamp.mtime_nsec = (gint64) get_u64 (data + 16);
+    record->stamp.ctime_nsec = (gint64) get_u64 (data + 24);
+    record->size = get_u64 (data + 32);
+    record->file_count = get_u32 (data + 40);
+    record->directory_count = get_u32 (data + 44);
+    names_offset = get_u32 (data + 48);
+    record->names_length = get_u32 (data + 52);
+    record->generation = get_u32 (data + 56);
+
+    if (names_offset > mapped_names_length ||
+        record->names_length > mapped_names_length - names_offset ||
+        (record->names_length > 0 &&
+         mapped_names[names_offset + record->names_length - 1] != '\0'))
+    {
+        return FALSE;
+    }
+
+    /* Points into the mapping, so only valid while the lock is held. */
+    record->names = (char *) mapped_names + names_offset;
+
+    return TRUE;
+}
+
+/* Binary search over the mapped records, which are sorted by device and inode. */
+static gboolean
+find_mapped_record (const NautilusDeepCountStamp *key,
+                    Record                       *record)
+{
+    guint32 low = 0;
+    guint32 high = n_mapped_records;
+
+    while (low < high)
+    {
+        guint32 middle = low + (high - low) / 2;
+        const guint8 *data = mapped_records + (gsize) middle * RECORD_SIZE;
+        guint64 device = get_u64 (data);
+        guint64 inode = get_u64 (data + 8);
+
+        if (device == key->device && inode == key->inode)
+        {
+            Record unused;
+
+            return read_mapped_record (middle, record != NULL ? record : &unused);
+        }
+
+        if (device < key->device || (device == key->device && inode < key->inode))
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return FALSE;
+}
+
+static GStrv
+split_names (const char *names,
+             guint32     length)
+{
+    g_autoptr (GStrvBuilder) builder = g_strv_builder_new ();
+
+    for (guint32 position = 0; position < length;)
+    {
+        const char *name = names + position;
+
+        /* Refuse anything that would lead out of the directory. */
+        if (*name == '\0' || strchr (name, '/') != NULL ||
+            strcmp (name, ".") == 0 || strcmp (name, "..") == 0)
+        {
+            return NULL;
+        }
+
+        g_strv_builder_add (builder, name);
+        position += strlen (name) + 1;
+    }
+
+    return g_strv_builder_end (builder);
+}
+
+/**
+ * nautilus_deep_count_cache_lookup:
+ * @path: the path of a local directory
+ * @stamp: the current state of the directory
+ * @totals: (out): return location for the totals of the directory's own entries
+ * @subdirectories: (out): return location for the names of the subdirectories
+ *     to be counted too
+ *
+ * May be called from any thread.
+ *
+ * Returns: whether the directory was found unchanged since it was counted
+ */
+gboolean
+nautilus_deep_count_cache_lookup (const char                    *path,
+                                  const NautilusDeepCountStamp  *stamp,
+                                  NautilusDeepCountTotals       *totals,
+                                  GStrv                         *subdirectories)
+{
+    Record mapped_record;
+    const Record *record = NULL;
+    GStrv names = NULL;
+
+    g_mutex_lock (&cache_mutex);
+    ensure_loaded_locked ();
+
+    if (!g_hash_table_contains (stale_paths, path))
+    {
+        record = g_hash_table_lookup (new_records, stamp);
+        if (record == NULL &&
+            !g_hash_table_contains (dropped_records, stamp) &&
+            find_mapped_record (stamp, &mapped_record))
+        {
+            record = &mapped_record;
+        }
+    }
+
+    if (record != NULL &&
+        record->stamp.mtime_nsec == stamp->mtime_nsec &&
+        record->stamp.ctime_nsec == stamp->ctime_nsec)
+    {
+        names = split_names (record->names, record->names_length);
+    }
+
+    if (names != NULL)
+    {
+        totals->directory_count = record->directory_count;
+        totals->file_count = record->file_count;
+        totals->unreadable_count = 0;
+        totals->size = record->size;
+        *subdirectories = names;
+    }
+
+    g_mutex_unlock (&cache_mutex);
+
+    return names != NULL;
+}
+
+/**
+ * nautilus_deep_count_cache_store:
+ * @path: the path of a local directory
+ * @stamp: the state of the directory from before it was read
+ * @totals: the totals of the directory's own entries
+ * @subdirectories: (array length=n_subdirectories): the names of the
+ *     subdirectories to be counted too
+ * @n_subdirectories: the number of subdirectories
+ *
+ * May be called from any thread. The record is written out on the next
+ * nautilus_deep_count_cache_schedule_save().
+ */
+void
+nautilus_deep_count_cache_store (const char                    *path,
+                                 const NautilusDeepCountStamp  *stamp,
+                                 const NautilusDeepCountTotals *totals,
+                                 const char * const            *subdirectories,
+                                 guint                          n_subdirectories)
+{
+    g_autoptr (GString) names = g_string_new (NULL);
+    Record *record;
+
+    for (guint i = 0; i < n_subdirectories; i++)
+    {
+        g_string_append_len (names, subdirectories[i], strlen (subdirectories[i]) + 1);
+    }
+
+    if (names->len > G_MAXUINT32)
+    {
+        return;
+    }
+
+    record = g_new0 (Record, 1);
+    record->stamp = *stamp;
+    record->size = totals->size;
+    record->file_count = totals->file_count;
+    record->directory_count = totals->directory_count;
+    record->names_length = names->len;
+    record->names = g_string_free (g_steal_pointer (&names), FALSE);
+
+    g_mutex_lock (&cache_mutex);
+    ensure_loaded_locked ();
+
+    record->generation = generation + 1;
+    g_hash_table_remove (stale_paths, path);
+    g_hash_table_remove (dropped_records, stamp);
+    /* Replace rather than insert, since the key lives in the record. */
+    g_hash_table_replace (new_records, &record->stamp, record);
+    dirty = TRUE;
+
+    g_mutex_unlock (&cache_mutex);
+}
+
+/**
+ * nautilus_deep_count_cache_invalidate:
+ * @directory: a directory whose entries changed
+ *
+ * Makes the next deep count read @directory again. Needed for changes that
+ * leave the directory itself untouched, such as a file growing.
+ */
+void
+nautilus_deep_count_cache_invalidate (GFile *directory)
+{
+    g_autofree char *path = NULL;
+    gboolean changed = FALSE;
+
+    if (directory == NULL || !g_file_is_native (directory))
+    {
+        return;
+    }
+
+    path = g_file_get_path (directory);
+    if (path == NULL)
+    {
+        return;
+    }
+
+    g_mutex_lock (&cache_mutex);
+    ensure_loaded_locked ();
+
+    /* Nothing to drop if nothing was ever counted. */
+    if ((n_mapped_records > 0 || g_hash_table_size (new_records) > 0) &&
+        !g_hash_table_contains (stale_paths, path))
+    {
+        g_hash_table_insert (stale_paths, g_steal_pointer (&path),
+                             GUINT_TO_POINTER (++stale_serial));
+        dirty = TRUE;
+        changed = TRUE;
+    }
+
+    g_mutex_unlock (&cache_mutex);
+
+    if (changed)
+    {
+        nautilus_deep_count_cache_schedule_save ();
+    }
+}
+
+/* Copies the stale paths with their serials, for the save to work on while
+ * they keep hiding the records from lookups. */
+static GHashTable *
+copy_stale_paths_locked (void)
+{
+    GHashTable *copy = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    GHashTableIter iter;
+    gpointer path;
+    gpointer serial;
+
+    g_hash_table_iter_init (&iter, stale_paths);
+    while (g_hash_table_iter_next (&iter, &path, &serial))
+    {
+        g_hash_table_insert (copy, g_strdup (path), serial);
+    }
+
+    return copy;
+}
+
+/* Looks up the directories whose records are to be dropped. Called without
+ * the lock, so that a slow filesystem doesn't hold up the workers. The keys
+ * match @paths by index, and are left zeroed for directories that are gone. */
+static GArray *
+stat_stale_paths (GPtrArray *paths)
+{
+    GArray *keys = g_array_sized_new (FALSE, TRUE, sizeof (NautilusDeepCountStamp),
+                                      paths->len);
+
+    g_array_set_size (keys, paths->len);
+    for (guint i = 0; i < paths->len; i++)
+    {
+        NautilusDeepCountStamp *key = &g_array_index (keys, NautilusDeepCountStamp, i);
+        struct stat statbuf;
+
+        /* A directory that is gone can't be reached from its parent anymore,
+         * so its record is left for eviction. */
+        if (g_lstat (paths->pdata[i], &statbuf) != 0)
+        {
+            continue;
+        }
+
+        key->device = statbuf.st_dev;
+        key->inode = statbuf.st_ino;
+    }
+
+    return keys;
+}
+
+static void
+drop_stale_records_locked (GPtrArray *paths,
+                           GArray    *keys)
+{
+    for (guint i = 0; i < keys->len; i++)
+    {
+        NautilusDeepCountStamp *key = &g_array_index (keys, NautilusDeepCountStamp, i);
+
+        /* Gone, or counted again since, in which case the record is fresh. */
+        if (key->inode == 0 || !g_hash_table_contains (stale_paths, paths->pdata[i]))
+        {
+            continue;
+        }
+
+        g_hash_table_remove (new_records, key);
+        if (find_mapped_record (key, NULL))
+        {
+            g_hash_table_insert (dropped_records, g_memdup2 (key, sizeof *key),
+                                 GUINT_TO_POINTER (generation + 1));
+        }
+    }
+}
+
+static gint
+compare_by_generation_descending (gconstpointer a,
+                                  gconstpointer b)
+{
+    const Record *record_a = a;
+    const Record *record_b = b;
+
+    if (record_a->generation != record_b->generation)
+    {
+        return record_a->generation < record_b->generation ? 1 : -1;
+    }
+
+    return 0;
+}
+
+static gint
+compare_by_key (gconstpointer a,
+                gconstpointer b)
+{
+    const Record *record_a = a;
+    const Record *record_b = b;
+
+    if (record_a->stamp.device != record_b->stamp.device)
+    {
+        return record_a->stamp.device < record_b->stamp.device ? -1 : 1;
+    }
+    if (record_a->stamp.inode != record_b->stamp.inode)
+    {
+        return record_a->stamp.inode < record_b->stamp.inode ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/* Merges the new records with the still valid mapped ones. */
+static GByteArray *
+serialize_locked (guint32 new_generation)
+{
+    g_autoptr (GArray) records = g_array_new (FALSE, FALSE, sizeof (Record));
+    GByteArray *buffer;
+    GHashTableIter iter;
+    Record *record;
+    guint64 names_length = 0;
+    guint32 n_records = 0;
+
+    g_hash_table_iter_init (&iter, new_records);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &record))
+    {
+        g_array_append_val (records, *record);
+    }
+
+    for (guint32 i = 0; i < n_mapped_records; i++)
+    {
+        Record mapped_record;
+
+        if (read_mapped_record (i, &mapped_record) &&
+            !g_hash_table_contains (new_records, &mapped_record.stamp) &&
+            !g_hash_table_contains (dropped_records, &mapped_record.stamp))
+        {
+            g_array_append_val (records, mapped_record);
+        }
+    }
+
+    if (records->len > CACHE_MAX_RECORDS)
+    {
+        g_array_sort (records, compare_by_generation_descending);
+        g_array_set_size (records, CACHE_MAX_RECORDS);
+    }
+    g_array_sort (records, compare_by_key);
+
+    /* Leave out whatever doesn't fit the 32-bit name offsets. */
+    for (; n_records < records->len; n_records++)
+    {
+        record = &g_array_index (records, Record, n_records);
+        if (names_length + record->names_length > G_MAXUINT32)
+        {
+            break;
+        }
+        names_length += record->names_length;
+    }
+
+    buffer = g_byte_array_sized_new (HEADER_SIZE + n_records * RECORD_SIZE + names_length);
+    g_byte_array_append (buffer, (const guint8 *) CACHE_MAGIC, strlen (CACHE_MAGIC));
+    append_u32 (buffer, CACHE_VERSION);
+    append_u32 (buffer, new_generation);
+    append_u32 (buffer, n_records);
+    append_u64 (buffer, names_length);
+
+    names_length = 0;
+    for (guint32 i = 0; i < n_records; i++)
+    {
+        record = &g_array_index (records, Record, i);
+
+        append_u64 (buffer, record->stamp.device);
+        append_u64 (buffer, record->stamp.inode);
+        append_u64 (buffer, (guint64) record->stamp.mtime_nsec);
+        append_u64 (buffer, (guint64) record->stamp.ctime_nsec);
+        append_u64 (buffer, record->size);
+        append_u32 (buffer, record->file_count);
+        append_u32 (buffer, record->directory_count);
+        append_u32 (buffer, names_length);
+        append_u32 (buffer, record->names_length);
+        append_u32 (buffer, record->generation);
+        append_u32 (buffer, 0);
+        names_length += record->names_length;
+    }
+
+    for (guint32 i = 0; i < n_records; i++)
+    {
+        record = &g_array_index (records, Record, i);
+        g_byte_array_append (buffer, (const guint8 *) record->names, record->names_length);
+    }
+
+    return buffer;
+}
+
+/* Forgets the stale paths in @stale, unless invalidated again since. */
+static void
+forget_stale_paths_locked (GHashTable *stale)
+{
+    GHashTableIter iter;
+    gpointer path;
+    gpointer serial;
+
+    g_hash_table_iter_init (&iter, stale);
+    while (g_hash_table_iter_next (&iter, &path, &serial))
+    {
+        if (g_hash_table_lookup (stale_paths, path) == serial)
+        {
+            g_hash_table_remove (stale_paths, path);
+        }
+    }
+}
+
+/* Forgets what the file written in @saved_generation now holds. */
+static void
+prune_saved_records_locked (guint32 saved_generation)
+{
+    GHashTableIter iter;
+    Record *record;
+    gpointer dropped_generation;
+
+    g_hash_table_iter_init (&iter, new_records);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &record))
+    {
+        if (record->generation <= saved_generation)
+        {
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+
+    g_hash_table_iter_init (&iter, dropped_records);
+    while (g_hash_table_iter_next (&iter, NULL, &dropped_generation))
+    {
+        if (GPOINTER_TO_UINT (dropped_generation) <= saved_generation)
+        {
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+}
+
+static void
+save_thread (GTask        *task,
+             gpointer      source_object,
+             gpointer      task_data,
+             GCancellable *cancellable)
+{
+    g_autofree char *dir = get_cache_dir ();
+    g_autofree char *path = get_cache_path ();
+    g_autoptr (GByteArray) buffer = NULL;
+    g_autoptr (GError) error = NULL;
+    g_autoptr (GHashTable) stale = NULL;
+    g_autoptr (GPtrArray) stale_list = NULL;
+    g_autoptr (GArray) stale_keys = NULL;
+    guint32 new_generation;
+
+    /* The paths stay stale until the records are gone from the file, as
+     * lookups would find them in the mapping meanwhile. */
+    g_mutex_lock (&cache_mutex);
+    stale = copy_stale_paths_locked ();
+    g_mutex_unlock (&cache_mutex);
+
+    stale_list = g_hash_table_get_keys_as_ptr_array (stale);
+    stale_keys = stat_stale_paths (stale_list);
+
+    g_mutex_lock (&cache_mutex);
+
+    drop_stale_records_locked (stale_list, stale_keys);
+    dirty = FALSE;
+    if (g_hash_table_size (new_records) == 0 && g_hash_table_size (dropped_records) == 0)
+    {
+        /* Nothing is mapped for them to hide. */
+        forget_stale_paths_locked (stale);
+        saving = FALSE;
+        g_mutex_unlock (&cache_mutex);
+        return;
+    }
+
+    /* Records stored from now on belong to the next save. */
+    new_generation = generation + 1;
+    buffer = serialize_locked (new_generation);
+    generation = new_generation;
+
+    g_mutex_unlock (&cache_mutex);
+
+    if (g_mkdir_with_parents (dir, 0700) != 0 ||
+        !g_file_set_contents_full (path, (const char *) buffer->data, buffer->len,
+                                   G_FILE_SET_CONTENTS_CONSISTENT, 0600, &error))
+    {
+        g_debug ("Failed to save deep count cache: %s",
+                 error != NULL ? error->message : g_strerror (errno));
+
+        g_mutex_lock (&cache_mutex);
+        saving = FALSE;
+        g_mutex_unlock (&cache_mutex);
+        return;
+    }
+
+    g_mutex_lock (&cache_mutex);
+    /* The old mapping stays valid until replaced, as the file was renamed
+     * over rather than rewritten. */
+    if (map_cache_file_locked (path))
+    {
+        prune_saved_records_locked (new_generation);
+        forget_stale_paths_locked (stale);
+    }
+    saving = FALSE;
+    g_mutex_unlock (&cache_mutex);
+}
+
+static gboolean
+on_save_timeout (gpointer user_data)
+{
+    g_autoptr (GTask) task = NULL;
+    gboolean start;
+
+    save_timeout_id = 0;
+
+    g_mutex_lock (&cache_mutex);
+    if (saving)
+    {
+        g_mutex_unlock (&cache_mutex);
+        nautilus_deep_count_cache_schedule_save ();
+        return G_SOURCE_REMOVE;
+    }
+    start = cache_loaded && dirty;
+    saving = start;
+    g_mutex_unlock (&cache_mutex);
+
+    if (start)
+    {
+        task = g_task_new (NULL, NULL, NULL, NULL);
+        g_task_set_source_tag (task, on_save_timeout);
+        g_task_run_in_thread (task, save_thread);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * nautilus_deep_count_cache_schedule_save:
+ *
+ * Writes out the changes to the cache a little later, on a worker thread.
+ * Must be called from the main thread.
+ */
+void
+nautilus_deep_count_cache_schedule_save (void)
+{
+    if (save_timeout_id == 0)
+    {
+        save_timeout_id = g_timeout_add_seconds (SAVE_DELAY, on_save_timeout, NULL);
+    }
+}
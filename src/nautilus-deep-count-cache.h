@@ -0,0 +1,36 @@
+/*
+ * nautilus-deep-count-cache.h: Persistent per-directory totals for deep counts
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "nautilus-deep-count.h"
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Identifies the state of a directory when its entries were counted. */
+typedef struct
+{
+    guint64 device;
+    guint64 inode;
+    gint64 mtime_nsec;
+    gint64 ctime_nsec;
+} NautilusDeepCountStamp;
+
+gboolean nautilus_deep_count_cache_lookup        (const char                    *path,
+                                                  const NautilusDeepCountStamp  *stamp,
+                                                  NautilusDeepCountTotals       *totals,
+                                                  GStrv                         *subdirectories);
+void     nautilus_deep_count_cache_store         (const char                    *path,
+                                                  const NautilusDeepCountStamp  *stamp,
+                                                  const NautilusDeepCountTotals *totals,
+                                                  const char * const            *subdirectories,
+                                                  guint                          n_subdirectories);
+void     nautilus_deep_count_cache_invalidate    (GFile                         *directory);
+void     nautilus_deep_count_cache_schedule_save (void);
+
+G_END_DECLS
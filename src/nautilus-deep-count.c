@@ -0,0 +1,836 @@
+/*
+ * nautilus-deep-count.c: Parallel traversal for recursive folder sizes
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "nautilus-deep-count"
+
+#include <config.h>
+#include "nautilus-deep-count.h"
+
+#include "nautilus-deep-count-cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+/**
+ * A deep count walks a whole subtree to find how many files and folders it
+ * holds and how much space they take. The walk is split across a few worker
+ * threads. Each worker keeps a deque of directories still to be read: it
+ * takes work from the tail of its own deque and, once that runs dry, steals
+ * from the head of another worker's, so a deep branch found by one worker is
+ * soon spread over all of them.
+ *
+ * Native directories are read with readdir(), with each entry looked up by
+ * statx() (fstatat() where it is missing) relative to the directory's file
+ * descriptor. Anything else is read with synchronous GIO calls from the
+ * workers. Only directories on the same filesystem as their parent are
+ * entered, and a file with several hard links adds to the size only once.
+ *
+ * Native directories that have not changed since an earlier count are not
+ * read at all; their totals come from the deep count cache, which is updated
+ * with each directory that is read.
+ *
+ * A request for a location that is already being counted joins the running
+ * traversal rather than starting a second one.
+ */
+
+#define MAX_WORKERS 4
+
+/* How often the totals so far are passed on to the requesters. */
+#define PROGRESS_INTERVAL 200
+
+#define GIO_ATTRIBUTES G_FILE_ATTRIBUTE_STANDARD_NAME "," \
+                       G_FILE_ATTRIBUTE_STANDARD_TYPE "," \
+                       G_FILE_ATTRIBUTE_STANDARD_SIZE "," \
+                       G_FILE_ATTRIBUTE_ID_FILESYSTEM "," \
+                       G_FILE_ATTRIBUTE_UNIX_DEVICE "," \
+                       G_FILE_ATTRIBUTE_UNIX_INODE "," \
+                       G_FILE_ATTRIBUTE_UNIX_NLINK
+
+typedef struct DeepCountJob DeepCountJob;
+
+typedef struct
+{
+    /* Native directories are queued by path, others by location. */
+    char *path;
+    GFile *location;
+
+    /* Device of the parent directory, for native ones other than the root. */
+    guint64 device;
+
+    /* Interned filesystem ID of the directory, for non-native ones. */
+    const char *fs_id;
+} WorkItem;
+
+typedef struct
+{
+    DeepCountJob *job;
+    guint index;
+
+    GMutex mutex;
+    GQueue items;
+} Worker;
+
+typedef struct
+{
+    guint64 device;
+    guint64 inode;
+} InodeKey;
+
+struct DeepCountJob
+{
+    gint ref_count;
+
+    char *uri;
+    GCancellable *cancellable;
+
+    Worker workers[MAX_WORKERS];
+    guint n_workers;
+
+    /* Protects everything below. */
+    GMutex mutex;
+    GCond cond;
+    guint pending;
+    guint work_generation;
+    guint n_finished_workers;
+    NautilusDeepCountTotals totals;
+    GHashTable *seen_inodes;
+
+    /* Used from the main thread only. */
+    GList *requests;
+    guint progress_id;
+};
+
+typedef struct
+{
+    guint id;
+    DeepCountJob *job;
+    NautilusDeepCountCallback callback;
+    gpointer user_data;
+} Request;
+
+/* Main thread only. */
+static GHashTable *jobs_by_uri;
+static GHashTable *requests_by_id;
+static guint last_request_id;
+
+static void
+work_item_free (WorkItem *item)
+{
+    g_free (item->path);
+    g_clear_object (&item->location);
+    g_free (item);
+}
+
+static guint
+inode_key_hash (gconstpointer key)
+{
+    const InodeKey *inode_key = key;
+
+    return g_int64_hash (&inode_key->inode) ^ g_int64_hash (&inode_key->device);
+}
+
+static gboolean
+inode_key_equal (gconstpointer a,
+                 gconstpointer b)
+{
+    const InodeKey *key_a = a;
+    const InodeKey *key_b = b;
+
+    return key_a->inode == key_b->inode && key_a->device == key_b->device;
+}
+
+static DeepCountJob *
+job_ref (DeepCountJob *job)
+{
+    g_atomic_int_inc (&job->ref_count);
+
+    return job;
+}
+
+static void
+job_unref (DeepCountJob *job)
+{
+    if (!g_atomic_int_dec_and_test (&job->ref_count))
+    {
+        return;
+    }
+
+    for (guint i = 0; i < job->n_workers; i++)
+    {
+        g_queue_clear_full (&job->workers[i].items, (GDestroyNotify) work_item_free);
+        g_mutex_clear (&job->workers[i].mutex);
+    }
+
+    g_mutex_clear (&job->mutex);
+    g_cond_clear (&job->cond);
+    g_hash_table_unref (job->seen_inodes);
+    g_object_unref (job->cancellable);
+    g_free (job->uri);
+    g_free (job);
+}
+
+/* Returns whether the size of the given inode still has to be counted. */
+static gboolean
+claim_inode (DeepCountJob *job,
+             guint64       device,
+             guint64       inode)
+{
+    InodeKey key = { device, inode };
+    gboolean claimed = FALSE;
+
+    g_mutex_lock (&job->mutex);
+    if (!g_hash_table_contains (job->seen_inodes, &key))
+    {
+        g_hash_table_add (job->seen_inodes, g_memdup2 (&key, sizeof key));
+        claimed = TRUE;
+    }
+    g_mutex_unlock (&job->mutex);
+
+    return claimed;
+}
+
+static void
+add_totals (DeepCountJob                  *job,
+            const NautilusDeepCountTotals *totals)
+{
+    g_mutex_lock (&job->mutex);
+    job->totals.directory_count += totals->directory_count;
+    job->totals.file_count += totals->file_count;
+    job->totals.unreadable_count += totals->unreadable_count;
+    job->totals.size += totals->size;
+    g_mutex_unlock (&job->mutex);
+}
+
+static void
+push_work (Worker   *worker,
+           WorkItem *item)
+{
+    DeepCountJob *job = worker->job;
+
+    /* Counted before it can be stolen, since whoever takes it may finish it
+     * and drop the count right away. */
+    g_mutex_lock (&job->mutex);
+    job->pending++;
+    g_mutex_unlock (&job->mutex);
+
+    g_mutex_lock (&worker->mutex);
+    g_queue_push_tail (&worker->items, item);
+    g_mutex_unlock (&worker->mutex);
+
+    /* Signalling under the lock pairs with the check in worker_thread_func(). */
+    g_mutex_lock (&job->mutex);
+    job->work_generation++;
+    g_cond_signal (&job->cond);
+    g_mutex_unlock (&job->mutex);
+}
+
+static WorkItem *
+pop_work (Worker *worker)
+{
+    DeepCountJob *job = worker->job;
+    WorkItem *item;
+
+    /* Newest first from our own deque, which keeps the walk depth-first... */
+    g_mutex_lock (&worker->mutex);
+    item = g_queue_pop_tail (&worker->items);
+    g_mutex_unlock (&worker->mutex);
+
+    /* ...and oldest first from the others, which takes the shallowest
+     * directories, likely the ones with the most left below them. */
+    for (guint i = 1; item == NULL && i < job->n_workers; i++)
+    {
+        Worker *victim = &job->workers[(worker->index + i) % job->n_workers];
+
+        g_mutex_lock (&victim->mutex);
+        item = g_queue_pop_head (&victim->items);
+        g_mutex_unlock (&victim->mutex);
+    }
+
+    return item;
+}
+
+typedef struct
+{
+    gboolean is_directory;
+    guint64 device;
+    guint64 inode;
+    guint64 n_links;
+    goffset size;
+} EntryInfo;
+
+static gboolean
+stat_entry (int         dir_fd,
+            const char *name,
+            EntryInfo  *info)
+{
+#ifdef HAVE_STATX
+    struct statx stx;
+
+    if (statx (dir_fd, name,
+               AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC,
+               STATX_TYPE | STATX_INO | STATX_NLINK | STATX_SIZE,
+               &stx) != 0)
+    {
+        return FALSE;
+    }
+
+    info->is_directory = S_ISDIR (stx.stx_mode);
+    info->device = makedev (stx.stx_dev_major, stx.stx_dev_minor);
+    info->inode = stx.stx_ino;
+    info->n_links = stx.stx_nlink;
+    info->size = stx.stx_size;
+#else
+    struct stat st;
+
+    if (fstatat (dir_fd, name, &st, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT) != 0)
+    {
+        return FALSE;
+    }
+
+    info->is_directory = S_ISDIR (st.st_mode);
+    info->device = st.st_dev;
+    info->inode = st.st_ino;
+    info->n_links = st.st_nlink;
+    info->size = st.st_size;
+#endif
+
+    return TRUE;
+}
+
+static void
+count_entry (DeepCountJob            *job,
+             const EntryInfo         *info,
+             NautilusDeepCountTotals *totals)
+{
+    if (info->is_directory)
+    {
+        totals->directory_count++;
+    }
+    else
+    {
+        /* Even non-regular files count as files. */
+        totals->file_count++;
+    }
+
+    /* Directories can't be hard linked, so only other files need checking. */
+    if (!info->is_directory && info->n_links > 1 &&
+        !claim_inode (job, info->device, info->inode))
+    {
+        return;
+    }
+
+    totals->size += info->size;
+}
+
+static void
+stamp_from_stat (const struct stat      *statbuf,
+                 NautilusDeepCountStamp *stamp)
+{
+    stamp->device = statbuf->st_dev;
+    stamp->inode = statbuf->st_ino;
+    stamp->mtime_nsec = (gint64) statbuf->st_mtim.tv_sec * G_GINT64_CONSTANT (1000000000) +
+                        statbuf->st_mtim.tv_nsec;
+    stamp->ctime_nsec = (gint64) statbuf->st_ctim.tv_sec * G_GINT64_CONSTANT (1000000000) +
+                        statbuf->st_ctim.tv_nsec;
+}
+
+static void
+push_native_subdirectory (Worker     *worker,
+                          const char *parent_path,
+                          const char *name,
+                          guint64     device)
+{
+    WorkItem *subdirectory = g_new0 (WorkItem, 1);
+
+    subdirectory->path = g_build_filename (parent_path, name, NULL);
+    subdirectory->device = device;
+    push_work (worker, subdirectory);
+}
+
+static void
+read_native_directory (Worker                  *worker,
+                       WorkItem                *item,
+                       NautilusDeepCountTotals *totals)
+{
+    DeepCountJob *job = worker->job;
+    g_autoptr (GPtrArray) subdirectories = NULL;
+    g_auto (GStrv) cached_subdirectories = NULL;
+    NautilusDeepCountStamp stamp;
+    struct stat dir_stat;
+    struct dirent *entry;
+    gboolean cacheable = TRUE;
+    DIR *dir;
+    int fd;
+
+    if (lstat (item->path, &dir_stat) == 0 && S_ISDIR (dir_stat.st_mode))
+    {
+        if (item->device != 0 && dir_stat.st_dev != item->device)
+        {
+            /* Something got mounted here since the parent was cached. */
+            return;
+        }
+
+        stamp_from_stat (&dir_stat, &stamp);
+        if (nautilus_deep_count_cache_lookup (item->path, &stamp, totals, &cached_subdirectories))
+        {
+            for (guint i = 0; cached_subdirectories[i] != NULL; i++)
+            {
+                push_native_subdirectory (worker, item->path, cached_subdirectories[i],
+                                          dir_stat.st_dev);
+            }
+            return;
+        }
+    }
+
+    fd = open (item->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || fstat (fd, &dir_stat) != 0)
+    {
+        totals->unreadable_count++;
+        if (fd >= 0)
+        {
+            close (fd);
+        }
+        return;
+    }
+
+    dir = fdopendir (fd);
+    if (dir == NULL)
+    {
+        totals->unreadable_count++;
+        close (fd);
+        return;
+    }
+
+    /* Taken before reading, so that a record can't claim to be newer than
+     * what was read. */
+    stamp_from_stat (&dir_stat, &stamp);
+    subdirectories = g_ptr_array_new_with_free_func (g_free);
+
+    while (TRUE)
+    {
+        EntryInfo info;
+
+        errno = 0;
+        entry = readdir (dir);
+        if (entry == NULL)
+        {
+            cacheable = cacheable && errno == 0;
+            break;
+        }
+
+        if (g_cancellable_is_cancelled (job->cancellable))
+        {
+            cacheable = FALSE;
+            break;
+        }
+
+        if (strcmp (entry->d_name, ".") == 0 || strcmp (entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        if (!stat_entry (fd, entry->d_name, &info))
+        {
+            /* Removed while we were reading. */
+            cacheable = FALSE;
+            continue;
+        }
+
+        /* Links are only told apart within one traversal. */
+        if (!info.is_directory && info.n_links > 1)
+        {
+            cacheable = FALSE;
+        }
+
+        count_entry (job, &info, totals);
+
+        if (info.is_directory && info.device == dir_stat.st_dev)
+        {
+            push_native_subdirectory (worker, item->path, entry->d_name, dir_stat.st_dev);
+            g_ptr_array_add (subdirectories, g_strdup (entry->d_name));
+        }
+    }
+
+    /* Also closes fd. */
+    closedir (dir);
+
+    if (cacheable)
+    {
+        nautilus_deep_count_cache_store (item->path, &stamp, totals,
+                                         (const char * const *) subdirectories->pdata,
+                                         subdirectories->len);
+    }
+}
+
+static void
+read_gio_directory (Worker                  *worker,
+                    WorkItem                *item,
+                    NautilusDeepCountTotals *totals)
+{
+    DeepCountJob *job = worker->job;
+    g_autoptr (GFileEnumerator) enumerator = NULL;
+    GFileInfo *info;
+
+    if (item->fs_id == NULL)
+    {
+        /* Only the root is queued without it. */
+        g_autoptr (GFileInfo) dir_info = NULL;
+
+        dir_info = g_file_query_info (item->location, G_FILE_ATTRIBUTE_ID_FILESYSTEM,
+                                      G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                      job->cancellable, NULL);
+        if (dir_info != NULL)
+        {
+            item->fs_id = g_intern_string (g_file_info_get_attribute_string (dir_info,
+                                                                             G_FILE_ATTRIBUTE_ID_FILESYSTEM));
+        }
+    }
+
+    enumerator = g_file_enumerate_children (item->location, GIO_ATTRIBUTES,
+                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                            job->cancellable, NULL);
+    if (enumerator == NULL)
+    {
+        totals->unreadable_count++;
+        return;
+    }
+
+    while ((info = g_file_enumerator_next_file (enumerator, job->cancellable, NULL)) != NULL)
+    {
+        EntryInfo entry =
+        {
+            .is_directory = g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY,
+            .device = g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_DEVICE),
+            .inode = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE),
+            .n_links = g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_NLINK),
+            .size = g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_STANDARD_SIZE) ?
+                    g_file_info_get_size (info) : 0,
+        };
+
+        /* Without an inode there is no telling links apart. */
+        if (entry.inode == 0)
+        {
+            entry.n_links = 1;
+        }
+
+        count_entry (job, &entry, totals);
+
+        if (entry.is_directory &&
+            g_strcmp0 (g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_ID_FILESYSTEM),
+                       item->fs_id) == 0)
+        {
+            WorkItem *subdirectory = g_new0 (WorkItem, 1);
+
+            subdirectory->location = g_file_enumerator_get_child (enumerator, info);
+            subdirectory->fs_id = item->fs_id;
+            push_work (worker, subdirectory);
+        }
+
+        g_object_unref (info);
+    }
+}
+
+static gboolean report_finished (gpointer user_data);
+
+static gpointer
+worker_thread_func (gpointer user_data)
+{
+    Worker *worker = user_data;
+    DeepCountJob *job = worker->job;
+    gboolean finished;
+
+    while (TRUE)
+    {
+        WorkItem *item;
+        guint generation;
+
+        g_mutex_lock (&job->mutex);
+        generation = job->work_generation;
+        g_mutex_unlock (&job->mutex);
+
+        item = pop_work (worker);
+        if (item != NULL)
+        {
+            NautilusDeepCountTotals totals = { 0 };
+
+            /* After cancellation, just drain the deques. */
+            if (!g_cancellable_is_cancelled (job->cancellable))
+            {
+                if (item->path != NULL)
+                {
+                    read_native_directory (worker, item, &totals);
+                }
+                else
+                {
+                    read_gio_directory (worker, item, &totals);
+                }
+                add_totals (job, &totals);
+            }
+            work_item_free (item);
+
+            g_mutex_lock (&job->mutex);
+            job->pending--;
+            if (job->pending == 0)
+            {
+                g_cond_broadcast (&job->cond);
+            }
+            g_mutex_unlock (&job->mutex);
+
+            continue;
+        }
+
+        g_mutex_lock (&job->mutex);
+        if (job->pending == 0)
+        {
+            g_mutex_unlock (&job->mutex);
+            break;
+        }
+        /* Nothing to steal right now, but others are still reading. Wait for
+         * them to queue more, unless they did since we looked. */
+        if (generation == job->work_generation)
+        {
+            g_cond_wait (&job->cond, &job->mutex);
+        }
+        g_mutex_unlock (&job->mutex);
+    }
+
+    g_mutex_lock (&job->mutex);
+    job->n_finished_workers++;
+    finished = job->n_finished_workers == job->n_workers;
+    g_mutex_unlock (&job->mutex);
+
+    if (finished)
+    {
+        /* Rather than waiting for the next progress report. */
+        g_idle_add_full (G_PRIORITY_DEFAULT, report_finished,
+                         job_ref (job), (GDestroyNotify) job_unref);
+    }
+
+    job_unref (job);
+
+    return NULL;
+}
+
+static void
+request_free (Request *request)
+{
+    g_free (request);
+}
+
+static void
+job_detach (DeepCountJob *job)
+{
+    g_clear_handle_id (&job->progress_id, g_source_remove);
+    g_hash_table_remove (jobs_by_uri, job->uri);
+    job_unref (job);
+
+    /* Even a cancelled traversal leaves records for the directories it read. */
+    nautilus_deep_count_cache_schedule_save ();
+}
+
+static gboolean
+report_progress (gpointer user_data)
+{
+    DeepCountJob *job = job_ref (user_data);
+    NautilusDeepCountTotals totals;
+    g_autoptr (GArray) ids = NULL;
+    gboolean done;
+    gboolean keep_going;
+
+    g_mutex_lock (&job->mutex);
+    totals = job->totals;
+    done = job->n_finished_workers == job->n_workers;
+    g_mutex_unlock (&job->mutex);
+
+    /* Callbacks may cancel any request, so look each one up again. */
+    ids = g_array_new (FALSE, FALSE, sizeof (guint));
+    for (GList *l = job->requests; l != NULL; l = l->next)
+    {
+        g_array_append_val (ids, ((Request *) l->data)->id);
+    }
+
+    if (done)
+    {
+        /* Detach first, so that callbacks may start a new count of the same
+         * location. */
+        job_detach (job);
+    }
+
+    for (guint i = 0; i < ids->len; i++)
+    {
+        guint id = g_array_index (ids, guint, i);
+        Request *request = g_hash_table_lookup (requests_by_id, GUINT_TO_POINTER (id));
+
+        if (request == NULL)
+        {
+            continue;
+        }
+
+        if (done)
+        {
+            g_hash_table_remove (requests_by_id, GUINT_TO_POINTER (id));
+            job->requests = g_list_remove (job->requests, request);
+        }
+
+        request->callback (&totals, done, request->user_data);
+
+        if (done)
+        {
+            request_free (request);
+        }
+    }
+
+    /* The last request may have been cancelled by a callback. */
+    keep_going = job->progress_id != 0;
+    job_unref (job);
+
+    return keep_going ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+static gboolean
+report_finished (gpointer user_data)
+{
+    DeepCountJob *job = user_data;
+
+    /* Unless it was cancelled, or the last progress report saw it done. */
+    if (job->progress_id != 0)
+    {
+        report_progress (job);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static DeepCountJob *
+job_new (GFile *location)
+{
+    DeepCountJob *job = g_new0 (DeepCountJob, 1);
+    g_autofree char *path = g_file_get_path (location);
+    WorkItem *root = g_new0 (WorkItem, 1);
+
+    job->ref_count = 1;
+    job->uri = g_file_get_uri (location);
+    job->cancellable = g_cancellable_new ();
+    job->seen_inodes = g_hash_table_new_full (inode_key_hash, inode_key_equal, g_free, NULL);
+    job->n_workers = CLAMP (g_get_num_processors (), 1, MAX_WORKERS);
+    g_mutex_init (&job->mutex);
+    g_cond_init (&job->cond);
+
+    for (guint i = 0; i < job->n_workers; i++)
+    {
+        job->workers[i].job = job;
+        job->workers[i].index = i;
+        g_mutex_init (&job->workers[i].mutex);
+        g_queue_init (&job->workers[i].items);
+    }
+
+    if (path != NULL && g_file_is_native (location))
+    {
+        root->path = g_steal_pointer (&path);
+    }
+    else
+    {
+        root->location = g_object_ref (location);
+    }
+    push_work (&job->workers[0], root);
+
+    for (guint i = 0; i < job->n_workers; i++)
+    {
+        job_ref (job);
+        g_thread_unref (g_thread_new ("nautilus-deep-count",
+                                      worker_thread_func, &job->workers[i]));
+    }
+
+    job->progress_id = g_timeout_add (PROGRESS_INTERVAL, report_progress, job);
+
+    return job;
+}
+
+/**
+ * nautilus_deep_count_start:
+ * @location: the directory to count
+ * @callback: called with the totals so far, and once more when done
+ * @user_data: user data for @callback
+ *
+ * Counts the files and directories below @location and adds up their sizes.
+ * If @location is already being counted, the request shares that traversal
+ * and first hears about the totals it has reached.
+ *
+ * Returns: an ID to pass to nautilus_deep_count_cancel()
+ */
+guint
+nautilus_deep_count_start (GFile                     *location,
+                           NautilusDeepCountCallback  callback,
+                           gpointer                   user_data)
+{
+    g_autofree char *uri = NULL;
+    DeepCountJob *job;
+    Request *request;
+
+    g_return_val_if_fail (G_IS_FILE (location), 0);
+    g_return_val_if_fail (callback != NULL, 0);
+
+    if (jobs_by_uri == NULL)
+    {
+        jobs_by_uri = g_hash_table_new (g_str_hash, g_str_equal);
+        requests_by_id = g_hash_table_new (NULL, NULL);
+    }
+
+    uri = g_file_get_uri (location);
+    job = g_hash_table_lookup (jobs_by_uri, uri);
+    if (job == NULL)
+    {
+        job = job_new (location);
+        g_hash_table_insert (jobs_by_uri, job->uri, job);
+    }
+
+    request = g_new0 (Request, 1);
+    request->id = ++last_request_id;
+    request->job = job;
+    request->callback = callback;
+    request->user_data = user_data;
+
+    job->requests = g_list_prepend (job->requests, request);
+    g_hash_table_insert (requests_by_id, GUINT_TO_POINTER (request->id), request);
+
+    return request->id;
+}
+
+/**
+ * nautilus_deep_count_cancel:
+ * @request_id: an ID returned by nautilus_deep_count_start()
+ *
+ * Stops reporting to the request. The traversal itself is stopped once no
+ * request is left for it.
+ */
+void
+nautilus_deep_count_cancel (guint request_id)
+{
+    Request *request;
+    DeepCountJob *job;
+
+    if (requests_by_id == NULL ||
+        !g_hash_table_steal_extended (requests_by_id, GUINT_TO_POINTER (request_id),
+                                      NULL, (gpointer *) &request))
+    {
+        return;
+    }
+
+    job = request->job;
+    job->requests = g_list_remove (job->requests, request);
+    request_free (request);
+
+    if (job->requests == NULL && job->progress_id != 0)
+    {
+        g_cancellable_cancel (job->cancellable);
+        job_detach (job);
+    }
+}
@@ -0,0 +1,33 @@
+/*
+ * nautilus-deep-count.h: Parallel traversal for recursive folder sizes
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct
+{
+    guint directory_count;
+    guint file_count;
+    guint unreadable_count;
+    goffset size;
+} NautilusDeepCountTotals;
+
+/* Called on the main thread with the totals so far, and a last time with
+ * @done set once the whole subtree has been read.
+ */
+typedef void (* NautilusDeepCountCallback) (const NautilusDeepCountTotals *totals,
+                                            gboolean                       done,
+                                            gpointer                       user_data);
+
+guint nautilus_deep_count_start  (GFile                     *location,
+                                  NautilusDeepCountCallback  callback,
+                                  gpointer                   user_data);
+void  nautilus_deep_count_cancel (guint                      request_id);
+
+G_END_DECLS
@@ -23,8 +23,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "nautilus-deep-count.h"
 #include "nautilus-directory-notify.h"
 #include "nautilus-directory-private.h"
+#include "nautilus-directory-snapshot.h"
 #include "nautilus-enums.h"
 #include "nautilus-file-private.h"
 #include "nautilus-file-utilities.h"
@@ -50,6 +52,9 @@ struct ThumbnailInfoState
     NautilusDirectory *directory;
     GCancellable *cancellable;
     NautilusFile *file;
+    /* For local files, @file and the other files of the directory that
+     * need thumbnail info, looked up in the cache at once. */
+    GPtrArray *batch;
 };
 
 struct ThumbnailBufState
@@ -80,6 +85,10 @@ struct DirectoryLoadState
     GFileEnumerator *enumerator;
     NautilusFile *load_directory_file;
     int load_file_count;
+
+    /* State of the directory from before enumerating, if known. */
+    NautilusDirectorySnapshotStamp snapshot_stamp;
+    gboolean has_snapshot_stamp;
 };
 
 struct GetInfoState
@@ -107,12 +116,7 @@ struct DirectoryCountState
 struct DeepCountState
 {
     NautilusDirectory *directory;
-    GCancellable *cancellable;
-    GFileEnumerator *enumerator;
-    GFile *deep_count_location;
-    GList *deep_count_subdirectories;
-    GHashTable *seen_deep_count_inodes;
-    char *fs_id;
+    guint request_id;
 };
 
 
@@ -156,8 +160,6 @@ static GHashTable *async_jobs;
 #endif
 
 /* Forward declarations for functions that need them. */
-static void     deep_count_load (DeepCountState *state,
-                                 GFile          *location);
 static gboolean request_is_satisfied (NautilusDirectory *directory,
                                       NautilusFile      *file,
                                       Request            request);
@@ -420,15 +422,19 @@ directory_count_cancel (NautilusDirectory *directory)
 static void
 deep_count_cancel (NautilusDirectory *directory)
 {
-    if (directory->details->deep_count_in_progress != NULL)
-    {
-        g_assert (NAUTILUS_IS_FILE (directory->details->deep_count_file));
+    DeepCountState *state = directory->details->deep_count_in_progress;
 
-        g_cancellable_cancel (directory->details->deep_count_in_progress->cancellable);
+    if (state != NULL)
+    {
+        nautilus_deep_count_cancel (state->request_id);
+        g_free (state);
 
-        directory->details->deep_count_file->details->deep_counts_status = NAUTILUS_REQUEST_NOT_STARTED;
+        if (directory->details->deep_count_file != NULL)
+        {
+            g_assert (NAUTILUS_IS_FILE (directory->details->deep_count_file));
+            directory->details->deep_count_file->details->deep_counts_status = NAUTILUS_REQUEST_NOT_STARTED;
+        }
 
-        directory->details->deep_count_in_progress->directory = NULL;
         directory->details->deep_count_in_progress = NULL;
         directory->details->deep_count_file = NULL;
 
@@ -859,7 +865,7 @@ dequeue_pending_idle_callback (gpointer callback_data)
 {
     NautilusDirectory *directory;
     GList *pending_file_info;
-    GList *node, *next;
+    GList *node;
     NautilusFile *file;
     GList *changed_files, *added_files;
     GFileInfo *file_info;
@@ -946,12 +952,13 @@ dequeue_pending_idle_callback (gpointer callback_data)
      */
     if (directory->details->directory_loaded)
     {
-        for (node = directory->details->file_list;
-             node != NULL; node = next)
-        {
-            file = NAUTILUS_FILE (node->data);
-            next = node->next;
+        NautilusDirectoryFileIter iter;
 
+        /* Marking a file gone removes it from the directory, which the
+         * iterator tolerates for the current file. */
+        nautilus_directory_file_iter_init (&iter, directory);
+        while (nautilus_directory_file_iter_next (&iter, &file))
+        {
             if (file->details->unconfirmed)
             {
                 nautilus_file_ref (file);
@@ -1086,8 +1093,6 @@ static void
 directory_load_done (NautilusDirectory *directory,
                      GError            *error)
 {
-    GList *node;
-
     g_object_ref (directory);
 
     directory->details->directory_loaded = TRUE;
@@ -1101,10 +1106,13 @@ directory_load_done (NautilusDirectory *directory,
          * they won't be marked "gone" later -- we don't know enough
          * about them to know whether they are really gone.
          */
-        for (node = directory->details->file_list;
-             node != NULL; node = node->next)
+        NautilusDirectoryFileIter iter;
+        NautilusFile *file;
+
+        nautilus_directory_file_iter_init (&iter, directory);
+        while (nautilus_directory_file_iter_next (&iter, &file))
         {
-            set_file_unconfirmed (NAUTILUS_FILE (node->data), FALSE);
+            set_file_unconfirmed (file, FALSE);
         }
 
         nautilus_directory_emit_load_error (directory, error);
@@ -1733,16 +1741,18 @@ has_problem (NautilusDirectory *directory,
              NautilusFile      *file,
              FileCheck          problem)
 {
-    GList *node;
+    NautilusFile * const *files;
+    guint n_files;
 
     if (file != NULL)
     {
         return (*problem)(file);
     }
 
-    for (node = directory->details->file_list; node != NULL; node = node->next)
+    files = nautilus_directory_peek_files (directory, &n_files);
+    for (guint i = 0; i < n_files; i++)
     {
-        if ((*problem)(node->data))
+        if ((*problem)(files[i]))
         {
             return TRUE;
         }
@@ -2005,13 +2015,13 @@ nautilus_directory_is_file_list_monitored (NautilusDirectory *directory)
 static void
 mark_all_files_unconfirmed (NautilusDirectory *directory)
 {
-    GList *node;
-    NautilusFile *file;
+    NautilusFile * const *files;
+    guint n_files;
 
-    for (node = directory->details->file_list; node != NULL; node = node->next)
+    files = nautilus_directory_peek_files (directory, &n_files);
+    for (guint i = 0; i < n_files; i++)
     {
-        file = node->data;
-        set_file_unconfirmed (file, TRUE);
+        set_file_unconfirmed (files[i], TRUE);
     }
 }
 
@@ -2072,6 +2082,20 @@ more_files_callback (GObject      *source_object,
     if (files == NULL)
     {
         directory_load_done (directory, error);
+
+        /* Saved again even if a snapshot was shown, as the files in it may
+         * have changed since without touching the directory itself. */
+        if (error == NULL && state->has_snapshot_stamp)
+        {
+            NautilusFile * const *directory_files;
+            guint n_files;
+
+            directory_files = nautilus_directory_peek_files (directory, &n_files);
+            nautilus_directory_snapshot_save (directory->details->location,
+                                              &state->snapshot_stamp,
+                                              directory_files, n_files);
+        }
+
         directory_load_state_free (state);
     }
     else
@@ -2136,6 +2160,80 @@ enumerate_children_callback (GObject      *source_object,
 }
 
 
+static void
+directory_load_enumerate (DirectoryLoadState *state)
+{
+    g_file_enumerate_children_async (state->directory->details->location,
+                                     NAUTILUS_FILE_DEFAULT_ATTRIBUTES,
+                                     0,     /* flags */
+                                     G_PRIORITY_DEFAULT,     /* prio */
+                                     state->cancellable,
+                                     enumerate_children_callback,
+                                     state);
+}
+
+/* Show the files of a snapshot right away. They stay unconfirmed, so the
+ * enumeration that follows updates the ones it finds and marks the rest gone.
+ */
+static void
+directory_load_apply_snapshot (NautilusDirectory *directory,
+                               GList             *infos)
+{
+    GList *added_files = NULL;
+
+    for (GList *l = infos; l != NULL; l = l->next)
+    {
+        GFileInfo *info = l->data;
+        NautilusFile *file;
+
+        if (nautilus_directory_find_file_by_name (directory, g_file_info_get_name (info)) != NULL)
+        {
+            continue;
+        }
+
+        file = nautilus_file_new_from_info (directory, info);
+        nautilus_directory_add_file (directory, file);
+        set_file_unconfirmed (file, TRUE);
+        file->details->is_added = TRUE;
+        added_files = g_list_prepend (added_files, file);
+    }
+
+    g_debug ("Showing %u files from snapshot", g_list_length (added_files));
+
+    nautilus_directory_emit_files_added (directory, added_files);
+    nautilus_file_list_free (added_files);
+}
+
+static void
+snapshot_load_callback (GObject      *source_object,
+                        GAsyncResult *res,
+                        gpointer      user_data)
+{
+    DirectoryLoadState *state;
+    g_autoptr (GError) error = NULL;
+    GList *infos;
+
+    state = user_data;
+    infos = nautilus_directory_snapshot_load_finish (res, &state->snapshot_stamp, &error);
+
+    if (state->directory == NULL)
+    {
+        /* Operation was cancelled. Bail out */
+        g_list_free_full (infos, g_object_unref);
+        directory_load_state_free (state);
+        return;
+    }
+
+    state->has_snapshot_stamp = (error == NULL);
+    if (infos != NULL)
+    {
+        directory_load_apply_snapshot (state->directory, infos);
+        g_list_free_full (infos, g_object_unref);
+    }
+
+    directory_load_enumerate (state);
+}
+
 /* Start monitoring the file list if it isn't already. */
 static void
 start_monitoring_file_list (NautilusDirectory *directory)
@@ -2146,7 +2244,7 @@ start_monitoring_file_list (NautilusDirectory *directory)
     {
         g_assert (!directory->details->directory_load_in_progress);
         directory->details->file_list_monitored = TRUE;
-        g_list_foreach (directory->details->file_list, (GFunc) nautilus_file_ref, NULL);
+        g_ptr_array_foreach (directory->details->files, (GFunc) nautilus_file_ref, NULL);
     }
 
     if (directory->details->directory_loaded ||
@@ -2177,13 +2275,17 @@ start_monitoring_file_list (NautilusDirectory *directory)
 
     directory->details->directory_load_in_progress = state;
 
-    g_file_enumerate_children_async (directory->details->location,
-                                     NAUTILUS_FILE_DEFAULT_ATTRIBUTES,
-                                     0,     /* flags */
-                                     G_PRIORITY_DEFAULT,     /* prio */
-                                     state->cancellable,
-                                     enumerate_children_callback,
-                                     state);
+    if (nautilus_directory_snapshot_is_enabled_for (directory->details->location))
+    {
+        nautilus_directory_snapshot_load_async (directory->details->location,
+                                                state->cancellable,
+                                                snapshot_load_callback,
+                                                state);
+    }
+    else
+    {
+        directory_load_enumerate (state);
+    }
 }
 
 /* Stop monitoring the file list if it is being monitored. */
@@ -2196,10 +2298,29 @@ nautilus_directory_stop_monitoring_file_list (NautilusDirectory *directory)
         return;
     }
 
+    NautilusFile * const *files;
+    guint n_files;
+    g_autoptr (GPtrArray) monitored_files = NULL;
+
     directory->details->file_list_monitored = FALSE;
     file_list_cancel (directory);
-    g_list_foreach (directory->details->file_list, (GFunc) nautilus_file_unref, NULL);
+
+    /* Dropping the last reference removes the file from the directory, and
+     * finalizing it may remove others too, so walk a copy. Every file there
+     * was held by the monitoring, which removals no longer release now. */
+    files = nautilus_directory_peek_files (directory, &n_files);
+    monitored_files = g_ptr_array_new_full (n_files, (GDestroyNotify) nautilus_file_unref);
+    for (guint i = 0; i < n_files; i++)
+    {
+        g_ptr_array_add (monitored_files, nautilus_file_ref (files[i]));
+    }
+
     directory->details->directory_loaded = FALSE;
+
+    for (guint i = 0; i < monitored_files->len; i++)
+    {
+        nautilus_file_unref (monitored_files->pdata[i]);
+    }
 }
 
 static void
@@ -2246,14 +2367,15 @@ static void
 nautilus_directory_invalidate_file_attributes (NautilusDirectory      *directory,
                                                NautilusFileAttributes  file_attributes)
 {
-    GList *node;
+    NautilusFile * const *files;
+    guint n_files;
 
     cancel_loading_attributes (directory, file_attributes);
 
-    for (node = directory->details->file_list; node != NULL; node = node->next)
+    files = nautilus_directory_peek_files (directory, &n_files);
+    for (guint i = 0; i < n_files; i++)
     {
-        nautilus_file_invalidate_attributes_internal (NAUTILUS_FILE (node->data),
-                                                      file_attributes);
+        nautilus_file_invalidate_attributes_internal (files[i], file_attributes);
     }
 
     if (directory->details->as_file != NULL)
@@ -2644,267 +2766,53 @@ directory_count_start (NautilusDirectory *directory,
     g_object_unref (location);
 }
 
-static inline gboolean
-seen_inode (DeepCountState *state,
-            GFileInfo      *info)
-{
-    guint64 inode;
-
-    inode = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE);
-
-    if (inode != 0)
-    {
-        return g_hash_table_lookup (state->seen_deep_count_inodes, &inode) != NULL;
-    }
-
-    return FALSE;
-}
-
-static inline void
-mark_inode_as_seen (DeepCountState *state,
-                    GFileInfo      *info)
-{
-    guint64 inode;
-
-    inode = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE);
-    if (inode != 0)
-    {
-        g_hash_table_add (state->seen_deep_count_inodes, &inode);
-    }
-}
-
 static void
-deep_count_one (DeepCountState *state,
-                GFileInfo      *info)
+deep_count_progress (const NautilusDeepCountTotals *totals,
+                     gboolean                       done,
+                     gpointer                       user_data)
 {
-    NautilusFile *file;
-    GFile *subdir;
-    gboolean is_seen_inode;
-    const char *fs_id;
-
-    is_seen_inode = seen_inode (state, info);
-    if (!is_seen_inode)
-    {
-        mark_inode_as_seen (state, info);
-    }
-
-    file = state->directory->details->deep_count_file;
+    DeepCountState *state = user_data;
+    NautilusDirectory *directory = state->directory;
+    NautilusFile *file = directory->details->deep_count_file;
 
-    if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY)
-    {
-        /* Count the directory. */
-        file->details->deep_directory_count += 1;
-
-        /* Record the fact that we have to descend into this directory. */
-        fs_id = g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_ID_FILESYSTEM);
-        if (g_strcmp0 (fs_id, state->fs_id) == 0)
-        {
-            /* only if it is on the same filesystem */
-            subdir = g_file_get_child (state->deep_count_location, g_file_info_get_name (info));
-            state->deep_count_subdirectories = g_list_prepend
-                                                   (state->deep_count_subdirectories, subdir);
-        }
-    }
-    else
-    {
-        /* Even non-regular files count as files. */
-        file->details->deep_file_count += 1;
-    }
+    g_assert (directory->details->deep_count_in_progress == state);
 
-    /* Count the size. */
-    if (!is_seen_inode && g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_STANDARD_SIZE))
+    if (file != NULL)
     {
-        file->details->deep_size += g_file_info_get_size (info);
+        file->details->deep_directory_count = totals->directory_count;
+        file->details->deep_file_count = totals->file_count;
+        file->details->deep_unreadable_count = totals->unreadable_count;
+        file->details->deep_size = totals->size;
     }
-}
 
-static void
-deep_count_state_free (DeepCountState *state)
-{
-    if (state->enumerator)
+    if (!done)
     {
-        if (!g_file_enumerator_is_closed (state->enumerator))
+        if (file != NULL)
         {
-            g_file_enumerator_close_async (state->enumerator,
-                                           0, NULL, NULL, NULL);
+            nautilus_file_updated_deep_count_in_progress (file);
         }
-        g_object_unref (state->enumerator);
-    }
-    g_object_unref (state->cancellable);
-    if (state->deep_count_location)
-    {
-        g_object_unref (state->deep_count_location);
+        return;
     }
-    g_list_free_full (state->deep_count_subdirectories, g_object_unref);
-    g_hash_table_unref (state->seen_deep_count_inodes);
-    g_free (state->fs_id);
-    g_free (state);
-}
 
-static void
-deep_count_next_dir (DeepCountState *state)
-{
-    GFile *location;
-    NautilusFile *file;
-    NautilusDirectory *directory;
-    gboolean done;
-
-    directory = state->directory;
-
-    g_object_unref (state->deep_count_location);
-    state->deep_count_location = NULL;
+    directory->details->deep_count_file = NULL;
+    directory->details->deep_count_in_progress = NULL;
+    g_free (state);
 
-    done = FALSE;
-    file = directory->details->deep_count_file;
+    nautilus_directory_ref (directory);
 
-    if (state->deep_count_subdirectories != NULL)
-    {
-        /* Work on a new directory. */
-        location = state->deep_count_subdirectories->data;
-        state->deep_count_subdirectories = g_list_remove
-                                               (state->deep_count_subdirectories, location);
-        deep_count_load (state, location);
-        g_object_unref (location);
-    }
-    else
+    if (file != NULL)
     {
         file->details->deep_counts_status = NAUTILUS_REQUEST_DONE;
-        directory->details->deep_count_file = NULL;
-        directory->details->deep_count_in_progress = NULL;
-        deep_count_state_free (state);
-        done = TRUE;
-    }
-
-    nautilus_file_updated_deep_count_in_progress (file);
-
-    if (done)
-    {
+        nautilus_file_updated_deep_count_in_progress (file);
         nautilus_file_changed (file);
-        async_job_end (directory, "deep count");
-        nautilus_directory_async_state_changed (directory);
-    }
-}
-
-static void
-deep_count_more_files_callback (GObject      *source_object,
-                                GAsyncResult *res,
-                                gpointer      user_data)
-{
-    DeepCountState *state;
-    NautilusDirectory *directory;
-    GList *files, *l;
-    GFileInfo *info;
-
-    state = user_data;
-
-    if (state->directory == NULL)
-    {
-        /* Operation was cancelled. Bail out */
-        deep_count_state_free (state);
-        return;
-    }
-
-    directory = nautilus_directory_ref (state->directory);
-
-    g_assert (directory->details->deep_count_in_progress != NULL);
-    g_assert (directory->details->deep_count_in_progress == state);
-
-    files = g_file_enumerator_next_files_finish (state->enumerator,
-                                                 res, NULL);
-
-    for (l = files; l != NULL; l = l->next)
-    {
-        info = l->data;
-        deep_count_one (state, info);
-        g_object_unref (info);
     }
 
-    if (files == NULL)
-    {
-        g_file_enumerator_close_async (state->enumerator, 0, NULL, NULL, NULL);
-        g_object_unref (state->enumerator);
-        state->enumerator = NULL;
-
-        deep_count_next_dir (state);
-    }
-    else
-    {
-        g_file_enumerator_next_files_async (state->enumerator,
-                                            DIRECTORY_LOAD_ITEMS_PER_CALLBACK,
-                                            G_PRIORITY_LOW,
-                                            state->cancellable,
-                                            deep_count_more_files_callback,
-                                            state);
-    }
-
-    g_list_free (files);
+    async_job_end (directory, "deep count");
+    nautilus_directory_async_state_changed (directory);
 
     nautilus_directory_unref (directory);
 }
 
-static void
-deep_count_callback (GObject      *source_object,
-                     GAsyncResult *res,
-                     gpointer      user_data)
-{
-    DeepCountState *state;
-    GFileEnumerator *enumerator;
-    NautilusFile *file;
-
-    state = user_data;
-
-    if (state->directory == NULL)
-    {
-        /* Operation was cancelled. Bail out */
-        deep_count_state_free (state);
-        return;
-    }
-
-    file = state->directory->details->deep_count_file;
-
-    enumerator = g_file_enumerate_children_finish (G_FILE (source_object), res, NULL);
-
-    if (enumerator == NULL)
-    {
-        file->details->deep_unreadable_count += 1;
-
-        deep_count_next_dir (state);
-    }
-    else
-    {
-        state->enumerator = enumerator;
-        g_file_enumerator_next_files_async (state->enumerator,
-                                            DIRECTORY_LOAD_ITEMS_PER_CALLBACK,
-                                            G_PRIORITY_LOW,
-                                            state->cancellable,
-                                            deep_count_more_files_callback,
-                                            state);
-    }
-}
-
-
-static void
-deep_count_load (DeepCountState *state,
-                 GFile          *location)
-{
-    state->deep_count_location = g_object_ref (location);
-
-    g_debug ("load_directory called to get deep file count for %p", location);
-    g_file_enumerate_children_async (state->deep_count_location,
-                                     G_FILE_ATTRIBUTE_STANDARD_NAME ","
-                                     G_FILE_ATTRIBUTE_STANDARD_TYPE ","
-                                     G_FILE_ATTRIBUTE_STANDARD_SIZE ","
-                                     G_FILE_ATTRIBUTE_STANDARD_IS_HIDDEN ","
-                                     G_FILE_ATTRIBUTE_STANDARD_IS_BACKUP ","
-                                     G_FILE_ATTRIBUTE_ID_FILESYSTEM ","
-                                     G_FILE_ATTRIBUTE_UNIX_INODE,
-                                     G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,     /* flags */
-                                     G_PRIORITY_LOW,     /* prio */
-                                     state->cancellable,
-                                     deep_count_callback,
-                                     state);
-}
-
 static void
 deep_count_stop (NautilusDirectory *directory)
 {
@@ -2930,32 +2838,12 @@ deep_count_stop (NautilusDirectory *directory)
     }
 }
 
-static void
-deep_count_got_info (GObject      *source_object,
-                     GAsyncResult *res,
-                     gpointer      user_data)
-{
-    GFileInfo *info;
-    const char *id;
-    GFile *file = (GFile *) source_object;
-    DeepCountState *state = (DeepCountState *) user_data;
-
-    info = g_file_query_info_finish (file, res, NULL);
-    if (info != NULL)
-    {
-        id = g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_ID_FILESYSTEM);
-        state->fs_id = g_strdup (id);
-        g_object_unref (info);
-    }
-    deep_count_load (state, file);
-}
-
 static void
 deep_count_start (NautilusDirectory *directory,
                   NautilusFile      *file,
                   gboolean          *doing_io)
 {
-    GFile *location;
+    g_autoptr (GFile) location = NULL;
     DeepCountState *state;
 
     if (directory->details->deep_count_in_progress != NULL)
@@ -2995,21 +2883,11 @@ deep_count_start (NautilusDirectory *directory,
 
     state = g_new0 (DeepCountState, 1);
     state->directory = directory;
-    state->cancellable = g_cancellable_new ();
-    state->seen_deep_count_inodes = g_hash_table_new (g_int64_hash, g_int64_equal);
-    state->fs_id = NULL;
 
     directory->details->deep_count_in_progress = state;
 
     location = nautilus_file_get_location (file);
-    g_file_query_info_async (location,
-                             G_FILE_ATTRIBUTE_ID_FILESYSTEM,
-                             G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                             G_PRIORITY_DEFAULT,
-                             NULL,
-                             deep_count_got_info,
-                             state);
-    g_object_unref (location);
+    state->request_id = nautilus_deep_count_start (location, deep_count_progress, state);
 }
 
 static void
@@ -3162,6 +3040,7 @@ static void
 thumbnail_info_state_free (ThumbnailInfoState *state)
 {
     g_clear_object (&state->cancellable);
+    g_clear_pointer (&state->batch, g_ptr_array_unref);
     g_free (state);
 }
 
@@ -3240,6 +3119,109 @@ thumbnail_info_query_callback (GObject      *source_object,
     thumbnail_info_state_free (state);
 }
 
+static void
+thumbnail_info_lookup_callback (GObject      *source_object,
+                                GAsyncResult *res,
+                                gpointer      user_data)
+{
+    ThumbnailInfoState *state = user_data;
+    GList *changed_files = NULL;
+
+    if (state->directory == NULL)
+    {
+        /* Operation was cancelled. Bail out */
+        thumbnail_info_state_free (state);
+        return;
+    }
+
+    g_autoptr (GArray) entries = nautilus_thumbnail_lookup_finish (res, NULL);
+    g_autoptr (NautilusDirectory) directory = nautilus_directory_ref (state->directory);
+
+    state->directory->details->thumbnail_info_state = NULL;
+    async_job_end (directory, "thumbnail info");
+
+    for (guint i = 0; i < state->batch->len; i++)
+    {
+        NautilusFile *file = state->batch->pdata[i];
+        NautilusThumbnailCacheEntry *entry = NULL;
+
+        if (file->details->is_gone || file->details->directory != directory)
+        {
+            continue;
+        }
+
+        if (entries != NULL)
+        {
+            entry = &g_array_index (entries, NautilusThumbnailCacheEntry, i);
+        }
+
+        if (!nautilus_file_set_thumbnail_info (file,
+                                               entry != NULL ? entry->path : NULL,
+                                               entry != NULL && entry->failed))
+        {
+            continue;
+        }
+
+        if (nautilus_file_is_self_owned (file))
+        {
+            nautilus_file_changed (file);
+        }
+        else
+        {
+            changed_files = g_list_prepend (changed_files, nautilus_file_ref (file));
+        }
+    }
+
+    nautilus_directory_async_state_changed (directory);
+
+    if (changed_files != NULL)
+    {
+        changed_files = g_list_reverse (changed_files);
+        nautilus_directory_emit_change_signals (directory, changed_files);
+        nautilus_file_list_free (changed_files);
+    }
+
+    thumbnail_info_state_free (state);
+}
+
+/* Looks up the thumbnail cache for @file and for every other file of
+ * @directory that waits for it, so that a folder needs a single pass. */
+static void
+thumbnail_info_lookup_batch (NautilusDirectory  *directory,
+                             ThumbnailInfoState *state)
+{
+    g_autoptr (GPtrArray) uris = g_ptr_array_new_with_free_func (g_free);
+    NautilusFile * const *files;
+    guint n_files;
+
+    state->batch = g_ptr_array_new_with_free_func ((GDestroyNotify) nautilus_file_unref);
+    g_ptr_array_add (state->batch, nautilus_file_ref (state->file));
+    g_ptr_array_add (uris, nautilus_file_get_uri (state->file));
+
+    files = nautilus_directory_peek_files (directory, &n_files);
+    for (guint i = 0; i < n_files; i++)
+    {
+        g_autofree char *uri = NULL;
+
+        if (files[i] == state->file ||
+            files[i]->details->is_gone ||
+            !is_needy (files[i], lacks_thumbnail_info, REQUEST_THUMBNAIL_INFO))
+        {
+            continue;
+        }
+
+        uri = nautilus_file_get_uri (files[i]);
+        if (g_str_has_prefix (uri, "file:"))
+        {
+            g_ptr_array_add (state->batch, nautilus_file_ref (files[i]));
+            g_ptr_array_add (uris, g_steal_pointer (&uri));
+        }
+    }
+
+    nautilus_thumbnail_lookup_async (uris, state->cancellable,
+                                     thumbnail_info_lookup_callback, state);
+}
+
 static void
 thumbnail_info_start (NautilusDirectory *directory,
                       NautilusFile      *file,
@@ -3273,6 +3255,14 @@ thumbnail_info_start (NautilusDirectory *directory,
 
     directory->details->thumbnail_info_state = state;
 
+    /* GIO would answer from the same cache that the batch reads, but with
+     * several stat() calls per file. */
+    if (g_file_has_uri_scheme (location, "file"))
+    {
+        thumbnail_info_lookup_batch (directory, state);
+        return;
+    }
+
     g_file_query_info_async (location,
                              "thumbnail::*",
                              G_FILE_QUERY_INFO_NONE,
@@ -3281,31 +3271,6 @@ thumbnail_info_start (NautilusDirectory *directory,
                              state);
 }
 
-static void
-scale_down_when_large (GdkPixbuf **pixbuf)
-{
-    gint width = gdk_pixbuf_get_width (*pixbuf), height = gdk_pixbuf_get_height (*pixbuf);
-    gint biggest_dimension = MAX (width, height);
-    gint max_size = nautilus_thumbnail_get_max_size ();
-
-    if (biggest_dimension <= max_size)
-    {
-        return;
-    }
-
-    gboolean wide = width > height;
-    double scale = (double) max_size / (double) biggest_dimension;
-    gint new_width = wide ? max_size : width * scale;
-    gint new_height = wide ? height * scale : max_size;
-    GdkPixbuf *new_pixbuf = gdk_pixbuf_scale_simple (*pixbuf,
-                                                     new_width,
-                                                     new_height,
-                                                     GDK_INTERP_BILINEAR);
-
-    g_clear_object (pixbuf);
-    *pixbuf = new_pixbuf;
-}
-
 /* Currently, GDK Pixbuf will decode the image on the main thread, even when
  * using the async variant of the function. Until that is fixed, use a GTask to
  * perform the decoding in a different thread. */
@@ -3317,12 +3282,13 @@ thumbnail_from_stream_thread (GTask        *task,
 {
     GInputStream *self = source_object;
     GError *error = NULL;
-    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_stream (self, cancellable, &error);
+    GdkPixbuf *pixbuf = nautilus_thumbnail_decode_stream (self,
+                                                          nautilus_thumbnail_get_max_size (),
+                                                          cancellable,
+                                                          &error);
 
     if (pixbuf != NULL)
     {
-        scale_down_when_large (&pixbuf);
-
         g_task_return_pointer (task, pixbuf, g_object_unref);
     }
     else
@@ -4360,18 +4326,113 @@ nautilus_directory_prioritze_file (NautilusDirectory *directory,
     nautilus_hash_queue_move_existing_to_head (directory->details->extension_queue, file);
 }
 
-
 static void
-add_all_files_to_work_queue (NautilusDirectory *directory)
+deprioritize_file (NautilusDirectory *directory,
+                   NautilusFile      *file)
 {
-    GList *node;
+    nautilus_hash_queue_move_existing_to_tail (directory->details->high_priority_queue, file);
+    nautilus_hash_queue_move_existing_to_tail (directory->details->low_priority_queue, file);
+    nautilus_hash_queue_move_existing_to_tail (directory->details->extension_queue, file);
+}
+
+/**
+ * nautilus_directory_set_viewport_files:
+ * @directory: a #NautilusDirectory
+ * @files: (array length=n_files): the files in view, most urgent first
+ * @n_files: the number of files in @files
+ * @n_visible: how many of @files are on screen, rather than in the margin
+ *   around it
+ *
+ * Reorders the work queues so that @files are handled first, in the given
+ * order. Files passed in a previous call but not in this one have scrolled
+ * away; they go behind all other pending work, and a directory count that is
+ * running for one of them is cancelled so the visible rows get it first.
+ *
+ * Pending thumbnails are moved to the matching nautilus_thumbnail_set_priority()
+ * class the same way.
+ */
+void
+nautilus_directory_set_viewport_files (NautilusDirectory    *directory,
+                                       NautilusFile * const *files,
+                                       guint                 n_files,
+                                       guint                 n_visible)
+{
+    g_autoptr (GHashTable) previous = NULL;
+    GHashTableIter iter;
     NautilusFile *file;
+    gboolean cancel_count;
+
+    g_return_if_fail (NAUTILUS_IS_DIRECTORY (directory));
+
+    previous = g_steal_pointer (&directory->details->viewport_files);
+    directory->details->viewport_files = g_hash_table_new (NULL, NULL);
+
+    for (guint i = 0; i < n_files; i++)
+    {
+        if (files[i]->details->directory != directory)
+        {
+            g_critical ("%s: file does not belong to this directory", G_STRFUNC);
+            continue;
+        }
 
-    for (node = directory->details->file_list; node != NULL; node = node->next)
+        g_hash_table_insert (directory->details->viewport_files, files[i],
+                             GUINT_TO_POINTER (i < n_visible ?
+                                               NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE :
+                                               NAUTILUS_THUMBNAIL_PRIORITY_PREFETCH));
+        g_hash_table_remove (previous, files[i]);
+    }
+
+    cancel_count = FALSE;
+    g_hash_table_iter_init (&iter, previous);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &file, NULL))
     {
-        file = NAUTILUS_FILE (node->data);
+        g_autofree char *uri = nautilus_file_get_uri (file);
 
-        nautilus_directory_add_file_to_work_queue (directory, file);
+        deprioritize_file (directory, file);
+        nautilus_thumbnail_set_priority (uri, NAUTILUS_THUMBNAIL_PRIORITY_BACKGROUND);
+
+        if (directory->details->count_in_progress != NULL &&
+            directory->details->count_in_progress->count_file == file)
+        {
+            cancel_count = TRUE;
+        }
+    }
+
+    /* Walk backwards so the most urgent file ends up at the head. */
+    for (guint i = n_files; i > 0; i--)
+    {
+        gpointer priority;
+
+        if (g_hash_table_lookup_extended (directory->details->viewport_files, files[i - 1],
+                                          NULL, &priority))
+        {
+            g_autofree char *uri = nautilus_file_get_uri (files[i - 1]);
+
+            nautilus_directory_prioritze_file (directory, files[i - 1]);
+            nautilus_thumbnail_set_priority (uri, GPOINTER_TO_UINT (priority));
+        }
+    }
+
+    if (cancel_count)
+    {
+        /* The file stays queued, so its count is started again once the
+         * files in view are done. */
+        directory_count_cancel (directory);
+        nautilus_directory_async_state_changed (directory);
+    }
+}
+
+
+static void
+add_all_files_to_work_queue (NautilusDirectory *directory)
+{
+    NautilusFile * const *files;
+    guint n_files;
+
+    files = nautilus_directory_peek_files (directory, &n_files);
+    for (guint i = 0; i < n_files; i++)
+    {
+        nautilus_directory_add_file_to_work_queue (directory, files[i]);
     }
 }
 
@@ -36,6 +36,12 @@ void nautilus_directory_notify_files_moved   (GList *file_pairs);
 void nautilus_directory_notify_files_changed (GList *files);
 void nautilus_directory_notify_files_removed (GList *files);
 
+/* Burst handling: re-read a whole directory instead of notifying about many
+ * individual changes. Returns FALSE if the directory isn't in a state where
+ * that is possible, in which case the individual changes must be notified.
+ */
+gboolean nautilus_directory_notify_directory_rescan (GFile *location);
+
 /* Unmount state hack.
  * This must be called right before nautilus_directory_notify_files_removed(),
  * to ensure that, when the file is notified as gone, it already knows it was
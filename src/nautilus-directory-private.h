@@ -65,9 +65,10 @@ struct NautilusDirectoryPrivate
 	/* The location. */
 	GFile *location;
 
-	/* The file objects. */
+	/* The file objects. The array is unordered and owns no references;
+	 * the hash maps names to the files in it. */
 	NautilusFile *as_file;
-	GList *file_list;
+	GPtrArray *files;
 	GHashTable *file_hash;
 
 	/* Queues of files needing some I/O done. */
@@ -75,6 +76,15 @@ struct NautilusDirectoryPrivate
 	NautilusHashQueue *low_priority_queue;
 	NautilusHashQueue *extension_queue;
 
+	/* Files the views currently show or are about to show, with the
+	 * NautilusThumbnailPriority of their thumbnails. Owns no references;
+	 * see nautilus_directory_set_viewport_files(). */
+	GHashTable *viewport_files;
+
+	/* Folded display names of the files, built on the first substring or
+	 * pattern lookup and kept up to date from then on. */
+	NautilusNameIndex *name_index;
+
 	/* Callbacks are inserted into ready when the callback is triggered and
 	 * scheduled to be called at idle. It's still kept in the hash table so we
 	 * can kill it when the file goes away before being called. The hash table
@@ -213,13 +223,35 @@ FileMonitors *     nautilus_directory_remove_file_monitors            (NautilusD
 void               nautilus_directory_add_file_monitors               (NautilusDirectory         *directory,
 								       NautilusFile              *file,
 								       FileMonitors              *monitors);
-GList *            nautilus_directory_begin_file_name_change          (NautilusDirectory         *directory,
+gboolean           nautilus_directory_begin_file_name_change          (NautilusDirectory         *directory,
 								       NautilusFile              *file);
 void               nautilus_directory_end_file_name_change            (NautilusDirectory         *directory,
 								       NautilusFile              *file,
-								       GList                     *node);
+								       gboolean                   indexed);
+void               nautilus_directory_file_display_name_changed       (NautilusDirectory         *directory,
+								       NautilusFile              *file);
 void               nautilus_directory_moved                           (const char                *from_uri,
 								       const char                *to_uri);
+
+/* Non-copying traversal of the file array. Iteration runs from the most
+ * recently added file backwards, so the file just returned by
+ * nautilus_directory_file_iter_next() may be removed from the directory
+ * without disturbing the rest of the walk.
+ */
+typedef struct
+{
+	NautilusDirectory *directory;
+	guint position;
+} NautilusDirectoryFileIter;
+
+void               nautilus_directory_file_iter_init                  (NautilusDirectoryFileIter *iter,
+								       NautilusDirectory         *directory);
+gboolean           nautilus_directory_file_iter_next                  (NautilusDirectoryFileIter *iter,
+								       NautilusFile             **file);
+NautilusFile * const *
+                   nautilus_directory_peek_files                      (NautilusDirectory         *directory,
+								       guint                     *n_files);
+
 /* Interface to the work queue. */
 
 void               nautilus_directory_add_file_to_work_queue          (NautilusDirectory *directory,
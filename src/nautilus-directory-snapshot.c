@@ -0,0 +1,812 @@
+/*
+ * nautilus-directory-snapshot.c: On-disk cache of directory listings
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "nautilus-directory-snapshot"
+
+#include "nautilus-directory-snapshot.h"
+
+#include <errno.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "nautilus-file-private.h"
+#include "nautilus-global-preferences.h"
+
+/**
+ * Snapshots let a large local directory be shown as soon as it is reopened,
+ * instead of after a complete enumeration. The directory loader populates the
+ * file list from the snapshot and then reconciles it with a real enumeration,
+ * so a snapshot only ever affects how early files appear, not which files end
+ * up being shown.
+ *
+ * Each snapshot is a single little-endian file named after the checksum of
+ * the directory URI:
+ *
+ *   header:  "NDLS", u32 version, u64 device, u64 inode,
+ *            i64 mtime (ns), i64 ctime (ns), u32 + URI
+ *   types:   u32 count, then u16 + content type for each
+ *   entries: u32 count, then for each file
+ *            u16 + name, u16 + display name (empty if same as name),
+ *            u8 file type, u8 flags, u16 content type index,
+ *            u32 unix mode, i64 size, i64 mtime (s)
+ *
+ * Only the directory's own stat data is used for validation. Renames,
+ * creations and deletions of children all change it, while attribute changes
+ * of children are picked up by the reconciliation anyway.
+ */
+
+#define SNAPSHOT_MAGIC "NDLS"
+#define SNAPSHOT_VERSION 1
+
+/* Small directories enumerate quickly enough that a snapshot isn't worth the
+ * disk space and the extra write.
+ */
+#define SNAPSHOT_MIN_FILES 500
+/* Snapshots kept on disk, the least recently used ones are pruned first. */
+#define MAX_SNAPSHOTS 32
+#define SNAPSHOT_NO_TYPE G_MAXUINT16
+
+enum
+{
+    ENTRY_HIDDEN = 1 << 0,
+    ENTRY_SYMLINK = 1 << 1,
+    ENTRY_CAN_TRASH = 1 << 2,
+    ENTRY_HAS_MODE = 1 << 3,
+};
+
+typedef struct
+{
+    NautilusDirectorySnapshotStamp stamp;
+    GList *infos;
+} LoadResult;
+
+typedef struct
+{
+    char *path;
+    struct stat statbuf;
+} SnapshotFile;
+
+typedef struct
+{
+    const guint8 *data;
+    gsize length;
+    gsize position;
+    gboolean failed;
+} Reader;
+
+/* What a snapshot keeps of a file, copied so that it can be serialized in a
+ * thread while the file changes. */
+typedef struct
+{
+    GRefString *name;
+    GRefString *display_name;
+    GRefString *mime_type;
+    guint8 type;
+    guint8 flags;
+    guint32 permissions;
+    guint64 size;
+    guint64 mtime;
+} SnapshotEntry;
+
+typedef struct
+{
+    NautilusDirectorySnapshotStamp stamp;
+    GArray *entries;
+} SaveData;
+
+gboolean
+nautilus_directory_snapshot_is_enabled_for (GFile *location)
+{
+    return g_file_is_native (location) &&
+           g_settings_get_boolean (nautilus_preferences,
+                                   NAUTILUS_PREFERENCES_DIRECTORY_LISTING_CACHE);
+}
+
+static char *
+get_snapshot_dir (void)
+{
+    return g_build_filename (g_get_user_cache_dir (), "nautilus", "listings", NULL);
+}
+
+static char *
+get_snapshot_path (const char *uri)
+{
+    g_autofree char *dir = get_snapshot_dir ();
+    g_autofree char *checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, uri, -1);
+
+    return g_build_filename (dir, checksum, NULL);
+}
+
+static gboolean
+stamp_for_path (const char                      *path,
+                NautilusDirectorySnapshotStamp  *stamp,
+                GError                         **error)
+{
+    struct stat statbuf;
+
+    if (g_lstat (path, &statbuf) != 0)
+    {
+        int errsv = errno;
+
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                     "Failed to stat %s: %s", path, g_strerror (errsv));
+        return FALSE;
+    }
+
+    stamp->device = statbuf.st_dev;
+    stamp->inode = statbuf.st_ino;
+    stamp->mtime_nsec = (gint64) statbuf.st_mtim.tv_sec * G_GINT64_CONSTANT (1000000000) +
+                        statbuf.st_mtim.tv_nsec;
+    stamp->ctime_nsec = (gint64) statbuf.st_ctim.tv_sec * G_GINT64_CONSTANT (1000000000) +
+                        statbuf.st_ctim.tv_nsec;
+
+    return TRUE;
+}
+
+static gboolean
+stamp_equal (const NautilusDirectorySnapshotStamp *a,
+             const NautilusDirectorySnapshotStamp *b)
+{
+    return a->device == b->device &&
+           a->inode == b->inode &&
+           a->mtime_nsec == b->mtime_nsec &&
+           a->ctime_nsec == b->ctime_nsec;
+}
+
+static const guint8 *
+read_bytes (Reader *reader,
+            gsize   length)
+{
+    const guint8 *bytes;
+
+    if (reader->failed || reader->length - reader->position < length)
+    {
+        reader->failed = TRUE;
+        return NULL;
+    }
+
+    bytes = reader->data + reader->position;
+    reader->position += length;
+
+    return bytes;
+}
+
+static guint8
+read_u8 (Reader *reader)
+{
+    const guint8 *bytes = read_bytes (reader, 1);
+
+    return bytes != NULL ? bytes[0] : 0;
+}
+
+static guint16
+read_u16 (Reader *reader)
+{
+    const guint8 *bytes = read_bytes (reader, sizeof (guint16));
+    guint16 value;
+
+    if (bytes == NULL)
+    {
+        return 0;
+    }
+
+    memcpy (&value, bytes, sizeof (value));
+    return GUINT16_FROM_LE (value);
+}
+
+static guint32
+read_u32 (Reader *reader)
+{
+    const guint8 *bytes = read_bytes (reader, sizeof (guint32));
+    guint32 value;
+
+    if (bytes == NULL)
+    {
+        return 0;
+    }
+
+    memcpy (&value, bytes, sizeof (value));
+    return GUINT32_FROM_LE (value);
+}
+
+static guint64
+read_u64 (Reader *reader)
+{
+    const guint8 *bytes = read_bytes (reader, sizeof (guint64));
+    guint64 value;
+
+    if (bytes == NULL)
+    {
+        return 0;
+    }
+
+    memcpy (&value, bytes, sizeof (value));
+    return GUINT64_FROM_LE (value);
+}
+
+/* Returns a newly allocated, nul-terminated copy of a length-prefixed string. */
+static char *
+read_string (Reader *reader,
+             gsize   length)
+{
+    const guint8 *bytes = read_bytes (reader, length);
+
+    return bytes != NULL ? g_strndup ((const char *) bytes, length) : NULL;
+}
+
+static void
+append_u8 (GByteArray *buffer,
+           guint8      value)
+{
+    g_byte_array_append (buffer, &value, sizeof (value));
+}
+
+static void
+append_u16 (GByteArray *buffer,
+            guint16     value)
+{
+    value = GUINT16_TO_LE (value);
+    g_byte_array_append (buffer, (const guint8 *) &value, sizeof (value));
+}
+
+static void
+append_u32 (GByteArray *buffer,
+            guint32     value)
+{
+    value = GUINT32_TO_LE (value);
+    g_byte_array_append (buffer, (const guint8 *) &value, sizeof (value));
+}
+
+static void
+append_u64 (GByteArray *buffer,
+            guint64     value)
+{
+    value = GUINT64_TO_LE (value);
+    g_byte_array_append (buffer, (const guint8 *) &value, sizeof (value));
+}
+
+static gboolean
+append_short_string (GByteArray *buffer,
+                     const char *string)
+{
+    gsize length = string != NULL ? strlen (string) : 0;
+
+    if (length > G_MAXUINT16)
+    {
+        return FALSE;
+    }
+
+    append_u16 (buffer, length);
+    g_byte_array_append (buffer, (const guint8 *) string, length);
+
+    return TRUE;
+}
+
+static GFileInfo *
+read_entry (Reader     *reader,
+            GPtrArray  *content_types)
+{
+    g_autoptr (GFileInfo) info = NULL;
+    g_autofree char *name = NULL;
+    g_autofree char *display_name = NULL;
+    guint8 file_type, flags;
+    guint16 type_index;
+    guint32 mode;
+    gint64 size, mtime;
+    const char *content_type = NULL;
+
+    name = read_string (reader, read_u16 (reader));
+    display_name = read_string (reader, read_u16 (reader));
+    file_type = read_u8 (reader);
+    flags = read_u8 (reader);
+    type_index = read_u16 (reader);
+    mode = read_u32 (reader);
+    size = (gint64) read_u64 (reader);
+    mtime = (gint64) read_u64 (reader);
+
+    if (reader->failed || name == NULL || *name == '\0' ||
+        (type_index != SNAPSHOT_NO_TYPE && type_index >= content_types->len))
+    {
+        reader->failed = TRUE;
+        return NULL;
+    }
+
+    info = g_file_info_new ();
+    g_file_info_set_name (info, name);
+    g_file_info_set_display_name (info, *display_name != '\0' ? display_name : name);
+    g_file_info_set_file_type (info, file_type);
+    g_file_info_set_size (info, size);
+    g_file_info_set_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED, mtime);
+    g_file_info_set_is_hidden (info, (flags & ENTRY_HIDDEN) != 0);
+    g_file_info_set_is_symlink (info, (flags & ENTRY_SYMLINK) != 0);
+    g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_TRASH,
+                                       (flags & ENTRY_CAN_TRASH) != 0);
+    if (flags & ENTRY_HAS_MODE)
+    {
+        g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_MODE, mode);
+    }
+
+    if (type_index != SNAPSHOT_NO_TYPE)
+    {
+        content_type = g_ptr_array_index (content_types, type_index);
+    }
+    if (content_type != NULL)
+    {
+        g_autoptr (GIcon) icon = g_content_type_get_icon (content_type);
+
+        g_file_info_set_content_type (info, content_type);
+        g_file_info_set_icon (info, icon);
+    }
+    else
+    {
+        /* NautilusFile expects every file info to carry an icon. */
+        g_autoptr (GIcon) icon = g_themed_icon_new ("text-x-generic");
+
+        g_file_info_set_icon (info, icon);
+    }
+
+    return g_steal_pointer (&info);
+}
+
+static GList *
+parse_snapshot (const guint8                         *data,
+                gsize                                 length,
+                const char                           *uri,
+                const NautilusDirectorySnapshotStamp *current)
+{
+    Reader reader = { data, length, 0, FALSE };
+    NautilusDirectorySnapshotStamp stamp;
+    g_autoptr (GPtrArray) content_types = g_ptr_array_new_with_free_func (g_free);
+    g_autofree char *snapshot_uri = NULL;
+    const guint8 *magic;
+    GList *infos = NULL;
+    guint32 count;
+
+    magic = read_bytes (&reader, strlen (SNAPSHOT_MAGIC));
+    if (magic == NULL || memcmp (magic, SNAPSHOT_MAGIC, strlen (SNAPSHOT_MAGIC)) != 0 ||
+        read_u32 (&reader) != SNAPSHOT_VERSION)
+    {
+        return NULL;
+    }
+
+    stamp.device = read_u64 (&reader);
+    stamp.inode = read_u64 (&reader);
+    stamp.mtime_nsec = (gint64) read_u64 (&reader);
+    stamp.ctime_nsec = (gint64) read_u64 (&reader);
+    snapshot_uri = read_string (&reader, read_u32 (&reader));
+    if (reader.failed || !stamp_equal (&stamp, current) ||
+        g_strcmp0 (snapshot_uri, uri) != 0)
+    {
+        return NULL;
+    }
+
+    count = read_u32 (&reader);
+    for (guint32 i = 0; i < count && !reader.failed; i++)
+    {
+        g_ptr_array_add (content_types, read_string (&reader, read_u16 (&reader)));
+    }
+
+    count = read_u32 (&reader);
+    for (guint32 i = 0; i < count && !reader.failed; i++)
+    {
+        GFileInfo *info = read_entry (&reader, content_types);
+
+        if (info != NULL)
+        {
+            infos = g_list_prepend (infos, info);
+        }
+    }
+
+    if (reader.failed || reader.position != reader.length)
+    {
+        g_list_free_full (infos, g_object_unref);
+        return NULL;
+    }
+
+    return g_list_reverse (infos);
+}
+
+static void
+load_result_free (LoadResult *result)
+{
+    g_list_free_full (result->infos, g_object_unref);
+    g_free (result);
+}
+
+static void
+load_thread (GTask        *task,
+             gpointer      source_object,
+             gpointer      task_data,
+             GCancellable *cancellable)
+{
+    GFile *location = source_object;
+    g_autofree char *path = g_file_get_path (location);
+    g_autofree char *uri = g_file_get_uri (location);
+    g_autofree char *snapshot_path = get_snapshot_path (uri);
+    g_autofree char *contents = NULL;
+    g_autoptr (GError) error = NULL;
+    LoadResult *result;
+    gsize length;
+
+    result = g_new0 (LoadResult, 1);
+
+    /* The stamp is taken before the caller starts enumerating, so a snapshot
+     * saved with it can never claim to be newer than its contents.
+     */
+    if (path == NULL || !stamp_for_path (path, &result->stamp, &error))
+    {
+        load_result_free (result);
+        if (error == NULL)
+        {
+            g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                                 "Location has no local path");
+        }
+        g_task_return_error (task, g_steal_pointer (&error));
+        return;
+    }
+
+    if (!g_cancellable_is_cancelled (cancellable) &&
+        g_file_get_contents (snapshot_path, &contents, &length, NULL))
+    {
+        result->infos = parse_snapshot ((const guint8 *) contents, length, uri, &result->stamp);
+        if (result->infos != NULL)
+        {
+            /* Keep recently used snapshots from being pruned. */
+            g_utime (snapshot_path, NULL);
+        }
+        else
+        {
+            g_debug ("Discarding stale snapshot for %s", uri);
+            g_unlink (snapshot_path);
+        }
+    }
+
+    g_task_return_pointer (task, result, (GDestroyNotify) load_result_free);
+}
+
+void
+nautilus_directory_snapshot_load_async (GFile               *location,
+                                        GCancellable        *cancellable,
+                                        GAsyncReadyCallback  callback,
+                                        gpointer             user_data)
+{
+    g_autoptr (GTask) task = NULL;
+
+    task = g_task_new (location, cancellable, callback, user_data);
+    g_task_set_source_tag (task, nautilus_directory_snapshot_load_async);
+    g_task_set_return_on_cancel (task, TRUE);
+    g_task_run_in_thread (task, load_thread);
+}
+
+/**
+ * nautilus_directory_snapshot_load_finish:
+ * @result: the result passed to the callback
+ * @stamp: (out): the current state of the directory
+ * @error: return location for an error
+ *
+ * Returns: (transfer full) (element-type GFileInfo): the files of a snapshot
+ *     matching @stamp, or %NULL if there is no such snapshot. %NULL with
+ *     @error set means @stamp is not valid either.
+ */
+GList *
+nautilus_directory_snapshot_load_finish (GAsyncResult                    *result,
+                                         NautilusDirectorySnapshotStamp  *stamp,
+                                         GError                         **error)
+{
+    LoadResult *load_result;
+    GList *infos;
+
+    g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+
+    load_result = g_task_propagate_pointer (G_TASK (result), error);
+    if (load_result == NULL)
+    {
+        return NULL;
+    }
+
+    *stamp = load_result->stamp;
+    infos = g_steal_pointer (&load_result->infos);
+    load_result_free (load_result);
+
+    return infos;
+}
+
+static gint
+compare_by_mtime_descending (gconstpointer a,
+                             gconstpointer b)
+{
+    const SnapshotFile *file_a = a;
+    const SnapshotFile *file_b = b;
+
+    if (file_a->statbuf.st_mtime != file_b->statbuf.st_mtime)
+    {
+        return file_a->statbuf.st_mtime < file_b->statbuf.st_mtime ? 1 : -1;
+    }
+
+    return 0;
+}
+
+/* Keeps only the most recently used snapshots. */
+static void
+prune_snapshots (const char *dir)
+{
+    g_autoptr (GDir) gdir = g_dir_open (dir, 0, NULL);
+    g_autoptr (GArray) entries = g_array_new (FALSE, FALSE, sizeof (SnapshotFile));
+    const char *name;
+
+    if (gdir == NULL)
+    {
+        return;
+    }
+
+    while ((name = g_dir_read_name (gdir)) != NULL)
+    {
+        SnapshotFile entry = { g_build_filename (dir, name, NULL), { 0 } };
+
+        if (g_stat (entry.path, &entry.statbuf) == 0)
+        {
+            g_array_append_val (entries, entry);
+        }
+        else
+        {
+            g_free (entry.path);
+        }
+    }
+
+    g_array_sort (entries, compare_by_mtime_descending);
+    for (guint i = 0; i < entries->len; i++)
+    {
+        SnapshotFile *entry = &g_array_index (entries, SnapshotFile, i);
+
+        if (i >= MAX_SNAPSHOTS)
+        {
+            g_unlink (entry->path);
+        }
+        g_free (entry->path);
+    }
+}
+
+static void
+snapshot_entry_clear (SnapshotEntry *entry)
+{
+    g_clear_pointer (&entry->name, g_ref_string_release);
+    g_clear_pointer (&entry->display_name, g_ref_string_release);
+    g_clear_pointer (&entry->mime_type, g_ref_string_release);
+}
+
+/* Only takes references on the strings, the rest of the work is left to
+ * serialize_entries(). */
+static GArray *
+copy_entries (NautilusFile * const *files,
+              guint                 n_files)
+{
+    GArray *entries = g_array_sized_new (FALSE, FALSE, sizeof (SnapshotEntry), n_files);
+
+    g_array_set_clear_func (entries, (GDestroyNotify) snapshot_entry_clear);
+
+    for (guint i = 0; i < n_files; i++)
+    {
+        NautilusFile *file = files[i];
+        SnapshotEntry entry = { 0 };
+
+        if (!file->details->got_file_info || file->details->is_gone ||
+            file->details->name == NULL)
+        {
+            continue;
+        }
+
+        entry.name = g_ref_string_acquire (file->details->name);
+        if (file->details->display_name != NULL)
+        {
+            entry.display_name = g_ref_string_acquire (file->details->display_name);
+        }
+        if (file->details->mime_type != NULL)
+        {
+            entry.mime_type = g_ref_string_acquire (file->details->mime_type);
+        }
+        entry.type = file->details->type;
+        entry.flags |= file->details->is_hidden ? ENTRY_HIDDEN : 0;
+        entry.flags |= file->details->is_symlink ? ENTRY_SYMLINK : 0;
+        entry.flags |= file->details->can_trash ? ENTRY_CAN_TRASH : 0;
+        entry.flags |= file->details->has_permissions ? ENTRY_HAS_MODE : 0;
+        entry.permissions = file->details->permissions;
+        entry.size = file->details->size;
+        entry.mtime = file->details->mtime;
+        g_array_append_val (entries, entry);
+    }
+
+    return entries;
+}
+
+static GBytes *
+serialize_entries (GFile                                *location,
+                   const NautilusDirectorySnapshotStamp *stamp,
+                   GArray                               *snapshot_entries)
+{
+    g_autoptr (GByteArray) buffer = NULL;
+    g_autoptr (GHashTable) type_indices = NULL;
+    g_autoptr (GPtrArray) content_types = NULL;
+    g_autofree char *uri = NULL;
+    guint32 n_entries = 0;
+    guint entries_offset;
+
+    uri = g_file_get_uri (location);
+    buffer = g_byte_array_sized_new (snapshot_entries->len * 48);
+    type_indices = g_hash_table_new (g_str_hash, g_str_equal);
+    content_types = g_ptr_array_new ();
+
+    g_byte_array_append (buffer, (const guint8 *) SNAPSHOT_MAGIC, strlen (SNAPSHOT_MAGIC));
+    append_u32 (buffer, SNAPSHOT_VERSION);
+    append_u64 (buffer, stamp->device);
+    append_u64 (buffer, stamp->inode);
+    append_u64 (buffer, stamp->mtime_nsec);
+    append_u64 (buffer, stamp->ctime_nsec);
+    append_u32 (buffer, strlen (uri));
+    g_byte_array_append (buffer, (const guint8 *) uri, strlen (uri));
+
+    /* Entries go to a separate buffer first, as the table of content types
+     * is only known once they have all been seen.
+     */
+    g_autoptr (GByteArray) entries = g_byte_array_sized_new (snapshot_entries->len * 40);
+    for (guint i = 0; i < snapshot_entries->len; i++)
+    {
+        SnapshotEntry *entry = &g_array_index (snapshot_entries, SnapshotEntry, i);
+        const char *name = entry->name;
+        const char *display_name = entry->display_name;
+        const char *mime_type = entry->mime_type;
+        guint16 type_index = SNAPSHOT_NO_TYPE;
+        guint entry_start = entries->len;
+
+        if (mime_type != NULL)
+        {
+            gpointer index;
+
+            if (g_hash_table_lookup_extended (type_indices, mime_type, NULL, &index))
+            {
+                type_index = GPOINTER_TO_UINT (index);
+            }
+            else if (content_types->len < SNAPSHOT_NO_TYPE)
+            {
+                type_index = content_types->len;
+                g_ptr_array_add (content_types, (gpointer) mime_type);
+                g_hash_table_insert (type_indices, (gpointer) mime_type,
+                                     GUINT_TO_POINTER (type_index));
+            }
+        }
+
+        if (!append_short_string (entries, name) ||
+            !append_short_string (entries, g_strcmp0 (display_name, name) != 0 ? display_name : NULL))
+        {
+            g_byte_array_set_size (entries, entry_start);
+            continue;
+        }
+        append_u8 (entries, entry->type);
+        append_u8 (entries, entry->flags);
+        append_u16 (entries, type_index);
+        append_u32 (entries, entry->permissions);
+        append_u64 (entries, entry->size);
+        append_u64 (entries, entry->mtime);
+        n_entries++;
+    }
+
+    append_u32 (buffer, content_types->len);
+    for (guint i = 0; i < content_types->len; i++)
+    {
+        append_short_string (buffer, g_ptr_array_index (content_types, i));
+    }
+    append_u32 (buffer, n_entries);
+    entries_offset = buffer->len;
+    g_byte_array_set_size (buffer, entries_offset + entries->len);
+    memcpy (buffer->data + entries_offset, entries->data, entries->len);
+
+    return g_byte_array_free_to_bytes (g_steal_pointer (&buffer));
+}
+
+static void
+save_data_free (SaveData *save_data)
+{
+    g_array_unref (save_data->entries);
+    g_free (save_data);
+}
+
+static void
+save_thread (GTask        *task,
+             gpointer      source_object,
+             gpointer      task_data,
+             GCancellable *cancellable)
+{
+    GFile *location = source_object;
+    SaveData *save_data = task_data;
+    g_autoptr (GBytes) contents = serialize_entries (location, &save_data->stamp,
+                                                     save_data->entries);
+    g_autofree char *uri = g_file_get_uri (location);
+    g_autofree char *dir = get_snapshot_dir ();
+    g_autofree char *snapshot_path = get_snapshot_path (uri);
+    g_autoptr (GError) error = NULL;
+    gsize length;
+    const char *data = g_bytes_get_data (contents, &length);
+
+    if (g_mkdir_with_parents (dir, 0700) != 0 ||
+        !g_file_set_contents_full (snapshot_path, data, length,
+                                   G_FILE_SET_CONTENTS_CONSISTENT, 0600, &error))
+    {
+        g_debug ("Failed to save snapshot for %s: %s", uri,
+                 error != NULL ? error->message : g_strerror (errno));
+        return;
+    }
+
+    prune_snapshots (dir);
+}
+
+/* testing-only */
+GList *
+nautilus_directory_snapshot_parse (GBytes                               *contents,
+                                   GFile                                *location,
+                                   const NautilusDirectorySnapshotStamp *stamp)
+{
+    g_autofree char *uri = g_file_get_uri (location);
+    gsize length;
+    const guint8 *data = g_bytes_get_data (contents, &length);
+
+    return parse_snapshot (data, length, uri, stamp);
+}
+
+/**
+ * nautilus_directory_snapshot_serialize:
+ * @location: the directory
+ * @stamp: the state of the directory from before it was enumerated
+ * @files: (array length=n_files): the files of the directory
+ * @n_files: the number of files
+ *
+ * Returns: (transfer full): the snapshot of @files, as
+ *     nautilus_directory_snapshot_save() writes it out.
+ */
+GBytes *
+nautilus_directory_snapshot_serialize (GFile                                *location,
+                                       const NautilusDirectorySnapshotStamp *stamp,
+                                       NautilusFile * const                 *files,
+                                       guint                                 n_files)
+{
+    g_autoptr (GArray) entries = copy_entries (files, n_files);
+
+    return serialize_entries (location, stamp, entries);
+}
+
+/**
+ * nautilus_directory_snapshot_save:
+ * @location: the directory
+ * @stamp: the state of the directory from before it was enumerated
+ * @files: (array length=n_files): the files of the directory
+ * @n_files: the number of files
+ *
+ * Copies what the listing needs of @files right away, then serializes and
+ * writes it out on a worker thread. Directories with only a few files are
+ * not saved.
+ */
+void
+nautilus_directory_snapshot_save (GFile                                *location,
+                                  const NautilusDirectorySnapshotStamp *stamp,
+                                  NautilusFile * const                 *files,
+                                  guint                                 n_files)
+{
+    g_autoptr (GTask) task = NULL;
+    SaveData *save_data;
+
+    if (n_files < SNAPSHOT_MIN_FILES)
+    {
+        return;
+    }
+
+    save_data = g_new0 (SaveData, 1);
+    save_data->stamp = *stamp;
+    save_data->entries = copy_entries (files, n_files);
+
+    task = g_task_new (location, NULL, NULL, NULL);
+    g_task_set_source_tag (task, nautilus_directory_snapshot_save);
+    g_task_set_task_data (task, save_data, (GDestroyNotify) save_data_free);
+    g_task_run_in_thread (task, save_thread);
+}
@@ -0,0 +1,50 @@
+/*
+ * nautilus-directory-snapshot.h: On-disk cache of directory listings
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "nautilus-types.h"
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Identifies the state of a directory when a listing was taken. A snapshot is
+ * only trusted while all of these still match the directory on disk.
+ */
+typedef struct
+{
+    guint64 device;
+    guint64 inode;
+    gint64 mtime_nsec;
+    gint64 ctime_nsec;
+} NautilusDirectorySnapshotStamp;
+
+gboolean nautilus_directory_snapshot_is_enabled_for (GFile                                *location);
+
+void     nautilus_directory_snapshot_load_async     (GFile                                *location,
+                                                     GCancellable                         *cancellable,
+                                                     GAsyncReadyCallback                   callback,
+                                                     gpointer                              user_data);
+GList *  nautilus_directory_snapshot_load_finish    (GAsyncResult                         *result,
+                                                     NautilusDirectorySnapshotStamp       *stamp,
+                                                     GError                              **error);
+
+void     nautilus_directory_snapshot_save           (GFile                                *location,
+                                                     const NautilusDirectorySnapshotStamp *stamp,
+                                                     NautilusFile * const                 *files,
+                                                     guint                                 n_files);
+GBytes * nautilus_directory_snapshot_serialize      (GFile                                *location,
+                                                     const NautilusDirectorySnapshotStamp *stamp,
+                                                     NautilusFile * const                 *files,
+                                                     guint                                 n_files);
+
+/* testing-only */
+GList *  nautilus_directory_snapshot_parse          (GBytes                               *contents,
+                                                     GFile                                *location,
+                                                     const NautilusDirectorySnapshotStamp *stamp);
+
+G_END_DECLS
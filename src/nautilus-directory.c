@@ -23,7 +23,9 @@
 
 #include <glib/gi18n.h>
 #include <gtk/gtk.h>
+#include <string.h>
 
+#include "nautilus-deep-count-cache.h"
 #include "nautilus-directory-notify.h"
 #include "nautilus-directory-private.h"
 #include "nautilus-enums.h"
@@ -33,6 +35,8 @@
 #include "nautilus-hash-queue.h"
 #include "nautilus-metadata.h"
 #include "nautilus-monitor.h"
+#include "nautilus-name-index.h"
+#include "nautilus-query.h"
 #include "nautilus-scheme.h"
 #include "nautilus-vfs-directory.h"
 #include "nautilus-vfs-file.h"
@@ -83,7 +87,24 @@ real_are_all_files_seen (NautilusDirectory *directory)
 static gboolean
 real_is_not_empty (NautilusDirectory *directory)
 {
-    return directory->details->file_list != NULL;
+    return directory->details->files->len > 0;
+}
+
+/* Returns a referenced list of all the files, most recently added first. */
+static GList *
+copy_file_array (NautilusDirectory *directory)
+{
+    NautilusFile * const *files;
+    guint n_files;
+    GList *list = NULL;
+
+    files = nautilus_directory_peek_files (directory, &n_files);
+    for (guint i = 0; i < n_files; i++)
+    {
+        list = g_list_prepend (list, nautilus_file_ref (files[i]));
+    }
+
+    return list;
 }
 
 static gboolean
@@ -100,11 +121,19 @@ is_tentative (NautilusFile *file,
 static GList *
 real_get_file_list (NautilusDirectory *directory)
 {
-    GList *tentative_files, *non_tentative_files;
+    NautilusFile * const *files;
+    guint n_files;
+    GList *non_tentative_files = NULL;
 
-    tentative_files = nautilus_file_list_filter (directory->details->file_list,
-                                                 &non_tentative_files, is_tentative, NULL);
-    nautilus_file_list_free (tentative_files);
+    files = nautilus_directory_peek_files (directory, &n_files);
+    for (guint i = 0; i < n_files; i++)
+    {
+        if (!is_tentative (files[i], NULL))
+        {
+            non_tentative_files = g_list_prepend (non_tentative_files,
+                                                  nautilus_file_ref (files[i]));
+        }
+    }
 
     return non_tentative_files;
 }
@@ -177,12 +206,15 @@ nautilus_directory_finalize (GObject *object)
         g_object_unref (directory->details->location);
     }
 
-    g_warn_if_fail (directory->details->file_list == NULL);
+    g_warn_if_fail (directory->details->files->len == 0);
+    g_ptr_array_unref (directory->details->files);
     g_hash_table_destroy (directory->details->file_hash);
 
     nautilus_hash_queue_destroy (directory->details->high_priority_queue);
     nautilus_hash_queue_destroy (directory->details->low_priority_queue);
     nautilus_hash_queue_destroy (directory->details->extension_queue);
+    g_hash_table_destroy (directory->details->viewport_files);
+    g_clear_pointer (&directory->details->name_index, nautilus_name_index_free);
     g_clear_pointer (&directory->details->call_when_ready_hash.unsatisfied, g_hash_table_unref);
     g_clear_pointer (&directory->details->call_when_ready_hash.ready, g_hash_table_unref);
     g_clear_list (&directory->details->files_changed_while_adding, g_object_unref);
@@ -308,11 +340,13 @@ static void
 nautilus_directory_init (NautilusDirectory *directory)
 {
     directory->details = nautilus_directory_get_instance_private (directory);
+    directory->details->files = g_ptr_array_new ();
     directory->details->file_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                            g_free, NULL);
     directory->details->high_priority_queue = nautilus_hash_queue_new (g_direct_hash, g_direct_equal, g_object_unref, NULL);
     directory->details->low_priority_queue = nautilus_hash_queue_new (g_direct_hash, g_direct_equal, g_object_unref, NULL);
     directory->details->extension_queue = nautilus_hash_queue_new (g_direct_hash, g_direct_equal, g_object_unref, NULL);
+    directory->details->viewport_files = g_hash_table_new (NULL, NULL);
     directory->details->call_when_ready_hash.unsatisfied = g_hash_table_new (NULL, NULL);
     directory->details->call_when_ready_hash.ready = g_hash_table_new (NULL, NULL);
     directory->details->monitor_table = g_hash_table_new (NULL, NULL);
@@ -367,7 +401,7 @@ emit_change_signals_for_all_files (NautilusDirectory *directory)
 {
     g_autolist (NautilusFile) files = NULL;
 
-    files = nautilus_file_list_copy (directory->details->file_list);
+    files = copy_file_array (directory);
     if (directory->details->as_file != NULL)
     {
         files = g_list_prepend (files, g_object_ref (directory->details->as_file));
@@ -760,36 +794,33 @@ nautilus_directory_are_all_files_seen (NautilusDirectory *directory)
 
 static void
 add_to_hash_table (NautilusDirectory *directory,
-                   NautilusFile      *file,
-                   GList             *node)
+                   NautilusFile      *file)
 {
     const char *name = nautilus_file_get_name (file);
 
     g_return_if_fail (name != NULL);
-    g_return_if_fail (node != NULL);
     g_return_if_fail (g_hash_table_lookup (directory->details->file_hash,
                                            name) == NULL);
 
-    g_hash_table_insert (directory->details->file_hash, g_strdup (name), node);
+    g_hash_table_insert (directory->details->file_hash, g_strdup (name), file);
 }
 
-static GList *
+static NautilusFile *
 extract_from_hash_table (NautilusDirectory *directory,
                          NautilusFile      *file)
 {
     const char *name = nautilus_file_get_name (file);
-    GList *node;
+    NautilusFile *indexed_file;
 
     if (name == NULL)
     {
         return NULL;
     }
 
-    /* Find the list node in the hash table. */
-    node = g_hash_table_lookup (directory->details->file_hash, name);
+    indexed_file = g_hash_table_lookup (directory->details->file_hash, name);
     g_hash_table_remove (directory->details->file_hash, name);
 
-    return node;
+    return indexed_file;
 }
 
 void
@@ -799,12 +830,17 @@ nautilus_directory_add_file (NautilusDirectory *directory,
     g_return_if_fail (NAUTILUS_IS_DIRECTORY (directory));
     g_return_if_fail (NAUTILUS_IS_FILE (file));
 
-    /* Add to list. */
-    GList *node = g_list_prepend (directory->details->file_list, file);
-    directory->details->file_list = node;
+    /* Add to the end of the array, remembering the slot for removal. */
+    file->details->directory_index = directory->details->files->len;
+    g_ptr_array_add (directory->details->files, file);
 
     /* Add to hash table. */
-    add_to_hash_table (directory, file, node);
+    add_to_hash_table (directory, file);
+
+    if (directory->details->name_index != NULL)
+    {
+        nautilus_name_index_add (directory->details->name_index, file);
+    }
 
     directory->details->confirmed_file_count++;
 
@@ -836,17 +872,29 @@ nautilus_directory_remove_file (NautilusDirectory *directory,
     g_return_if_fail (NAUTILUS_IS_DIRECTORY (directory));
     g_return_if_fail (NAUTILUS_IS_FILE (file));
 
-    /* Find the list node in the hash table. */
-    GList *node = extract_from_hash_table (directory, file);
-    g_return_if_fail (node != NULL);
-    g_return_if_fail (node->data == file);
+    GPtrArray *files = directory->details->files;
+    guint index = file->details->directory_index;
+
+    /* Drop it from the hash table. */
+    NautilusFile *indexed_file = extract_from_hash_table (directory, file);
+    g_return_if_fail (indexed_file == file);
+    g_return_if_fail (index < files->len && g_ptr_array_index (files, index) == file);
 
-    /* Remove the item from the list. */
-    directory->details->file_list = g_list_remove_link
-                                        (directory->details->file_list, node);
-    g_list_free_1 (node);
+    /* Move the last file into the vacated slot. */
+    g_ptr_array_remove_index_fast (files, index);
+    if (index < files->len)
+    {
+        NautilusFile *moved_file = g_ptr_array_index (files, index);
+        moved_file->details->directory_index = index;
+    }
 
     nautilus_directory_remove_file_from_work_queue (directory, file);
+    g_hash_table_remove (directory->details->viewport_files, file);
+
+    if (directory->details->name_index != NULL)
+    {
+        nautilus_name_index_remove (directory->details->name_index, file);
+    }
 
     if (!file->details->unconfirmed)
     {
@@ -860,41 +908,92 @@ nautilus_directory_remove_file (NautilusDirectory *directory,
     }
 }
 
-GList *
+gboolean
 nautilus_directory_begin_file_name_change (NautilusDirectory *directory,
                                            NautilusFile      *file)
 {
-    /* Find the list node in the hash table. */
-    return extract_from_hash_table (directory, file);
+    /* Only the name index changes, the array slot stays put. */
+    return extract_from_hash_table (directory, file) != NULL;
 }
 
 void
 nautilus_directory_end_file_name_change (NautilusDirectory *directory,
                                          NautilusFile      *file,
-                                         GList             *node)
+                                         gboolean           indexed)
 {
     g_return_if_fail (NAUTILUS_IS_DIRECTORY (directory));
     g_return_if_fail (NAUTILUS_IS_FILE (file));
 
-    /* Add the list node to the hash table. */
-    if (node != NULL)
+    /* Index the file again under its new name. */
+    if (indexed)
+    {
+        add_to_hash_table (directory, file);
+    }
+}
+
+void
+nautilus_directory_file_display_name_changed (NautilusDirectory *directory,
+                                              NautilusFile      *file)
+{
+    if (directory->details->name_index != NULL)
+    {
+        nautilus_name_index_update (directory->details->name_index, file);
+    }
+}
+
+void
+nautilus_directory_file_iter_init (NautilusDirectoryFileIter *iter,
+                                   NautilusDirectory         *directory)
+{
+    g_return_if_fail (iter != NULL);
+    g_return_if_fail (NAUTILUS_IS_DIRECTORY (directory));
+
+    iter->directory = directory;
+    iter->position = directory->details->files->len;
+}
+
+gboolean
+nautilus_directory_file_iter_next (NautilusDirectoryFileIter  *iter,
+                                   NautilusFile              **file)
+{
+    GPtrArray *files = iter->directory->details->files;
+
+    /* Removals only ever move the last file into the vacated slot, which
+     * has already been visited when walking backwards. Clamp in case more
+     * than the current file went away.
+     */
+    iter->position = MIN (iter->position, files->len);
+    if (iter->position == 0)
     {
-        add_to_hash_table (directory, file, node);
+        return FALSE;
     }
+
+    iter->position--;
+    *file = g_ptr_array_index (files, iter->position);
+
+    return TRUE;
+}
+
+NautilusFile * const *
+nautilus_directory_peek_files (NautilusDirectory *directory,
+                               guint             *n_files)
+{
+    g_return_val_if_fail (NAUTILUS_IS_DIRECTORY (directory), NULL);
+    g_return_val_if_fail (n_files != NULL, NULL);
+
+    *n_files = directory->details->files->len;
+
+    return (NautilusFile * const *) directory->details->files->pdata;
 }
 
 NautilusFile *
 nautilus_directory_find_file_by_name (NautilusDirectory *directory,
                                       const char        *name)
 {
-    GList *node;
-
     g_return_val_if_fail (NAUTILUS_IS_DIRECTORY (directory), NULL);
     g_return_val_if_fail (name != NULL, NULL);
 
-    node = g_hash_table_lookup (directory->details->file_hash,
-                                name);
-    return node == NULL ? NULL : NAUTILUS_FILE (node->data);
+    return g_hash_table_lookup (directory->details->file_hash, name);
 }
 
 void
@@ -1102,6 +1201,11 @@ nautilus_directory_notify_files_changed (GList *files)
     for (GList *node = files; node != NULL; node = node->next)
     {
         GFile *location = node->data;
+        g_autoptr (GFile) parent = g_file_get_parent (location);
+
+        /* A file changed in place doesn't change its directory, so deep
+         * counts wouldn't otherwise notice. */
+        nautilus_deep_count_cache_invalidate (parent);
 
         /* Find the file. */
         g_autoptr (NautilusFile) file = nautilus_file_get_existing (location);
@@ -1119,7 +1223,6 @@ nautilus_directory_notify_files_changed (GList *files)
         }
         else
         {
-            g_autoptr (GFile) parent = g_file_get_parent (location);
             NautilusDirectory *dir = lookup_existing (location);
 
             if (dir != NULL && dir->details->new_files_in_progress != NULL &&
@@ -1137,6 +1240,34 @@ nautilus_directory_notify_files_changed (GList *files)
     g_hash_table_foreach (changed_lists, (GHFunc) notify_directory_changes, NULL);
 }
 
+gboolean
+nautilus_directory_notify_directory_rescan (GFile *location)
+{
+    NautilusDirectory *directory = lookup_existing (location);
+    g_autofree char *uri = NULL;
+
+    /* A directory that is still loading will not see changes to files it has
+     * already enumerated, and restarting the load on every burst could keep
+     * it from ever finishing.
+     */
+    if (directory == NULL ||
+        !nautilus_directory_is_file_list_monitored (directory) ||
+        !directory->details->directory_loaded)
+    {
+        return FALSE;
+    }
+
+    uri = g_file_get_uri (location);
+    g_debug ("Rescanning %s after a burst of changes", uri);
+
+    /* Reloading the file list updates the info of every file it finds, so no
+     * attributes need to be invalidated up front.
+     */
+    nautilus_directory_force_reload_internal (directory, 0);
+
+    return TRUE;
+}
+
 void
 nautilus_directory_mark_files_unmounted (GList *files)
 {
@@ -1281,7 +1412,7 @@ nautilus_directory_moved_internal (GFile *old_location,
                                              nautilus_file_ref (directory->details->as_file));
         }
         affected_files = g_list_concat (affected_files,
-                                        nautilus_file_list_copy (directory->details->file_list));
+                                        copy_file_array (directory));
     }
 
     return affected_files;
@@ -1529,18 +1660,141 @@ nautilus_directory_is_editable (NautilusDirectory *directory)
     return NAUTILUS_DIRECTORY_CLASS (G_OBJECT_GET_CLASS (directory))->is_editable (directory);
 }
 
+static NautilusNameIndex *
+get_name_index (NautilusDirectory *directory)
+{
+    if (directory->details->name_index == NULL)
+    {
+        GPtrArray *files = directory->details->files;
+
+        directory->details->name_index = nautilus_name_index_new ();
+        for (guint i = 0; i < files->len; i++)
+        {
+            nautilus_name_index_add (directory->details->name_index,
+                                     g_ptr_array_index (files, i));
+        }
+    }
+
+    return directory->details->name_index;
+}
+
+/* Subclasses that list files other than their own can't use the index. */
+static gboolean
+lists_own_files (NautilusDirectory *directory)
+{
+    return NAUTILUS_DIRECTORY_GET_CLASS (directory)->get_file_list == real_get_file_list;
+}
+
+GList *
+nautilus_directory_find_files_containing (NautilusDirectory  *directory,
+                                          const char * const *words)
+{
+    GList *ret = NULL;
+
+    g_return_val_if_fail (NAUTILUS_IS_DIRECTORY (directory), NULL);
+
+    if (!lists_own_files (directory))
+    {
+        GList *files = nautilus_directory_get_file_list (directory);
+
+        for (GList *l = files; l != NULL; l = l->next)
+        {
+            NautilusFile *file = NAUTILUS_FILE (l->data);
+            g_autofree char *key = nautilus_query_prepare_string (nautilus_file_get_display_name (file));
+            gboolean matches = TRUE;
+
+            for (guint i = 0; matches && words != NULL && words[i] != NULL; i++)
+            {
+                matches = (strstr (key, words[i]) != NULL);
+            }
+
+            if (matches)
+            {
+                ret = g_list_prepend (ret, nautilus_file_ref (file));
+            }
+        }
+
+        nautilus_file_list_free (files);
+
+        return ret;
+    }
+
+    g_autoptr (GPtrArray) files = nautilus_name_index_lookup (get_name_index (directory), words);
+
+    for (guint i = 0; i < files->len; i++)
+    {
+        NautilusFile *file = g_ptr_array_index (files, i);
+
+        if (!is_tentative (file, NULL))
+        {
+            ret = g_list_prepend (ret, nautilus_file_ref (file));
+        }
+    }
+
+    return ret;
+}
+
+/* Returns the longest run of ASCII characters in @glob that any match must
+ * contain literally, folded like display names in the name index. ASCII text
+ * stays a substring when both sides are decomposed and lowercased. */
+static char *
+get_required_literal (const char *glob)
+{
+    const char *best = NULL;
+    size_t best_length = 0;
+
+    for (const char *p = glob; *p != '\0';)
+    {
+        size_t length = 0;
+
+        while (p[length] != '\0' && p[length] != '*' && p[length] != '?' &&
+               g_ascii_isprint (p[length]))
+        {
+            length++;
+        }
+
+        if (length > best_length)
+        {
+            best = p;
+            best_length = length;
+        }
+
+        p += MAX (length, 1);
+    }
+
+    if (best == NULL)
+    {
+        return NULL;
+    }
+
+    g_autofree char *literal = g_strndup (best, best_length);
+
+    return nautilus_query_prepare_string (literal);
+}
+
 GList *
 nautilus_directory_match_pattern (NautilusDirectory *directory,
                                   const char        *pattern)
 {
+    g_autoptr (GPatternSpec) spec = g_pattern_spec_new (pattern);
+    g_autofree char *literal = get_required_literal (pattern);
     GList *files, *l, *ret;
-    GPatternSpec *spec;
-
 
     ret = NULL;
-    spec = g_pattern_spec_new (pattern);
 
-    files = nautilus_directory_get_file_list (directory);
+    /* Narrow the candidates down through the name index when the pattern
+     * has enough literal text for its trigrams to be selective. */
+    if (literal != NULL && strlen (literal) >= 3)
+    {
+        const char * const words[] = { literal, NULL };
+
+        files = nautilus_directory_find_files_containing (directory, words);
+    }
+    else
+    {
+        files = nautilus_directory_get_file_list (directory);
+    }
+
     for (l = files; l; l = l->next)
     {
         NautilusFile *file = NAUTILUS_FILE (l->data);
@@ -1552,7 +1806,6 @@ nautilus_directory_match_pattern (NautilusDirectory *directory,
         }
     }
 
-    g_pattern_spec_free (spec);
     nautilus_file_list_free (files);
 
     return ret;
@@ -196,6 +196,15 @@ void               nautilus_directory_cancel_callback          (NautilusDirector
 								NautilusDirectoryCallback  callback,
 								gpointer                   callback_data);
 
+/* Tell the directory which of its files are on screen, most urgent first, so
+ * their attributes and thumbnails are fetched before those of files further
+ * away. The first @n_visible files are on screen, the others just around it.
+ */
+void               nautilus_directory_set_viewport_files       (NautilusDirectory         *directory,
+								NautilusFile * const      *files,
+								guint                      n_files,
+								guint                      n_visible);
+
 
 /* Monitor the files in a directory. */
 void               nautilus_directory_file_monitor_add         (NautilusDirectory         *directory,
@@ -213,6 +222,10 @@ GList *            nautilus_directory_get_file_list            (NautilusDirector
 
 GList *            nautilus_directory_match_pattern            (NautilusDirectory         *directory,
 							        const char *glob);
+/* Get the files whose display name contains all of @words, which must have
+ * been folded with nautilus_query_prepare_string(). */
+GList *            nautilus_directory_find_files_containing    (NautilusDirectory         *directory,
+								const char * const        *words);
 
 
 /* Return true if the directory has information about all the files.
@@ -38,8 +38,15 @@ typedef struct
     NautilusFileChangeKind kind;
     GFile *from;
     GFile *to;
+    gboolean from_monitor;
 } NautilusFileChange;
 
+/* When a single flush holds at least this many additions, changes and
+ * removals seen by the monitor of one directory, the directory is re-read
+ * instead, which turns e.g. a `git checkout` into one listing update.
+ */
+#define BURST_RESCAN_THRESHOLD 500
+
 static GAsyncQueue *
 nautilus_file_changes_queue_get (void)
 {
@@ -55,8 +62,11 @@ nautilus_file_changes_queue_get (void)
     return file_changes_queue;
 }
 
-void
-nautilus_file_changes_queue_file_added (GFile *location)
+static void
+queue_change (NautilusFileChangeKind  kind,
+              GFile                  *from,
+              GFile                  *to,
+              gboolean                from_monitor)
 {
     NautilusFileChange *new_item;
     GAsyncQueue *queue;
@@ -64,68 +74,78 @@ nautilus_file_changes_queue_file_added (GFile *location)
     queue = nautilus_file_changes_queue_get ();
 
     new_item = g_new0 (NautilusFileChange, 1);
-    new_item->kind = CHANGE_FILE_ADDED;
-    new_item->from = g_object_ref (location);
+    new_item->kind = kind;
+    new_item->from = g_object_ref (from);
+    new_item->to = to != NULL ? g_object_ref (to) : NULL;
+    new_item->from_monitor = from_monitor;
     g_async_queue_push (queue, new_item);
 }
 
 void
-nautilus_file_changes_queue_file_changed (GFile *location)
+nautilus_file_changes_queue_file_added (GFile *location)
 {
-    NautilusFileChange *new_item;
-    GAsyncQueue *queue;
-
-    queue = nautilus_file_changes_queue_get ();
+    queue_change (CHANGE_FILE_ADDED, location, NULL, FALSE);
+}
 
-    new_item = g_new0 (NautilusFileChange, 1);
-    new_item->kind = CHANGE_FILE_CHANGED;
-    new_item->from = g_object_ref (location);
-    g_async_queue_push (queue, new_item);
+void
+nautilus_file_changes_queue_file_changed (GFile *location)
+{
+    queue_change (CHANGE_FILE_CHANGED, location, NULL, FALSE);
 }
 
 /* A specialized variant of nautilus_file_changes_queue_file_removed(). */
 void
 nautilus_file_changes_queue_file_unmounted (GFile *location)
 {
-    NautilusFileChange *new_item;
-    GAsyncQueue *queue;
-
-    queue = nautilus_file_changes_queue_get ();
-
-    new_item = g_new0 (NautilusFileChange, 1);
-    new_item->kind = CHANGE_FILE_UNMOUNTED;
-    new_item->from = g_object_ref (location);
-    g_async_queue_push (queue, new_item);
+    queue_change (CHANGE_FILE_UNMOUNTED, location, NULL, FALSE);
 }
 
 void
 nautilus_file_changes_queue_file_removed (GFile *location)
 {
-    NautilusFileChange *new_item;
-    GAsyncQueue *queue;
-
-    queue = nautilus_file_changes_queue_get ();
-
-    new_item = g_new0 (NautilusFileChange, 1);
-    new_item->kind = CHANGE_FILE_REMOVED;
-    new_item->from = g_object_ref (location);
-    g_async_queue_push (queue, new_item);
+    queue_change (CHANGE_FILE_REMOVED, location, NULL, FALSE);
 }
 
 void
 nautilus_file_changes_queue_file_moved (GFile *from,
                                         GFile *to)
 {
-    NautilusFileChange *new_item;
-    GAsyncQueue *queue;
+    queue_change (CHANGE_FILE_MOVED, from, to, FALSE);
+}
 
-    queue = nautilus_file_changes_queue_get ();
+/* The same, for changes seen by a file monitor rather than made by one of
+ * our own file operations. Only these count toward a burst, as operations
+ * already report every file they touch.
+ */
+void
+nautilus_file_changes_queue_monitor_file_added (GFile *location)
+{
+    queue_change (CHANGE_FILE_ADDED, location, NULL, TRUE);
+}
 
-    new_item = g_new (NautilusFileChange, 1);
-    new_item->kind = CHANGE_FILE_MOVED;
-    new_item->from = g_object_ref (from);
-    new_item->to = g_object_ref (to);
-    g_async_queue_push (queue, new_item);
+void
+nautilus_file_changes_queue_monitor_file_changed (GFile *location)
+{
+    queue_change (CHANGE_FILE_CHANGED, location, NULL, TRUE);
+}
+
+void
+nautilus_file_changes_queue_monitor_file_unmounted (GFile *location)
+{
+    queue_change (CHANGE_FILE_UNMOUNTED, location, NULL, TRUE);
+}
+
+void
+nautilus_file_changes_queue_monitor_file_removed (GFile *location)
+{
+    queue_change (CHANGE_FILE_REMOVED, location, NULL, TRUE);
+}
+
+void
+nautilus_file_changes_queue_monitor_file_moved (GFile *from,
+                                                GFile *to)
+{
+    queue_change (CHANGE_FILE_MOVED, from, to, TRUE);
 }
 
 static void
@@ -148,6 +168,248 @@ pairs_list_free (GList *pairs)
     g_list_free_full (pairs, g_free);
 }
 
+static void
+change_free (NautilusFileChange *change)
+{
+    g_clear_object (&change->from);
+    g_clear_object (&change->to);
+    g_free (change);
+}
+
+static gboolean
+is_per_file_change (NautilusFileChange *change)
+{
+    return change->kind == CHANGE_FILE_ADDED ||
+           change->kind == CHANGE_FILE_CHANGED ||
+           change->kind == CHANGE_FILE_REMOVED;
+}
+
+/* The directory whose listing a change affects. Moves count toward the
+ * directory they go to, as that is where tools like rsync rename the
+ * temporary files they write.
+ */
+static GFile *
+get_burst_directory (NautilusFileChange *change)
+{
+    if (!change->from_monitor)
+    {
+        return NULL;
+    }
+
+    if (is_per_file_change (change))
+    {
+        return g_file_get_parent (change->from);
+    }
+    else if (change->kind == CHANGE_FILE_MOVED)
+    {
+        return g_file_get_parent (change->to);
+    }
+
+    return NULL;
+}
+
+static gboolean
+is_within_directories (GFile      *file,
+                       GHashTable *directories)
+{
+    g_autoptr (GFile) parent = g_file_get_parent (file);
+
+    return parent != NULL && g_hash_table_contains (directories, parent);
+}
+
+/* Replaces bursts of changes in one directory with a rescan of it. Removals
+ * and unmounts are always kept, as removed folders have monitors and
+ * children of their own to let go of, and so are moves from other
+ * directories, as they carry more than a listing update.
+ */
+static void
+rescan_bursts (GPtrArray *changes)
+{
+    g_autoptr (GHashTable) counts = g_hash_table_new_full (g_file_hash, (GEqualFunc) g_file_equal,
+                                                           g_object_unref, NULL);
+    g_autoptr (GHashTable) rescanned = g_hash_table_new_full (g_file_hash, (GEqualFunc) g_file_equal,
+                                                              g_object_unref, NULL);
+    GHashTableIter iter;
+    gpointer parent, count;
+
+    if (changes->len < BURST_RESCAN_THRESHOLD)
+    {
+        return;
+    }
+
+    for (guint i = 0; i < changes->len; i++)
+    {
+        GFile *change_parent = get_burst_directory (g_ptr_array_index (changes, i));
+
+        if (change_parent != NULL)
+        {
+            count = g_hash_table_lookup (counts, change_parent);
+            g_hash_table_replace (counts, change_parent, GUINT_TO_POINTER (GPOINTER_TO_UINT (count) + 1));
+        }
+    }
+
+    g_hash_table_iter_init (&iter, counts);
+    while (g_hash_table_iter_next (&iter, &parent, &count))
+    {
+        if (GPOINTER_TO_UINT (count) >= BURST_RESCAN_THRESHOLD &&
+            nautilus_directory_notify_directory_rescan (parent))
+        {
+            g_hash_table_add (rescanned, g_object_ref (parent));
+        }
+    }
+
+    if (g_hash_table_size (rescanned) == 0)
+    {
+        return;
+    }
+
+    for (guint i = 0; i < changes->len; i++)
+    {
+        NautilusFileChange *change = g_ptr_array_index (changes, i);
+
+        if (change == NULL)
+        {
+            continue;
+        }
+
+        if ((change->kind == CHANGE_FILE_ADDED || change->kind == CHANGE_FILE_CHANGED) &&
+            is_within_directories (change->from, rescanned))
+        {
+            g_clear_pointer (&g_ptr_array_index (changes, i), change_free);
+        }
+        else if (change->kind == CHANGE_FILE_MOVED &&
+                 is_within_directories (change->from, rescanned) &&
+                 is_within_directories (change->to, rescanned))
+        {
+            /* The rescan picks up the new name, but not the tags. */
+            nautilus_tag_manager_update_moved_uris (nautilus_tag_manager_get (),
+                                                    change->from,
+                                                    change->to);
+            g_clear_pointer (&g_ptr_array_index (changes, i), change_free);
+        }
+    }
+}
+
+/* Remembers @file's ancestors, unless already known. */
+static void
+add_ancestors (GHashTable *ancestors,
+               GFile      *file)
+{
+    g_autoptr (GFile) parent = g_file_get_parent (file);
+
+    while (parent != NULL && !g_hash_table_contains (ancestors, parent))
+    {
+        GFile *next = g_file_get_parent (parent);
+
+        g_hash_table_add (ancestors, g_steal_pointer (&parent));
+        parent = next;
+    }
+}
+
+/* Merges repeated changes to the same file, keeping the order of the rest:
+ *
+ *  - a change after an addition or another change is redundant, as the
+ *    file info is only queried when the changes are flushed;
+ *  - repeated additions or removals are redundant;
+ *  - a removal supersedes the addition or change before it, which collapses
+ *    short-lived files into a removal of something that isn't known anyway.
+ *
+ * Nothing is merged across a move of the same file, or across a move of a
+ * directory that holds changed files. Unmounts affect whole trees, so
+ * nothing is merged across them at all.
+ */
+static void
+merge_repeated_changes (GPtrArray *changes)
+{
+    g_autoptr (GHashTable) last_change = g_hash_table_new (g_file_hash, (GEqualFunc) g_file_equal);
+    g_autoptr (GHashTable) ancestors = g_hash_table_new_full (g_file_hash, (GEqualFunc) g_file_equal,
+                                                              g_object_unref, NULL);
+
+    for (guint i = 0; i < changes->len; i++)
+    {
+        NautilusFileChange *change = g_ptr_array_index (changes, i);
+        NautilusFileChange *previous;
+        gpointer previous_index;
+        gboolean redundant = FALSE;
+
+        if (change == NULL)
+        {
+            continue;
+        }
+
+        if (change->kind == CHANGE_FILE_MOVED &&
+            !g_hash_table_contains (ancestors, change->from) &&
+            !g_hash_table_contains (ancestors, change->to))
+        {
+            /* A file is renamed into place, like rsync and editors do. */
+            g_hash_table_remove (last_change, change->from);
+            g_hash_table_remove (last_change, change->to);
+            continue;
+        }
+
+        if (!is_per_file_change (change))
+        {
+            g_hash_table_remove_all (last_change);
+            g_hash_table_remove_all (ancestors);
+            continue;
+        }
+
+        if (g_hash_table_lookup_extended (last_change, change->from, NULL, &previous_index))
+        {
+            guint index = GPOINTER_TO_UINT (previous_index);
+
+            previous = g_ptr_array_index (changes, index);
+            switch (change->kind)
+            {
+                case CHANGE_FILE_CHANGED:
+                {
+                    redundant = previous->kind != CHANGE_FILE_REMOVED;
+                }
+                break;
+
+                case CHANGE_FILE_ADDED:
+                {
+                    redundant = previous->kind == CHANGE_FILE_ADDED;
+                }
+                break;
+
+                case CHANGE_FILE_REMOVED:
+                {
+                    if (previous->kind == CHANGE_FILE_REMOVED)
+                    {
+                        redundant = TRUE;
+                    }
+                    else
+                    {
+                        g_hash_table_remove (last_change, previous->from);
+                        g_clear_pointer (&g_ptr_array_index (changes, index), change_free);
+                    }
+                }
+                break;
+
+                default:
+                {
+                    g_assert_not_reached ();
+                }
+                break;
+            }
+        }
+        else
+        {
+            add_ancestors (ancestors, change->from);
+        }
+
+        if (redundant)
+        {
+            g_clear_pointer (&g_ptr_array_index (changes, i), change_free);
+        }
+        else
+        {
+            g_hash_table_insert (last_change, change->from, GUINT_TO_POINTER (i));
+        }
+    }
+}
+
 /* go through changes in the change queue, send ones with the same kind
  * in a list to the different nautilus_directory_notify calls
  */
@@ -160,6 +422,8 @@ nautilus_file_changes_consume_changes (void)
     GFilePair *pair;
     GAsyncQueue *queue;
     gboolean flush_needed;
+    g_autoptr (GPtrArray) pending = g_ptr_array_new ();
+    guint next = 0;
 
 
     additions = NULL;
@@ -169,6 +433,17 @@ nautilus_file_changes_consume_changes (void)
 
     queue = nautilus_file_changes_queue_get ();
 
+    /* Take everything that has been queued so far, so that it can be
+     * coalesced before anyone gets notified.
+     */
+    while ((change = g_async_queue_try_pop (queue)) != NULL)
+    {
+        g_ptr_array_add (pending, change);
+    }
+
+    rescan_bursts (pending);
+    merge_repeated_changes (pending);
+
     /* Consume changes from the queue, stuffing them into one of three lists,
      * keep doing it while the changes are of the same kind, then send them off.
      * This is to ensure that the changes get sent off in the same order that they
@@ -176,7 +451,11 @@ nautilus_file_changes_consume_changes (void)
      */
     for (;;)
     {
-        change = g_async_queue_try_pop (queue);
+        change = NULL;
+        while (change == NULL && next < pending->len)
+        {
+            change = g_ptr_array_index (pending, next++);
+        }
 
         /* figure out if we need to flush the pending changes that we collected sofar */
 
@@ -29,4 +29,11 @@ void nautilus_file_changes_queue_file_removed                    (GFile      *lo
 void nautilus_file_changes_queue_file_moved                      (GFile      *from,
 								  GFile      *to);
 
+void nautilus_file_changes_queue_monitor_file_added              (GFile      *location);
+void nautilus_file_changes_queue_monitor_file_changed            (GFile      *location);
+void nautilus_file_changes_queue_monitor_file_unmounted          (GFile      *location);
+void nautilus_file_changes_queue_monitor_file_removed            (GFile      *location);
+void nautilus_file_changes_queue_monitor_file_moved              (GFile      *from,
+								  GFile      *to);
+
 void nautilus_file_changes_consume_changes                       (void);
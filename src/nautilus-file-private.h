@@ -40,6 +40,9 @@ typedef enum {
 struct NautilusFilePrivate
 {
 	NautilusDirectory *directory;
+	/* Position in the directory's file array, maintained by the
+	 * directory while the file is indexed there. */
+	guint directory_index;
 	
 	GRefString *name;
 
@@ -233,6 +236,9 @@ gboolean      nautilus_file_update_name                    (NautilusFile
 							    const char             *name);
 gboolean      nautilus_file_update_thumbnail_info          (NautilusFile           *file,
                                                             GFileInfo              *info);
+gboolean      nautilus_file_set_thumbnail_info             (NautilusFile           *file,
+                                                            const char             *thumbnail_path,
+                                                            gboolean                thumbnailing_failed);
 gboolean      nautilus_file_update_metadata_from_info      (NautilusFile           *file,
 							    GFileInfo              *info);
 
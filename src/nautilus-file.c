@@ -285,6 +285,11 @@ nautilus_file_set_display_name (NautilusFile *file,
         g_free (file->details->display_name_collation_key);
         file->details->display_name_collation_key = g_utf8_collate_key_for_filename (display_name, -1);
 
+        if (file->details->directory != NULL)
+        {
+            nautilus_directory_file_display_name_changed (file->details->directory, file);
+        }
+
         g_object_notify_by_pspec (G_OBJECT (file), properties[PROP_DISPLAY_NAME]);
         g_object_notify_by_pspec (G_OBJECT (file), properties[PROP_A11Y_NAME]);
     }
@@ -2519,7 +2524,7 @@ update_info_internal (NautilusFile *file,
                       GFileInfo    *info,
                       gboolean      update_name)
 {
-    GList *node;
+    gboolean indexed;
     gboolean changed;
     gboolean is_symlink, is_hidden, is_mountpoint;
     gboolean has_permissions;
@@ -2968,8 +2973,8 @@ update_info_internal (NautilusFile *file,
         {
             changed = TRUE;
 
-            node = nautilus_directory_begin_file_name_change
-                       (file->details->directory, file);
+            indexed = nautilus_directory_begin_file_name_change
+                          (file->details->directory, file);
 
             g_clear_pointer (&file->details->name, g_ref_string_release);
             if (g_strcmp0 (file->details->display_name, name) == 0)
@@ -2992,7 +2997,7 @@ update_info_internal (NautilusFile *file,
             }
 
             nautilus_directory_end_file_name_change
-                (file->details->directory, file, node);
+                (file->details->directory, file, indexed);
         }
     }
 
@@ -3021,8 +3026,9 @@ nautilus_file_update_info (NautilusFile *file,
 }
 
 gboolean
-nautilus_file_update_thumbnail_info (NautilusFile *file,
-                                     GFileInfo    *info)
+nautilus_file_set_thumbnail_info (NautilusFile *file,
+                                  const char   *thumbnail_path,
+                                  gboolean      thumbnailing_failed)
 {
     gboolean changed = FALSE;
 
@@ -3032,15 +3038,11 @@ nautilus_file_update_thumbnail_info (NautilusFile *file,
         changed = TRUE;
     }
 
-    const gchar *thumbnail_path = g_file_info_get_attribute_byte_string (info,
-                                                                         G_FILE_ATTRIBUTE_THUMBNAIL_PATH);
     if (g_set_str (&file->details->thumbnail_path, thumbnail_path))
     {
         changed = TRUE;
     }
 
-    gboolean thumbnailing_failed = g_file_info_get_attribute_boolean (info,
-                                                                      G_FILE_ATTRIBUTE_THUMBNAILING_FAILED);
     if (file->details->thumbnailing_failed != thumbnailing_failed)
     {
         changed = TRUE;
@@ -3050,12 +3052,24 @@ nautilus_file_update_thumbnail_info (NautilusFile *file,
     return changed;
 }
 
+gboolean
+nautilus_file_update_thumbnail_info (NautilusFile *file,
+                                     GFileInfo    *info)
+{
+    const gchar *thumbnail_path = g_file_info_get_attribute_byte_string (info,
+                                                                         G_FILE_ATTRIBUTE_THUMBNAIL_PATH);
+    gboolean thumbnailing_failed = g_file_info_get_attribute_boolean (info,
+                                                                      G_FILE_ATTRIBUTE_THUMBNAILING_FAILED);
+
+    return nautilus_file_set_thumbnail_info (file, thumbnail_path, thumbnailing_failed);
+}
+
 static gboolean
 update_name_internal (NautilusFile *file,
                       const char   *name,
                       gboolean      in_directory)
 {
-    GList *node;
+    gboolean indexed;
 
     g_assert (name != NULL);
 
@@ -3069,11 +3083,11 @@ update_name_internal (NautilusFile *file,
         return FALSE;
     }
 
-    node = NULL;
+    indexed = FALSE;
     if (in_directory)
     {
-        node = nautilus_directory_begin_file_name_change
-                   (file->details->directory, file);
+        indexed = nautilus_directory_begin_file_name_change
+                      (file->details->directory, file);
     }
 
     g_clear_pointer (&file->details->name, g_ref_string_release);
@@ -3087,7 +3101,7 @@ update_name_internal (NautilusFile *file,
     if (in_directory)
     {
         nautilus_directory_end_file_name_change
-            (file->details->directory, file, node);
+            (file->details->directory, file, indexed);
     }
 
     return TRUE;
@@ -4043,6 +4057,194 @@ nautilus_file_compare_for_sort_by_attribute     (NautilusFile *file_1,
 }
 
 
+static Knowledge
+get_sort_key_time (NautilusFile     *file,
+                   NautilusDateType  type,
+                   gint64           *value)
+{
+    time_t time = 0;
+    Knowledge knowledge = get_time (file, &time, type);
+
+    *value = (knowledge == KNOWN) ? time : 0;
+    return knowledge;
+}
+
+/**
+ * nautilus_file_get_sort_key:
+ * @file: A file object
+ * @attribute: The attribute the files are sorted by
+ * @key: (out caller-allocates): Return location for the key
+ *
+ * Reduces the primary criterion used by
+ * nautilus_file_compare_for_sort_by_attribute_q() to values that can be
+ * compared without looking at @file again. The key must be computed anew
+ * whenever @file changes, and freed with nautilus_file_sort_key_clear().
+ **/
+void
+nautilus_file_get_sort_key (NautilusFile        *file,
+                            GQuark               attribute,
+                            NautilusFileSortKey *key)
+{
+    Knowledge knowledge;
+
+    g_return_if_fail (NAUTILUS_IS_FILE (file));
+
+    *key = (NautilusFileSortKey) { .attribute = attribute };
+
+    /* Ranks follow the order documented in the compare_by_*() functions:
+     * a lower rank sorts first, unknown values before unknowable ones. */
+    if (attribute == 0 || attribute == attribute_name_q)
+    {
+        const char *name = nautilus_file_peek_display_name (file);
+
+        key->rank = (name[0] == SORT_LAST_CHAR1 || name[0] == SORT_LAST_CHAR2);
+        key->string = g_strdup (nautilus_file_peek_display_name_collation_key (file));
+    }
+    else if (attribute == attribute_size_q)
+    {
+        if (nautilus_file_is_directory (file))
+        {
+            guint count = 0;
+
+            knowledge = get_item_count (file, &count);
+            key->value = (knowledge == KNOWN) ? count : 0;
+            key->rank = UNKNOWN - knowledge;
+        }
+        else
+        {
+            goffset size = 0;
+
+            knowledge = get_size (file, &size);
+            key->value = (knowledge == KNOWN) ? size : 0;
+            key->rank = UNKNOWN + 1 + (UNKNOWN - knowledge);
+        }
+    }
+    else if (attribute == attribute_type_q)
+    {
+        const char *type_string;
+
+        if (nautilus_file_is_directory (file))
+        {
+            key->rank = 0;
+        }
+        else if ((type_string = nautilus_file_get_type_as_string_no_extra_text (file)) != NULL)
+        {
+            key->rank = 1;
+            key->string = g_utf8_collate_key (type_string, -1);
+        }
+        else
+        {
+            key->rank = 2;
+        }
+    }
+    else if (attribute == attribute_starred_q)
+    {
+        g_autofree char *uri = nautilus_file_get_uri (file);
+
+        key->rank = !nautilus_tag_manager_file_is_starred (nautilus_tag_manager_get (), uri);
+    }
+    else if (attribute == attribute_modification_date_q || attribute == attribute_date_modified_q || attribute == attribute_date_modified_full_q)
+    {
+        key->rank = UNKNOWN - get_sort_key_time (file, NAUTILUS_DATE_TYPE_MODIFIED, &key->value);
+    }
+    else if (attribute == attribute_accessed_date_q || attribute == attribute_date_accessed_q || attribute == attribute_date_accessed_full_q)
+    {
+        key->rank = UNKNOWN - get_sort_key_time (file, NAUTILUS_DATE_TYPE_ACCESSED, &key->value);
+    }
+    else if (attribute == attribute_date_created_q || attribute == attribute_date_created_full_q)
+    {
+        key->rank = UNKNOWN - get_sort_key_time (file, NAUTILUS_DATE_TYPE_CREATED, &key->value);
+    }
+    else if (attribute == attribute_trashed_on_q || attribute == attribute_trashed_on_full_q)
+    {
+        key->rank = UNKNOWN - get_sort_key_time (file, NAUTILUS_DATE_TYPE_TRASHED, &key->value);
+    }
+    else if (attribute == attribute_recency_q)
+    {
+        key->rank = UNKNOWN - get_sort_key_time (file, NAUTILUS_DATE_TYPE_RECENCY, &key->value);
+    }
+    else if (attribute == attribute_search_relevance_q)
+    {
+        /* Truncating keeps the order; the truncated part only matters for
+         * ties, which fall back to the exact comparison. */
+        key->value = (gint64) (file->details->search_relevance * 1e6);
+    }
+    else
+    {
+        key->string = nautilus_file_get_string_attribute_q (file, attribute);
+    }
+}
+
+void
+nautilus_file_sort_key_clear (NautilusFileSortKey *key)
+{
+    g_clear_pointer (&key->string, g_free);
+    key->attribute = 0;
+}
+
+/**
+ * nautilus_file_compare_sort_keys:
+ * @file_1: A file object
+ * @key_1: The sort key of @file_1
+ * @file_2: Another file object
+ * @key_2: The sort key of @file_2, for the same attribute as @key_1
+ * @directories_first: Put all directories before any non-directories
+ * @reversed: Reverse the order of the items, except that
+ * the directories_first flag is still respected.
+ *
+ * Same as nautilus_file_compare_for_sort_by_attribute_q(), but only looks
+ * at the files themselves when their keys are equal.
+ *
+ * Return value: see nautilus_file_compare_for_sort().
+ **/
+int
+nautilus_file_compare_sort_keys (NautilusFile              *file_1,
+                                 const NautilusFileSortKey *key_1,
+                                 NautilusFile              *file_2,
+                                 const NautilusFileSortKey *key_2,
+                                 gboolean                   directories_first,
+                                 gboolean                   reversed)
+{
+    int result;
+
+    if (file_1 == file_2)
+    {
+        return 0;
+    }
+
+    g_return_val_if_fail (key_1->attribute == key_2->attribute, 0);
+
+    result = nautilus_file_compare_for_sort_internal (file_1, file_2, directories_first, reversed);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    if (key_1->rank != key_2->rank)
+    {
+        result = key_1->rank < key_2->rank ? -1 : +1;
+    }
+    else if (key_1->value != key_2->value)
+    {
+        result = key_1->value < key_2->value ? -1 : +1;
+    }
+    else if (key_1->string != NULL && key_2->string != NULL)
+    {
+        result = strcmp (key_1->string, key_2->string);
+    }
+
+    if (result == 0)
+    {
+        return nautilus_file_compare_for_sort_by_attribute_q (file_1, file_2,
+                                                              key_1->attribute,
+                                                              directories_first,
+                                                              reversed);
+    }
+
+    return reversed ? -result : result;
+}
+
+
 /**
  * nautilus_file_compare_name:
  * @file: A file object
@@ -5076,20 +5278,35 @@ nautilus_file_get_thumbnail_icon (NautilusFile          *file,
     {
         g_autofree gchar *uri = nautilus_file_get_uri (file);
         time_t modified_time = 0;
+        goffset size = -1;
+        /* Being requested means being about to be shown, even before the
+         *  view has been laid out and knows whether it is on screen. */
+        NautilusThumbnailPriority priority = NAUTILUS_THUMBNAIL_PRIORITY_PREFETCH;
+        gpointer viewport_priority;
 
         file->details->thumbnail_cancellable = g_cancellable_new ();
 
+        if (file->details->directory != NULL &&
+            g_hash_table_lookup_extended (file->details->directory->details->viewport_files,
+                                          file, NULL, &viewport_priority))
+        {
+            priority = GPOINTER_TO_UINT (viewport_priority);
+        }
+
         if (file->details->got_file_info &&
             file->details->file_info_is_up_to_date &&
             file->details->mtime != 0)
         {
             modified_time = file->details->mtime;
+            size = file->details->size;
         }
 
         file->details->is_thumbnailing = TRUE;
         nautilus_create_thumbnail_async (uri,
                                          nautilus_file_get_mime_type (file),
                                          modified_time,
+                                         size,
+                                         priority,
                                          file->details->thumbnail_cancellable,
                                          file_thumbnailing_done_cb,
                                          file);
@@ -5142,7 +5359,8 @@ nautilus_file_get_icon (NautilusFile          *file,
     if (icon == NULL)
     {
         g_autoptr (GIcon) gicon = nautilus_file_get_gicon (file, flags);
-        icon = nautilus_icon_info_lookup (gicon, size, scale);
+        icon = nautilus_icon_info_lookup_for_content_type (nautilus_file_get_mime_type (file),
+                                                           gicon, size, scale);
 
         if (nautilus_icon_info_is_fallback (icon))
         {
@@ -6960,6 +7178,56 @@ nautilus_file_get_string_attribute_q (NautilusFile *file,
     return g_strdup (extension_attribute);
 }
 
+/**
+ * nautilus_file_get_attributes_for_string_attribute_q:
+ * @attribute_q: a quark as passed to nautilus_file_get_string_attribute_q()
+ *     or nautilus_file_compare_for_sort_by_attribute_q()
+ *
+ * Returns: what has to be loaded, besides %NAUTILUS_FILE_ATTRIBUTE_INFO, to
+ * show or sort by @attribute_q.
+ */
+NautilusFileAttributes
+nautilus_file_get_attributes_for_string_attribute_q (GQuark attribute_q)
+{
+    if (attribute_q == attribute_size_q ||
+        attribute_q == attribute_size_detail_q)
+    {
+        /* Folder sizes are given as item counts. */
+        return NAUTILUS_FILE_ATTRIBUTE_DIRECTORY_ITEM_COUNT;
+    }
+
+    /* Deep counts are shown when known, but too costly to ask for just to
+     * show them. */
+    if (attribute_q == attribute_name_q ||
+        attribute_q == attribute_type_q ||
+        attribute_q == attribute_detailed_type_q ||
+        attribute_q == attribute_mime_type_q ||
+        attribute_q == attribute_deep_size_q ||
+        attribute_q == attribute_deep_file_count_q ||
+        attribute_q == attribute_deep_directory_count_q ||
+        attribute_q == attribute_deep_total_count_q ||
+        attribute_q == attribute_trash_orig_path_q ||
+        nautilus_file_is_date_sort_attribute_q (attribute_q) ||
+        attribute_q == attribute_permissions_q ||
+        attribute_q == attribute_selinux_context_q ||
+        attribute_q == attribute_octal_permissions_q ||
+        attribute_q == attribute_owner_q ||
+        attribute_q == attribute_group_q ||
+        attribute_q == attribute_uri_q ||
+        attribute_q == attribute_where_q ||
+        attribute_q == attribute_link_target_q ||
+        attribute_q == attribute_volume_q ||
+        attribute_q == attribute_free_space_q ||
+        attribute_q == attribute_starred_q ||
+        attribute_q == attribute_search_relevance_q)
+    {
+        return 0;
+    }
+
+    /* Anything else may be provided by an extension. */
+    return NAUTILUS_FILE_ATTRIBUTE_EXTENSION_INFO;
+}
+
 char *
 nautilus_file_get_string_attribute (NautilusFile *file,
                                     const char   *attribute_name)
@@ -85,6 +85,17 @@ typedef enum {
 
 #define NAUTILUS_THUMBNAIL_MINIMUM_ICON_SIZE 32
 
+/* The primary sort criterion of a file for one attribute, reduced to plain
+ * values that are cheap to compare: first by rank, then by value, then by
+ * string with strcmp(). Ties are broken by the regular comparison functions.
+ */
+typedef struct {
+	GQuark attribute;
+	guint rank;
+	gint64 value;
+	char *string;
+} NautilusFileSortKey;
+
 typedef void (*NautilusFileCallback)          (NautilusFile  *file,
 				               gpointer       callback_data);
 typedef gboolean (*NautilusFileFilterFunc)    (NautilusFile  *file,
@@ -366,6 +377,7 @@ char *                  nautilus_file_get_string_attribute_with_default (Nautilu
 									 const char                     *attribute_name);
 char *                  nautilus_file_get_string_attribute_with_default_q (NautilusFile                  *file,
 									 GQuark                          attribute_q);
+NautilusFileAttributes  nautilus_file_get_attributes_for_string_attribute_q (GQuark                        attribute_q);
 
 /* Matching with another URI. */
 gboolean                nautilus_file_matches_uri                       (NautilusFile                   *file,
@@ -393,6 +405,16 @@ int                     nautilus_file_compare_for_sort_by_attribute_q   (Nautilu
 									 GQuark                          attribute,
 									 gboolean                        directories_first,
 									 gboolean                        reversed);
+void                    nautilus_file_get_sort_key                      (NautilusFile                   *file,
+									 GQuark                          attribute,
+									 NautilusFileSortKey            *key);
+void                    nautilus_file_sort_key_clear                    (NautilusFileSortKey            *key);
+int                     nautilus_file_compare_sort_keys                 (NautilusFile                   *file_1,
+									 const NautilusFileSortKey      *key_1,
+									 NautilusFile                   *file_2,
+									 const NautilusFileSortKey      *key_2,
+									 gboolean                        directories_first,
+									 gboolean                        reversed);
 gboolean                nautilus_file_is_date_sort_attribute_q          (GQuark                          attribute);
 gboolean                nautilus_file_attribute_slow_sort               (const gchar                    *sort_attribute);
 int                     nautilus_file_compare_location                  (NautilusFile                    *file_1,
@@ -166,6 +166,10 @@ struct _NautilusFilesView
     gboolean scripts_menu_updated;
     gboolean templates_menu_updated;
 
+    /* Selected folders, monitored for the item counts in the status, which
+     * the directory monitors leave to the cells of visible items. */
+    GHashTable *item_count_monitored_files;
+
     guint display_selection_idle_id;
     guint update_context_menus_timeout_id;
     guint update_status_idle_id;
@@ -189,6 +193,10 @@ struct _NautilusFilesView
     GList *new_added_files;
     GList *new_changed_files;
 
+    /* Whether items already in the model changed and may be out of order.
+     * Added items are inserted in order and don't need a re-sort. */
+    gboolean needs_resort;
+
     NautilusFileList *pending_selection;
     GHashTable *pending_reveal;
     GHashTable *awaiting_acknowledge;
@@ -2511,11 +2519,63 @@ action_show_hidden_files (GSimpleAction *action,
     g_simple_action_set_state (action, state);
 }
 
+/* Cells request what they show for the files they are bound to, so the
+ * directories are only monitored for what is needed for every file.
+ */
+static NautilusFileAttributes
+get_directory_monitor_attributes (NautilusFilesView *self)
+{
+    NautilusFileAttributes attributes = NAUTILUS_FILE_ATTRIBUTE_INFO | NAUTILUS_FILE_ATTRIBUTE_MOUNT;
+    g_autoptr (GVariant) sort_state = g_action_group_get_action_state (self->view_action_group,
+                                                                       "sort");
+    const char *sort_attribute;
+
+    g_variant_get (sort_state, "(&sb)", &sort_attribute, NULL);
+
+    /* Sorting needs the attribute for every file, not just the visible ones.
+     * For instance, folders are sorted by size on their item count. */
+    if (g_strcmp0 (sort_attribute, "invalid") != 0)
+    {
+        attributes |= nautilus_file_get_attributes_for_string_attribute_q (g_quark_from_string (sort_attribute));
+    }
+
+    return attributes;
+}
+
+static void
+update_directory_monitor_attributes (NautilusFilesView *self)
+{
+    NautilusFileAttributes attributes;
+
+    /* Not monitoring yet, see finish_loading(). */
+    if (self->files_added_handler_id == 0)
+    {
+        return;
+    }
+
+    /* Without a callback, this only replaces the attributes. */
+    attributes = get_directory_monitor_attributes (self);
+    nautilus_directory_file_monitor_add (self->directory,
+                                         &self->directory,
+                                         self->show_hidden_files,
+                                         attributes,
+                                         NULL, NULL);
+    for (NautilusDirectoryList *l = self->subdirectory_list; l != NULL; l = l->next)
+    {
+        nautilus_directory_file_monitor_add (l->data,
+                                             &self->directory,
+                                             self->show_hidden_files,
+                                             attributes,
+                                             NULL, NULL);
+    }
+}
+
 static void
 action_sort_order_changed (GSimpleAction *action,
                            GVariant      *value,
                            gpointer       user_data)
 {
+    NautilusFilesView *self = NAUTILUS_FILES_VIEW (user_data);
     g_autoptr (GVariant) old_value = g_action_get_state (G_ACTION (action));
 
     /* Don't resort if the action is in the same state as before */
@@ -2526,6 +2586,8 @@ action_sort_order_changed (GSimpleAction *action,
 
     /* Actual changes happen through binding to NautilusListBase:sort-state. */
     g_simple_action_set_state (action, value);
+
+    update_directory_monitor_attributes (self);
 }
 
 static void
@@ -3310,6 +3372,69 @@ nautilus_files_view_finalize (GObject *object)
     G_OBJECT_CLASS (nautilus_files_view_parent_class)->finalize (object);
 }
 
+static void
+stop_monitoring_item_counts (NautilusFilesView *self)
+{
+    GHashTableIter iter;
+    NautilusFile *file;
+
+    if (self->item_count_monitored_files == NULL)
+    {
+        return;
+    }
+
+    g_hash_table_iter_init (&iter, self->item_count_monitored_files);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &file, NULL))
+    {
+        nautilus_file_monitor_remove (file, &self->item_count_monitored_files);
+    }
+    g_clear_pointer (&self->item_count_monitored_files, g_hash_table_destroy);
+}
+
+/* Keeps the item counts of the selected folders coming, whether or not they
+ * are visible. The status is updated as they arrive, see
+ * files_changed_callback().
+ */
+static void
+monitor_item_counts (NautilusFilesView *self,
+                     GList             *selection)
+{
+    g_autoptr (GHashTable) old_files = g_steal_pointer (&self->item_count_monitored_files);
+
+    self->item_count_monitored_files = g_hash_table_new_full (NULL, NULL,
+                                                              (GDestroyNotify) nautilus_file_unref,
+                                                              NULL);
+
+    for (GList *l = selection; l != NULL; l = l->next)
+    {
+        NautilusFile *file = l->data;
+
+        if (!nautilus_file_is_directory (file) ||
+            !g_hash_table_add (self->item_count_monitored_files, nautilus_file_ref (file)))
+        {
+            continue;
+        }
+
+        if (old_files == NULL || !g_hash_table_remove (old_files, file))
+        {
+            nautilus_file_monitor_add (file, &self->item_count_monitored_files,
+                                       NAUTILUS_FILE_ATTRIBUTE_DIRECTORY_ITEM_COUNT);
+        }
+    }
+
+    if (old_files != NULL)
+    {
+        GHashTableIter iter;
+        NautilusFile *file;
+
+        g_hash_table_iter_init (&iter, old_files);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &file, NULL))
+        {
+            nautilus_file_monitor_remove (file, &self->item_count_monitored_files);
+        }
+    }
+}
+
 /**
  * nautilus_files_view_display_selection_info:
  *
@@ -3348,6 +3473,7 @@ nautilus_files_view_display_selection_info (NautilusFilesView *view)
     }
 
     selection = nautilus_files_view_get_selection (view);
+    monitor_item_counts (view, selection);
 
     folder_item_count_known = TRUE;
     folder_count = 0;
@@ -3996,7 +4122,11 @@ still_should_show_file (NautilusFilesView *view,
 static void
 files_view_end_file_changes (NautilusFilesView *self)
 {
-    nautilus_view_model_sort (self->model);
+    if (self->needs_resort)
+    {
+        self->needs_resort = FALSE;
+        nautilus_view_model_sort (self->model);
+    }
 
     /* Addition and removal of files modify the empty state */
     nautilus_files_view_update_status_overlay (self);
@@ -4146,6 +4276,7 @@ files_view_file_changed (NautilusFilesView *self,
     if (item != NULL)
     {
         nautilus_view_item_file_changed (item);
+        self->needs_resort = TRUE;
     }
     else
     {
@@ -4643,11 +4774,7 @@ nautilus_files_view_add_subdirectory (NautilusFilesView *self,
 
     nautilus_directory_ref (directory);
 
-    attributes =
-        NAUTILUS_FILE_ATTRIBUTE_DIRECTORY_ITEM_COUNT |
-        NAUTILUS_FILE_ATTRIBUTE_INFO |
-        NAUTILUS_FILE_ATTRIBUTE_MOUNT |
-        NAUTILUS_FILE_ATTRIBUTE_EXTENSION_INFO;
+    attributes = get_directory_monitor_attributes (self);
 
     nautilus_directory_file_monitor_add (directory,
                                          &self->directory,
@@ -8530,15 +8657,9 @@ finish_loading (NautilusFilesView *self)
     self->load_error_handler_id = g_signal_connect (self->directory, "load-error",
                                                     G_CALLBACK (load_error_callback), self);
 
-    /* Monitor a directory's item count because the "size"
-     * attribute is based on that, and the file's metadata
-     * and possible custom name.
-     */
-    attributes =
-        NAUTILUS_FILE_ATTRIBUTE_DIRECTORY_ITEM_COUNT |
-        NAUTILUS_FILE_ATTRIBUTE_INFO |
-        NAUTILUS_FILE_ATTRIBUTE_MOUNT |
-        NAUTILUS_FILE_ATTRIBUTE_EXTENSION_INFO;
+    /* Item counts, which the "size" attribute of folders is based on, and
+     * extension info are requested by the cells of visible items. */
+    attributes = get_directory_monitor_attributes (self);
 
     self->files_added_handler_id = g_signal_connect
                                        (self->directory, "files-added",
@@ -8656,6 +8777,7 @@ nautilus_files_view_stop_loading (NautilusFilesView *self)
     done_loading (self, FALSE);
 
     disconnect_directory_handlers (self);
+    stop_monitoring_item_counts (self);
 }
 
 static gboolean
@@ -138,6 +138,9 @@ typedef enum
 /* Date and time format in the view */
 #define NAUTILUS_PREFERENCES_DATE_TIME_FORMAT "date-time-format"
 
+/* Snapshots of large directory listings for faster reopening */
+#define NAUTILUS_PREFERENCES_DIRECTORY_LISTING_CACHE "directory-listing-cache"
+
 typedef enum
 {
         NAUTILUS_DATE_TIME_FORMAT_SIMPLE = 0,
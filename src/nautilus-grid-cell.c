@@ -16,7 +16,6 @@
 #include "nautilus-view-item.h"
 #include "nautilus-view-cell.h"
 #include "nautilus-animated-thumbnail.h"
-#include "nautilus-animated-paintable.h"
 
 struct _NautilusGridCell
 {
@@ -33,11 +32,6 @@ struct _NautilusGridCell
     GtkWidget *second_caption;
     GtkWidget *third_caption;
 
-    /* Animation support */
-    NautilusAnimatedPaintable *animated_paintable;
-    gboolean is_animated;
-    gboolean animation_playing;
-
     gboolean in_file_change;
 };
 
@@ -47,6 +41,8 @@ static gboolean
 should_play_animation (NautilusGridCell *self)
 {
     NautilusAnimationMode mode = nautilus_animated_thumbnail_get_mode ();
+    /* The grid view sets these on the cells of its items. */
+    GtkStateFlags state = gtk_widget_get_state_flags (GTK_WIDGET (self));
 
     switch (mode)
     {
@@ -57,15 +53,23 @@ should_play_animation (NautilusGridCell *self)
             return TRUE;
 
         case NAUTILUS_ANIMATION_MODE_ON_SELECT:
+            return (state & GTK_STATE_FLAG_SELECTED) != 0;
+
         case NAUTILUS_ANIMATION_MODE_ON_HOVER:
-            /* Will be handled by event handlers */
-            return FALSE;
+            return (state & GTK_STATE_FLAG_PRELIGHT) != 0;
 
         default:
             return FALSE;
     }
 }
 
+static void
+update_animation_playing (NautilusGridCell *self)
+{
+    nautilus_image_set_animation_playing (NAUTILUS_IMAGE (self->icon),
+                                          should_play_animation (self));
+}
+
 static void
 update_icon (NautilusGridCell *self)
 {
@@ -152,12 +156,35 @@ update_captions (NautilusGridCell *self)
     }
 }
 
+/* Shows @icon in the next emblem image after @previous, reusing the images
+ * of the previous item before creating new ones. */
+static GtkWidget *
+show_emblem (NautilusGridCell *self,
+             GtkWidget        *previous,
+             GIcon            *icon)
+{
+    GtkWidget *image = (previous != NULL)
+                       ? gtk_widget_get_next_sibling (previous)
+                       : gtk_widget_get_first_child (self->emblems_box);
+
+    if (image == NULL)
+    {
+        image = gtk_image_new ();
+        gtk_box_append (GTK_BOX (self->emblems_box), image);
+    }
+
+    gtk_image_set_from_gicon (GTK_IMAGE (image), icon);
+
+    return image;
+}
+
 static void
 update_emblems (NautilusGridCell *self)
 {
     g_autoptr (NautilusViewItem) item = NULL;
     NautilusFile *file;
     GtkWidget *child;
+    GtkWidget *last_emblem = NULL;
     GtkIconTheme *theme;
     g_autolist (GIcon) emblems = NULL;
     g_autofree gchar *file_uri = NULL;
@@ -167,16 +194,11 @@ update_emblems (NautilusGridCell *self)
     file = nautilus_view_item_get_file (item);
     file_uri = nautilus_file_get_uri (file);
 
-    /* Remove old emblems. */
-    while ((child = gtk_widget_get_first_child (self->emblems_box)) != NULL)
-    {
-        gtk_box_remove (GTK_BOX (self->emblems_box), child);
-    }
-
     if (nautilus_tag_manager_file_is_starred (nautilus_tag_manager_get (), file_uri))
     {
-        gtk_box_append (GTK_BOX (self->emblems_box),
-                        gtk_image_new_from_icon_name ("starred-symbolic"));
+        g_autoptr (GIcon) starred_icon = g_themed_icon_new ("starred-symbolic");
+
+        last_emblem = show_emblem (self, last_emblem, starred_icon);
     }
 
     theme = gtk_icon_theme_get_for_display (gdk_display_get_default ());
@@ -191,8 +213,15 @@ update_emblems (NautilusGridCell *self)
             continue;
         }
 
-        gtk_box_append (GTK_BOX (self->emblems_box),
-                        gtk_image_new_from_gicon (l->data));
+        last_emblem = show_emblem (self, last_emblem, l->data);
+    }
+
+    /* Remove the emblems the previous item had in excess. */
+    while ((child = (last_emblem != NULL)
+                    ? gtk_widget_get_next_sibling (last_emblem)
+                    : gtk_widget_get_first_child (self->emblems_box)) != NULL)
+    {
+        gtk_box_remove (GTK_BOX (self->emblems_box), child);
     }
 }
 
@@ -208,10 +237,32 @@ on_file_changed (NautilusGridCell *self)
     self->in_file_change = FALSE;
 }
 
+static void
+update_file_attributes (NautilusGridCell *self)
+{
+    /* Extension info is needed for emblems. */
+    NautilusFileAttributes attributes = NAUTILUS_FILE_ATTRIBUTE_EXTENSION_INFO;
+
+    for (guint i = 0; self->caption_attributes != NULL && i < NAUTILUS_GRID_CELL_N_CAPTIONS; i++)
+    {
+        if (self->caption_attributes[i] != 0)
+        {
+            attributes |= nautilus_file_get_attributes_for_string_attribute_q (self->caption_attributes[i]);
+        }
+    }
+
+    nautilus_view_cell_set_file_attributes (NAUTILUS_VIEW_CELL (self), attributes);
+}
+
 static void
 on_icon_size_changed (NautilusGridCell *self)
 {
-    g_autoptr (NautilusViewItem) item = nautilus_view_cell_get_item (NAUTILUS_VIEW_CELL (self));
+    g_autoptr (NautilusViewItem) item = NULL;
+
+    /* The view also notifies the icon size when captions change. */
+    update_file_attributes (self);
+
+    item = nautilus_view_cell_get_item (NAUTILUS_VIEW_CELL (self));
 
     if (item == NULL)
     {
@@ -299,13 +350,6 @@ nautilus_grid_cell_dispose (GObject *object)
         g_signal_group_set_target (self->item_signal_group, NULL);
     }
 
-    /* Stop and clean up animation */
-    if (self->animated_paintable != NULL)
-    {
-        nautilus_animated_paintable_stop (self->animated_paintable);
-        g_clear_object (&self->animated_paintable);
-    }
-
     gtk_widget_dispose_template (GTK_WIDGET (self), NAUTILUS_TYPE_GRID_CELL);
     g_clear_object (&self->item_signal_group);
 
@@ -541,6 +585,12 @@ nautilus_grid_cell_init (NautilusGridCell *self)
     g_signal_connect_object (nautilus_preferences, "changed::" NAUTILUS_PREFERENCES_DATE_TIME_FORMAT,
                              G_CALLBACK (update_captions), self,
                              G_CONNECT_SWAPPED);
+    g_signal_connect_object (nautilus_preferences, "changed::" NAUTILUS_PREFERENCES_ANIMATED_THUMBNAILS,
+                             G_CALLBACK (update_animation_playing), self,
+                             G_CONNECT_SWAPPED);
+    g_signal_connect (self, "state-flags-changed",
+                      G_CALLBACK (update_animation_playing), NULL);
+    update_animation_playing (self);
 
     /* Connect automatically to an item. */
     self->item_signal_group = g_signal_group_new (NAUTILUS_TYPE_VIEW_ITEM);
@@ -572,4 +622,5 @@ nautilus_grid_cell_set_caption_attributes (NautilusGridCell *self,
                                            GQuark           *attrs)
 {
     self->caption_attributes = attrs;
+    update_file_attributes (self);
 }
@@ -57,16 +57,12 @@ nautilus_grid_view_sort (gconstpointer a,
                          gpointer      user_data)
 {
     NautilusGridView *self = user_data;
-    NautilusFile *file_a;
-    NautilusFile *file_b;
 
-    file_a = nautilus_view_item_get_file ((NautilusViewItem *) a);
-    file_b = nautilus_view_item_get_file ((NautilusViewItem *) b);
-
-    return nautilus_file_compare_for_sort_by_attribute_q (file_a, file_b,
-                                                          self->sort_attribute,
-                                                          self->directories_first,
-                                                          self->reversed);
+    return nautilus_view_item_compare_for_sort ((NautilusViewItem *) a,
+                                                (NautilusViewItem *) b,
+                                                self->sort_attribute,
+                                                self->directories_first,
+                                                self->reversed);
 }
 
 static void
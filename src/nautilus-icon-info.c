@@ -158,10 +158,24 @@ typedef struct
     int size;
 } ThemedIconKey;
 
+typedef struct
+{
+    GIcon *icon;
+    NautilusIconInfo *icon_info;
+} ContentTypeIcon;
+
 static GHashTable *loadable_icon_cache = NULL;
 static GHashTable *themed_icon_cache = NULL;
 static guint reap_cache_timeout = 0;
 
+/* Most files of a folder share a few content types, and thus icons. Icons
+ * are remembered by content type here, without being reaped, to spare the
+ * icon theme lookups. Keys are ThemedIconKeys holding the content type. */
+static GHashTable *content_type_icon_cache = NULL;
+static GHashTable *content_type_icons_prewarming = NULL;
+/* Bumped whenever caches are cleared, to drop prewarmed icons from before */
+static guint cache_generation = 0;
+
 static guint64 time_now;
 
 static gboolean
@@ -246,6 +260,18 @@ nautilus_icon_info_clear_caches (void)
     {
         g_hash_table_remove_all (themed_icon_cache);
     }
+
+    if (content_type_icon_cache)
+    {
+        g_hash_table_remove_all (content_type_icon_cache);
+    }
+
+    if (content_type_icons_prewarming)
+    {
+        g_hash_table_remove_all (content_type_icons_prewarming);
+    }
+
+    cache_generation++;
 }
 
 static guint
@@ -323,14 +349,15 @@ themed_icon_key_free (ThemedIconKey *key)
 }
 
 static GtkIconPaintable *
-lookup_themed_icon (GtkIconTheme *theme,
-                    GIcon        *icon,
-                    int           size,
-                    float         scale)
+lookup_themed_icon (GtkIconTheme       *theme,
+                    GIcon              *icon,
+                    int                 size,
+                    float               scale,
+                    GtkIconLookupFlags  flags)
 {
     const gchar *generic_app_icon_name = "application-x-generic";
     g_autoptr (GtkIconPaintable) icon_paintable = gtk_icon_theme_lookup_by_gicon (theme, icon, size, scale,
-                                                                                  GTK_TEXT_DIR_NONE, 0);
+                                                                                  GTK_TEXT_DIR_NONE, flags);
     const gchar *icon_name = gtk_icon_paintable_get_icon_name (icon_paintable);
 
     if (G_IS_THEMED_ICON (icon) &&
@@ -345,7 +372,7 @@ lookup_themed_icon (GtkIconTheme *theme,
             gtk_icon_theme_has_icon (theme, names[0]))
         {
             return gtk_icon_theme_lookup_icon (theme, names[0], NULL, size, scale,
-                                               GTK_TEXT_DIR_NONE, 0);
+                                               GTK_TEXT_DIR_NONE, flags);
         }
     }
 
@@ -427,7 +454,7 @@ nautilus_icon_info_lookup (GIcon *icon,
         return nautilus_icon_info_new_for_paintable (NULL);
     }
 
-    icon_paintable = lookup_themed_icon (theme, icon, size, scale);
+    icon_paintable = lookup_themed_icon (theme, icon, size, scale, 0);
 
     if (G_IS_THEMED_ICON (icon))
     {
@@ -467,6 +494,288 @@ nautilus_icon_info_lookup (GIcon *icon,
     }
 }
 
+static void
+content_type_icon_free (ContentTypeIcon *content_type_icon)
+{
+    g_object_unref (content_type_icon->icon);
+    g_object_unref (content_type_icon->icon_info);
+    g_free (content_type_icon);
+}
+
+static void
+content_type_icon_cache_insert (const char       *content_type,
+                                int               size,
+                                int               scale,
+                                GIcon            *icon,
+                                NautilusIconInfo *icon_info)
+{
+    ContentTypeIcon *content_type_icon;
+
+    if (content_type_icon_cache == NULL)
+    {
+        content_type_icon_cache =
+            g_hash_table_new_full ((GHashFunc) themed_icon_key_hash,
+                                   (GEqualFunc) themed_icon_key_equal,
+                                   (GDestroyNotify) themed_icon_key_free,
+                                   (GDestroyNotify) content_type_icon_free);
+    }
+
+    content_type_icon = g_new0 (ContentTypeIcon, 1);
+    content_type_icon->icon = g_object_ref (icon);
+    content_type_icon->icon_info = g_object_ref (icon_info);
+
+    g_hash_table_insert (content_type_icon_cache,
+                         themed_icon_key_new (content_type, scale, size),
+                         content_type_icon);
+}
+
+static ContentTypeIcon *
+content_type_icon_cache_lookup (const char *content_type,
+                                int         size,
+                                int         scale)
+{
+    ThemedIconKey lookup_key;
+
+    if (content_type_icon_cache == NULL)
+    {
+        return NULL;
+    }
+
+    lookup_key.icon_name = (char *) content_type;
+    lookup_key.scale = scale;
+    lookup_key.size = size;
+
+    return g_hash_table_lookup (content_type_icon_cache, &lookup_key);
+}
+
+/**
+ * nautilus_icon_info_lookup_for_content_type:
+ * @content_type: (nullable): the content type of the file @icon is for
+ * @icon: the icon of the file
+ * @size: the size to look it up at
+ * @scale: the scale to look it up at
+ *
+ * Like nautilus_icon_info_lookup(), but remembers the icon of @content_type
+ * itself, so that files showing it only cost a hash table lookup. Files whose
+ * icon isn't the one of their content type, like special folders, go through
+ * nautilus_icon_info_lookup().
+ */
+NautilusIconInfo *
+nautilus_icon_info_lookup_for_content_type (const char *content_type,
+                                            GIcon      *icon,
+                                            int         size,
+                                            int         scale)
+{
+    ContentTypeIcon *content_type_icon;
+    NautilusIconInfo *icon_info;
+
+    if (content_type == NULL || !G_IS_THEMED_ICON (icon))
+    {
+        return nautilus_icon_info_lookup (icon, size, scale);
+    }
+
+    content_type_icon = content_type_icon_cache_lookup (content_type, size, scale);
+    if (content_type_icon != NULL)
+    {
+        if (g_icon_equal (content_type_icon->icon, icon))
+        {
+            return g_object_ref (content_type_icon->icon_info);
+        }
+
+        return nautilus_icon_info_lookup (icon, size, scale);
+    }
+
+    icon_info = nautilus_icon_info_lookup (icon, size, scale);
+
+    if (!nautilus_icon_info_is_fallback (icon_info))
+    {
+        g_autoptr (GIcon) generic_icon = g_content_type_get_icon (content_type);
+
+        /* The first file of a type may as well be one that stands out. */
+        if (g_icon_equal (generic_icon, icon))
+        {
+            content_type_icon_cache_insert (content_type, size, scale, icon, icon_info);
+        }
+    }
+
+    return icon_info;
+}
+
+gboolean
+nautilus_icon_info_has_content_type_icon (const char *content_type,
+                                          int         size,
+                                          int         scale)
+{
+    return content_type_icon_cache_lookup (content_type, size, scale) != NULL;
+}
+
+typedef struct
+{
+    GtkIconTheme *theme;
+    GStrv content_types;
+    int size;
+    int scale;
+    guint generation;
+} PrewarmData;
+
+typedef struct
+{
+    char *content_type;
+    GIcon *icon;
+    GtkIconPaintable *icon_paintable;
+} PrewarmedIcon;
+
+static void
+prewarm_data_free (PrewarmData *data)
+{
+    g_object_unref (data->theme);
+    g_strfreev (data->content_types);
+    g_free (data);
+}
+
+static void
+prewarmed_icon_free (PrewarmedIcon *prewarmed)
+{
+    g_free (prewarmed->content_type);
+    g_object_unref (prewarmed->icon);
+    g_clear_object (&prewarmed->icon_paintable);
+    g_free (prewarmed);
+}
+
+/* GtkIconTheme can be used from any thread. */
+static void
+prewarm_thread (GTask        *task,
+                gpointer      source_object,
+                gpointer      task_data,
+                GCancellable *cancellable)
+{
+    PrewarmData *data = task_data;
+    GPtrArray *prewarmed_icons = g_ptr_array_new_with_free_func ((GDestroyNotify) prewarmed_icon_free);
+
+    for (guint i = 0; data->content_types[i] != NULL; i++)
+    {
+        PrewarmedIcon *prewarmed = g_new0 (PrewarmedIcon, 1);
+
+        prewarmed->content_type = g_strdup (data->content_types[i]);
+        prewarmed->icon = g_content_type_get_icon (data->content_types[i]);
+
+        if (gtk_icon_theme_has_gicon (data->theme, prewarmed->icon))
+        {
+            /* Preloading gets the texture loaded too, ready for the first
+             * snapshot. */
+            prewarmed->icon_paintable = lookup_themed_icon (data->theme, prewarmed->icon,
+                                                            data->size, data->scale,
+                                                            GTK_ICON_LOOKUP_PRELOAD);
+        }
+
+        g_ptr_array_add (prewarmed_icons, prewarmed);
+    }
+
+    g_task_return_pointer (task, prewarmed_icons, (GDestroyNotify) g_ptr_array_unref);
+}
+
+static void
+prewarm_done_cb (GObject      *source_object,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+    PrewarmData *data = g_task_get_task_data (G_TASK (result));
+    g_autoptr (GPtrArray) prewarmed_icons = g_task_propagate_pointer (G_TASK (result), NULL);
+
+    if (data->generation != cache_generation)
+    {
+        /* The icon theme changed meanwhile */
+        return;
+    }
+
+    for (guint i = 0; i < prewarmed_icons->len; i++)
+    {
+        PrewarmedIcon *prewarmed = prewarmed_icons->pdata[i];
+        ThemedIconKey lookup_key;
+
+        lookup_key.icon_name = prewarmed->content_type;
+        lookup_key.scale = data->scale;
+        lookup_key.size = data->size;
+        g_hash_table_remove (content_type_icons_prewarming, &lookup_key);
+
+        if (prewarmed->icon_paintable != NULL &&
+            content_type_icon_cache_lookup (prewarmed->content_type, data->size, data->scale) == NULL)
+        {
+            g_autoptr (NautilusIconInfo) icon_info = NULL;
+
+            icon_info = nautilus_icon_info_new_for_icon_paintable (prewarmed->icon_paintable);
+            content_type_icon_cache_insert (prewarmed->content_type, data->size, data->scale,
+                                            prewarmed->icon, icon_info);
+        }
+    }
+}
+
+/**
+ * nautilus_icon_info_prewarm_content_types:
+ * @content_types: the content types of files about to be shown
+ * @size: the size they are going to be shown at
+ * @scale: the scale they are going to be shown at
+ *
+ * Looks up the icons of @content_types that aren't known yet in a thread,
+ * for nautilus_icon_info_lookup_for_content_type() to find them.
+ */
+void
+nautilus_icon_info_prewarm_content_types (const char * const *content_types,
+                                          int                 size,
+                                          int                 scale)
+{
+    g_autoptr (GTask) task = NULL;
+    g_autoptr (GStrvBuilder) builder = g_strv_builder_new ();
+    g_auto (GStrv) missing_content_types = NULL;
+    PrewarmData *data;
+
+    if (content_type_icons_prewarming == NULL)
+    {
+        content_type_icons_prewarming =
+            g_hash_table_new_full ((GHashFunc) themed_icon_key_hash,
+                                   (GEqualFunc) themed_icon_key_equal,
+                                   (GDestroyNotify) themed_icon_key_free,
+                                   NULL);
+    }
+
+    for (guint i = 0; content_types[i] != NULL; i++)
+    {
+        ThemedIconKey lookup_key;
+
+        lookup_key.icon_name = (char *) content_types[i];
+        lookup_key.scale = scale;
+        lookup_key.size = size;
+
+        if (content_type_icon_cache_lookup (content_types[i], size, scale) != NULL ||
+            g_hash_table_contains (content_type_icons_prewarming, &lookup_key))
+        {
+            continue;
+        }
+
+        g_hash_table_add (content_type_icons_prewarming,
+                          themed_icon_key_new (content_types[i], scale, size));
+        g_strv_builder_add (builder, content_types[i]);
+    }
+
+    missing_content_types = g_strv_builder_end (builder);
+    if (missing_content_types[0] == NULL)
+    {
+        return;
+    }
+
+    data = g_new0 (PrewarmData, 1);
+    data->content_types = g_steal_pointer (&missing_content_types);
+    data->theme = g_object_ref (gtk_icon_theme_get_for_display (gdk_display_get_default ()));
+    data->size = size;
+    data->scale = scale;
+    data->generation = cache_generation;
+
+    task = g_task_new (NULL, NULL, prewarm_done_cb, NULL);
+    g_task_set_source_tag (task, nautilus_icon_info_prewarm_content_types);
+    g_task_set_task_data (task, data, (GDestroyNotify) prewarm_data_free);
+    g_task_run_in_thread (task, prewarm_thread);
+}
+
 static GdkPaintable *
 nautilus_icon_info_get_paintable_nodefault (NautilusIconInfo *icon)
 {
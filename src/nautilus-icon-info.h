@@ -19,6 +19,13 @@ nautilus_icon_info_new_for_paintable (GdkPaintable      *paintable);
 NautilusIconInfo *    nautilus_icon_info_lookup                       (GIcon             *icon,
 								       int                size,
 								       int                scale);
+NautilusIconInfo *    nautilus_icon_info_lookup_for_content_type      (const char        *content_type,
+								       GIcon             *icon,
+								       int                size,
+								       int                scale);
+void                  nautilus_icon_info_prewarm_content_types        (const char * const *content_types,
+								       int                 size,
+								       int                 scale);
 gboolean              nautilus_icon_info_is_fallback                  (NautilusIconInfo  *icon);
 GdkPaintable *        nautilus_icon_info_get_paintable                (NautilusIconInfo  *icon);
 GdkTexture *          nautilus_icon_info_get_texture                  (NautilusIconInfo  *icon);
@@ -26,4 +33,9 @@ const char *          nautilus_icon_info_get_used_name                (NautilusI
 
 void                  nautilus_icon_info_clear_caches                 (void);
 
+/* testing-only */
+gboolean              nautilus_icon_info_has_content_type_icon        (const char        *content_type,
+								       int                size,
+								       int                scale);
+
 G_END_DECLS
@@ -10,6 +10,8 @@
 
 #include "nautilus-image.h"
 
+#include "nautilus-animated-paintable.h"
+#include "nautilus-animated-thumbnail.h"
 #include "nautilus-file.h"
 #include "nautilus-global-preferences.h"
 #include "nautilus-hash-queue.h"
@@ -29,9 +31,16 @@ struct _NautilusImage
     gint size;
     GFile *source;
     GdkTexture *texture;
+    /* The framed texture at the current size, reused across snapshots */
+    GskRenderNode *texture_node;
+    /* The pixel size thumbnails are being loaded at */
+    gint tier_size;
     guint64 source_mtime;
     gchar *source_content_type;
     GdkPaintable *fallback_paintable;
+    /* Shown instead of the texture while playing, if the source is animated */
+    NautilusAnimatedPaintable *animation;
+    gboolean animation_playing;
 
     gboolean is_loading_attributes;
     GCancellable *cancellable;
@@ -50,15 +59,17 @@ static GParamSpec *properties[N_PROPS];
 
 G_DEFINE_FINAL_TYPE (NautilusImage, nautilus_image, GTK_TYPE_WIDGET);
 
-#define CACHE_COUNT_LIMIT 1000
+/* Decoded textures are budgeted by their pixel data, which at the largest
+ * zoom levels is a megabyte per thumbnail. */
+#define TEXTURE_CACHE_BYTES_LIMIT (256 * 1024 * 1024)
+/* Encoded thumbnail files are an order of magnitude smaller, and spare disk
+ * reads when the zoom level changes. */
+#define COMPRESSED_CACHE_BYTES_LIMIT (64 * 1024 * 1024)
 
 static void
 nautilus_image_set_texture (NautilusImage *self,
                             GdkTexture    *texture);
 
-/* Global cache for all images. Maps GFile => GdkTexture */
-static NautilusHashQueue *thumbnail_cache;
-
 static guint64 cached_thumbnail_size_limit;
 
 static void
@@ -75,7 +86,9 @@ typedef struct
 {
     GFile *file;
     GdkTexture *texture;
+    gsize n_bytes;
     guint64 mtime;
+    gchar *content_type;
 } ThumbnailCacheItem;
 
 static void
@@ -83,61 +96,267 @@ thumbnail_cache_item_free (ThumbnailCacheItem *item)
 {
     g_clear_object (&item->file);
     g_clear_object (&item->texture);
+    g_free (item->content_type);
     g_free (item);
 }
 
-static ThumbnailCacheItem *
-thumbnail_cache_get (GFile *file)
+typedef struct
+{
+    GFile *file;
+    GBytes *bytes;
+    guint64 mtime;
+} CompressedCacheItem;
+
+static void
+compressed_cache_item_free (CompressedCacheItem *item)
 {
-    if (thumbnail_cache == NULL)
+    g_clear_object (&item->file);
+    g_clear_pointer (&item->bytes, g_bytes_unref);
+    g_free (item);
+}
+
+/* Textures decoded for one pixel size, oldest first. */
+typedef struct
+{
+    int size;
+    NautilusHashQueue *items;
+    gsize n_bytes;
+    guint64 last_used;
+} CacheTier;
+
+/* Global cache for all images. Zoom levels each have their own tier of
+ * textures, and the tiers that were used least recently are evicted first
+ * when the budget is exceeded. Maps GFile => ThumbnailCacheItem in tiers,
+ * and GFile => CompressedCacheItem in the compressed queue. */
+static struct
+{
+    GPtrArray *tiers;
+    gsize texture_bytes;
+    NautilusHashQueue *compressed;
+    gsize compressed_bytes;
+    guint64 clock;
+    NautilusImageCacheStats stats;
+} thumbnail_cache;
+
+static gsize
+get_texture_n_bytes (GdkTexture *texture)
+{
+    return (gsize) gdk_texture_get_width (texture) * gdk_texture_get_height (texture) * 4;
+}
+
+static CacheTier *
+get_cache_tier (int size)
+{
+    if (G_UNLIKELY (thumbnail_cache.tiers == NULL))
     {
-        return NULL;
+        thumbnail_cache.tiers = g_ptr_array_new ();
     }
 
-    ThumbnailCacheItem *item = nautilus_hash_queue_find_item (thumbnail_cache, file);
+    for (guint i = 0; i < thumbnail_cache.tiers->len; i++)
+    {
+        CacheTier *tier = g_ptr_array_index (thumbnail_cache.tiers, i);
 
-    if (item != NULL)
+        if (tier->size == size)
+        {
+            return tier;
+        }
+    }
+
+    CacheTier *tier = g_new0 (CacheTier, 1);
+    tier->size = size;
+    tier->items = nautilus_hash_queue_new (g_file_hash, (GEqualFunc) g_file_equal,
+                                           NULL, (GDestroyNotify) thumbnail_cache_item_free);
+    g_ptr_array_add (thumbnail_cache.tiers, tier);
+
+    return tier;
+}
+
+static void
+cache_tier_remove (CacheTier          *tier,
+                   ThumbnailCacheItem *item)
+{
+    tier->n_bytes -= item->n_bytes;
+    thumbnail_cache.texture_bytes -= item->n_bytes;
+    nautilus_hash_queue_remove (tier->items, item->file);
+}
+
+static void
+thumbnail_cache_evict (void)
+{
+    while (thumbnail_cache.texture_bytes > TEXTURE_CACHE_BYTES_LIMIT)
     {
-        nautilus_hash_queue_move_existing_to_tail (thumbnail_cache, item->file);
+        CacheTier *victim = NULL;
+
+        for (guint i = 0; i < thumbnail_cache.tiers->len; i++)
+        {
+            CacheTier *tier = g_ptr_array_index (thumbnail_cache.tiers, i);
+
+            if (!nautilus_hash_queue_is_empty (tier->items) &&
+                (victim == NULL || tier->last_used < victim->last_used))
+            {
+                victim = tier;
+            }
+        }
+
+        if (victim == NULL)
+        {
+            break;
+        }
+
+        cache_tier_remove (victim, nautilus_hash_queue_peek_head (victim->items));
+        thumbnail_cache.stats.evictions++;
     }
+}
 
-    return item;
+/* Looks for a texture of @file at least @size pixels large, preferring the
+ * smallest such. With @allow_smaller, a smaller texture is returned instead
+ * of nothing, to show until a sharper one is loaded. */
+static ThumbnailCacheItem *
+thumbnail_cache_lookup (GFile    *file,
+                        int       size,
+                        gboolean  allow_smaller)
+{
+    ThumbnailCacheItem *best_item = NULL;
+    CacheTier *best_tier = NULL;
+
+    for (guint i = 0; thumbnail_cache.tiers != NULL && i < thumbnail_cache.tiers->len; i++)
+    {
+        CacheTier *tier = g_ptr_array_index (thumbnail_cache.tiers, i);
+        ThumbnailCacheItem *item = nautilus_hash_queue_find_item (tier->items, file);
+        gboolean better;
+
+        if (item == NULL)
+        {
+            continue;
+        }
+
+        if (tier->size >= size)
+        {
+            better = (best_tier == NULL || best_tier->size < size || tier->size < best_tier->size);
+        }
+        else
+        {
+            better = allow_smaller &&
+                     (best_tier == NULL || (best_tier->size < size && tier->size > best_tier->size));
+        }
+
+        if (better)
+        {
+            best_item = item;
+            best_tier = tier;
+        }
+    }
+
+    if (best_item != NULL)
+    {
+        nautilus_hash_queue_move_existing_to_tail (best_tier->items, best_item->file);
+        best_tier->last_used = ++thumbnail_cache.clock;
+    }
+
+    return best_item;
 }
 
 static void
 thumbnail_cache_add (GFile      *file,
+                     int         size,
                      GdkTexture *texture,
-                     guint64     mtime)
+                     guint64     mtime,
+                     const char *content_type)
 {
-    if (G_UNLIKELY (thumbnail_cache == NULL))
+    CacheTier *tier = get_cache_tier (size);
+    ThumbnailCacheItem *old_item = nautilus_hash_queue_find_item (tier->items, file);
+
+    if (old_item != NULL)
     {
-        thumbnail_cache = nautilus_hash_queue_new (g_file_hash, (GEqualFunc) g_file_equal,
-                                                   NULL, (GDestroyNotify) thumbnail_cache_item_free);
+        cache_tier_remove (tier, old_item);
     }
 
-    ThumbnailCacheItem *old_item = nautilus_hash_queue_find_item (thumbnail_cache, file);
+    ThumbnailCacheItem *new_item = g_new0 (ThumbnailCacheItem, 1);
+    new_item->file = g_object_ref (file);
+    new_item->texture = g_object_ref (texture);
+    new_item->n_bytes = get_texture_n_bytes (texture);
+    new_item->mtime = mtime;
+    new_item->content_type = g_strdup (content_type);
 
-    if (old_item != NULL)
+    nautilus_hash_queue_enqueue (tier->items, new_item->file, new_item);
+    tier->n_bytes += new_item->n_bytes;
+    tier->last_used = ++thumbnail_cache.clock;
+    thumbnail_cache.texture_bytes += new_item->n_bytes;
+
+    thumbnail_cache_evict ();
+}
+
+static CompressedCacheItem *
+compressed_cache_get (GFile *file)
+{
+    if (thumbnail_cache.compressed == NULL)
     {
-        g_set_object (&old_item->texture, texture);
-        old_item->mtime = mtime;
-        nautilus_hash_queue_move_existing_to_tail (thumbnail_cache, file);
+        return NULL;
+    }
 
-        return;
+    CompressedCacheItem *item = nautilus_hash_queue_find_item (thumbnail_cache.compressed, file);
+
+    if (item != NULL)
+    {
+        nautilus_hash_queue_move_existing_to_tail (thumbnail_cache.compressed, item->file);
     }
-    else if (nautilus_hash_queue_get_length (thumbnail_cache) >= CACHE_COUNT_LIMIT)
+
+    return item;
+}
+
+static void
+compressed_cache_remove (CompressedCacheItem *item)
+{
+    thumbnail_cache.compressed_bytes -= g_bytes_get_size (item->bytes);
+    nautilus_hash_queue_remove (thumbnail_cache.compressed, item->file);
+}
+
+static void
+compressed_cache_add (GFile   *file,
+                      GBytes  *bytes,
+                      guint64  mtime)
+{
+    if (G_UNLIKELY (thumbnail_cache.compressed == NULL))
     {
-        ThumbnailCacheItem *item = nautilus_hash_queue_peek_head (thumbnail_cache);
+        thumbnail_cache.compressed = nautilus_hash_queue_new (g_file_hash, (GEqualFunc) g_file_equal,
+                                                              NULL, (GDestroyNotify) compressed_cache_item_free);
+    }
+
+    CompressedCacheItem *old_item = nautilus_hash_queue_find_item (thumbnail_cache.compressed, file);
 
-        nautilus_hash_queue_remove (thumbnail_cache, item->file);
+    if (old_item != NULL)
+    {
+        compressed_cache_remove (old_item);
     }
 
-    ThumbnailCacheItem *new_item = g_new0 (ThumbnailCacheItem, 1);
+    CompressedCacheItem *new_item = g_new0 (CompressedCacheItem, 1);
     new_item->file = g_object_ref (file);
-    new_item->texture = g_object_ref (texture);
+    new_item->bytes = g_bytes_ref (bytes);
     new_item->mtime = mtime;
 
-    nautilus_hash_queue_enqueue (thumbnail_cache, file, new_item);
+    nautilus_hash_queue_enqueue (thumbnail_cache.compressed, new_item->file, new_item);
+    thumbnail_cache.compressed_bytes += g_bytes_get_size (bytes);
+
+    while (thumbnail_cache.compressed_bytes > COMPRESSED_CACHE_BYTES_LIMIT)
+    {
+        compressed_cache_remove (nautilus_hash_queue_peek_head (thumbnail_cache.compressed));
+        thumbnail_cache.stats.compressed_evictions++;
+    }
+}
+
+/**
+ * nautilus_image_get_cache_stats:
+ * @stats: (out caller-allocates): the counters of the thumbnail cache
+ *
+ * Reports how well the thumbnail cache shared by all images performs, for
+ * tuning its budgets.
+ */
+void
+nautilus_image_get_cache_stats (NautilusImageCacheStats *stats)
+{
+    *stats = thumbnail_cache.stats;
+    stats->texture_bytes = thumbnail_cache.texture_bytes;
+    stats->compressed_bytes = thumbnail_cache.compressed_bytes;
 }
 
 static GHashTable *
@@ -232,6 +451,16 @@ get_error_paintable (NautilusImage *self)
     return error_paintable[index];
 }
 
+/* The pixel size that thumbnails are decoded and cached at for this image. */
+static int
+get_tier_size (NautilusImage *self)
+{
+    int max_size = nautilus_thumbnail_get_max_size ();
+    int size = self->size * gtk_widget_get_scale_factor (GTK_WIDGET (self));
+
+    return (size > 0) ? MIN (size, max_size) : max_size;
+}
+
 static void
 setup_texture_for_image (NautilusImage *self,
                          GdkPixbuf     *pixbuf)
@@ -240,7 +469,8 @@ setup_texture_for_image (NautilusImage *self,
     g_autoptr (GdkTexture) texture = gdk_texture_new_for_pixbuf (rotated_pixbuf);
 
     nautilus_image_set_texture (self, texture);
-    thumbnail_cache_add (self->source, self->texture, self->source_mtime);
+    thumbnail_cache_add (self->source, self->tier_size, self->texture,
+                         self->source_mtime, self->source_content_type);
 }
 
 static void
@@ -251,6 +481,31 @@ handle_loading_error (NautilusImage *self)
     gtk_widget_queue_draw (GTK_WIDGET (self));
 }
 
+static void
+scale_down_when_large (GdkPixbuf **pixbuf,
+                       gint        max_size)
+{
+    gint width = gdk_pixbuf_get_width (*pixbuf), height = gdk_pixbuf_get_height (*pixbuf);
+    gint biggest_dimension = MAX (width, height);
+
+    if (biggest_dimension <= max_size)
+    {
+        return;
+    }
+
+    gboolean wide = width > height;
+    double scale = (double) max_size / (double) biggest_dimension;
+    gint new_width = wide ? max_size : MAX (width * scale, 1);
+    gint new_height = wide ? MAX (height * scale, 1) : max_size;
+
+    GdkPixbuf *new_pixbuf = gdk_pixbuf_scale_simple (*pixbuf,
+                                                     new_width,
+                                                     new_height,
+                                                     GDK_INTERP_BILINEAR);
+    g_clear_object (pixbuf);
+    *pixbuf = new_pixbuf;
+}
+
 static void
 thumbnailing_done_cb (GObject      *source_object,
                       GAsyncResult *res,
@@ -270,6 +525,7 @@ thumbnailing_done_cb (GObject      *source_object,
 
     if (pixbuf != NULL && self->error == NULL)
     {
+        scale_down_when_large (&pixbuf, self->tier_size);
         setup_texture_for_image (self, pixbuf);
     }
     else
@@ -278,47 +534,35 @@ thumbnailing_done_cb (GObject      *source_object,
     }
 }
 
-static void
-scale_down_when_large (GdkPixbuf **pixbuf)
+typedef struct
 {
-    gint width = gdk_pixbuf_get_width (*pixbuf), height = gdk_pixbuf_get_height (*pixbuf);
-    gint biggest_dimension = MAX (width, height);
-    gint max_size = nautilus_thumbnail_get_max_size ();
-
-    if (biggest_dimension <= max_size)
-    {
-        return;
-    }
-
-    gboolean wide = width > height;
-    double scale = (double) max_size / (double) biggest_dimension;
-    gint new_width = wide ? max_size : width * scale;
-    gint new_height = wide ? height * scale : max_size;
+    GBytes *bytes;
+    gint size;
+} DecodeData;
 
-    GdkPixbuf *new_pixbuf = gdk_pixbuf_scale_simple (*pixbuf,
-                                                     new_width,
-                                                     new_height,
-                                                     GDK_INTERP_BILINEAR);
-    g_clear_object (pixbuf);
-    *pixbuf = new_pixbuf;
+static void
+decode_data_free (DecodeData *data)
+{
+    g_bytes_unref (data->bytes);
+    g_free (data);
 }
 
 /* Currently, GDK Pixbuf will decode the image on the main thread, even when
  * using the async variant of the function. Until that is fixed, use a GTask to
  * perform the decoding in a different thread. */
 static void
-thumbnail_from_stream_thread (GTask        *task,
-                              gpointer      source_object,
-                              gpointer      task_data,
-                              GCancellable *cancellable)
+thumbnail_from_bytes_thread (GTask        *task,
+                             gpointer      source_object,
+                             gpointer      task_data,
+                             GCancellable *cancellable)
 {
-    GInputStream *self = source_object;
+    DecodeData *data = task_data;
+    g_autoptr (GInputStream) stream = g_memory_input_stream_new_from_bytes (data->bytes);
     GError *error = NULL;
-    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_stream (self, cancellable, &error);
+    GdkPixbuf *pixbuf = nautilus_thumbnail_decode_stream (stream, data->size, cancellable, &error);
 
     if (pixbuf != NULL)
     {
-        scale_down_when_large (&pixbuf);
         g_task_return_pointer (task, pixbuf, g_object_unref);
     }
     else
@@ -328,19 +572,24 @@ thumbnail_from_stream_thread (GTask        *task,
 }
 
 static void
-thumbnail_from_stream_async (GInputStream        *stream,
-                             GCancellable        *cancellable,
-                             GAsyncReadyCallback  callback,
-                             gpointer             user_data)
+thumbnail_from_bytes_async (GBytes              *bytes,
+                            gint                 size,
+                            GCancellable        *cancellable,
+                            GAsyncReadyCallback  callback,
+                            gpointer             user_data)
 {
-    g_autoptr (GTask) task = g_task_new (stream, cancellable, callback, user_data);
+    g_autoptr (GTask) task = g_task_new (NULL, cancellable, callback, user_data);
+    DecodeData *data = g_new0 (DecodeData, 1);
 
-    g_task_run_in_thread (task, thumbnail_from_stream_thread);
+    data->bytes = g_bytes_ref (bytes);
+    data->size = size;
+    g_task_set_task_data (task, data, (GDestroyNotify) decode_data_free);
+    g_task_run_in_thread (task, thumbnail_from_bytes_thread);
 }
 
 static GdkPixbuf *
-thumbnail_from_stream_finish (GAsyncResult  *result,
-                              GError       **error)
+thumbnail_from_bytes_finish (GAsyncResult  *result,
+                             GError       **error)
 {
     return g_task_propagate_pointer (G_TASK (result), error);
 }
@@ -352,7 +601,7 @@ thumbnail_pixbuf_ready_callback (GObject      *source_object,
 {
     g_autoptr (GError) error = NULL;
     NautilusImage *self = user_data;
-    g_autoptr (GdkPixbuf) pixbuf = thumbnail_from_stream_finish (res, &error);
+    g_autoptr (GdkPixbuf) pixbuf = thumbnail_from_bytes_finish (res, &error);
 
     if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
     {
@@ -373,13 +622,13 @@ thumbnail_pixbuf_ready_callback (GObject      *source_object,
 }
 
 static void
-thumbnail_file_read_callback (GObject      *source_object,
-                              GAsyncResult *res,
-                              gpointer      user_data)
+thumbnail_file_loaded_callback (GObject      *source_object,
+                                GAsyncResult *res,
+                                gpointer      user_data)
 {
     NautilusImage *self = user_data;
     g_autoptr (GError) error = NULL;
-    g_autoptr (GFileInputStream) stream = g_file_read_finish (G_FILE (source_object), res, &error);
+    g_autoptr (GBytes) bytes = g_file_load_bytes_finish (G_FILE (source_object), res, NULL, &error);
 
     if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
     {
@@ -389,12 +638,16 @@ thumbnail_file_read_callback (GObject      *source_object,
 
     self->error = g_steal_pointer (&error);
 
-    if (stream != NULL && self->error == NULL)
+    if (bytes != NULL && self->error == NULL)
     {
-        thumbnail_from_stream_async (G_INPUT_STREAM (stream),
-                                     self->cancellable,
-                                     thumbnail_pixbuf_ready_callback,
-                                     self);
+        /* Keep the encoded file around, so that other zoom levels decode it
+         * from memory. */
+        compressed_cache_add (self->source, bytes, self->source_mtime);
+        thumbnail_from_bytes_async (bytes,
+                                    self->tier_size,
+                                    self->cancellable,
+                                    thumbnail_pixbuf_ready_callback,
+                                    self);
     }
     else
     {
@@ -402,6 +655,163 @@ thumbnail_file_read_callback (GObject      *source_object,
     }
 }
 
+static void
+clear_animation (NautilusImage *self)
+{
+    if (self->animation == NULL)
+    {
+        return;
+    }
+
+    g_signal_handlers_disconnect_by_func (self->animation, gtk_widget_queue_draw, self);
+    nautilus_animated_paintable_set_widget (self->animation, NULL);
+    g_clear_object (&self->animation);
+    gtk_widget_queue_draw (GTK_WIDGET (self));
+}
+
+static void
+set_animation (NautilusImage             *self,
+               NautilusAnimatedPaintable *animation)
+{
+    clear_animation (self);
+
+    if (nautilus_animated_paintable_get_n_frames (animation) < 2)
+    {
+        /* Out of frame memory, the thumbnail shows the same. */
+        return;
+    }
+
+    self->animation = g_object_ref (animation);
+    g_signal_connect_swapped (animation, "invalidate-contents",
+                              G_CALLBACK (gtk_widget_queue_draw), self);
+    nautilus_animated_paintable_set_widget (animation, GTK_WIDGET (self));
+
+    if (self->animation_playing)
+    {
+        nautilus_animated_paintable_start (animation);
+        gtk_widget_queue_draw (GTK_WIDGET (self));
+    }
+}
+
+/* Decodes every frame in a thread, at the size of the thumbnail, so that
+ * playing only swaps textures. */
+static void
+animation_load_thread (GTask        *task,
+                       gpointer      source_object,
+                       gpointer      task_data,
+                       GCancellable *cancellable)
+{
+    int size = GPOINTER_TO_INT (task_data);
+    g_autoptr (GFileInputStream) stream = NULL;
+    g_autoptr (GdkPixbufAnimation) animation = NULL;
+    GError *error = NULL;
+    guint n_frames;
+
+    stream = g_file_read (source_object, cancellable, &error);
+    if (stream == NULL)
+    {
+        g_task_return_error (task, error);
+        return;
+    }
+
+    n_frames = nautilus_animated_thumbnail_count_frames (G_INPUT_STREAM (stream), cancellable, &error);
+    if (error != NULL ||
+        !g_seekable_seek (G_SEEKABLE (stream), 0, G_SEEK_SET, cancellable, &error))
+    {
+        g_task_return_error (task, error);
+        return;
+    }
+
+    animation = gdk_pixbuf_animation_new_from_stream (G_INPUT_STREAM (stream), cancellable, &error);
+    if (animation == NULL)
+    {
+        g_task_return_error (task, error);
+        return;
+    }
+
+    g_task_return_pointer (task,
+                           nautilus_animated_paintable_new (animation, n_frames, size),
+                           g_object_unref);
+}
+
+static void
+animation_loaded_callback (GObject      *source_object,
+                           GAsyncResult *res,
+                           gpointer      user_data)
+{
+    NautilusImage *self = user_data;
+    g_autoptr (GError) error = NULL;
+    g_autoptr (NautilusAnimatedPaintable) animation = g_task_propagate_pointer (G_TASK (res), &error);
+    g_autofree gchar *uri = NULL;
+
+    if (animation == NULL)
+    {
+        /* The thumbnail stays, still. */
+        if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+            g_debug ("Failed to load animation: %s", error->message);
+        }
+
+        return;
+    }
+
+    uri = g_file_get_uri (G_FILE (source_object));
+    nautilus_animated_thumbnail_cache_add (uri, animation);
+    set_animation (self, animation);
+}
+
+static void
+animation_probed_callback (GObject      *source_object,
+                           GAsyncResult *res,
+                           gpointer      user_data)
+{
+    NautilusImage *self = user_data;
+    GFile *source = G_FILE (source_object);
+    g_autoptr (NautilusAnimatedPaintable) animation = NULL;
+    g_autoptr (GTask) task = NULL;
+    g_autofree gchar *uri = NULL;
+
+    /* Also when cancelled, or when the file could not be read. */
+    if (!nautilus_animated_thumbnail_probe_finish (source, res, NULL))
+    {
+        return;
+    }
+
+    uri = g_file_get_uri (source);
+    animation = nautilus_animated_thumbnail_cache_get (uri, self->tier_size);
+    if (animation != NULL)
+    {
+        set_animation (self, animation);
+        return;
+    }
+
+    task = g_task_new (source, self->cancellable, animation_loaded_callback, self);
+    g_task_set_task_data (task, GINT_TO_POINTER (self->tier_size), NULL);
+    g_task_run_in_thread (task, animation_load_thread);
+}
+
+/* Only images that turn out animated from their headers are loaded as
+ * animations, which spares decoding the frames of every PNG. */
+static void
+probe_animation (NautilusImage *self,
+                 GFileInfo     *info)
+{
+    if (!nautilus_animated_thumbnail_is_supported (self->source_content_type) ||
+        !g_file_is_native (self->source) ||
+        (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_STANDARD_SIZE) &&
+         g_file_info_get_size (info) > (goffset) cached_thumbnail_size_limit) ||
+        nautilus_animated_thumbnail_get_mode () == NAUTILUS_ANIMATION_MODE_NEVER)
+    {
+        return;
+    }
+
+    nautilus_animated_thumbnail_probe_async (self->source,
+                                             self->source_mtime,
+                                             self->cancellable,
+                                             animation_probed_callback,
+                                             self);
+}
+
 static void
 file_info_ready_callback (GObject      *source_object,
                           GAsyncResult *res,
@@ -427,20 +837,46 @@ file_info_ready_callback (GObject      *source_object,
         return;
     }
 
-    ThumbnailCacheItem *cache_item = thumbnail_cache_get (self->source);
+    ThumbnailCacheItem *cache_item = thumbnail_cache_lookup (self->source, self->tier_size, FALSE);
 
     self->source_mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
-    self->source_content_type = g_strdup (g_file_info_get_content_type (info));
+    if (g_set_str (&self->source_content_type, g_file_info_get_content_type (info)))
+    {
+        /* Video framing depends on the type. */
+        g_clear_pointer (&self->texture_node, gsk_render_node_unref);
+        gtk_widget_queue_draw (GTK_WIDGET (self));
+    }
+
+    probe_animation (self, info);
 
     /* Look in nautilus's thumbnail cache */
     if (cache_item != NULL &&
         cache_item->mtime == self->source_mtime)
     {
+        thumbnail_cache.stats.hits++;
         nautilus_image_set_texture (self, cache_item->texture);
 
         return;
     }
 
+    /* Decode again from memory when only another zoom level was cached */
+    CompressedCacheItem *compressed_item = compressed_cache_get (self->source);
+
+    if (compressed_item != NULL &&
+        compressed_item->mtime == self->source_mtime)
+    {
+        thumbnail_cache.stats.compressed_hits++;
+        thumbnail_from_bytes_async (compressed_item->bytes,
+                                    self->tier_size,
+                                    self->cancellable,
+                                    thumbnail_pixbuf_ready_callback,
+                                    self);
+
+        return;
+    }
+
+    thumbnail_cache.stats.misses++;
+
     /* Look in the user's thumbnail cache */
     if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_THUMBNAIL_IS_VALID) &&
         g_file_info_get_attribute_boolean (info, G_FILE_ATTRIBUTE_THUMBNAIL_IS_VALID))
@@ -451,11 +887,10 @@ file_info_ready_callback (GObject      *source_object,
         {
             g_autoptr (GFile) thumb_file = g_file_new_for_path (thumb_path);
 
-            g_file_read_async (thumb_file,
-                               G_PRIORITY_DEFAULT,
-                               self->cancellable,
-                               thumbnail_file_read_callback,
-                               self);
+            g_file_load_bytes_async (thumb_file,
+                                     self->cancellable,
+                                     thumbnail_file_loaded_callback,
+                                     self);
 
             return;
         }
@@ -510,6 +945,9 @@ file_info_ready_callback (GObject      *source_object,
     nautilus_create_thumbnail_async (uri,
                                      self->source_content_type,
                                      self->source_mtime,
+                                     g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_STANDARD_SIZE) ?
+                                     g_file_info_get_size (info) : -1,
+                                     NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE,
                                      self->cancellable,
                                      thumbnailing_done_cb,
                                      self);
@@ -530,6 +968,8 @@ nautilus_image_set_texture (NautilusImage *self,
 
     if (g_set_object (&self->texture, texture))
     {
+        g_clear_pointer (&self->texture_node, gsk_render_node_unref);
+
         if (resize)
         {
             gtk_widget_queue_resize (GTK_WIDGET (self));
@@ -560,6 +1000,40 @@ nautilus_image_set_fallback (NautilusImage *self,
     }
 }
 
+static void
+load_source (NautilusImage *self)
+{
+    g_clear_error (&self->error);
+    clear_animation (self);
+
+    self->is_loading_attributes = FALSE;
+    g_cancellable_cancel (self->cancellable);
+    g_clear_object (&self->cancellable);
+
+    self->tier_size = get_tier_size (self);
+
+    if (self->source != NULL)
+    {
+        self->cancellable = g_cancellable_new ();
+        self->is_loading_attributes = TRUE;
+
+        /* First query the file info to check size and type */
+        g_file_query_info_async (self->source,
+                                 G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                                 G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE ","
+                                 G_FILE_ATTRIBUTE_ACCESS_CAN_READ ","
+                                 G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+                                 G_FILE_ATTRIBUTE_THUMBNAIL_IS_VALID ","
+                                 G_FILE_ATTRIBUTE_THUMBNAILING_FAILED ","
+                                 G_FILE_ATTRIBUTE_THUMBNAIL_PATH,
+                                 G_FILE_QUERY_INFO_NONE,
+                                 G_PRIORITY_DEFAULT,
+                                 self->cancellable,
+                                 file_info_ready_callback,
+                                 self);
+    }
+}
+
 /**
  * nautilus_image_set_source:
  * @self: A #NautilusImage
@@ -573,7 +1047,7 @@ nautilus_image_set_fallback (NautilusImage *self,
  * source hasn't changed.
  *
  * When a new source is set, the function will:
- * - Clear any previously loaded texture
+ * - Show a cached thumbnail of the new source, if any, or clear the texture
  * - Cancel any pending file operations from previous source loads
  * - Query file information including size, content type, and modification time
  * - Check if a valid thumbnail exists in cache, otherwise create a new one
@@ -591,41 +1065,63 @@ nautilus_image_set_source (NautilusImage *self,
     }
 
     g_set_object (&self->source, source);
-    nautilus_image_set_texture (self, NULL);
     g_clear_pointer (&self->source_content_type, g_free);
     self->source_mtime = 0;
-    g_clear_error (&self->error);
 
-    self->is_loading_attributes = FALSE;
-    g_cancellable_cancel (self->cancellable);
-    g_clear_object (&self->cancellable);
+    /* Show a cached thumbnail right away, so that cells recycled while
+     * scrolling don't flash the loading icon and resize twice. Its mtime is
+     * checked once the file info arrives. */
+    ThumbnailCacheItem *cache_item = (source != NULL)
+                                     ? thumbnail_cache_lookup (source, get_tier_size (self), TRUE)
+                                     : NULL;
 
-    if (source != NULL)
+    if (cache_item != NULL)
     {
-        self->cancellable = g_cancellable_new ();
-        self->is_loading_attributes = TRUE;
-
-        /* First query the file info to check size and type */
-        g_file_query_info_async (self->source,
-                                 G_FILE_ATTRIBUTE_STANDARD_SIZE ","
-                                 G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE ","
-                                 G_FILE_ATTRIBUTE_ACCESS_CAN_READ ","
-                                 G_FILE_ATTRIBUTE_TIME_MODIFIED ","
-                                 G_FILE_ATTRIBUTE_THUMBNAIL_IS_VALID ","
-                                 G_FILE_ATTRIBUTE_THUMBNAILING_FAILED ","
-                                 G_FILE_ATTRIBUTE_THUMBNAIL_PATH,
-                                 G_FILE_QUERY_INFO_NONE,
-                                 G_PRIORITY_DEFAULT,
-                                 self->cancellable,
-                                 file_info_ready_callback,
-                                 self);
+        self->source_content_type = g_strdup (cache_item->content_type);
     }
 
+    nautilus_image_set_texture (self, (cache_item != NULL) ? cache_item->texture : NULL);
+    load_source (self);
+
     gtk_widget_queue_draw (GTK_WIDGET (self));
 
     g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_SOURCE]);
 }
 
+/**
+ * nautilus_image_set_animation_playing:
+ * @self: A #NautilusImage
+ * @playing: whether to play the source, if it is animated
+ *
+ * Animated sources show their thumbnail while not playing. Their frames are
+ * loaded along with it, unless animations are turned off.
+ */
+void
+nautilus_image_set_animation_playing (NautilusImage *self,
+                                      gboolean       playing)
+{
+    if (self->animation_playing == playing)
+    {
+        return;
+    }
+
+    self->animation_playing = playing;
+
+    if (self->animation != NULL)
+    {
+        if (playing)
+        {
+            nautilus_animated_paintable_start (self->animation);
+        }
+        else
+        {
+            nautilus_animated_paintable_stop (self->animation);
+        }
+
+        gtk_widget_queue_draw (GTK_WIDGET (self));
+    }
+}
+
 void
 nautilus_image_set_size (NautilusImage *self,
                          gint           size)
@@ -633,6 +1129,14 @@ nautilus_image_set_size (NautilusImage *self,
     if (self->size != size)
     {
         self->size = size;
+        g_clear_pointer (&self->texture_node, gsk_render_node_unref);
+
+        /* Zooming in needs a sharper thumbnail, while the current one is
+         * shown scaled up meanwhile. Zooming out keeps the sharper one. */
+        if (self->texture != NULL && get_tier_size (self) > self->tier_size)
+        {
+            load_source (self);
+        }
 
         gtk_widget_queue_resize (GTK_WIDGET (self));
 
@@ -692,44 +1196,80 @@ nautilus_image_init (NautilusImage *self)
     gtk_widget_set_name (GTK_WIDGET (self), "NautilusImage");
 }
 
+/* Fits @paintable into the size of the image, with rounded corners, and
+ * framed if the source is a video. */
 static void
-real_snapshot (GtkWidget   *widget,
-               GtkSnapshot *snapshot)
+snapshot_thumbnail (NautilusImage *self,
+                    GtkSnapshot   *snapshot,
+                    GdkPaintable  *paintable)
 {
-    NautilusImage *self = NAUTILUS_IMAGE (widget);
+    double width = gdk_paintable_get_intrinsic_width (paintable);
+    double height = gdk_paintable_get_intrinsic_height (paintable);
+    GskRoundedRect rounded_rect;
+    const float border_radius = 2.0;
 
-    if (self->texture != NULL)
+    if (MAX (width, height) != self->size)
     {
-        double width = gdk_texture_get_width (self->texture);
-        double height = gdk_texture_get_height (self->texture);
-        GskRoundedRect rounded_rect;
-        const float border_radius = 2.0;
+        float scale_factor = MAX (width, height) / self->size;
 
-        if (MAX (width, height) != self->size)
-        {
-            float scale_factor = MAX (width, height) / self->size;
+        width = width / scale_factor;
+        height = height / scale_factor;
+    }
 
-            width = width / scale_factor;
-            height = height / scale_factor;
-        }
+    gsk_rounded_rect_init_from_rect (&rounded_rect,
+                                     &GRAPHENE_RECT_INIT (0, 0, width, height),
+                                     border_radius);
+    gtk_snapshot_push_rounded_clip (snapshot, &rounded_rect);
 
-        gsk_rounded_rect_init_from_rect (&rounded_rect,
-                                         &GRAPHENE_RECT_INIT (0, 0, width, height),
-                                         border_radius);
-        gtk_snapshot_push_rounded_clip (snapshot, &rounded_rect);
+    gdk_paintable_snapshot (paintable,
+                            GDK_SNAPSHOT (snapshot),
+                            width, height);
 
-        gdk_paintable_snapshot (GDK_PAINTABLE (self->texture),
-                                GDK_SNAPSHOT (snapshot),
-                                width, height);
+    if (self->size >= NAUTILUS_GRID_ICON_SIZE_SMALL &&
+        content_type_is_video (self->source_content_type))
+    {
+        nautilus_ui_frame_video (snapshot, width, height);
+    }
+
+    /* End rounded clip */
+    gtk_snapshot_pop (snapshot);
+}
+
+static GskRenderNode *
+create_texture_node (NautilusImage *self)
+{
+    g_autoptr (GtkSnapshot) snapshot = gtk_snapshot_new ();
+
+    snapshot_thumbnail (self, snapshot, GDK_PAINTABLE (self->texture));
+
+    return gtk_snapshot_free_to_node (g_steal_pointer (&snapshot));
+}
 
-        if (self->size >= NAUTILUS_GRID_ICON_SIZE_SMALL &&
-            content_type_is_video (self->source_content_type))
+static void
+real_snapshot (GtkWidget   *widget,
+               GtkSnapshot *snapshot)
+{
+    NautilusImage *self = NAUTILUS_IMAGE (widget);
+
+    if (self->animation != NULL &&
+        nautilus_animated_paintable_is_playing (self->animation))
+    {
+        /* Changes with every frame, so there is no node to keep. */
+        snapshot_thumbnail (self, snapshot, GDK_PAINTABLE (self->animation));
+    }
+    else if (self->texture != NULL)
+    {
+        /* Snapshots are redone on every selection, hover or scroll change
+         * of the cell, while the framed texture only changes with it. */
+        if (self->texture_node == NULL)
         {
-            nautilus_ui_frame_video (snapshot, width, height);
+            self->texture_node = create_texture_node (self);
         }
 
-        /* End rounded clip */
-        gtk_snapshot_pop (snapshot);
+        if (self->texture_node != NULL)
+        {
+            gtk_snapshot_append_node (snapshot, self->texture_node);
+        }
     }
     else if (!self->is_loading_attributes &&
              self->cancellable != NULL &&
@@ -795,8 +1335,10 @@ nautilus_image_dispose (GObject *object)
 {
     NautilusImage *self = NAUTILUS_IMAGE (object);
 
+    clear_animation (self);
     g_clear_object (&self->source);
     g_clear_object (&self->texture);
+    g_clear_pointer (&self->texture_node, gsk_render_node_unref);
     g_clear_pointer (&self->source_content_type, g_free);
     g_clear_object (&self->fallback_paintable);
     g_cancellable_cancel (self->cancellable);
@@ -17,6 +17,20 @@ G_BEGIN_DECLS
 
 G_DECLARE_FINAL_TYPE (NautilusImage, nautilus_image, NAUTILUS, IMAGE, GtkWidget)
 
+typedef struct
+{
+    /* Lookups served by a decoded texture */
+    guint64 hits;
+    /* Lookups decoded again from an in-memory thumbnail file */
+    guint64 compressed_hits;
+    /* Lookups that had to read the thumbnail from disk or create it */
+    guint64 misses;
+    guint64 evictions;
+    guint64 compressed_evictions;
+    gsize texture_bytes;
+    gsize compressed_bytes;
+} NautilusImageCacheStats;
+
 NautilusImage *
 nautilus_image_new (void);
 
@@ -29,6 +43,12 @@ nautilus_image_set_size                                 (NautilusImage *self,
 void
 nautilus_image_set_fallback                             (NautilusImage *self,
                                                          GdkPaintable  *paintable);
+void
+nautilus_image_set_animation_playing                    (NautilusImage *self,
+                                                         gboolean       playing);
+
+void
+nautilus_image_get_cache_stats                          (NautilusImageCacheStats *stats);
 
 G_END_DECLS
 
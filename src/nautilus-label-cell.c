@@ -116,6 +116,9 @@ nautilus_label_cell_constructed (GObject *object)
                   NULL);
     gtk_label_set_xalign (self->label, xalign);
 
+    nautilus_view_cell_set_file_attributes (NAUTILUS_VIEW_CELL (self),
+                                            nautilus_file_get_attributes_for_string_attribute_q (self->attribute_q));
+
     if (nautilus_file_is_date_sort_attribute_q (self->attribute_q))
     {
         g_signal_connect_object (nautilus_preferences, "changed::" NAUTILUS_PREFERENCES_DATE_TIME_FORMAT,
@@ -18,6 +18,7 @@
 #include "nautilus-file-operations.h"
 #include "nautilus-metadata.h"
 #include "nautilus-global-preferences.h"
+#include "nautilus-icon-info.h"
 #include "nautilus-thumbnails.h"
 
 #ifdef GDK_WINDOWING_X11
@@ -27,6 +28,9 @@
 /* 1 page worth of scroll in 100ms zooms in or out when the ctrl key is held */
 #define SCROLL_TO_ZOOM_INTERVAL 100
 
+/* Wait for scrolling to settle a little before reordering the work queues. */
+#define VIEWPORT_UPDATE_DELAY 50
+
 /**
  * NautilusListBase:
  *
@@ -63,6 +67,9 @@ struct _NautilusListBasePrivate
 
     gdouble amount_scrolled_for_zoom;
     guint scroll_timeout_id;
+
+    guint viewport_update_id;
+    GHashTable *viewport_directories;
 };
 
 G_DEFINE_ABSTRACT_TYPE_WITH_PRIVATE (NautilusListBase, nautilus_list_base, ADW_TYPE_BIN)
@@ -898,6 +905,195 @@ typedef struct
     GQuark attribute_q;
 } NautilusListBaseSortData;
 
+static void
+clear_viewport (NautilusListBase *self)
+{
+    NautilusListBasePrivate *priv = nautilus_list_base_get_instance_private (self);
+    GHashTableIter iter;
+    NautilusDirectory *directory;
+
+    g_clear_handle_id (&priv->viewport_update_id, g_source_remove);
+
+    g_hash_table_iter_init (&iter, priv->viewport_directories);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &directory, NULL))
+    {
+        nautilus_directory_set_viewport_files (directory, NULL, 0, 0);
+        g_hash_table_iter_remove (&iter);
+    }
+}
+
+static void
+add_viewport_item (GListModel *model,
+                   guint       position,
+                   GHashTable *files_by_directory)
+{
+    g_autoptr (NautilusViewItem) item = get_view_item (model, position);
+    NautilusFile *file = nautilus_view_item_get_file (item);
+    NautilusDirectory *directory = nautilus_file_get_directory (file);
+    GPtrArray *files;
+
+    if (directory == NULL)
+    {
+        return;
+    }
+
+    files = g_hash_table_lookup (files_by_directory, directory);
+    if (files == NULL)
+    {
+        files = g_ptr_array_new ();
+        g_hash_table_insert (files_by_directory, directory, files);
+    }
+
+    g_ptr_array_add (files, file);
+}
+
+/* Hands the rows on screen, followed by a page worth of rows on either side,
+ * to the directories they belong to, so that their attributes are loaded
+ * before those of rows further away. */
+static void
+update_viewport (gpointer user_data)
+{
+    NautilusListBase *self = user_data;
+    NautilusListBasePrivate *priv = nautilus_list_base_get_instance_private (self);
+    g_autoptr (GHashTable) files_by_directory = NULL;
+    g_autoptr (GHashTable) previous_directories = NULL;
+    g_autoptr (GHashTable) n_visible_by_directory = NULL;
+    GtkAdjustment *vadjustment;
+    GListModel *model;
+    GHashTableIter iter;
+    NautilusDirectory *directory;
+    GPtrArray *files;
+    gdouble upper;
+    guint n_items;
+    guint first;
+    guint last;
+    guint margin;
+
+    priv->viewport_update_id = 0;
+
+    if (priv->model == NULL)
+    {
+        return;
+    }
+
+    model = G_LIST_MODEL (priv->model);
+    n_items = g_list_model_get_n_items (model);
+    vadjustment = gtk_scrolled_window_get_vadjustment (GTK_SCROLLED_WINDOW (priv->scrolled_window));
+    upper = gtk_adjustment_get_upper (vadjustment);
+
+    if (n_items == 0 || upper <= 0)
+    {
+        clear_viewport (self);
+        return;
+    }
+
+    /* All rows have the same height, so the scroll position maps linearly onto
+     * model positions. This is only an estimate, hence the margin. */
+    first = MIN (n_items - 1, (guint) (n_items * gtk_adjustment_get_value (vadjustment) / upper));
+    last = MIN (n_items - 1,
+                (guint) (n_items * (gtk_adjustment_get_value (vadjustment) +
+                                    gtk_adjustment_get_page_size (vadjustment)) / upper));
+    margin = last - first + 1;
+
+    files_by_directory = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) g_ptr_array_unref);
+
+    for (guint i = first; i <= last; i++)
+    {
+        add_viewport_item (model, i, files_by_directory);
+    }
+
+    n_visible_by_directory = g_hash_table_new (NULL, NULL);
+    g_hash_table_iter_init (&iter, files_by_directory);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &directory, (gpointer *) &files))
+    {
+        g_hash_table_insert (n_visible_by_directory, directory, GUINT_TO_POINTER (files->len));
+    }
+
+    /* Then the rows just outside, nearest first, preferring the ones below. */
+    for (guint distance = 1; distance <= margin; distance++)
+    {
+        if (last + distance < n_items)
+        {
+            add_viewport_item (model, last + distance, files_by_directory);
+        }
+        if (first >= distance)
+        {
+            add_viewport_item (model, first - distance, files_by_directory);
+        }
+    }
+
+    previous_directories = g_steal_pointer (&priv->viewport_directories);
+    priv->viewport_directories = g_hash_table_new_full (NULL, NULL, g_object_unref, NULL);
+
+    g_hash_table_iter_init (&iter, files_by_directory);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &directory, (gpointer *) &files))
+    {
+        nautilus_directory_set_viewport_files (directory,
+                                               (NautilusFile * const *) files->pdata,
+                                               files->len,
+                                               GPOINTER_TO_UINT (g_hash_table_lookup (n_visible_by_directory,
+                                                                                      directory)));
+        g_hash_table_add (priv->viewport_directories, nautilus_directory_ref (directory));
+        g_hash_table_remove (previous_directories, directory);
+    }
+
+    /* Directories with nothing left in view. */
+    g_hash_table_iter_init (&iter, previous_directories);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &directory, NULL))
+    {
+        nautilus_directory_set_viewport_files (directory, NULL, 0, 0);
+    }
+}
+
+static void
+on_viewport_changed (NautilusListBase *self)
+{
+    NautilusListBasePrivate *priv = nautilus_list_base_get_instance_private (self);
+
+    if (priv->viewport_update_id == 0)
+    {
+        priv->viewport_update_id = g_timeout_add_once (VIEWPORT_UPDATE_DELAY,
+                                                       update_viewport, self);
+    }
+}
+
+/* Files that share a content type mostly share an icon too. Have the icons
+ * of newly shown content types looked up in a thread, ahead of the cells. */
+static void
+on_model_items_changed (NautilusListBase *self,
+                        guint             position,
+                        guint             removed,
+                        guint             added)
+{
+    NautilusListBasePrivate *priv = nautilus_list_base_get_instance_private (self);
+    g_autoptr (GHashTable) content_types = NULL;
+    g_autofree const char **content_types_array = NULL;
+
+    /* Sorting only moves the same items around. */
+    if (added == 0 || added == removed)
+    {
+        return;
+    }
+
+    content_types = g_hash_table_new (g_str_hash, g_str_equal);
+    for (guint i = position; i < position + added; i++)
+    {
+        g_autoptr (NautilusViewItem) item = get_view_item (G_LIST_MODEL (priv->model), i);
+
+        if (item != NULL)
+        {
+            NautilusFile *file = nautilus_view_item_get_file (item);
+
+            g_hash_table_add (content_types, (gpointer) nautilus_file_get_mime_type (file));
+        }
+    }
+
+    content_types_array = (const char **) g_hash_table_get_keys_as_array (content_types, NULL);
+    nautilus_icon_info_prewarm_content_types (content_types_array,
+                                              nautilus_list_base_get_icon_size (self),
+                                              gtk_widget_get_scale_factor (GTK_WIDGET (self)));
+}
+
 static void
 base_setup_directory (NautilusListBase  *self,
                       NautilusDirectory *directory)
@@ -907,6 +1103,8 @@ base_setup_directory (NautilusListBase  *self,
     g_clear_object (&priv->directory_as_file);
     priv->directory_as_file = nautilus_directory_get_corresponding_file (directory);
 
+    clear_viewport (self);
+
     /* Temporary workaround */
     rubberband_set_state (self, TRUE);
 
@@ -1038,6 +1236,7 @@ nautilus_list_base_dispose (GObject *object)
     g_clear_object (&priv->model);
     g_clear_handle_id (&priv->hover_timer_id, g_source_remove);
     g_clear_handle_id (&priv->scroll_timeout_id, g_source_remove);
+    clear_viewport (self);
 
     G_OBJECT_CLASS (nautilus_list_base_parent_class)->dispose (object);
 }
@@ -1045,6 +1244,11 @@ nautilus_list_base_dispose (GObject *object)
 static void
 nautilus_list_base_finalize (GObject *object)
 {
+    NautilusListBase *self = NAUTILUS_LIST_BASE (object);
+    NautilusListBasePrivate *priv = nautilus_list_base_get_instance_private (self);
+
+    g_hash_table_destroy (priv->viewport_directories);
+
     G_OBJECT_CLASS (nautilus_list_base_parent_class)->finalize (object);
 }
 
@@ -1192,7 +1396,15 @@ nautilus_list_base_set_property (GObject      *object,
     {
         case PROP_MODEL:
         {
-            g_set_object (&priv->model, g_value_get_object (value));
+            if (g_set_object (&priv->model, g_value_get_object (value)) && priv->model != NULL)
+            {
+                g_signal_connect_object (priv->model, "items-changed",
+                                         G_CALLBACK (on_viewport_changed), self,
+                                         G_CONNECT_SWAPPED);
+                g_signal_connect_object (priv->model, "items-changed",
+                                         G_CALLBACK (on_model_items_changed), self,
+                                         G_CONNECT_SWAPPED);
+            }
         }
         break;
 
@@ -1282,6 +1494,7 @@ nautilus_list_base_init (NautilusListBase *self)
 {
     NautilusListBasePrivate *priv = nautilus_list_base_get_instance_private (self);
     GtkEventController *controller;
+    GtkAdjustment *vadjustment;
 
     priv->scrolled_window = gtk_scrolled_window_new ();
     priv->overlay = gtk_overlay_new ();
@@ -1294,6 +1507,15 @@ nautilus_list_base_init (NautilusListBase *self)
     gtk_event_controller_set_propagation_phase (controller, GTK_PHASE_CAPTURE);
     g_signal_connect (controller, "scroll", G_CALLBACK (on_scroll), self);
 
+    priv->viewport_directories = g_hash_table_new_full (NULL, NULL, g_object_unref, NULL);
+    vadjustment = gtk_scrolled_window_get_vadjustment (GTK_SCROLLED_WINDOW (priv->scrolled_window));
+    g_signal_connect_object (vadjustment, "value-changed",
+                             G_CALLBACK (on_viewport_changed), self,
+                             G_CONNECT_SWAPPED);
+    g_signal_connect_object (vadjustment, "changed",
+                             G_CALLBACK (on_viewport_changed), self,
+                             G_CONNECT_SWAPPED);
+
     g_signal_connect_object (nautilus_preferences,
                              "changed::" NAUTILUS_PREFERENCES_CLICK_POLICY,
                              G_CALLBACK (set_click_mode_from_settings), self,
@@ -259,18 +259,17 @@ nautilus_list_view_sort (gconstpointer a,
                          gpointer      user_data)
 {
     GQuark attribute_q = GPOINTER_TO_UINT (user_data);
-    NautilusFile *file_a = nautilus_view_item_get_file ((NautilusViewItem *) a);
-    NautilusFile *file_b = nautilus_view_item_get_file ((NautilusViewItem *) b);
 
     /* The reversed argument is FALSE because the columnview sorter handles that
      * itself and if we don't want to reverse the reverse. The directories_first
      * argument is also FALSE for the same reason: we don't want the columnview
      * sorter to reverse it (it would display directories last!); instead we
      * handle directories_first in a separate sorter. */
-    return nautilus_file_compare_for_sort_by_attribute_q (file_a, file_b,
-                                                          attribute_q,
-                                                          FALSE /* directories_first */,
-                                                          FALSE /* reversed */);
+    return nautilus_view_item_compare_for_sort ((NautilusViewItem *) a,
+                                                (NautilusViewItem *) b,
+                                                attribute_q,
+                                                FALSE /* directories_first */,
+                                                FALSE /* reversed */);
 }
 
 static gint
@@ -25,36 +25,96 @@
 
 #include <config.h>
 #include "nautilus-monitor.h"
+#include "nautilus-directory-notify.h"
 #include "nautilus-file-changes-queue.h"
 #include "nautilus-file-utilities.h"
 
+#include <errno.h>
 #include <gio/gio.h>
+#include <glib-unix.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+/* A directory watched through the shared inotify descriptor. Watches are
+ * shared by every monitor of the same path, and the kernel hands out the
+ * same descriptor for every path leading to the same directory, so there
+ * can be several watches per descriptor.
+ *
+ * When the kernel drops a watch, because its directory was deleted, moved
+ * away or unmounted, the watch is kept as missing, with a @wd of -1, and
+ * added again once its path exists again.
+ */
+typedef struct
+{
+    int wd;
+    GFile *location;
+    char *path;
+    guint ref_count;
+} NativeWatch;
 
 struct NautilusMonitor
 {
     GFileMonitor *monitor;
+    NativeWatch *native_watch;
     GVolumeMonitor *volume_monitor;
     GFile *location;
 };
 
-static gboolean call_consume_changes_idle_id = 0;
+#define NATIVE_WATCH_MASK (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                           IN_DELETE_SELF | IN_MOVE_SELF | IN_MOVED_FROM | \
+                           IN_MOVED_TO | IN_UNMOUNT | IN_ONLYDIR)
+
+/* The same interval GIO's inotify backend checks missing paths at. */
+#define MISSING_WATCH_RETRY_SECONDS 4
+
+static int inotify_fd = -1;
+static GHashTable *watches_by_path = NULL;
+static GHashTable *watches_by_wd = NULL;
+/* Descriptors removed by us, whose IN_IGNORED is still to come. */
+static GHashTable *removed_wds = NULL;
+static GList *missing_watches = NULL;
+static guint retry_missing_watches_id = 0;
+
+/* Changes are flushed at most this often. An isolated event is still
+ * handled at idle, but during an event storm this gives the changes queue a
+ * window in which to coalesce events, and keeps the main loop responsive.
+ */
+#define CONSUME_CHANGES_INTERVAL_MS 100
+
+static guint call_consume_changes_idle_id = 0;
+static gint64 last_consume_changes_time = 0;
 
 static gboolean
 call_consume_changes_idle_cb (gpointer not_used)
 {
     nautilus_file_changes_consume_changes ();
     call_consume_changes_idle_id = 0;
-    return FALSE;
+    last_consume_changes_time = g_get_monotonic_time ();
+    return G_SOURCE_REMOVE;
 }
 
 static void
 schedule_call_consume_changes (void)
 {
-    if (call_consume_changes_idle_id == 0)
+    gint64 elapsed_ms;
+
+    if (call_consume_changes_idle_id != 0)
+    {
+        return;
+    }
+
+    elapsed_ms = (g_get_monotonic_time () - last_consume_changes_time) / 1000;
+    if (elapsed_ms >= CONSUME_CHANGES_INTERVAL_MS)
     {
         call_consume_changes_idle_id =
             g_idle_add (call_consume_changes_idle_cb, NULL);
     }
+    else
+    {
+        call_consume_changes_idle_id =
+            g_timeout_add (CONSUME_CHANGES_INTERVAL_MS - elapsed_ms,
+                           call_consume_changes_idle_cb, NULL);
+    }
 }
 
 static void
@@ -69,7 +129,7 @@ mount_removed (GVolumeMonitor *volume_monitor,
     if (g_file_equal (monitor->location, mount_location) ||
         g_file_has_prefix (monitor->location, mount_location))
     {
-        nautilus_file_changes_queue_file_unmounted (monitor->location);
+        nautilus_file_changes_queue_monitor_file_unmounted (monitor->location);
         schedule_call_consume_changes ();
     }
 
@@ -95,25 +155,25 @@ dir_changed (GFileMonitor      *monitor,
         case G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED:
         case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
         {
-            nautilus_file_changes_queue_file_changed (child);
+            nautilus_file_changes_queue_monitor_file_changed (child);
         }
         break;
 
         case G_FILE_MONITOR_EVENT_UNMOUNTED:
         {
-            nautilus_file_changes_queue_file_unmounted (child);
+            nautilus_file_changes_queue_monitor_file_unmounted (child);
         }
         break;
 
         case G_FILE_MONITOR_EVENT_DELETED:
         {
-            nautilus_file_changes_queue_file_removed (child);
+            nautilus_file_changes_queue_monitor_file_removed (child);
         }
         break;
 
         case G_FILE_MONITOR_EVENT_CREATED:
         {
-            nautilus_file_changes_queue_file_added (child);
+            nautilus_file_changes_queue_monitor_file_added (child);
         }
         break;
 
@@ -121,11 +181,11 @@ dir_changed (GFileMonitor      *monitor,
         {
             if (other_file != NULL)
             {
-                nautilus_file_changes_queue_file_moved (other_file, child);
+                nautilus_file_changes_queue_monitor_file_moved (other_file, child);
             }
             else
             {
-                nautilus_file_changes_queue_file_added (child);
+                nautilus_file_changes_queue_monitor_file_added (child);
             }
         }
         break;
@@ -134,18 +194,18 @@ dir_changed (GFileMonitor      *monitor,
         {
             if (other_file != NULL)
             {
-                nautilus_file_changes_queue_file_moved (child, other_file);
+                nautilus_file_changes_queue_monitor_file_moved (child, other_file);
             }
             else
             {
-                nautilus_file_changes_queue_file_removed (child);
+                nautilus_file_changes_queue_monitor_file_removed (child);
             }
         }
         break;
 
         case G_FILE_MONITOR_EVENT_RENAMED:
         {
-            nautilus_file_changes_queue_file_moved (child, other_file);
+            nautilus_file_changes_queue_monitor_file_moved (child, other_file);
         }
         break;
     }
@@ -153,16 +213,446 @@ dir_changed (GFileMonitor      *monitor,
     schedule_call_consume_changes ();
 }
 
+static gboolean
+use_native_backend (void)
+{
+    static gsize initialized = 0;
+    static gboolean use_native = FALSE;
+
+    if (g_once_init_enter (&initialized))
+    {
+        use_native = g_strcmp0 (g_getenv ("NAUTILUS_MONITOR_BACKEND"), "inotify") == 0;
+        g_once_init_leave (&initialized, 1);
+    }
+
+    return use_native;
+}
+
+/* Takes the source of a rename matching @cookie, preferring one from
+ * @directory, as the kernel reports the rename once for every path sharing
+ * a watch descriptor.
+ */
+static GFile *
+take_move_source (GHashTable *moves_from,
+                  guint32     cookie,
+                  GFile      *directory)
+{
+    GPtrArray *sources = g_hash_table_lookup (moves_from, GUINT_TO_POINTER (cookie));
+    guint index = 0;
+
+    if (sources == NULL || sources->len == 0)
+    {
+        return NULL;
+    }
+
+    for (guint i = 0; i < sources->len; i++)
+    {
+        g_autoptr (GFile) parent = g_file_get_parent (g_ptr_array_index (sources, i));
+
+        if (parent != NULL && g_file_equal (parent, directory))
+        {
+            index = i;
+            break;
+        }
+    }
+
+    return g_ptr_array_steal_index (sources, index);
+}
+
+static void
+queue_native_event (GFile                    *directory,
+                    const struct inotify_event *event,
+                    GHashTable               *moves_from)
+{
+    g_autoptr (GFile) child = NULL;
+
+    if (event->len == 0)
+    {
+        /* Events about the watched directory itself. */
+        if (event->mask & IN_UNMOUNT)
+        {
+            nautilus_file_changes_queue_monitor_file_unmounted (directory);
+        }
+        else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+        {
+            /* A move shows up as such in the parent's watch, if any. */
+            nautilus_file_changes_queue_monitor_file_removed (directory);
+        }
+        else if (event->mask & IN_ATTRIB)
+        {
+            nautilus_file_changes_queue_monitor_file_changed (directory);
+        }
+        return;
+    }
+
+    child = g_file_get_child (directory, event->name);
+
+    if (event->mask & (IN_ATTRIB | IN_CLOSE_WRITE))
+    {
+        nautilus_file_changes_queue_monitor_file_changed (child);
+    }
+    else if (event->mask & IN_CREATE)
+    {
+        nautilus_file_changes_queue_monitor_file_added (child);
+    }
+    else if (event->mask & IN_DELETE)
+    {
+        nautilus_file_changes_queue_monitor_file_removed (child);
+    }
+    else if (event->mask & IN_MOVED_FROM)
+    {
+        GPtrArray *sources = g_hash_table_lookup (moves_from, GUINT_TO_POINTER (event->cookie));
+
+        /* Held back until the matching IN_MOVED_TO shows up, which the
+         * kernel queues right after it if the destination is watched too.
+         */
+        if (sources == NULL)
+        {
+            sources = g_ptr_array_new_with_free_func (g_object_unref);
+            g_hash_table_insert (moves_from, GUINT_TO_POINTER (event->cookie), sources);
+        }
+        g_ptr_array_add (sources, g_steal_pointer (&child));
+    }
+    else if (event->mask & IN_MOVED_TO)
+    {
+        g_autoptr (GFile) from = take_move_source (moves_from, event->cookie, directory);
+
+        if (from != NULL)
+        {
+            nautilus_file_changes_queue_monitor_file_moved (from, child);
+        }
+        else
+        {
+            nautilus_file_changes_queue_monitor_file_added (child);
+        }
+    }
+}
+
+static gboolean
+native_watch_attach (NativeWatch *watch)
+{
+    GList *same_wd;
+    int wd;
+
+    wd = inotify_add_watch (inotify_fd, watch->path, NATIVE_WATCH_MASK);
+    if (wd < 0)
+    {
+        return FALSE;
+    }
+
+    watch->wd = wd;
+    same_wd = g_hash_table_lookup (watches_by_wd, GINT_TO_POINTER (wd));
+    g_hash_table_insert (watches_by_wd, GINT_TO_POINTER (wd), g_list_prepend (same_wd, watch));
+
+    return TRUE;
+}
+
+static gboolean
+retry_missing_watches_cb (gpointer user_data)
+{
+    for (GList *l = missing_watches; l != NULL;)
+    {
+        NativeWatch *watch = l->data;
+        GList *next = l->next;
+
+        if (native_watch_attach (watch))
+        {
+            missing_watches = g_list_delete_link (missing_watches, l);
+
+            /* Files created before the watch was back went unnoticed. */
+            nautilus_directory_notify_directory_rescan (watch->location);
+        }
+
+        l = next;
+    }
+
+    if (missing_watches == NULL)
+    {
+        retry_missing_watches_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* The kernel dropped @wd, and it may hand out the same number again. */
+static void
+native_watches_lost (int wd)
+{
+    GList *watches = NULL;
+
+    g_hash_table_steal_extended (watches_by_wd, GINT_TO_POINTER (wd), NULL, (gpointer *) &watches);
+
+    for (GList *l = watches; l != NULL; l = l->next)
+    {
+        NativeWatch *watch = l->data;
+
+        watch->wd = -1;
+        missing_watches = g_list_prepend (missing_watches, watch);
+    }
+    g_list_free (watches);
+
+    if (missing_watches != NULL && retry_missing_watches_id == 0)
+    {
+        retry_missing_watches_id = g_timeout_add_seconds (MISSING_WATCH_RETRY_SECONDS,
+                                                          retry_missing_watches_cb, NULL);
+    }
+}
+
+static void
+rescan_all_native_watches (void)
+{
+    g_autoptr (GList) watches = g_hash_table_get_values (watches_by_path);
+
+    for (GList *l = watches; l != NULL; l = l->next)
+    {
+        NativeWatch *watch = l->data;
+
+        if (!nautilus_directory_notify_directory_rescan (watch->location))
+        {
+            nautilus_file_changes_queue_monitor_file_changed (watch->location);
+        }
+    }
+}
+
+static gboolean
+inotify_fd_ready (gint         fd,
+                  GIOCondition condition,
+                  gpointer     user_data)
+{
+    /* Large enough for a few hundred events with typical names. */
+    char buffer[64 * 1024] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    g_autoptr (GHashTable) moves_from = g_hash_table_new_full (NULL, NULL, NULL,
+                                                               (GDestroyNotify) g_ptr_array_unref);
+    GHashTableIter iter;
+    gpointer sources;
+    gboolean queued = FALSE;
+    ssize_t length;
+
+    while ((length = read (fd, buffer, sizeof (buffer))) > 0)
+    {
+        for (char *p = buffer; p < buffer + length;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *) p;
+            GList *watches;
+
+            p += sizeof (struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                g_warning ("Inotify event queue overflowed, rescanning monitored folders");
+                rescan_all_native_watches ();
+                queued = TRUE;
+                continue;
+            }
+
+            if (event->mask & IN_IGNORED)
+            {
+                if (!g_hash_table_remove (removed_wds, GINT_TO_POINTER (event->wd)))
+                {
+                    native_watches_lost (event->wd);
+                }
+                continue;
+            }
+
+            watches = g_hash_table_lookup (watches_by_wd, GINT_TO_POINTER (event->wd));
+            for (GList *l = watches; l != NULL; l = l->next)
+            {
+                NativeWatch *watch = l->data;
+
+                queue_native_event (watch->location, event, moves_from);
+                queued = TRUE;
+            }
+
+            if ((event->mask & IN_MOVE_SELF) && watches != NULL)
+            {
+                /* The kernel follows the directory to its new path, which
+                 * the watches don't know, so they wait for the old one to
+                 * come back instead. */
+                inotify_rm_watch (fd, event->wd);
+                g_hash_table_add (removed_wds, GINT_TO_POINTER (event->wd));
+                native_watches_lost (event->wd);
+            }
+        }
+    }
+
+    if (length < 0 && errno != EAGAIN && errno != EINTR)
+    {
+        g_warning ("Failed to read inotify events: %s", g_strerror (errno));
+    }
+
+    /* Moves out of the watched directories. */
+    g_hash_table_iter_init (&iter, moves_from);
+    while (g_hash_table_iter_next (&iter, NULL, &sources))
+    {
+        for (guint i = 0; i < ((GPtrArray *) sources)->len; i++)
+        {
+            nautilus_file_changes_queue_monitor_file_removed (g_ptr_array_index (sources, i));
+        }
+    }
+
+    if (queued)
+    {
+        schedule_call_consume_changes ();
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+ensure_inotify (void)
+{
+    if (inotify_fd >= 0)
+    {
+        return TRUE;
+    }
+
+    inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
+    {
+        g_warning ("Failed to initialize inotify: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    watches_by_path = g_hash_table_new (g_str_hash, g_str_equal);
+    watches_by_wd = g_hash_table_new (NULL, NULL);
+    removed_wds = g_hash_table_new (NULL, NULL);
+    g_unix_fd_add (inotify_fd, G_IO_IN, inotify_fd_ready, NULL);
+
+    return TRUE;
+}
+
+static NativeWatch *
+native_watch_ref (GFile *location)
+{
+    g_autofree char *path = g_file_get_path (location);
+    NativeWatch *watch;
+
+    if (path == NULL || !ensure_inotify ())
+    {
+        return NULL;
+    }
+
+    watch = g_hash_table_lookup (watches_by_path, path);
+    if (watch != NULL)
+    {
+        watch->ref_count++;
+        return watch;
+    }
+
+    watch = g_new0 (NativeWatch, 1);
+    watch->location = g_object_ref (location);
+    watch->path = g_steal_pointer (&path);
+    watch->ref_count = 1;
+
+    if (!native_watch_attach (watch))
+    {
+        if (errno == ENOSPC)
+        {
+            guint n_watches, watch_limit;
+
+            nautilus_monitor_get_watch_usage (&n_watches, &watch_limit);
+            g_warning_once ("Reached the inotify watch limit (%u watches held, limit %u), "
+                            "falling back to GIO monitors",
+                            n_watches, watch_limit);
+        }
+
+        g_object_unref (watch->location);
+        g_free (watch->path);
+        g_free (watch);
+
+        return NULL;
+    }
+
+    g_hash_table_insert (watches_by_path, watch->path, watch);
+
+    return watch;
+}
+
+static void
+native_watch_unref (NativeWatch *watch)
+{
+    GList *same_wd;
+
+    if (--watch->ref_count > 0)
+    {
+        return;
+    }
+
+    g_hash_table_remove (watches_by_path, watch->path);
+
+    if (watch->wd < 0)
+    {
+        missing_watches = g_list_remove (missing_watches, watch);
+        if (missing_watches == NULL)
+        {
+            g_clear_handle_id (&retry_missing_watches_id, g_source_remove);
+        }
+    }
+    else
+    {
+        same_wd = g_hash_table_lookup (watches_by_wd, GINT_TO_POINTER (watch->wd));
+        same_wd = g_list_remove (same_wd, watch);
+        if (same_wd != NULL)
+        {
+            g_hash_table_insert (watches_by_wd, GINT_TO_POINTER (watch->wd), same_wd);
+        }
+        else
+        {
+            g_hash_table_remove (watches_by_wd, GINT_TO_POINTER (watch->wd));
+            inotify_rm_watch (inotify_fd, watch->wd);
+            g_hash_table_add (removed_wds, GINT_TO_POINTER (watch->wd));
+        }
+    }
+
+    g_object_unref (watch->location);
+    g_free (watch->path);
+    g_free (watch);
+}
+
+/**
+ * nautilus_monitor_get_watch_usage:
+ * @n_watches: (out): number of inotify watches held by the native backend
+ * @watch_limit: (out): the per-user inotify watch limit, or 0 if unknown
+ *
+ * Reports how many kernel watches the native monitor backend uses, for
+ * diagnosing folders that stop updating. The limit is shared with every
+ * other process of the user.
+ */
+void
+nautilus_monitor_get_watch_usage (guint *n_watches,
+                                  guint *watch_limit)
+{
+    g_autofree char *contents = NULL;
+
+    *n_watches = watches_by_wd != NULL ? g_hash_table_size (watches_by_wd) : 0;
+    *watch_limit = 0;
+
+    if (g_file_get_contents ("/proc/sys/fs/inotify/max_user_watches", &contents, NULL, NULL))
+    {
+        *watch_limit = g_ascii_strtoull (contents, NULL, 10);
+    }
+}
+
 NautilusMonitor *
 nautilus_monitor_directory (GFile *location)
 {
-    GFileMonitor *dir_monitor;
+    GFileMonitor *dir_monitor = NULL;
     NautilusMonitor *ret;
 
     ret = g_slice_new0 (NautilusMonitor);
-    dir_monitor = g_file_monitor_directory (location,
-                                            G_FILE_MONITOR_WATCH_MOUNTS | G_FILE_MONITOR_WATCH_MOVES,
-                                            NULL, NULL);
+
+    if (use_native_backend () && g_file_is_native (location))
+    {
+        ret->native_watch = native_watch_ref (location);
+    }
+
+    if (ret->native_watch == NULL)
+    {
+        dir_monitor = g_file_monitor_directory (location,
+                                                G_FILE_MONITOR_WATCH_MOUNTS | G_FILE_MONITOR_WATCH_MOVES,
+                                                NULL, NULL);
+    }
 
     if (dir_monitor != NULL)
     {
@@ -205,6 +695,8 @@ nautilus_monitor_cancel (NautilusMonitor *monitor)
         g_object_unref (monitor->monitor);
     }
 
+    g_clear_pointer (&monitor->native_watch, native_watch_unref);
+
     if (monitor->volume_monitor != NULL)
     {
         g_signal_handlers_disconnect_by_func (monitor->volume_monitor, mount_removed, monitor);
@@ -31,3 +31,6 @@ typedef struct NautilusMonitor NautilusMonitor;
 
 NautilusMonitor *nautilus_monitor_directory (GFile *location);
 void             nautilus_monitor_cancel    (NautilusMonitor *monitor);
+
+void             nautilus_monitor_get_watch_usage (guint *n_watches,
+                                                   guint *watch_limit);
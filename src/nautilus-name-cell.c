@@ -463,6 +463,10 @@ nautilus_name_cell_init (NautilusNameCell *self)
 {
     gtk_widget_init_template (GTK_WIDGET (self));
 
+    /* For emblems. */
+    nautilus_view_cell_set_file_attributes (NAUTILUS_VIEW_CELL (self),
+                                            NAUTILUS_FILE_ATTRIBUTE_EXTENSION_INFO);
+
     g_signal_connect (self, "map", G_CALLBACK (on_map_changed), GINT_TO_POINTER (TRUE));
     g_signal_connect (self, "unmap", G_CALLBACK (on_map_changed), GINT_TO_POINTER (FALSE));
     g_signal_connect (self, "notify::icon-size",
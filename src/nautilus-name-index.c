@@ -0,0 +1,260 @@
+/*
+ * nautilus-name-index.c: Trigram index over folded display names
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <config.h>
+#include "nautilus-name-index.h"
+
+#include "nautilus-file.h"
+#include "nautilus-query.h"
+
+#include <string.h>
+
+/* Rebuilding the posting lists costs as much as indexing every name again, so
+ * removed entries are only swept out once they are numerous. */
+#define MIN_REMOVED_FOR_COMPACTION 1024
+
+typedef struct
+{
+    NautilusFile *file;
+    char *key;
+} Entry;
+
+/**
+ * `NautilusNameIndex` keeps the display names of a set of files folded the
+ * way query words are, plus posting lists mapping each 3-byte sequence of
+ * those names to the entries containing it. Substring lookups only verify the
+ * entries of the rarest trigram of the words instead of folding every name.
+ */
+struct NautilusNameIndex
+{
+    /* Entries in insertion order. Removed entries keep their slot, with a
+     * NULL file, until the next compaction so that entry ids stay valid. */
+    GArray *entries;
+    guint n_removed;
+
+    /* NautilusFile → entry id + 1 */
+    GHashTable *entry_ids;
+
+    /* Packed trigram → GArray of ascending entry ids */
+    GHashTable *postings;
+};
+
+static inline guint
+pack_trigram (const char *bytes)
+{
+    return ((guint) (guchar) bytes[0] << 16) |
+           ((guint) (guchar) bytes[1] << 8) |
+           (guint) (guchar) bytes[2];
+}
+
+static void
+entry_clear (Entry *entry)
+{
+    g_free (entry->key);
+}
+
+static GArray *
+entries_new (guint reserved_size)
+{
+    GArray *entries = g_array_sized_new (FALSE, FALSE, sizeof (Entry), reserved_size);
+
+    g_array_set_clear_func (entries, (GDestroyNotify) entry_clear);
+
+    return entries;
+}
+
+NautilusNameIndex *
+nautilus_name_index_new (void)
+{
+    NautilusNameIndex *index = g_new0 (NautilusNameIndex, 1);
+
+    index->entries = entries_new (0);
+    index->entry_ids = g_hash_table_new (NULL, NULL);
+    index->postings = g_hash_table_new_full (NULL, NULL, NULL,
+                                             (GDestroyNotify) g_array_unref);
+
+    return index;
+}
+
+void
+nautilus_name_index_free (NautilusNameIndex *index)
+{
+    g_array_unref (index->entries);
+    g_hash_table_destroy (index->entry_ids);
+    g_hash_table_destroy (index->postings);
+    g_free (index);
+}
+
+static void
+add_postings (NautilusNameIndex *index,
+              const char        *key,
+              guint              id)
+{
+    size_t length = strlen (key);
+
+    for (size_t i = 0; i + 3 <= length; i++)
+    {
+        gpointer trigram = GUINT_TO_POINTER (pack_trigram (key + i));
+        GArray *ids = g_hash_table_lookup (index->postings, trigram);
+
+        if (ids == NULL)
+        {
+            ids = g_array_sized_new (FALSE, FALSE, sizeof (guint), 1);
+            g_hash_table_insert (index->postings, trigram, ids);
+        }
+        else if (g_array_index (ids, guint, ids->len - 1) == id)
+        {
+            /* The trigram occurs more than once in this name. Ids only
+             * grow, so an earlier occurrence is always the last one. */
+            continue;
+        }
+
+        g_array_append_val (ids, id);
+    }
+}
+
+static void
+add_entry (NautilusNameIndex *index,
+           NautilusFile      *file,
+           char              *key)
+{
+    Entry entry = { .file = file, .key = key };
+    guint id = index->entries->len;
+
+    g_array_append_val (index->entries, entry);
+    g_hash_table_insert (index->entry_ids, file, GUINT_TO_POINTER (id + 1));
+    add_postings (index, key, id);
+}
+
+static void
+compact (NautilusNameIndex *index)
+{
+    g_autoptr (GArray) entries = index->entries;
+
+    index->entries = entries_new (entries->len - index->n_removed);
+    index->n_removed = 0;
+    g_hash_table_remove_all (index->entry_ids);
+    g_hash_table_remove_all (index->postings);
+
+    for (guint i = 0; i < entries->len; i++)
+    {
+        Entry *entry = &g_array_index (entries, Entry, i);
+
+        if (entry->file != NULL)
+        {
+            add_entry (index, entry->file, g_steal_pointer (&entry->key));
+        }
+    }
+}
+
+void
+nautilus_name_index_add (NautilusNameIndex *index,
+                         NautilusFile      *file)
+{
+    g_return_if_fail (!g_hash_table_contains (index->entry_ids, file));
+
+    add_entry (index, file,
+               nautilus_query_prepare_string (nautilus_file_get_display_name (file)));
+}
+
+void
+nautilus_name_index_remove (NautilusNameIndex *index,
+                            NautilusFile      *file)
+{
+    guint id = GPOINTER_TO_UINT (g_hash_table_lookup (index->entry_ids, file));
+
+    if (id == 0)
+    {
+        return;
+    }
+
+    Entry *entry = &g_array_index (index->entries, Entry, id - 1);
+
+    g_hash_table_remove (index->entry_ids, file);
+    entry->file = NULL;
+    g_clear_pointer (&entry->key, g_free);
+    index->n_removed++;
+
+    if (index->n_removed >= MIN_REMOVED_FOR_COMPACTION &&
+        index->n_removed > index->entries->len / 2)
+    {
+        compact (index);
+    }
+}
+
+/* Re-folds the display name of @file, if it is indexed. */
+void
+nautilus_name_index_update (NautilusNameIndex *index,
+                            NautilusFile      *file)
+{
+    if (g_hash_table_contains (index->entry_ids, file))
+    {
+        nautilus_name_index_remove (index, file);
+        nautilus_name_index_add (index, file);
+    }
+}
+
+static gboolean
+key_contains_all (const char         *key,
+                  const char * const *words)
+{
+    for (guint i = 0; words != NULL && words[i] != NULL; i++)
+    {
+        if (strstr (key, words[i]) == NULL)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+GPtrArray *
+nautilus_name_index_lookup (NautilusNameIndex  *index,
+                            const char * const *words)
+{
+    GPtrArray *files = g_ptr_array_new_with_free_func ((GDestroyNotify) nautilus_file_unref);
+    GArray *candidates = NULL;
+
+    /* Every match contains every trigram of every word, so the shortest
+     * posting list among them bounds the entries to check. Words shorter
+     * than a trigram leave the candidates unbounded. */
+    for (guint i = 0; words != NULL && words[i] != NULL; i++)
+    {
+        size_t length = strlen (words[i]);
+
+        for (size_t j = 0; j + 3 <= length; j++)
+        {
+            GArray *ids = g_hash_table_lookup (index->postings,
+                                               GUINT_TO_POINTER (pack_trigram (words[i] + j)));
+
+            if (ids == NULL)
+            {
+                return files;
+            }
+
+            if (candidates == NULL || ids->len < candidates->len)
+            {
+                candidates = ids;
+            }
+        }
+    }
+
+    guint n_candidates = (candidates != NULL) ? candidates->len : index->entries->len;
+
+    for (guint i = 0; i < n_candidates; i++)
+    {
+        guint id = (candidates != NULL) ? g_array_index (candidates, guint, i) : i;
+        Entry *entry = &g_array_index (index->entries, Entry, id);
+
+        if (entry->file != NULL && key_contains_all (entry->key, words))
+        {
+            g_ptr_array_add (files, nautilus_file_ref (entry->file));
+        }
+    }
+
+    return files;
+}
@@ -0,0 +1,26 @@
+/*
+ * nautilus-name-index.h: Trigram index over folded display names
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "nautilus-types.h"
+
+#include <glib.h>
+
+NautilusNameIndex * nautilus_name_index_new     (void);
+void                nautilus_name_index_free    (NautilusNameIndex *index);
+
+void                nautilus_name_index_add     (NautilusNameIndex *index,
+                                                 NautilusFile      *file);
+void                nautilus_name_index_remove  (NautilusNameIndex *index,
+                                                 NautilusFile      *file);
+void                nautilus_name_index_update  (NautilusNameIndex *index,
+                                                 NautilusFile      *file);
+
+/* Returns the indexed files whose folded display name contains all of @words,
+ * which must have been folded with nautilus_query_prepare_string(). */
+GPtrArray *         nautilus_name_index_lookup  (NautilusNameIndex  *index,
+                                                 const char * const *words);
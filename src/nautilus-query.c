@@ -123,8 +123,16 @@ nautilus_query_init (NautilusQuery *query)
     nautilus_query_update_search_content (query);
 }
 
-static gchar *
-prepare_string_for_compare (const gchar *string)
+/**
+ * nautilus_query_prepare_string:
+ * @string: a display name or query text
+ *
+ * Folds @string the way query words are matched: decomposed and lowercased.
+ *
+ * Returns: (transfer full): the folded string
+ */
+gchar *
+nautilus_query_prepare_string (const gchar *string)
 {
     gchar *normalized, *res;
 
@@ -150,7 +158,7 @@ nautilus_query_matches_string (NautilusQuery *query,
         return 0;
     }
 
-    prepared_string = prepare_string_for_compare (string);
+    prepared_string = nautilus_query_prepare_string (string);
 
     for (guint idx = 0; idx < query->prepared_words->len; idx++)
     {
@@ -180,6 +188,30 @@ nautilus_query_matches_string (NautilusQuery *query,
     return retval;
 }
 
+/**
+ * Returns: (nullable) (transfer full): the words of the query text as folded
+ *   by nautilus_query_prepare_string(), or %NULL if the query has no text
+ */
+GStrv
+nautilus_query_get_prepared_words (NautilusQuery *query)
+{
+    if (query->text == NULL)
+    {
+        return NULL;
+    }
+
+    g_autoptr (GStrvBuilder) builder = g_strv_builder_new ();
+
+    for (guint idx = 0; idx < query->prepared_words->len; idx++)
+    {
+        GString *word = query->prepared_words->pdata[idx];
+
+        g_strv_builder_add (builder, word->str);
+    }
+
+    return g_strv_builder_end (builder);
+}
+
 NautilusQuery *
 nautilus_query_new (void)
 {
@@ -232,7 +264,7 @@ nautilus_query_set_text (NautilusQuery *query,
     g_autoptr (GPtrArray) prepared_words = NULL;
     if (query->text != NULL)
     {
-        g_autofree gchar *prepared_query = prepare_string_for_compare (query->text);
+        g_autofree gchar *prepared_query = nautilus_query_prepare_string (query->text);
         g_auto (GStrv) split_query = g_strsplit (prepared_query, " ", -1);
         guint split_num = g_strv_length (split_query);
 
@@ -76,6 +76,8 @@ gboolean
 nautilus_query_update_recursive_setting (NautilusQuery *self);
 
 gdouble        nautilus_query_matches_string     (NautilusQuery *query, const gchar *string);
+GStrv          nautilus_query_get_prepared_words (NautilusQuery *query);
+gchar *        nautilus_query_prepare_string     (const gchar   *string);
 
 gboolean       nautilus_query_has_active_filter  (NautilusQuery *query);
 gboolean       nautilus_query_is_empty           (NautilusQuery *query);
@@ -127,7 +127,12 @@ model_directory_ready_cb (NautilusDirectory *directory,
     GDateTime *end_date;
     GPtrArray *date_range;
 
-    files = nautilus_directory_get_file_list (directory);
+    g_auto (GStrv) words = nautilus_query_get_prepared_words (model->query);
+
+    /* Only files containing every word can match, and the directory finds
+     * those without folding every name again. */
+    files = nautilus_directory_find_files_containing (directory,
+                                                      (const char * const *) words);
 
     for (l = files; l != NULL; l = l->next)
     {
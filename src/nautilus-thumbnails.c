@@ -31,9 +31,12 @@
 #include "nautilus-file-utilities.h"
 #include "nautilus-hash-queue.h"
 #include "nautilus-animated-thumbnail.h"
-#include <math.h>
+#include "nautilus-video-mime-types.h"
+#include <gio/gunixmounts.h>
+#include <glib/gstdio.h>
 #include <gtk/gtk.h>
 #include <errno.h>
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/wait.h>
@@ -50,7 +53,24 @@
 /* This specific number of processors seems to work ok even on relatively slow
  * computers. However, this might not be the effective number of processors
  * used simultaneously because of main thread load and I/O bounds. */
-#define MAX_THUMBNAILING_THREADS ceil (g_get_num_processors () / 2);
+#define MAX_THUMBNAILING_THREADS (g_get_num_processors () / 2 + 1)
+
+/* Removable and network media are slow enough that a few thumbnails being
+ * made from them would keep every thread busy waiting on I/O. */
+#define MAX_THREADS_PER_SLOW_MOUNT 1
+
+/* Video thumbnailers demux and decode, often from network shares, and take
+ * seconds where images take milliseconds. They get threads of their own,
+ * so that a folder of videos doesn't hold up the images next to them. */
+#define MAX_VIDEO_THUMBNAILING_THREADS 2
+
+/* How long callers wait for a video thumbnail, before the thumbnailer is
+ * asked to give up on it. */
+#define VIDEO_THUMBNAIL_TIMEOUT_SECS 20
+
+/* Period over which the throughput reported by nautilus_thumbnail_get_stats()
+ * is averaged. */
+#define THROUGHPUT_WINDOW_USEC (5 * G_USEC_PER_SEC)
 
 static gboolean thumbnail_starter_cb (gpointer data);
 
@@ -69,10 +89,24 @@ typedef struct
     char *mime_type;
     time_t original_file_mtime;
     time_t updated_file_mtime;
+    goffset size;
     gboolean is_animated;
     GdkPixbuf *pixbuf;
     GPtrArray *callbacks;
 
+    NautilusThumbnailPriority priority;
+    /* Interned; NULL for media without a thread limit. */
+    const char *slow_mount;
+    /* Cancels the generation, once no callback is waiting for it anymore. */
+    GCancellable *cancellable;
+
+    gboolean is_video;
+    guint timeout_id;
+    gboolean timed_out;
+    /* Whether it counts against the running threads. A video that timed out
+     * stops counting before its thumbnailer returns. */
+    gboolean holds_thread;
+
     GError *error;
 } NautilusThumbnailInfo;
 
@@ -90,19 +124,43 @@ typedef struct
  *  idle handler is currently registered. */
 static guint thumbnail_thread_starter_id = 0;
 
-/* The list of NautilusThumbnailInfo structs containing information about the
- *  thumbnails we are making. */
-static NautilusHashQueue *thumbnails_to_make = NULL;
+/* The NautilusThumbnailInfo structs of the thumbnails we are going to make,
+ *  one queue per NautilusThumbnailPriority. */
+static NautilusHashQueue *thumbnails_to_make[NAUTILUS_THUMBNAIL_N_PRIORITIES] = { NULL };
 
 /* The icons being currently thumbnailed. */
 static GHashTable *currently_thumbnailing_hash = NULL;
 
-/* The number of currently running threads. */
+/* Slow mount → number of thumbnails being made from it. */
+static GHashTable *running_per_slow_mount = NULL;
+
+/* The number of currently running threads, videos aside. */
 static guint running_threads = 0;
+static guint running_video_threads = 0;
+
+/* The number of videos in thumbnails_to_make. */
+static guint queued_videos = 0;
 
 /* The maximum number of threads allowed. */
 static guint max_threads = 0;
 
+/* How long callers wait for a video thumbnail, in seconds. */
+static guint video_timeout_secs = VIDEO_THUMBNAIL_TIMEOUT_SECS;
+
+static struct
+{
+    guint64 generated;
+    guint64 failed;
+    guint64 cancelled;
+    guint64 timed_out;
+    guint64 generated_in_process;
+    guint64 in_process_fallbacks;
+
+    gint64 window_start;
+    guint window_finished;
+    gdouble finished_per_second;
+} thumbnail_stats;
+
 static gboolean
 get_file_mtime (const char *file_uri,
                 time_t     *mtime)
@@ -147,6 +205,7 @@ free_thumbnail_info (NautilusThumbnailInfo *info)
     g_free (info->mime_type);
     g_clear_object (&info->pixbuf);
     g_clear_pointer (&info->callbacks, g_ptr_array_unref);
+    g_clear_object (&info->cancellable);
     g_clear_error (&info->error);
     g_free (info);
 }
@@ -243,285 +302,1539 @@ nautilus_thumbnail_get_path_for_uri (const char *uri)
     return gnome_desktop_thumbnail_path_for_uri (uri, get_thumbnail_scale ());
 }
 
-void
-nautilus_thumbnail_prioritize (const char *file_uri)
+/***************************************************************************
+ * Thumbnail cache lookups.
+ ***************************************************************************/
+
+/* Directories of the freedesktop thumbnail cache, below
+ * $XDG_CACHE_HOME/thumbnails, indexed by GnomeDesktopThumbnailSize. */
+static const char * const cache_dir_names[] =
 {
-    if (G_UNLIKELY (thumbnails_to_make == NULL))
-    {
-        return;
-    }
+    "normal", "large", "x-large", "xx-large", "fail/gnome-thumbnail-factory",
+};
+#define CACHE_DIR_FAILED 4
+#define N_CACHE_DIRS G_N_ELEMENTS (cache_dir_names)
+G_STATIC_ASSERT (GNOME_DESKTOP_THUMBNAIL_SIZE_XXLARGE == CACHE_DIR_FAILED - 1);
+
+/* The names of the files in each cache directory, read once and then kept up
+ * to date by monitors, so that looking up the thumbnails of a whole folder
+ * does not take a stat() per file. Accessed from lookup threads. */
+static GMutex cache_index_mutex;
+static GHashTable *cache_index[N_CACHE_DIRS];
+static GFileMonitor *cache_monitors[N_CACHE_DIRS];
+
+typedef struct
+{
+    GPtrArray *uris;
+    char *cache_dir;
+    /* Thumbnail sizes to look for, the one we make first. */
+    guint sizes[CACHE_DIR_FAILED];
+} CacheLookupData;
+
+static char *
+get_cache_name_for_uri (const char *uri)
+{
+    g_autofree char *md5 = g_compute_checksum_for_string (G_CHECKSUM_MD5, uri, -1);
 
-    nautilus_hash_queue_move_existing_to_head (thumbnails_to_make, file_uri);
+    return g_strconcat (md5, ".png", NULL);
 }
 
-void
-nautilus_thumbnail_deprioritize (const char *file_uri)
+static void
+cache_index_update (guint       dir,
+                    const char *name,
+                    gboolean    present)
 {
-    if (G_UNLIKELY (thumbnails_to_make == NULL))
+    g_mutex_lock (&cache_index_mutex);
+
+    /* Until the directory has been read, that read will pick it up. */
+    if (cache_index[dir] != NULL)
     {
-        return;
+        if (present)
+        {
+            g_hash_table_add (cache_index[dir], g_strdup (name));
+        }
+        else
+        {
+            g_hash_table_remove (cache_index[dir], name);
+        }
     }
 
-    nautilus_hash_queue_move_existing_to_tail (thumbnails_to_make, file_uri);
+    g_mutex_unlock (&cache_index_mutex);
 }
 
-/***************************************************************************
- * Thumbnail Thread Functions.
- ***************************************************************************/
-
-static GHashTable *
-get_types_table (void)
+static void
+on_cache_dir_changed (GFileMonitor      *monitor,
+                      GFile             *file,
+                      GFile             *other_file,
+                      GFileMonitorEvent  event_type,
+                      gpointer           user_data)
 {
-    static GHashTable *image_mime_types = NULL;
-    GSList *format_list, *l;
-    char **types;
-    int i;
+    guint dir = GPOINTER_TO_UINT (user_data);
+    g_autofree char *name = g_file_get_basename (file);
 
-    if (image_mime_types == NULL)
+    switch (event_type)
     {
-        image_mime_types =
-            g_hash_table_new_full (g_str_hash, g_str_equal,
-                                   g_free, NULL);
+        case G_FILE_MONITOR_EVENT_CREATED:
+        case G_FILE_MONITOR_EVENT_MOVED_IN:
+        {
+            cache_index_update (dir, name, TRUE);
+        }
+        break;
 
-        format_list = gdk_pixbuf_get_formats ();
-        for (l = format_list; l; l = l->next)
+        case G_FILE_MONITOR_EVENT_DELETED:
+        case G_FILE_MONITOR_EVENT_MOVED_OUT:
         {
-            types = gdk_pixbuf_format_get_mime_types (l->data);
+            cache_index_update (dir, name, FALSE);
+        }
+        break;
 
-            for (i = 0; types[i] != NULL; i++)
-            {
-                g_hash_table_insert (image_mime_types,
-                                     types [i],
-                                     GUINT_TO_POINTER (1));
-            }
+        case G_FILE_MONITOR_EVENT_RENAMED:
+        {
+            g_autofree char *new_name = g_file_get_basename (other_file);
 
-            g_free (types);
+            /* Thumbnails are written to a temporary file first. */
+            cache_index_update (dir, name, FALSE);
+            cache_index_update (dir, new_name, TRUE);
         }
+        break;
 
-        g_slist_free (format_list);
+        default:
+        {
+        }
+        break;
     }
-
-    return image_mime_types;
 }
 
-static gboolean
-pixbuf_can_load_type (const char *mime_type)
+static void
+ensure_cache_monitors (const char *cache_dir)
 {
-    GHashTable *image_mime_types;
-
-    image_mime_types = get_types_table ();
-    if (g_hash_table_lookup (image_mime_types, mime_type))
+    for (guint i = 0; i < N_CACHE_DIRS; i++)
     {
-        return TRUE;
-    }
+        g_autoptr (GFile) location = NULL;
 
-    return FALSE;
-}
+        if (cache_monitors[i] != NULL)
+        {
+            continue;
+        }
 
-gboolean
-nautilus_thumbnail_is_mimetype_limited_by_size (const char *mime_type)
-{
-    return pixbuf_can_load_type (mime_type);
+        location = g_file_new_build_filename (cache_dir, cache_dir_names[i], NULL);
+        cache_monitors[i] = g_file_monitor_directory (location, G_FILE_MONITOR_WATCH_MOVES,
+                                                      NULL, NULL);
+
+        if (cache_monitors[i] != NULL)
+        {
+            g_signal_connect (cache_monitors[i], "changed",
+                              G_CALLBACK (on_cache_dir_changed), GUINT_TO_POINTER (i));
+        }
+    }
 }
 
-gboolean
-nautilus_can_thumbnail (const gchar *uri,
-                        const gchar *mime_type,
-                        time_t       modified_time)
+static GHashTable *
+read_cache_dir (const char *path)
 {
-    GnomeDesktopThumbnailFactory *factory = get_thumbnail_factory ();
+    GHashTable *names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    g_autoptr (GDir) dir = g_dir_open (path, 0, NULL);
+    const char *name;
 
-    return gnome_desktop_thumbnail_factory_can_thumbnail (factory,
-                                                          uri,
-                                                          mime_type,
-                                                          modified_time);
+    while (dir != NULL && (name = g_dir_read_name (dir)) != NULL)
+    {
+        if (g_str_has_suffix (name, ".png"))
+        {
+            g_hash_table_add (names, g_strdup (name));
+        }
+    }
+
+    return names;
 }
 
 static void
-handle_cancelled_callbacks (NautilusThumbnailInfo *info)
+ensure_cache_index (const char *cache_dir)
 {
-    for (guint i = 0; i < info->callbacks->len; i++)
+    for (guint i = 0; i < N_CACHE_DIRS; i++)
     {
-        ThumbnailCreationCallback *thumbnail_callback = info->callbacks->pdata[i];
-        ThumbnailCreationResult res = { .info = info, .callback = thumbnail_callback };
+        g_autofree char *path = NULL;
+        GHashTable *names;
+        gboolean is_loaded;
 
-        if (thumbnail_callback->cancellable != NULL &&
-            g_cancellable_is_cancelled (thumbnail_callback->cancellable))
+        g_mutex_lock (&cache_index_mutex);
+        is_loaded = cache_index[i] != NULL;
+        g_mutex_unlock (&cache_index_mutex);
+
+        if (is_loaded)
         {
-            g_debug ("Cancelled thumbnail: %s", info->image_uri);
+            continue;
+        }
 
-            if (thumbnail_callback->callback != NULL)
-            {
-                (*thumbnail_callback->callback) (NULL,
-                                                 (GAsyncResult *) &res,
-                                                 thumbnail_callback->user_data);
-            }
+        /* Reading a large cache takes a while; don't keep the monitors of
+         * the main thread waiting meanwhile. */
+        path = g_build_filename (cache_dir, cache_dir_names[i], NULL);
+        names = read_cache_dir (path);
 
-            g_ptr_array_remove_index_fast (info->callbacks, i--);
+        g_mutex_lock (&cache_index_mutex);
+        if (cache_index[i] == NULL)
+        {
+            cache_index[i] = g_steal_pointer (&names);
         }
+        g_mutex_unlock (&cache_index_mutex);
+
+        g_clear_pointer (&names, g_hash_table_unref);
     }
 }
 
 static void
-handle_callbacks_and_free (NautilusThumbnailInfo *info)
+cache_lookup_data_free (CacheLookupData *data)
 {
-    for (uint i = 0; i < info->callbacks->len; i++)
+    g_ptr_array_unref (data->uris);
+    g_free (data->cache_dir);
+    g_free (data);
+}
+
+static void
+nautilus_thumbnail_cache_entry_clear (NautilusThumbnailCacheEntry *entry)
+{
+    g_free (entry->path);
+}
+
+static void
+cache_lookup_thread (GTask        *task,
+                     gpointer      source_object,
+                     gpointer      task_data,
+                     GCancellable *cancellable)
+{
+    CacheLookupData *data = task_data;
+    g_autoptr (GPtrArray) names = g_ptr_array_new_full (data->uris->len, g_free);
+    g_autoptr (GArray) entries = NULL;
+
+    ensure_cache_index (data->cache_dir);
+
+    for (guint i = 0; i < data->uris->len; i++)
     {
-        ThumbnailCreationCallback *thumbnail_callback = info->callbacks->pdata[i];
-        ThumbnailCreationResult res = { .info = info, .callback = thumbnail_callback };
+        g_ptr_array_add (names, get_cache_name_for_uri (data->uris->pdata[i]));
+    }
 
-        if (thumbnail_callback->callback != NULL)
+    entries = g_array_sized_new (FALSE, TRUE, sizeof (NautilusThumbnailCacheEntry), names->len);
+    g_array_set_clear_func (entries, (GDestroyNotify) nautilus_thumbnail_cache_entry_clear);
+    g_array_set_size (entries, names->len);
+
+    g_mutex_lock (&cache_index_mutex);
+
+    for (guint i = 0; i < names->len; i++)
+    {
+        NautilusThumbnailCacheEntry *entry = &g_array_index (entries, NautilusThumbnailCacheEntry, i);
+        const char *name = names->pdata[i];
+
+        for (guint j = 0; j < G_N_ELEMENTS (data->sizes); j++)
         {
-            (*thumbnail_callback->callback) (NULL,
-                                             (GAsyncResult *) &res,
-                                             thumbnail_callback->user_data);
+            if (g_hash_table_contains (cache_index[data->sizes[j]], name))
+            {
+                entry->path = g_build_filename (data->cache_dir, cache_dir_names[data->sizes[j]],
+                                                name, NULL);
+                break;
+            }
         }
+
+        entry->failed = g_hash_table_contains (cache_index[CACHE_DIR_FAILED], name);
     }
 
-    free_thumbnail_info (info);
+    g_mutex_unlock (&cache_index_mutex);
+
+    g_task_return_pointer (task, g_steal_pointer (&entries), (GDestroyNotify) g_array_unref);
 }
 
+/**
+ * nautilus_thumbnail_lookup_async:
+ * @uris: (element-type utf8): uris of files to find the thumbnails of
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: called when done
+ * @user_data: data for @callback
+ *
+ * Looks up what the thumbnail cache holds for each of @uris, like the
+ * `thumbnail::*` file attributes would, but all at once and without touching
+ * the cache for every file. The size we make thumbnails at is preferred,
+ * then the largest available.
+ */
 void
-nautilus_create_thumbnail_async (const gchar         *uri,
-                                 const gchar         *mime_type,
-                                 time_t               modified_time,
+nautilus_thumbnail_lookup_async (GPtrArray           *uris,
                                  GCancellable        *cancellable,
                                  GAsyncReadyCallback  callback,
                                  gpointer             user_data)
 {
-    g_return_if_fail (uri != NULL && *uri != '\0');
+    g_autoptr (GTask) task = g_task_new (NULL, cancellable, callback, user_data);
+    CacheLookupData *data = g_new0 (CacheLookupData, 1);
+    guint preferred_size = get_thumbnail_scale ();
+    guint n_sizes = 0;
 
-    g_autoptr (NautilusThumbnailInfo) info = g_new0 (NautilusThumbnailInfo, 1);
-    g_autoptr (ThumbnailCreationCallback) cb_data = g_new0 (ThumbnailCreationCallback, 1);
+    data->uris = g_ptr_array_ref (uris);
+    data->cache_dir = g_build_filename (g_get_user_cache_dir (), "thumbnails", NULL);
 
-    info->image_uri = g_strdup (uri);
-    info->mime_type = g_strdup (mime_type);
-    info->callbacks = g_ptr_array_new_with_free_func ((GDestroyNotify) free_thumbnail_callback);
+    data->sizes[n_sizes++] = preferred_size;
+    for (guint size = CACHE_DIR_FAILED; size > 0; size--)
+    {
+        if (size - 1 != preferred_size)
+        {
+            data->sizes[n_sizes++] = size - 1;
+        }
+    }
 
-    cb_data->cancellable = cancellable != NULL ? g_object_ref (cancellable) : NULL;
-    cb_data->callback = callback;
-    cb_data->user_data = user_data;
+    ensure_cache_monitors (data->cache_dir);
 
-    if (cancellable != NULL &&
-        g_cancellable_is_cancelled (cancellable))
-    {
-        /* Call the callback immediately */
-        g_ptr_array_add (info->callbacks, g_steal_pointer (&cb_data));
-        handle_cancelled_callbacks (info);
+    g_task_set_source_tag (task, nautilus_thumbnail_lookup_async);
+    g_task_set_task_data (task, data, (GDestroyNotify) cache_lookup_data_free);
+    g_task_run_in_thread (task, cache_lookup_thread);
+}
 
-        return;
-    }
+/**
+ * nautilus_thumbnail_lookup_finish:
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Returns: (transfer full) (element-type NautilusThumbnailCacheEntry): one
+ *   entry per uri passed to nautilus_thumbnail_lookup_async(), in order
+ */
+GArray *
+nautilus_thumbnail_lookup_finish (GAsyncResult  *result,
+                                  GError       **error)
+{
+    return g_task_propagate_pointer (G_TASK (result), error);
+}
 
-    /* Hopefully the caller will already have the image file mtime,
-     *  so we can just use that. Otherwise we have to get it ourselves. */
-    if (modified_time == 0)
-    {
-        get_file_mtime (info->image_uri, &modified_time);
-    }
+/***************************************************************************
+ * Failure cache.
+ ***************************************************************************/
 
-    info->original_file_mtime = modified_time;
-    info->updated_file_mtime = modified_time;
+/* Failed thumbnails are recorded by the factory as images in the failure
+ * directory, which have to be opened and read to tell whether they are
+ * still valid, every time a file is looked at again. Failures are remembered
+ * here too, by uri, mtime and size, so that folders of corrupt or unsupported
+ * files are answered from memory. They are kept across sessions in
+ * $XDG_CACHE_HOME/nautilus/thumbnail-failures, as a GVariant of type
+ * FAILURE_CACHE_TYPE, which is read in a thread the first time failures are
+ * looked at. Until then, only the failures of this session are known, and
+ * changes to the saved ones are held back to be applied once they are read.
+ * Otherwise only used from the main thread. */
 
-    if (G_UNLIKELY (thumbnails_to_make == NULL))
-    {
-        thumbnails_to_make = nautilus_hash_queue_new (g_str_hash, g_str_equal, NULL, NULL);
-        currently_thumbnailing_hash = g_hash_table_new (g_str_hash,
-                                                        g_str_equal);
-    }
+#define FAILURE_CACHE_TYPE "a(sxx)"
+#define FAILURE_CACHE_MAX_RECORDS 100000
 
-    /* Check if it is already in the list of thumbnails to make or
-     *  currently being made. */
-    NautilusThumbnailInfo *existing_info = g_hash_table_lookup (currently_thumbnailing_hash, info->image_uri);
+/* Seconds to wait for more failures before writing the cache out. */
+#define FAILURE_CACHE_SAVE_DELAY 10
 
-    if (existing_info == NULL)
-    {
-        existing_info = nautilus_hash_queue_find_item (thumbnails_to_make, info->image_uri);
-    }
+/* For when the size of a file isn't known. */
+#define UNKNOWN_SIZE -1
 
-    if (existing_info == NULL)
-    {
-        /* Add the thumbnail to the list. */
-        g_debug ("(Main Thread) Adding thumbnail: %s",
-                 info->image_uri);
+typedef struct
+{
+    char *uri;
+    gint64 mtime;
+    gint64 size;
+} FailureRecord;
+
+/* uri → FailureRecord, least recently failed first */
+static NautilusHashQueue *failure_cache = NULL;
+static guint failure_cache_save_id = 0;
+
+/* While the saved failures are read: the uris forgotten meanwhile, and the
+ * prefixes purged meanwhile, with "" for all of them. */
+static gboolean failure_cache_loading = FALSE;
+static GHashTable *failure_cache_forgotten = NULL;
+static GPtrArray *failure_cache_purged = NULL;
+
+static void purge_failure_records (NautilusHashQueue *queue,
+                                   const char        *uri_prefix,
+                                   GPtrArray         *paths);
+static void delete_failed_thumbnails (GPtrArray *paths);
 
-        g_ptr_array_add (info->callbacks, g_steal_pointer (&cb_data));
-        nautilus_hash_queue_enqueue (thumbnails_to_make, info->image_uri, info);
-        g_steal_pointer (&info);
+static void
+failure_record_free (FailureRecord *record)
+{
+    g_free (record->uri);
+    g_free (record);
+}
 
-        /* If we didn't schedule the thumbnail function to start on idle, do
-         *  that now. We don't want to start it until all the other work is
-         *  done, so the GUI will be updated as quickly as possible. */
-        if (thumbnail_thread_starter_id == 0)
-        {
-            thumbnail_thread_starter_id = g_idle_add_full (G_PRIORITY_LOW, thumbnail_starter_cb, NULL, NULL);
-        }
-    }
-    else
-    {
-        g_debug ("(Main Thread) Updating non-current mtime: %s",
-                 info->image_uri);
+static char *
+get_failure_cache_path (void)
+{
+    return g_build_filename (g_get_user_cache_dir (), "nautilus", "thumbnail-failures", NULL);
+}
 
-        /* The file in the queue might need a new original mtime */
-        existing_info->updated_file_mtime = info->original_file_mtime;
-        g_ptr_array_add (existing_info->callbacks, g_steal_pointer (&cb_data));
-    }
+static NautilusHashQueue *
+failure_records_new (void)
+{
+    return nautilus_hash_queue_new (g_str_hash, g_str_equal, NULL,
+                                    (GDestroyNotify) failure_record_free);
 }
 
-GdkPixbuf *
-nautilus_create_thumbnail_finish (GAsyncResult  *res,
-                                  GError       **error)
+static void
+failure_records_insert (NautilusHashQueue *queue,
+                        const char        *uri,
+                        gint64             mtime,
+                        gint64             size)
 {
-    ThumbnailCreationResult *result = (ThumbnailCreationResult *) res;
-    ThumbnailCreationCallback *callback = result->callback;
-    NautilusThumbnailInfo *info = result->info;
+    FailureRecord *record = g_new0 (FailureRecord, 1);
 
-    if (callback->cancellable != NULL &&
-        g_cancellable_is_cancelled (callback->cancellable))
-    {
-        if (error != NULL)
-        {
-            *error = g_error_new (G_IO_ERROR, G_IO_ERROR_CANCELLED, "Cancelled");
-        }
+    record->uri = g_strdup (uri);
+    record->mtime = mtime;
+    record->size = size;
 
-        return NULL;
-    }
+    nautilus_hash_queue_remove (queue, uri);
+    nautilus_hash_queue_enqueue (queue, record->uri, record);
 
-    if (info->error != NULL)
+    if (nautilus_hash_queue_get_length (queue) > FAILURE_CACHE_MAX_RECORDS)
     {
-        if (error != NULL)
-        {
-            *error = g_error_copy (info->error);
-        }
+        FailureRecord *oldest = nautilus_hash_queue_peek_head (queue);
 
-        return NULL;
+        nautilus_hash_queue_remove (queue, oldest->uri);
     }
-
-    return info->pixbuf != NULL ? g_object_ref (info->pixbuf) : NULL;
 }
 
 static void
-thumbnail_finalize (NautilusThumbnailInfo *info)
+load_failure_cache_thread (GTask        *task,
+                           gpointer      source_object,
+                           gpointer      task_data,
+                           GCancellable *cancellable)
 {
-    g_hash_table_remove (currently_thumbnailing_hash, info->image_uri);
-    running_threads -= 1;
+    NautilusHashQueue *queue = failure_records_new ();
+    g_autofree char *path = get_failure_cache_path ();
+    g_autoptr (GMappedFile) file = NULL;
+    g_autoptr (GBytes) bytes = NULL;
+    g_autoptr (GVariant) records = NULL;
+    g_autoptr (GError) error = NULL;
+    GVariantIter iter;
+    const char *uri;
+    gint64 mtime;
+    gint64 size;
+
+    file = g_mapped_file_new (path, FALSE, &error);
+    if (file == NULL)
+    {
+        if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+            g_debug ("Could not read thumbnail failures: %s", error->message);
+        }
+
+        g_task_return_pointer (task, queue, (GDestroyNotify) nautilus_hash_queue_destroy);
+
+        return;
+    }
+
+    bytes = g_mapped_file_get_bytes (file);
+    records = g_variant_new_from_bytes (G_VARIANT_TYPE (FAILURE_CACHE_TYPE), bytes, FALSE);
+
+    /* Saved oldest first, like they are kept. */
+    g_variant_iter_init (&iter, records);
+    while (g_variant_iter_next (&iter, "(&sxx)", &uri, &mtime, &size))
+    {
+        failure_records_insert (queue, uri, mtime, size);
+    }
+
+    g_task_return_pointer (task, queue, (GDestroyNotify) nautilus_hash_queue_destroy);
+}
+
+static void
+failure_cache_loaded_cb (GObject      *source_object,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+    NautilusHashQueue *loaded = g_task_propagate_pointer (G_TASK (result), NULL);
+    g_autoptr (GPtrArray) paths = g_ptr_array_new_with_free_func (g_free);
+    GHashTableIter iter;
+    const char *uri;
+
+    /* Apply what happened meanwhile to the saved failures... */
+    g_hash_table_iter_init (&iter, failure_cache_forgotten);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &uri, NULL))
+    {
+        nautilus_hash_queue_remove (loaded, uri);
+    }
+    for (guint i = 0; i < failure_cache_purged->len; i++)
+    {
+        const char *uri_prefix = failure_cache_purged->pdata[i];
+
+        purge_failure_records (loaded, *uri_prefix != '\0' ? uri_prefix : NULL, paths);
+    }
+
+    /* ...and keep the failures of this session as the most recent ones. */
+    for (GList *l = ((GQueue *) failure_cache)->head; l != NULL; l = l->next)
+    {
+        FailureRecord *record = l->data;
+
+        failure_records_insert (loaded, record->uri, record->mtime, record->size);
+    }
+
+    nautilus_hash_queue_destroy (failure_cache);
+    failure_cache = loaded;
+    failure_cache_loading = FALSE;
+    g_clear_pointer (&failure_cache_forgotten, g_hash_table_destroy);
+    g_clear_pointer (&failure_cache_purged, g_ptr_array_unref);
+
+    g_debug ("Loaded %u thumbnail failures",
+             nautilus_hash_queue_get_length (failure_cache));
+
+    delete_failed_thumbnails (paths);
+}
+
+static void
+ensure_failure_cache (void)
+{
+    g_autoptr (GTask) task = NULL;
+
+    if (failure_cache != NULL)
+    {
+        return;
+    }
+
+    /* Up to FAILURE_CACHE_MAX_RECORDS of them, too many to parse in the
+     * main thread. */
+    failure_cache = failure_records_new ();
+    failure_cache_loading = TRUE;
+    failure_cache_forgotten = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    failure_cache_purged = g_ptr_array_new_with_free_func (g_free);
+
+    task = g_task_new (NULL, NULL, failure_cache_loaded_cb, NULL);
+    g_task_set_source_tag (task, ensure_failure_cache);
+    g_task_run_in_thread (task, load_failure_cache_thread);
+}
+
+static void
+failure_cache_saved_cb (GObject      *source_object,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+    g_autoptr (GError) error = NULL;
+
+    if (!g_file_replace_contents_finish (G_FILE (source_object), result, NULL, &error))
+    {
+        g_debug ("Could not save thumbnail failures: %s", error->message);
+    }
+}
+
+static gboolean
+save_failure_cache (gpointer user_data)
+{
+    g_autofree char *path = get_failure_cache_path ();
+    g_autofree char *dir = g_path_get_dirname (path);
+    g_autoptr (GFile) location = g_file_new_for_path (path);
+    g_autoptr (GVariant) records = NULL;
+    g_autoptr (GBytes) bytes = NULL;
+    GVariantBuilder builder;
+
+    /* Writing now would drop the failures not read yet. */
+    if (failure_cache_loading)
+    {
+        return G_SOURCE_CONTINUE;
+    }
+
+    failure_cache_save_id = 0;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE (FAILURE_CACHE_TYPE));
+    for (GList *l = ((GQueue *) failure_cache)->head; l != NULL; l = l->next)
+    {
+        FailureRecord *record = l->data;
+
+        g_variant_builder_add (&builder, "(sxx)", record->uri, record->mtime, record->size);
+    }
+    records = g_variant_ref_sink (g_variant_builder_end (&builder));
+    bytes = g_variant_get_data_as_bytes (records);
+
+    if (g_mkdir_with_parents (dir, 0700) != 0)
+    {
+        g_debug ("Could not create %s: %s", dir, g_strerror (errno));
+        return G_SOURCE_REMOVE;
+    }
+
+    g_file_replace_contents_bytes_async (location, bytes, NULL, FALSE,
+                                         G_FILE_CREATE_PRIVATE | G_FILE_CREATE_REPLACE_DESTINATION,
+                                         NULL, failure_cache_saved_cb, NULL);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+schedule_failure_cache_save (void)
+{
+    if (failure_cache_save_id == 0)
+    {
+        failure_cache_save_id = g_timeout_add_seconds (FAILURE_CACHE_SAVE_DELAY,
+                                                       save_failure_cache, NULL);
+    }
+}
+
+/* @size may be UNKNOWN_SIZE, to only compare the mtime. */
+static gboolean
+failure_cache_lookup (const char *uri,
+                      gint64      mtime,
+                      gint64      size)
+{
+    FailureRecord *record;
+
+    ensure_failure_cache ();
+
+    record = nautilus_hash_queue_find_item (failure_cache, uri);
+    if (record == NULL)
+    {
+        return FALSE;
+    }
+
+    if (record->mtime != mtime ||
+        (size != UNKNOWN_SIZE && record->size != UNKNOWN_SIZE && record->size != size))
+    {
+        /* The file changed since, so it gets another try. */
+        nautilus_hash_queue_remove (failure_cache, uri);
+        schedule_failure_cache_save ();
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+failure_cache_add (const char *uri,
+                   gint64      mtime,
+                   gint64      size)
+{
+    ensure_failure_cache ();
+    failure_records_insert (failure_cache, uri, mtime, size);
+    schedule_failure_cache_save ();
+}
+
+static void
+failure_cache_remove (const char *uri)
+{
+    ensure_failure_cache ();
+
+    if (failure_cache_loading)
+    {
+        g_hash_table_add (failure_cache_forgotten, g_strdup (uri));
+        schedule_failure_cache_save ();
+    }
+
+    if (nautilus_hash_queue_find_item (failure_cache, uri) != NULL)
+    {
+        nautilus_hash_queue_remove (failure_cache, uri);
+        schedule_failure_cache_save ();
+    }
+}
+
+static void
+delete_failed_thumbnails_thread (GTask        *task,
+                                 gpointer      source_object,
+                                 gpointer      task_data,
+                                 GCancellable *cancellable)
+{
+    GPtrArray *paths = task_data;
+
+    for (guint i = 0; i < paths->len; i++)
+    {
+        if (g_unlink (paths->pdata[i]) != 0 && errno != ENOENT)
+        {
+            g_debug ("Could not delete failed thumbnail %s: %s",
+                     (char *) paths->pdata[i], g_strerror (errno));
+        }
+    }
+
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+delete_failed_thumbnails (GPtrArray *paths)
+{
+    g_autoptr (GTask) task = NULL;
+
+    if (paths->len == 0)
+    {
+        return;
+    }
+
+    task = g_task_new (NULL, NULL, NULL, NULL);
+    g_task_set_source_tag (task, delete_failed_thumbnails);
+    g_task_set_task_data (task, g_ptr_array_ref (paths), (GDestroyNotify) g_ptr_array_unref);
+    g_task_run_in_thread (task, delete_failed_thumbnails_thread);
+}
+
+/* Removes the records in @queue whose uri starts with @uri_prefix, or all of
+ * them, and adds the paths of their failed thumbnails to @paths. */
+static void
+purge_failure_records (NautilusHashQueue *queue,
+                       const char        *uri_prefix,
+                       GPtrArray         *paths)
+{
+    g_autofree char *failed_dir = g_build_filename (g_get_user_cache_dir (), "thumbnails",
+                                                    cache_dir_names[CACHE_DIR_FAILED], NULL);
+    GList *next;
+
+    for (GList *l = ((GQueue *) queue)->head; l != NULL; l = next)
+    {
+        FailureRecord *record = l->data;
+        g_autofree char *name = NULL;
+
+        next = l->next;
+
+        if (uri_prefix != NULL && !g_str_has_prefix (record->uri, uri_prefix))
+        {
+            continue;
+        }
+
+        name = get_cache_name_for_uri (record->uri);
+        cache_index_update (CACHE_DIR_FAILED, name, FALSE);
+        g_ptr_array_add (paths, g_build_filename (failed_dir, name, NULL));
+
+        nautilus_hash_queue_remove (queue, record->uri);
+    }
+}
+
+/**
+ * nautilus_thumbnail_purge_failures:
+ * @uri_prefix: (nullable): only purge the files whose uri starts with this,
+ *   like the ones of a folder, or %NULL for all of them
+ *
+ * Forgets that making thumbnails failed for the remembered files, and
+ * removes the records of the thumbnail factory for them, so that they get
+ * tried again the next time they are looked up.
+ */
+void
+nautilus_thumbnail_purge_failures (const char *uri_prefix)
+{
+    g_autoptr (GPtrArray) paths = g_ptr_array_new_with_free_func (g_free);
+
+    ensure_failure_cache ();
+
+    if (failure_cache_loading)
+    {
+        /* For the saved ones, once they are read. */
+        g_ptr_array_add (failure_cache_purged, g_strdup (uri_prefix != NULL ? uri_prefix : ""));
+        schedule_failure_cache_save ();
+    }
+
+    purge_failure_records (failure_cache, uri_prefix, paths);
+
+    if (paths->len == 0)
+    {
+        return;
+    }
+
+    g_debug ("Purging %u thumbnail failures", paths->len);
+    schedule_failure_cache_save ();
+    delete_failed_thumbnails (paths);
+}
+
+/* Loaders other than the JPEG one decode every pixel before scaling down,
+ *  so bigger images are left to the sandboxed thumbnailers. */
+#define DECODE_MAX_PIXELS (50 * 1000 * 1000)
+
+typedef struct
+{
+    gint max_size;
+    gboolean too_large;
+} DecodeSize;
+
+static void
+on_decode_size_prepared (GdkPixbufLoader *loader,
+                         gint             width,
+                         gint             height,
+                         gpointer         user_data)
+{
+    DecodeSize *decode_size = user_data;
+    gint max_size = decode_size->max_size;
+    gint biggest_dimension = MAX (width, height);
+
+    if ((gint64) width * height > DECODE_MAX_PIXELS)
+    {
+        /* Stops the loader before it allocates anything. */
+        decode_size->too_large = TRUE;
+        gdk_pixbuf_loader_set_size (loader, 0, 0);
+
+        return;
+    }
+
+    if (biggest_dimension <= max_size)
+    {
+        return;
+    }
+
+    /* The longest side gets exactly @max_size, rather than one pixel less
+     *  when the scaled size truncates, and the other one is rounded. */
+    if (width >= height)
+    {
+        height = MAX ((gint) round ((double) height * max_size / width), 1);
+        width = max_size;
+    }
+    else
+    {
+        width = MAX ((gint) round ((double) width * max_size / height), 1);
+        height = max_size;
+    }
+
+    gdk_pixbuf_loader_set_size (loader, width, height);
+}
+
+/**
+ * nautilus_thumbnail_decode_stream:
+ * @stream: a stream of encoded image data
+ * @max_size: the largest width or height to decode at
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Decodes an image no larger than @max_size, without scaling it up. Loaders
+ * that can, like the JPEG one, decode directly at the smaller size instead
+ * of decoding every pixel and resampling afterwards. Images of more than 50
+ * megapixels are refused with %G_IO_ERROR_NOT_SUPPORTED, before anything is
+ * decoded. This blocks, so it is meant for worker threads.
+ *
+ * Returns: (transfer full) (nullable): the decoded image
+ */
+GdkPixbuf *
+nautilus_thumbnail_decode_stream (GInputStream  *stream,
+                                  gint           max_size,
+                                  GCancellable  *cancellable,
+                                  GError       **error)
+{
+    g_autoptr (GdkPixbufLoader) loader = gdk_pixbuf_loader_new ();
+    g_autofree guchar *buffer = g_malloc (64 * 1024);
+    DecodeSize decode_size = { .max_size = max_size };
+    gssize n_read;
+
+    g_signal_connect (loader, "size-prepared",
+                      G_CALLBACK (on_decode_size_prepared), &decode_size);
+
+    while ((n_read = g_input_stream_read (stream, buffer, 64 * 1024, cancellable, error)) > 0)
+    {
+        g_autoptr (GError) write_error = NULL;
+
+        if (!gdk_pixbuf_loader_write (loader, buffer, n_read, &write_error) ||
+            decode_size.too_large)
+        {
+            gdk_pixbuf_loader_close (loader, NULL);
+
+            if (decode_size.too_large)
+            {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                             "Too many pixels to be decoded in process");
+            }
+            else
+            {
+                g_propagate_error (error, g_steal_pointer (&write_error));
+            }
+
+            return NULL;
+        }
+    }
+
+    if (n_read < 0)
+    {
+        gdk_pixbuf_loader_close (loader, NULL);
+
+        return NULL;
+    }
+
+    if (!gdk_pixbuf_loader_close (loader, decode_size.too_large ? NULL : error))
+    {
+        if (decode_size.too_large)
+        {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                         "Too many pixels to be decoded in process");
+        }
+
+        return NULL;
+    }
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+
+    if (pixbuf == NULL)
+    {
+        g_set_error_literal (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                             "Image data could not be decoded");
+
+        return NULL;
+    }
+
+    return g_object_ref (pixbuf);
+}
+
+static void
+schedule_thumbnail_starter (void)
+{
+    /* We don't want to start it until all the other work is done, so the GUI
+     *  will be updated as quickly as possible. */
+    if (thumbnail_thread_starter_id == 0)
+    {
+        thumbnail_thread_starter_id = g_idle_add_full (G_PRIORITY_LOW, thumbnail_starter_cb, NULL, NULL);
+    }
+}
+
+static gboolean
+queues_are_empty (void)
+{
+    for (NautilusThumbnailPriority p = 0; p < NAUTILUS_THUMBNAIL_N_PRIORITIES; p++)
+    {
+        if (!nautilus_hash_queue_is_empty (thumbnails_to_make[p]))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void
+enqueue_thumbnail_info (NautilusThumbnailInfo *info)
+{
+    nautilus_hash_queue_enqueue (thumbnails_to_make[info->priority], info->image_uri, info);
+    if (info->is_video)
+    {
+        queued_videos += 1;
+    }
+}
+
+static void
+dequeue_thumbnail_info (NautilusThumbnailInfo *info)
+{
+    nautilus_hash_queue_remove (thumbnails_to_make[info->priority], info->image_uri);
+    if (info->is_video)
+    {
+        queued_videos -= 1;
+    }
+}
+
+/**
+ * nautilus_thumbnail_set_priority:
+ * @file_uri: the uri of a file a thumbnail was requested for
+ * @priority: the class to queue the request in
+ *
+ * Moves a pending request to the queue of @priority, ahead of the requests
+ * already there, except for %NAUTILUS_THUMBNAIL_PRIORITY_BACKGROUND which
+ * goes behind them. To keep an order among several files, set the most
+ * urgent one last.
+ */
+void
+nautilus_thumbnail_set_priority (const char                *file_uri,
+                                 NautilusThumbnailPriority  priority)
+{
+    NautilusThumbnailInfo *info;
+
+    g_return_if_fail (priority < NAUTILUS_THUMBNAIL_N_PRIORITIES);
+
+    if (G_UNLIKELY (currently_thumbnailing_hash == NULL))
+    {
+        return;
+    }
+
+    info = g_hash_table_lookup (currently_thumbnailing_hash, file_uri);
+    if (info != NULL)
+    {
+        /* Takes effect if it has to be made again. */
+        info->priority = priority;
+        return;
+    }
+
+    for (NautilusThumbnailPriority p = 0; p < NAUTILUS_THUMBNAIL_N_PRIORITIES && info == NULL; p++)
+    {
+        info = nautilus_hash_queue_find_item (thumbnails_to_make[p], file_uri);
+    }
+
+    if (info == NULL)
+    {
+        return;
+    }
+
+    if (info->priority != priority)
+    {
+        dequeue_thumbnail_info (info);
+        info->priority = priority;
+        enqueue_thumbnail_info (info);
+    }
+
+    if (priority == NAUTILUS_THUMBNAIL_PRIORITY_BACKGROUND)
+    {
+        nautilus_hash_queue_move_existing_to_tail (thumbnails_to_make[priority], file_uri);
+    }
+    else
+    {
+        nautilus_hash_queue_move_existing_to_head (thumbnails_to_make[priority], file_uri);
+    }
+
+    /* Requests that lost their callers are only noticed by the starter. */
+    schedule_thumbnail_starter ();
+}
+
+void
+nautilus_thumbnail_prioritize (const char *file_uri)
+{
+    nautilus_thumbnail_set_priority (file_uri, NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE);
+}
+
+void
+nautilus_thumbnail_deprioritize (const char *file_uri)
+{
+    nautilus_thumbnail_set_priority (file_uri, NAUTILUS_THUMBNAIL_PRIORITY_BACKGROUND);
+}
+
+void
+nautilus_thumbnail_get_stats (NautilusThumbnailStats *stats)
+{
+    gint64 elapsed = g_get_monotonic_time () - thumbnail_stats.window_start;
+
+    g_return_if_fail (stats != NULL);
+
+    *stats = (NautilusThumbnailStats) { 0 };
+
+    for (NautilusThumbnailPriority p = 0; p < NAUTILUS_THUMBNAIL_N_PRIORITIES; p++)
+    {
+        if (thumbnails_to_make[p] != NULL)
+        {
+            stats->queued[p] = nautilus_hash_queue_get_length (thumbnails_to_make[p]);
+        }
+    }
+
+    stats->running = running_threads;
+    stats->running_videos = running_video_threads;
+    stats->generated = thumbnail_stats.generated;
+    stats->failed = thumbnail_stats.failed;
+    stats->cancelled = thumbnail_stats.cancelled;
+    stats->timed_out = thumbnail_stats.timed_out;
+    stats->generated_in_process = thumbnail_stats.generated_in_process;
+    stats->in_process_fallbacks = thumbnail_stats.in_process_fallbacks;
+
+    /* The window is only closed when a thumbnail finishes, so an idle queue
+     * would otherwise keep reporting its last rate. */
+    if (thumbnail_stats.window_start != 0 && elapsed >= THROUGHPUT_WINDOW_USEC)
+    {
+        stats->finished_per_second = thumbnail_stats.window_finished * (gdouble) G_USEC_PER_SEC / elapsed;
+    }
+    else
+    {
+        stats->finished_per_second = thumbnail_stats.finished_per_second;
+    }
+}
+
+static void
+record_finished_thumbnail (void)
+{
+    gint64 now = g_get_monotonic_time ();
+    gint64 elapsed;
+
+    if (thumbnail_stats.window_start == 0)
+    {
+        thumbnail_stats.window_start = now;
+    }
+
+    thumbnail_stats.window_finished += 1;
+    elapsed = now - thumbnail_stats.window_start;
+
+    if (elapsed >= THROUGHPUT_WINDOW_USEC)
+    {
+        thumbnail_stats.finished_per_second = thumbnail_stats.window_finished * (gdouble) G_USEC_PER_SEC / elapsed;
+        thumbnail_stats.window_start = now;
+        thumbnail_stats.window_finished = 0;
+
+        g_debug ("%.1f thumbnails/s, %u running, %u visible, %u prefetch and %u background queued",
+                 thumbnail_stats.finished_per_second, running_threads,
+                 nautilus_hash_queue_get_length (thumbnails_to_make[NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE]),
+                 nautilus_hash_queue_get_length (thumbnails_to_make[NAUTILUS_THUMBNAIL_PRIORITY_PREFETCH]),
+                 nautilus_hash_queue_get_length (thumbnails_to_make[NAUTILUS_THUMBNAIL_PRIORITY_BACKGROUND]));
+    }
+}
+
+/***************************************************************************
+ * Mounts.
+ ***************************************************************************/
+
+typedef struct
+{
+    char *path;
+    const char *key;
+    gboolean is_slow;
+} MountPoint;
+
+/* Longest path first, so that the first prefix found is the enclosing mount. */
+static GPtrArray *mount_points = NULL;
+
+static void
+mount_point_free (MountPoint *mount_point)
+{
+    g_free (mount_point->path);
+    g_free (mount_point);
+}
+
+static gboolean
+is_slow_fs_type (const char *fs_type)
+{
+    static const char * const slow_fs_types[] =
+    {
+        "9p", "afs", "cifs", "exfat", "fuseblk", "msdos", "ncpfs", "nfs",
+        "nfs4", "ntfs", "ntfs3", "smb3", "smbfs", "sshfs", "udf", "vfat",
+        NULL
+    };
+
+    return g_str_has_prefix (fs_type, "fuse.") ||
+           g_strv_contains (slow_fs_types, fs_type);
+}
+
+static gint
+compare_mount_points (gconstpointer a,
+                      gconstpointer b)
+{
+    const MountPoint *mount_point_a = *(const MountPoint **) a;
+    const MountPoint *mount_point_b = *(const MountPoint **) b;
+
+    return (gint) strlen (mount_point_b->path) - (gint) strlen (mount_point_a->path);
+}
+
+static void
+on_mounts_changed (GUnixMountMonitor *monitor,
+                   gpointer           user_data)
+{
+    g_clear_pointer (&mount_points, g_ptr_array_unref);
+}
+
+static GPtrArray *
+get_mount_points (void)
+{
+    static GUnixMountMonitor *monitor = NULL;
+
+    if (G_UNLIKELY (monitor == NULL))
+    {
+        monitor = g_unix_mount_monitor_get ();
+        g_signal_connect (monitor, "mounts-changed", G_CALLBACK (on_mounts_changed), NULL);
+    }
+
+    if (mount_points == NULL)
+    {
+        GList *entries = g_unix_mount_entries_get (NULL);
+
+        mount_points = g_ptr_array_new_with_free_func ((GDestroyNotify) mount_point_free);
+
+        for (GList *l = entries; l != NULL; l = l->next)
+        {
+            GUnixMountEntry *entry = l->data;
+            MountPoint *mount_point = g_new0 (MountPoint, 1);
+
+            mount_point->path = g_strdup (g_unix_mount_entry_get_mount_path (entry));
+            mount_point->key = g_intern_string (mount_point->path);
+            mount_point->is_slow = is_slow_fs_type (g_unix_mount_entry_get_fs_type (entry)) ||
+                                   g_unix_mount_entry_guess_can_eject (entry);
+
+            g_ptr_array_add (mount_points, mount_point);
+        }
+
+        g_ptr_array_sort (mount_points, compare_mount_points);
+        g_list_free_full (entries, (GDestroyNotify) g_unix_mount_entry_free);
+    }
+
+    return mount_points;
+}
+
+/* Returns an interned string identifying the mount @uri is on, if that is a
+ * slow one, or NULL. */
+static const char *
+get_slow_mount_for_uri (const char *uri)
+{
+    g_autofree char *path = NULL;
+    GPtrArray *points;
+
+    if (!g_str_has_prefix (uri, "file://"))
+    {
+        /* Not mounted locally. With a host, that is somewhere on the network;
+         * without one, it is a virtual location like the trash. */
+        g_autofree char *scheme = NULL;
+        g_autofree char *host = NULL;
+        g_autofree char *key = NULL;
+
+        if (!g_uri_split (uri, G_URI_FLAGS_NONE, &scheme, NULL, &host, NULL, NULL, NULL, NULL, NULL) ||
+            host == NULL || *host == '\0')
+        {
+            return NULL;
+        }
+
+        key = g_strdup_printf ("%s://%s", scheme, host);
+
+        return g_intern_string (key);
+    }
+
+    path = g_filename_from_uri (uri, NULL, NULL);
+    if (path == NULL)
+    {
+        return NULL;
+    }
+
+    points = get_mount_points ();
+    for (guint i = 0; i < points->len; i++)
+    {
+        MountPoint *mount_point = points->pdata[i];
+        size_t length = strlen (mount_point->path);
+
+        if (g_str_has_prefix (path, mount_point->path) &&
+            (path[length] == '/' || path[length] == '\0' || g_str_equal (mount_point->path, "/")))
+        {
+            return mount_point->is_slow ? mount_point->key : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+static gboolean
+mount_has_free_thread (const char *slow_mount)
+{
+    return slow_mount == NULL ||
+           GPOINTER_TO_UINT (g_hash_table_lookup (running_per_slow_mount, slow_mount)) < MAX_THREADS_PER_SLOW_MOUNT;
+}
+
+static void
+count_running_on_mount (const char *slow_mount,
+                        gint        delta)
+{
+    guint count;
+
+    if (slow_mount == NULL)
+    {
+        return;
+    }
+
+    count = GPOINTER_TO_UINT (g_hash_table_lookup (running_per_slow_mount, slow_mount)) + delta;
+
+    if (count == 0)
+    {
+        g_hash_table_remove (running_per_slow_mount, slow_mount);
+    }
+    else
+    {
+        g_hash_table_insert (running_per_slow_mount, (gpointer) slow_mount, GUINT_TO_POINTER (count));
+    }
+}
+
+/***************************************************************************
+ * Thumbnail Thread Functions.
+ ***************************************************************************/
+
+static GHashTable *
+get_types_table (void)
+{
+    static GHashTable *image_mime_types = NULL;
+    GSList *format_list, *l;
+    char **types;
+    int i;
+
+    if (image_mime_types == NULL)
+    {
+        image_mime_types =
+            g_hash_table_new_full (g_str_hash, g_str_equal,
+                                   g_free, NULL);
+
+        format_list = gdk_pixbuf_get_formats ();
+        for (l = format_list; l; l = l->next)
+        {
+            types = gdk_pixbuf_format_get_mime_types (l->data);
+
+            for (i = 0; types[i] != NULL; i++)
+            {
+                g_hash_table_insert (image_mime_types,
+                                     types [i],
+                                     GUINT_TO_POINTER (1));
+            }
+
+            g_free (types);
+        }
+
+        g_slist_free (format_list);
+    }
+
+    return image_mime_types;
+}
+
+static gboolean
+pixbuf_can_load_type (const char *mime_type)
+{
+    GHashTable *image_mime_types;
+
+    image_mime_types = get_types_table ();
+    if (g_hash_table_lookup (image_mime_types, mime_type))
+    {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+gboolean
+nautilus_thumbnail_is_mimetype_limited_by_size (const char *mime_type)
+{
+    return pixbuf_can_load_type (mime_type);
+}
+
+gboolean
+nautilus_can_thumbnail (const gchar *uri,
+                        const gchar *mime_type,
+                        time_t       modified_time)
+{
+    GnomeDesktopThumbnailFactory *factory = get_thumbnail_factory ();
+
+    if (modified_time != INVALID_MTIME &&
+        failure_cache_lookup (uri, modified_time, UNKNOWN_SIZE))
+    {
+        return FALSE;
+    }
+
+    return gnome_desktop_thumbnail_factory_can_thumbnail (factory,
+                                                          uri,
+                                                          mime_type,
+                                                          modified_time);
+}
+
+static gboolean
+is_video_mime_type (const char *mime_type)
+{
+    return mime_type != NULL &&
+           (g_str_has_prefix (mime_type, "video/") ||
+            g_strv_contains (video_mime_types, mime_type));
+}
+
+static void
+handle_cancelled_callbacks (NautilusThumbnailInfo *info)
+{
+    for (guint i = 0; i < info->callbacks->len; i++)
+    {
+        ThumbnailCreationCallback *thumbnail_callback = info->callbacks->pdata[i];
+        ThumbnailCreationResult res = { .info = info, .callback = thumbnail_callback };
+
+        if (thumbnail_callback->cancellable != NULL &&
+            g_cancellable_is_cancelled (thumbnail_callback->cancellable))
+        {
+            g_debug ("Cancelled thumbnail: %s", info->image_uri);
+
+            if (thumbnail_callback->callback != NULL)
+            {
+                (*thumbnail_callback->callback) (NULL,
+                                                 (GAsyncResult *) &res,
+                                                 thumbnail_callback->user_data);
+            }
+
+            g_ptr_array_remove_index_fast (info->callbacks, i--);
+        }
+    }
+}
+
+static void
+handle_callbacks_and_free (NautilusThumbnailInfo *info)
+{
+    for (uint i = 0; i < info->callbacks->len; i++)
+    {
+        ThumbnailCreationCallback *thumbnail_callback = info->callbacks->pdata[i];
+        ThumbnailCreationResult res = { .info = info, .callback = thumbnail_callback };
+
+        if (thumbnail_callback->callback != NULL)
+        {
+            (*thumbnail_callback->callback) (NULL,
+                                             (GAsyncResult *) &res,
+                                             thumbnail_callback->user_data);
+        }
+    }
+
+    free_thumbnail_info (info);
+}
+
+static gboolean
+complete_failed_thumbnail (gpointer data)
+{
+    handle_callbacks_and_free (data);
+
+    return G_SOURCE_REMOVE;
+}
+
+void
+nautilus_create_thumbnail_async (const gchar               *uri,
+                                 const gchar               *mime_type,
+                                 time_t                     modified_time,
+                                 goffset                    size,
+                                 NautilusThumbnailPriority  priority,
+                                 GCancellable              *cancellable,
+                                 GAsyncReadyCallback        callback,
+                                 gpointer                   user_data)
+{
+    g_return_if_fail (uri != NULL && *uri != '\0');
+    g_return_if_fail (priority < NAUTILUS_THUMBNAIL_N_PRIORITIES);
+
+    g_autoptr (NautilusThumbnailInfo) info = g_new0 (NautilusThumbnailInfo, 1);
+    g_autoptr (ThumbnailCreationCallback) cb_data = g_new0 (ThumbnailCreationCallback, 1);
+
+    info->image_uri = g_strdup (uri);
+    info->mime_type = g_strdup (mime_type);
+    info->callbacks = g_ptr_array_new_with_free_func ((GDestroyNotify) free_thumbnail_callback);
+
+    cb_data->cancellable = cancellable != NULL ? g_object_ref (cancellable) : NULL;
+    cb_data->callback = callback;
+    cb_data->user_data = user_data;
+
+    if (cancellable != NULL &&
+        g_cancellable_is_cancelled (cancellable))
+    {
+        /* Call the callback immediately */
+        g_ptr_array_add (info->callbacks, g_steal_pointer (&cb_data));
+        handle_cancelled_callbacks (info);
+
+        return;
+    }
+
+    /* Hopefully the caller will already have the image file mtime,
+     *  so we can just use that. Otherwise we have to get it ourselves. */
+    if (modified_time == 0)
+    {
+        get_file_mtime (info->image_uri, &modified_time);
+    }
+
+    info->original_file_mtime = modified_time;
+    info->updated_file_mtime = modified_time;
+    info->size = size;
+
+    if (modified_time != INVALID_MTIME &&
+        failure_cache_lookup (info->image_uri, modified_time, size))
+    {
+        g_debug ("(Main Thread) Thumbnail failed before: %s",
+                 info->image_uri);
+
+        info->error = g_error_new (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                   "Making a thumbnail failed before");
+        g_ptr_array_add (info->callbacks, g_steal_pointer (&cb_data));
+
+        /* Callers don't expect to be called back before this returns. */
+        g_idle_add (complete_failed_thumbnail, g_steal_pointer (&info));
+
+        return;
+    }
+
+    if (G_UNLIKELY (currently_thumbnailing_hash == NULL))
+    {
+        for (NautilusThumbnailPriority p = 0; p < NAUTILUS_THUMBNAIL_N_PRIORITIES; p++)
+        {
+            thumbnails_to_make[p] = nautilus_hash_queue_new (g_str_hash, g_str_equal, NULL, NULL);
+        }
+        currently_thumbnailing_hash = g_hash_table_new (g_str_hash,
+                                                        g_str_equal);
+        running_per_slow_mount = g_hash_table_new (NULL, NULL);
+    }
+
+    /* Check if it is already in the list of thumbnails to make or
+     *  currently being made. */
+    NautilusThumbnailInfo *existing_info = g_hash_table_lookup (currently_thumbnailing_hash, info->image_uri);
+
+    for (NautilusThumbnailPriority p = 0; p < NAUTILUS_THUMBNAIL_N_PRIORITIES && existing_info == NULL; p++)
+    {
+        existing_info = nautilus_hash_queue_find_item (thumbnails_to_make[p], info->image_uri);
+    }
+
+    if (existing_info == NULL)
+    {
+        /* Add the thumbnail to the list. */
+        g_debug ("(Main Thread) Adding thumbnail: %s",
+                 info->image_uri);
+
+        info->priority = priority;
+        info->slow_mount = get_slow_mount_for_uri (info->image_uri);
+        info->is_video = is_video_mime_type (info->mime_type);
+
+        g_ptr_array_add (info->callbacks, g_steal_pointer (&cb_data));
+        enqueue_thumbnail_info (g_steal_pointer (&info));
+
+        schedule_thumbnail_starter ();
+    }
+    else
+    {
+        g_debug ("(Main Thread) Updating non-current mtime: %s",
+                 info->image_uri);
+
+        /* The file in the queue might need a new original mtime */
+        existing_info->updated_file_mtime = info->original_file_mtime;
+        existing_info->size = info->size;
+        g_ptr_array_add (existing_info->callbacks, g_steal_pointer (&cb_data));
+
+        if (priority < existing_info->priority)
+        {
+            nautilus_thumbnail_set_priority (existing_info->image_uri, priority);
+        }
+    }
+}
+
+GdkPixbuf *
+nautilus_create_thumbnail_finish (GAsyncResult  *res,
+                                  GError       **error)
+{
+    ThumbnailCreationResult *result = (ThumbnailCreationResult *) res;
+    ThumbnailCreationCallback *callback = result->callback;
+    NautilusThumbnailInfo *info = result->info;
+
+    if (callback->cancellable != NULL &&
+        g_cancellable_is_cancelled (callback->cancellable))
+    {
+        if (error != NULL)
+        {
+            *error = g_error_new (G_IO_ERROR, G_IO_ERROR_CANCELLED, "Cancelled");
+        }
+
+        return NULL;
+    }
+
+    if (info->error != NULL)
+    {
+        if (error != NULL)
+        {
+            *error = g_error_copy (info->error);
+        }
+
+        return NULL;
+    }
+
+    return info->pixbuf != NULL ? g_object_ref (info->pixbuf) : NULL;
+}
+
+static void
+release_thread (NautilusThumbnailInfo *info)
+{
+    if (!info->holds_thread)
+    {
+        return;
+    }
+
+    info->holds_thread = FALSE;
+    if (info->is_video)
+    {
+        running_video_threads -= 1;
+    }
+    else
+    {
+        running_threads -= 1;
+    }
+    count_running_on_mount (info->slow_mount, -1);
+}
+
+static void
+thumbnail_finalize (NautilusThumbnailInfo *info)
+{
+    gboolean was_cancelled = g_cancellable_is_cancelled (info->cancellable);
+
+    g_hash_table_remove (currently_thumbnailing_hash, info->image_uri);
+    release_thread (info);
 
     handle_cancelled_callbacks (info);
 
     /*  If the original file mtime of the request changed, then
-     *  we need to redo the thumbnail. */
-    if (info->original_file_mtime == info->updated_file_mtime ||
-        info->callbacks->len == 0)
+     *  we need to redo the thumbnail. The same goes for a cancelled one that
+     *  got requested again in the meantime, unless it ran out of time. */
+    was_cancelled = was_cancelled && !info->timed_out;
+    if (info->callbacks->len == 0 ||
+        (info->original_file_mtime == info->updated_file_mtime && !was_cancelled))
     {
         handle_callbacks_and_free (info);
     }
     else
     {
         info->original_file_mtime = info->updated_file_mtime;
+        g_clear_object (&info->pixbuf);
+        g_clear_error (&info->error);
 
-        nautilus_hash_queue_enqueue (thumbnails_to_make, info->image_uri, info);
+        enqueue_thumbnail_info (info);
     }
 
-    if (nautilus_hash_queue_is_empty (thumbnails_to_make))
+    if (queues_are_empty ())
     {
         g_debug ("(Thumbnail Async Thread) Exiting");
     }
@@ -548,6 +1861,14 @@ thumbnail_failed_cb (GObject      *source_object,
         g_debug ("(Thumbnail Async Thread) Could not create a failed thumbnail: %s (%s)",
                  info->image_uri, error->message);
     }
+    else
+    {
+        /* Don't wait for the monitor, the file will be looked up again
+         *  right away. */
+        g_autofree char *name = get_cache_name_for_uri (info->image_uri);
+
+        cache_index_update (CACHE_DIR_FAILED, name, TRUE);
+    }
 
     thumbnail_finalize (info);
 }
@@ -569,26 +1890,66 @@ thumbnail_saved_cb (GObject      *source_object,
         g_debug ("(Thumbnail Async Thread) Saving thumbnail failed: %s (%s)",
                  info->image_uri, error->message);
     }
+    else
+    {
+        g_autofree char *name = get_cache_name_for_uri (info->image_uri);
+
+        cache_index_update (get_thumbnail_scale (), name, TRUE);
+    }
+
+    failure_cache_remove (info->image_uri);
 
     thumbnail_finalize (info);
 }
 
+/* Takes ownership of @pixbuf. */
 static void
-thumbnail_generated_cb (GObject      *source_object,
-                        GAsyncResult *result,
-                        gpointer      data)
+thumbnail_generated (NautilusThumbnailInfo *info,
+                     GdkPixbuf             *pixbuf,
+                     GError                *error)
 {
-    GnomeDesktopThumbnailFactory *thumbnail_factory = GNOME_DESKTOP_THUMBNAIL_FACTORY (source_object);
-    NautilusThumbnailInfo *info = data;
-    g_autoptr (GError) error = NULL;
-    GdkPixbuf *pixbuf = NULL;
+    GnomeDesktopThumbnailFactory *thumbnail_factory = get_thumbnail_factory ();
 
-    pixbuf = gnome_desktop_thumbnail_factory_generate_thumbnail_finish (thumbnail_factory,
-                                                                        result,
-                                                                        &error);
+    g_clear_handle_id (&info->timeout_id, g_source_remove);
+
+    if (info->timed_out && pixbuf == NULL)
+    {
+        /* Whatever the thumbnailer says, it ran out of time, which may well be
+         *  down to a busy machine or a slow mount rather than the file. Like a
+         *  cancellation, it was counted and gave up its thread already, and
+         *  isn't recorded as failed, so that it gets tried again next time. */
+        g_debug ("(Thumbnail Async Thread) Thumbnail timed out: %s",
+                 info->image_uri);
+
+        info->error = g_error_new (G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                                   "Thumbnailing took longer than %u seconds",
+                                   video_timeout_secs);
+        thumbnail_finalize (info);
+
+        return;
+    }
+
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        /* Nobody wanted it anymore, which says nothing about the file, so
+         *  don't record a failure for it. */
+        g_debug ("(Thumbnail Async Thread) Thumbnail cancelled: %s",
+                 info->image_uri);
+
+        g_clear_object (&pixbuf);
+        thumbnail_stats.cancelled += 1;
+        info->error = g_error_copy (error);
+        thumbnail_finalize (info);
+
+        return;
+    }
+
+    record_finished_thumbnail ();
 
     if (pixbuf != NULL)
     {
+        thumbnail_stats.generated += 1;
+
         g_autofree gchar *mtime = g_strdup_printf ("%" G_GINT64_FORMAT,
                                                    (gint64) info->updated_file_mtime);
 
@@ -611,7 +1972,9 @@ thumbnail_generated_cb (GObject      *source_object,
     }
     else
     {
+        thumbnail_stats.failed += 1;
         info->error = g_error_copy (error);
+        failure_cache_add (info->image_uri, info->updated_file_mtime, info->size);
         g_debug ("(Thumbnail Async Thread) Thumbnail failed: %s (%s)",
                  info->image_uri, error->message);
 
@@ -624,86 +1987,397 @@ thumbnail_generated_cb (GObject      *source_object,
     }
 }
 
-/* This function is added as a very low priority idle function to start the
- *  async threads to create any needed thumbnails. It is added with a very
- *  low priority so that it doesn't delay showing the directory in the
- *  icon/list views. We want to show the files in the directory as quickly
- *  as possible. */
+static void
+thumbnail_generated_cb (GObject      *source_object,
+                        GAsyncResult *result,
+                        gpointer      data)
+{
+    GnomeDesktopThumbnailFactory *thumbnail_factory = GNOME_DESKTOP_THUMBNAIL_FACTORY (source_object);
+    g_autoptr (GError) error = NULL;
+    GdkPixbuf *pixbuf;
+
+    pixbuf = gnome_desktop_thumbnail_factory_generate_thumbnail_finish (thumbnail_factory,
+                                                                        result,
+                                                                        &error);
+
+    thumbnail_generated (data, pixbuf, error);
+}
+
 static gboolean
-thumbnail_starter_cb (gpointer data)
+video_thumbnail_timeout_cb (gpointer data)
 {
-    GnomeDesktopThumbnailFactory *thumbnail_factory;
-    NautilusThumbnailInfo *info = NULL;
-    guint ignored_thumbnails = 0;
-    time_t current_orig_mtime = 0;
-    time_t current_time;
-    guint backoff_time;
-    guint backoff_time_min = THUMBNAIL_CREATION_DELAY_SECS + 1;
+    NautilusThumbnailInfo *info = data;
 
-    g_debug ("(Main Thread) Creating thumbnails thread");
+    g_debug ("(Main Thread) Video thumbnail timed out: %s",
+             info->image_uri);
 
-    thumbnail_factory = get_thumbnail_factory ();
-    thumbnail_thread_starter_id = 0;
+    info->timeout_id = 0;
+    info->timed_out = TRUE;
+    thumbnail_stats.timed_out += 1;
 
-    if (G_UNLIKELY (max_threads == 0))
+    /* Answer the callers now rather than when the thumbnailer returns, which
+     *  only happens once it notices the cancellation, if it does. Whoever asks
+     *  again meanwhile gets the late result, if any. */
+    info->error = g_error_new (G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                               "Thumbnailing took longer than %u seconds",
+                               video_timeout_secs);
+    for (guint i = 0; i < info->callbacks->len; i++)
+    {
+        ThumbnailCreationCallback *thumbnail_callback = info->callbacks->pdata[i];
+        ThumbnailCreationResult res = { .info = info, .callback = thumbnail_callback };
+
+        if (thumbnail_callback->callback != NULL)
+        {
+            (*thumbnail_callback->callback) (NULL,
+                                             (GAsyncResult *) &res,
+                                             thumbnail_callback->user_data);
+        }
+    }
+    g_ptr_array_set_size (info->callbacks, 0);
+    g_clear_error (&info->error);
+
+    g_cancellable_cancel (info->cancellable);
+
+    /* Thumbnailers may well ignore the cancellation, and must not keep the
+     *  next video waiting meanwhile. The late result still finalizes it. */
+    release_thread (info);
+    schedule_thumbnail_starter ();
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+generate_thumbnail_externally (NautilusThumbnailInfo *info)
+{
+    if (info->is_video)
+    {
+        info->timeout_id = g_timeout_add_seconds (video_timeout_secs,
+                                                  video_thumbnail_timeout_cb, info);
+    }
+
+    gnome_desktop_thumbnail_factory_generate_thumbnail_async (get_thumbnail_factory (),
+                                                              info->image_uri,
+                                                              info->mime_type,
+                                                              info->cancellable,
+                                                              thumbnail_generated_cb,
+                                                              info);
+}
+
+/***************************************************************************
+ * In-process thumbnailing.
+ ***************************************************************************/
+
+/* Beyond this, decoding in our own address space is not worth the memory it
+ *  might take, compressed images being typically a tenth of their pixels. */
+#define IN_PROCESS_MAX_FILE_SIZE (64 * 1024 * 1024)
+
+typedef struct
+{
+    char *uri;
+    gint max_size;
+} InProcessThumbnailData;
+
+static void
+in_process_thumbnail_data_free (InProcessThumbnailData *data)
+{
+    g_free (data->uri);
+    g_free (data);
+}
+
+/* The external thumbnailers for these formats would only run the same
+ *  GdkPixbuf loaders that we have in process already, but pay for starting a
+ *  sandboxed process on every file. */
+static gboolean
+can_thumbnail_in_process (NautilusThumbnailInfo *info)
+{
+    static const char * const mime_types[] =
+    {
+        "image/jpeg", "image/png", "image/webp", NULL
+    };
+
+    return info->mime_type != NULL &&
+           g_strv_contains (mime_types, info->mime_type) &&
+           pixbuf_can_load_type (info->mime_type);
+}
+
+static void
+in_process_thumbnail_thread (GTask        *task,
+                             gpointer      source_object,
+                             gpointer      task_data,
+                             GCancellable *cancellable)
+{
+    InProcessThumbnailData *data = task_data;
+    g_autoptr (GFile) file = g_file_new_for_uri (data->uri);
+    g_autoptr (GFileInputStream) stream = NULL;
+    g_autoptr (GFileInfo) file_info = NULL;
+    g_autoptr (GdkPixbuf) pixbuf = NULL;
+    GError *error = NULL;
+
+    stream = g_file_read (file, cancellable, &error);
+    if (stream == NULL)
+    {
+        g_task_return_error (task, error);
+        return;
+    }
+
+    file_info = g_file_input_stream_query_info (stream, G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                                cancellable, NULL);
+    if (file_info != NULL &&
+        g_file_info_get_size (file_info) > IN_PROCESS_MAX_FILE_SIZE)
+    {
+        g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                                 "Too large to be thumbnailed in process");
+        return;
+    }
+
+    pixbuf = nautilus_thumbnail_decode_stream (G_INPUT_STREAM (stream), data->max_size,
+                                               cancellable, &error);
+    if (pixbuf == NULL)
+    {
+        g_task_return_error (task, error);
+        return;
+    }
+
+    g_task_return_pointer (task, gdk_pixbuf_apply_embedded_orientation (pixbuf), g_object_unref);
+}
+
+static void
+in_process_thumbnail_done_cb (GObject      *source_object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+    NautilusThumbnailInfo *info = user_data;
+    g_autoptr (GError) error = NULL;
+    GdkPixbuf *pixbuf;
+
+    pixbuf = g_task_propagate_pointer (G_TASK (result), &error);
+
+    if (pixbuf == NULL &&
+        !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        /* Let a real thumbnailer try, and have the final say on whether
+         *  the file can be thumbnailed at all. */
+        g_debug ("(Thumbnail Async Thread) In-process thumbnail failed: %s (%s)",
+                 info->image_uri, error->message);
+
+        thumbnail_stats.in_process_fallbacks += 1;
+        generate_thumbnail_externally (info);
+
+        return;
+    }
+
+    if (pixbuf != NULL)
     {
-        max_threads = MAX_THUMBNAILING_THREADS
+        thumbnail_stats.generated_in_process += 1;
     }
 
-    /* We loop until the queue is empty, or we reach the thread limit. */
-    while (ignored_thumbnails < nautilus_hash_queue_get_length (thumbnails_to_make) &&
-           running_threads <= max_threads)
+    thumbnail_generated (info, pixbuf, error);
+}
+
+static void
+generate_thumbnail_in_process (NautilusThumbnailInfo *info)
+{
+    g_autoptr (GTask) task = g_task_new (NULL, info->cancellable, in_process_thumbnail_done_cb, info);
+    InProcessThumbnailData *data = g_new0 (InProcessThumbnailData, 1);
+
+    data->uri = g_strdup (info->image_uri);
+    data->max_size = nautilus_thumbnail_get_max_size ();
+
+    g_task_set_source_tag (task, generate_thumbnail_in_process);
+    g_task_set_task_data (task, data, (GDestroyNotify) in_process_thumbnail_data_free);
+    g_task_run_in_thread (task, in_process_thumbnail_thread);
+}
+
+/* Cancels the thumbnails being made that all their callers have given up on,
+ *  like the ones of rows that were scrolled past before they got one. */
+static void
+cancel_unwanted_thumbnails (void)
+{
+    g_autoptr (GList) running = g_hash_table_get_values (currently_thumbnailing_hash);
+
+    for (GList *l = running; l != NULL; l = l->next)
     {
-        info = nautilus_hash_queue_peek_head (thumbnails_to_make);
-        nautilus_hash_queue_remove (thumbnails_to_make, info->image_uri);
+        NautilusThumbnailInfo *info = l->data;
 
         handle_cancelled_callbacks (info);
 
-        if (info->callbacks->len == 0)
+        if (info->callbacks->len == 0 &&
+            !g_cancellable_is_cancelled (info->cancellable))
         {
-            free_thumbnail_info (info);
+            g_debug ("(Main Thread) Cancelling thumbnail: %s",
+                     info->image_uri);
 
-            continue;
+            g_cancellable_cancel (info->cancellable);
         }
+    }
+}
+
+static gboolean
+has_free_thread (NautilusThumbnailInfo *info)
+{
+    if (info->is_video)
+    {
+        return running_video_threads < MAX_VIDEO_THUMBNAILING_THREADS;
+    }
+
+    return running_threads < max_threads;
+}
+
+/* Whether none of the @images_left images and @videos_left videos still to
+ *  be looked at could get a thread. */
+static gboolean
+no_thread_for (guint images_left,
+               guint videos_left)
+{
+    return (images_left == 0 || running_threads >= max_threads) &&
+           (videos_left == 0 || running_video_threads >= MAX_VIDEO_THUMBNAILING_THREADS);
+}
+
+static void
+start_thumbnail (NautilusThumbnailInfo *info)
+{
+    g_debug ("(Thumbnail Thread) Creating thumbnail: %s",
+             info->image_uri);
+
+    if (info->is_video)
+    {
+        running_video_threads += 1;
+    }
+    else
+    {
+        running_threads += 1;
+    }
+    info->holds_thread = TRUE;
+    info->timed_out = FALSE;
+    count_running_on_mount (info->slow_mount, 1);
+    g_hash_table_insert (currently_thumbnailing_hash, info->image_uri, info);
+
+    g_clear_object (&info->cancellable);
+    info->cancellable = g_cancellable_new ();
+
+    if (can_thumbnail_in_process (info))
+    {
+        generate_thumbnail_in_process (info);
+    }
+    else
+    {
+        generate_thumbnail_externally (info);
+    }
+}
+
+/* Starts the most urgent thumbnails that can be made right away, in a single
+ *  pass over the queues that ends as soon as nothing left in them could get
+ *  a thread. Skipped ones keep their place, and @backoff_time is lowered to
+ *  when the first recently modified one can be made. */
+static void
+start_next_thumbnails (guint *backoff_time)
+{
+    guint videos_left = queued_videos;
+    guint images_left = 0;
+    time_t current_time;
+
+    for (NautilusThumbnailPriority p = 0; p < NAUTILUS_THUMBNAIL_N_PRIORITIES; p++)
+    {
+        images_left += nautilus_hash_queue_get_length (thumbnails_to_make[p]);
+    }
+    images_left -= queued_videos;
+
+    if (no_thread_for (images_left, videos_left))
+    {
+        return;
+    }
+
+    time (&current_time);
 
-        current_orig_mtime = info->updated_file_mtime;
-        time (&current_time);
+    for (NautilusThumbnailPriority p = 0; p < NAUTILUS_THUMBNAIL_N_PRIORITIES; p++)
+    {
+        GList *next;
 
-        /* Don't try to create a thumbnail if the file was modified recently.
-         *  This prevents constant re-thumbnailing of changing files. */
-        if (current_time < current_orig_mtime + THUMBNAIL_CREATION_DELAY_SECS &&
-            current_time >= current_orig_mtime)
+        for (GList *l = ((GQueue *) thumbnails_to_make[p])->head; l != NULL; l = next)
         {
-            g_debug ("(Thumbnail Thread) Skipping: %s",
-                     info->image_uri);
+            NautilusThumbnailInfo *info = l->data;
+            time_t current_orig_mtime = info->updated_file_mtime;
 
-            /* Only retain the smallest backoff time */
-            backoff_time = THUMBNAIL_CREATION_DELAY_SECS - (current_time - current_orig_mtime);
-            backoff_time_min = MIN (backoff_time, backoff_time_min);
+            next = l->next;
 
-            nautilus_hash_queue_enqueue (thumbnails_to_make, info->image_uri, info);
-            ignored_thumbnails += 1;
-            continue;
+            if (info->is_video)
+            {
+                videos_left -= 1;
+            }
+            else
+            {
+                images_left -= 1;
+            }
+
+            handle_cancelled_callbacks (info);
+
+            if (info->callbacks->len == 0)
+            {
+                dequeue_thumbnail_info (info);
+                free_thumbnail_info (info);
+
+                continue;
+            }
+
+            /* Don't try to create a thumbnail if the file was modified recently.
+             *  This prevents constant re-thumbnailing of changing files. */
+            if (current_time < current_orig_mtime + THUMBNAIL_CREATION_DELAY_SECS &&
+                current_time >= current_orig_mtime)
+            {
+                g_debug ("(Thumbnail Thread) Skipping: %s",
+                         info->image_uri);
+
+                /* Only retain the smallest backoff time */
+                *backoff_time = MIN (*backoff_time,
+                                     THUMBNAIL_CREATION_DELAY_SECS - (current_time - current_orig_mtime));
+
+                continue;
+            }
+
+            /* Slow media must not take the threads needed by everything
+             *  else; their turn comes again when one of theirs finishes. */
+            if (!has_free_thread (info) ||
+                !mount_has_free_thread (info->slow_mount))
+            {
+                continue;
+            }
+
+            dequeue_thumbnail_info (info);
+            start_thumbnail (info);
+
+            if (no_thread_for (images_left, videos_left))
+            {
+                return;
+            }
         }
+    }
+}
 
-        /* Create the thumbnail. */
-        g_debug ("(Thumbnail Thread) Creating thumbnail: %s",
-                 info->image_uri);
+/* This function is added as a very low priority idle function to start the
+ *  async threads to create any needed thumbnails. It is added with a very
+ *  low priority so that it doesn't delay showing the directory in the
+ *  icon/list views. We want to show the files in the directory as quickly
+ *  as possible. */
+static gboolean
+thumbnail_starter_cb (gpointer data)
+{
+    guint backoff_time_min = THUMBNAIL_CREATION_DELAY_SECS + 1;
 
-        running_threads += 1;
-        g_hash_table_insert (currently_thumbnailing_hash, info->image_uri, info);
+    g_debug ("(Main Thread) Creating thumbnails thread");
 
-        gnome_desktop_thumbnail_factory_generate_thumbnail_async (thumbnail_factory,
-                                                                  info->image_uri,
-                                                                  info->mime_type,
-                                                                  NULL,
-                                                                  thumbnail_generated_cb,
-                                                                  info);
+    thumbnail_thread_starter_id = 0;
+
+    if (G_UNLIKELY (max_threads == 0))
+    {
+        max_threads = MAX_THUMBNAILING_THREADS;
     }
 
+    cancel_unwanted_thumbnails ();
+    start_next_thumbnails (&backoff_time_min);
+
     /* Reschedule thumbnailing via a change notification */
     if (thumbnail_thread_starter_id == 0 &&
-        ignored_thumbnails > 0)
+        backoff_time_min <= THUMBNAIL_CREATION_DELAY_SECS)
     {
         thumbnail_thread_starter_id = g_timeout_add_seconds (backoff_time_min,
                                                              thumbnail_starter_cb, NULL);
@@ -711,3 +2385,26 @@ thumbnail_starter_cb (gpointer data)
 
     return G_SOURCE_REMOVE;
 }
+
+/**
+ * nautilus_thumbnail_set_max_threads:
+ * @n_threads: how many images may be thumbnailed at once, or 0 for the default
+ *
+ * Overrides the number of threads picked from the number of processors.
+ * Videos have threads of their own.
+ */
+void
+nautilus_thumbnail_set_max_threads (guint n_threads)
+{
+    max_threads = n_threads;
+}
+
+/**
+ * nautilus_thumbnail_set_video_timeout:
+ * @seconds: how long callers wait for a video thumbnail, or 0 for the default
+ */
+void
+nautilus_thumbnail_set_video_timeout (guint seconds)
+{
+    video_timeout_secs = seconds > 0 ? seconds : VIDEO_THUMBNAIL_TIMEOUT_SECS;
+}
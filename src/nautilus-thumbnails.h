@@ -23,15 +23,49 @@
 
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
+/* Requests are served class by class, in this order. */
+typedef enum
+{
+    NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE,
+    NAUTILUS_THUMBNAIL_PRIORITY_PREFETCH,
+    NAUTILUS_THUMBNAIL_PRIORITY_BACKGROUND,
+    NAUTILUS_THUMBNAIL_N_PRIORITIES,
+} NautilusThumbnailPriority;
+
+typedef struct
+{
+    guint queued[NAUTILUS_THUMBNAIL_N_PRIORITIES];
+    guint running;
+    guint running_videos;
+
+    /* Since startup */
+    guint64 generated;
+    guint64 failed;
+    guint64 cancelled;
+    /* Videos that took too long, counted in failed too once given up on */
+    guint64 timed_out;
+    /* Decoded by Nautilus itself, counted in generated too */
+    guint64 generated_in_process;
+    /* Handed on to a thumbnailer after failing to decode in process */
+    guint64 in_process_fallbacks;
+
+    /* Generated or failed, over the last few seconds */
+    gdouble finished_per_second;
+} NautilusThumbnailStats;
+
 guint      nautilus_thumbnail_get_max_size          (void);
 
-/* Returns NULL if there's no thumbnail yet. */
-void       nautilus_create_thumbnail_async          (const gchar         *uri,
-                                                     const gchar         *mime_type,
-                                                     time_t               modified_time,
-                                                     GCancellable        *cancellable,
-                                                     GAsyncReadyCallback  callback,
-                                                     gpointer             user_data);
+/* Returns NULL if there's no thumbnail yet. @size may be -1 if unknown.
+ * @priority is the class the request is queued in, if it isn't already in a
+ * more urgent one. */
+void       nautilus_create_thumbnail_async          (const gchar               *uri,
+                                                     const gchar               *mime_type,
+                                                     time_t                     modified_time,
+                                                     goffset                    size,
+                                                     NautilusThumbnailPriority  priority,
+                                                     GCancellable              *cancellable,
+                                                     GAsyncReadyCallback        callback,
+                                                     gpointer                   user_data);
 GdkPixbuf *nautilus_create_thumbnail_finish         (GAsyncResult  *res,
                                                      GError       **error);
 gboolean   nautilus_can_thumbnail                   (const gchar *uri,
@@ -40,7 +74,35 @@ gboolean   nautilus_can_thumbnail                   (const gchar *uri,
 gboolean   nautilus_thumbnail_is_mimetype_limited_by_size
 						    (const char *mime_type);
 char *     nautilus_thumbnail_get_path_for_uri      (const char *uri);
+typedef struct
+{
+    /* The largest thumbnail available, preferring the size we make. */
+    char *path;
+    /* Whether making one failed before. */
+    gboolean failed;
+} NautilusThumbnailCacheEntry;
+
+void       nautilus_thumbnail_lookup_async          (GPtrArray           *uris,
+                                                     GCancellable        *cancellable,
+                                                     GAsyncReadyCallback  callback,
+                                                     gpointer             user_data);
+GArray *   nautilus_thumbnail_lookup_finish         (GAsyncResult  *result,
+                                                     GError       **error);
+GdkPixbuf *nautilus_thumbnail_decode_stream         (GInputStream  *stream,
+                                                     gint           max_size,
+                                                     GCancellable  *cancellable,
+                                                     GError       **error);
 
 /* Queue handling: */
+void       nautilus_thumbnail_set_priority          (const char                *file_uri,
+                                                     NautilusThumbnailPriority  priority);
 void       nautilus_thumbnail_prioritize            (const char   *file_uri);
 void       nautilus_thumbnail_deprioritize          (const char   *file_uri);
+void       nautilus_thumbnail_get_stats             (NautilusThumbnailStats *stats);
+
+/* Failure handling: */
+void       nautilus_thumbnail_purge_failures        (const char *uri_prefix);
+
+/* testing-only */
+void       nautilus_thumbnail_set_max_threads       (guint n_threads);
+void       nautilus_thumbnail_set_video_timeout     (guint seconds);
@@ -47,6 +47,7 @@ typedef struct  NautilusHashQueue           NautilusHashQueue;
 typedef struct _NautilusIconInfo            NautilusIconInfo;
 typedef struct _NautilusListBase            NautilusListBase;
 typedef struct  NautilusMonitor             NautilusMonitor;
+typedef struct  NautilusNameIndex           NautilusNameIndex;
 typedef struct _NautilusProgressInfo        NautilusProgressInfo;
 typedef struct _NautilusQuery               NautilusQuery;
 typedef struct _NautilusQueryEditor         NautilusQueryEditor;
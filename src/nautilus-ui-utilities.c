@@ -259,23 +259,30 @@ nautilus_g_menu_replace_string_in_item (GMenu       *menu,
     g_menu_insert_item (menu, i, item);
 }
 
-static GdkPixbuf *filmholes_left = NULL;
-static GdkPixbuf *filmholes_right = NULL;
+/* Uploaded once and shared by every video thumbnail, so that framing
+ * doesn't create new textures on each snapshot. */
+static GdkTexture *filmholes_left = NULL;
+static GdkTexture *filmholes_right = NULL;
 
 static gboolean
 ensure_filmholes (void)
 {
     if (filmholes_left == NULL)
     {
-        filmholes_left = gdk_pixbuf_new_from_resource ("/org/gnome/nautilus/image/filmholes.png", NULL);
-    }
-    if (filmholes_right == NULL &&
-        filmholes_left != NULL)
-    {
-        filmholes_right = gdk_pixbuf_flip (filmholes_left, TRUE);
+        g_autoptr (GdkPixbuf) left = gdk_pixbuf_new_from_resource ("/org/gnome/nautilus/image/filmholes.png", NULL);
+
+        if (left == NULL)
+        {
+            return FALSE;
+        }
+
+        g_autoptr (GdkPixbuf) right = gdk_pixbuf_flip (left, TRUE);
+
+        filmholes_left = gdk_texture_new_for_pixbuf (left);
+        filmholes_right = gdk_texture_new_for_pixbuf (right);
     }
 
-    return (filmholes_left && filmholes_right);
+    return TRUE;
 }
 
 void
@@ -283,8 +290,6 @@ nautilus_ui_frame_video (GtkSnapshot *snapshot,
                          gdouble      width,
                          gdouble      height)
 {
-    g_autoptr (GdkTexture) left_texture = NULL;
-    g_autoptr (GdkTexture) right_texture = NULL;
     int holes_width, holes_height;
 
     if (!ensure_filmholes ())
@@ -292,16 +297,15 @@ nautilus_ui_frame_video (GtkSnapshot *snapshot,
         return;
     }
 
-    holes_width = gdk_pixbuf_get_width (filmholes_left);
-    holes_height = gdk_pixbuf_get_height (filmholes_left);
+    holes_width = gdk_texture_get_width (filmholes_left);
+    holes_height = gdk_texture_get_height (filmholes_left);
 
     /* Left */
     gtk_snapshot_push_repeat (snapshot,
                               &GRAPHENE_RECT_INIT (0, 0, holes_width, height),
                               NULL);
-    left_texture = gdk_texture_new_for_pixbuf (filmholes_left);
     gtk_snapshot_append_texture (snapshot,
-                                 left_texture,
+                                 filmholes_left,
                                  &GRAPHENE_RECT_INIT (0, 0, holes_width, holes_height));
     gtk_snapshot_pop (snapshot);
 
@@ -309,9 +313,8 @@ nautilus_ui_frame_video (GtkSnapshot *snapshot,
     gtk_snapshot_push_repeat (snapshot,
                               &GRAPHENE_RECT_INIT (width - holes_width, 0, holes_width, height),
                               NULL);
-    right_texture = gdk_texture_new_for_pixbuf (filmholes_right);
     gtk_snapshot_append_texture (snapshot,
-                                 right_texture,
+                                 filmholes_right,
                                  &GRAPHENE_RECT_INIT (width - holes_width, 0, holes_width, holes_height));
     gtk_snapshot_pop (snapshot);
 }
@@ -6,6 +6,7 @@
 
 #include "nautilus-view-cell.h"
 
+#include "nautilus-file.h"
 #include "nautilus-list-base.h"
 #include "nautilus-view-item.h"
 
@@ -19,6 +20,11 @@
  *
  * The view is responsible for setting #NautilusViewCell:item. This can be done
  * using a GBinding from #GtkListItem:item to #NautilusViewCell:item.
+ *
+ * The view only monitors basic information for all of its files. Subclasses
+ * which show more than that declare it with
+ * nautilus_view_cell_set_file_attributes(), and it is then requested only for
+ * the file of the item the cell is bound to.
  */
 
 typedef struct _NautilusViewCellPrivate NautilusViewCellPrivate;
@@ -29,6 +35,9 @@ struct _NautilusViewCellPrivate
     NautilusListBase *view; /* Unowned */
     NautilusViewItem *item; /* Owned reference */
 
+    NautilusFileAttributes file_attributes;
+    NautilusFile *monitored_file; /* Owned reference */
+
     guint icon_size;
     guint position;
 
@@ -50,6 +59,42 @@ enum
 
 static GParamSpec *properties[N_PROPS] = { NULL, };
 
+static void
+clear_file_monitor (NautilusViewCell *self)
+{
+    NautilusViewCellPrivate *priv = nautilus_view_cell_get_instance_private (self);
+
+    if (priv->monitored_file != NULL)
+    {
+        nautilus_file_monitor_remove (priv->monitored_file, self);
+        g_clear_object (&priv->monitored_file);
+    }
+}
+
+static void
+update_file_monitor (NautilusViewCell *self)
+{
+    NautilusViewCellPrivate *priv = nautilus_view_cell_get_instance_private (self);
+    NautilusFile *file = NULL;
+
+    if (priv->item != NULL && priv->file_attributes != 0)
+    {
+        file = nautilus_view_item_get_file (priv->item);
+    }
+
+    if (priv->monitored_file != file)
+    {
+        clear_file_monitor (self);
+    }
+
+    if (file != NULL)
+    {
+        /* Replaces the attributes if the file is monitored already. */
+        nautilus_file_monitor_add (file, self, priv->file_attributes);
+        g_set_object (&priv->monitored_file, file);
+    }
+}
+
 static void
 nautilus_view_cell_get_property (GObject    *object,
                                  guint       prop_id,
@@ -111,7 +156,10 @@ nautilus_view_cell_set_property (GObject      *object,
 
         case PROP_ITEM:
         {
-            g_set_object (&priv->item, g_value_get_object (value));
+            if (g_set_object (&priv->item, g_value_get_object (value)))
+            {
+                update_file_monitor (self);
+            }
         }
         break;
 
@@ -146,6 +194,7 @@ nautilus_view_cell_dispose (GObject *object)
     NautilusViewCell *self = NAUTILUS_VIEW_CELL (object);
     NautilusViewCellPrivate *priv = nautilus_view_cell_get_instance_private (self);
 
+    clear_file_monitor (self);
     g_clear_object (&priv->item);
     g_clear_weak_pointer (&priv->view);
 
@@ -196,6 +245,31 @@ nautilus_view_cell_once (NautilusViewCell *self)
     return TRUE;
 }
 
+/**
+ * nautilus_view_cell_set_file_attributes:
+ * @self: a #NautilusViewCell
+ * @attributes: what the cell shows beyond basic file information
+ *
+ * Keeps @attributes loaded and up to date for the file of the bound item, for
+ * as long as it is bound.
+ */
+void
+nautilus_view_cell_set_file_attributes (NautilusViewCell       *self,
+                                        NautilusFileAttributes  attributes)
+{
+    g_return_if_fail (NAUTILUS_IS_VIEW_CELL (self));
+
+    NautilusViewCellPrivate *priv = nautilus_view_cell_get_instance_private (self);
+
+    if (priv->file_attributes == attributes)
+    {
+        return;
+    }
+
+    priv->file_attributes = attributes;
+    update_file_monitor (self);
+}
+
 guint
 nautilus_view_cell_get_position (NautilusViewCell *self)
 {
@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include "nautilus-enums.h"
 #include "nautilus-types.h"
 
 #include <gtk/gtk.h>
@@ -27,5 +28,7 @@ void nautilus_view_cell_set_item (NautilusViewCell      *self,
 NautilusViewItem *nautilus_view_cell_get_item (NautilusViewCell *self);
 guint nautilus_view_cell_get_position (NautilusViewCell *self);
 gboolean nautilus_view_cell_once (NautilusViewCell *self);
+void nautilus_view_cell_set_file_attributes (NautilusViewCell       *self,
+                                             NautilusFileAttributes  attributes);
 
 G_END_DECLS
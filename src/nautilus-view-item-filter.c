@@ -11,6 +11,24 @@
 #include "nautilus-view-item.h"
 
 #include <gio/gio.h>
+#include <string.h>
+
+/**
+ * The file filters of the file chooser are GtkFileFilters, but matching
+ * those means filling a GFileInfo for each item and going through all the
+ * rules of the filter every time. Instead, the rules are read out once and
+ * compiled into something each item can be checked against cheaply:
+ *
+ * - The "*.ext" patterns, including the case-insensitive "*.[eE][xX][tT]"
+ *   form GTK makes of suffixes, become tables of suffixes, so a name is
+ *   matched by looking up what follows each of its dots.
+ * - Content types are checked against the MIME types of the filter once per
+ *   distinct content type, subclasses included, and the answer is kept.
+ * - Any other pattern is left to a GtkFileFilter holding just those.
+ *
+ * As a filter matches whatever any of its rules matches, comparing the rules
+ * of the old and new filter tells whether it got more or less strict.
+ */
 
 enum
 {
@@ -21,6 +39,31 @@ enum
 
 static GParamSpec *properties[N_PROPS] = { NULL, };
 
+typedef enum
+{
+    RULE_PATTERN = 0,
+    RULE_MIME_TYPE = 1,
+} RuleType;
+
+typedef struct
+{
+    /* "type:value" strings of all rules, for comparing filters. */
+    GHashTable *rules;
+
+    gboolean matches_all;
+    GHashTable *suffixes;
+    /* Lowercase. */
+    GHashTable *suffixes_ignoring_case;
+
+    GPtrArray *content_types;
+    /* Content type -> whether it is one of content_types or a subclass. */
+    GHashTable *content_type_matches;
+
+    /* For patterns that aren't plain suffixes. */
+    GtkFileFilter *fallback;
+    GFileInfo *mannequin;
+} CompiledFilter;
+
 struct _NautilusViewItemFilter
 {
     GtkFilter parent_instance;
@@ -28,11 +71,242 @@ struct _NautilusViewItemFilter
     GtkFilterMatch strictness;
 
     GtkFileFilter *file_filter;
-    GFileInfo *mannequin;
+    CompiledFilter *compiled;
 };
 
 G_DEFINE_TYPE (NautilusViewItemFilter, nautilus_view_item_filter, GTK_TYPE_FILTER)
 
+static void
+compiled_filter_free (CompiledFilter *compiled)
+{
+    g_hash_table_unref (compiled->rules);
+    g_hash_table_unref (compiled->suffixes);
+    g_hash_table_unref (compiled->suffixes_ignoring_case);
+    g_ptr_array_unref (compiled->content_types);
+    g_hash_table_unref (compiled->content_type_matches);
+    g_clear_object (&compiled->fallback);
+    g_clear_object (&compiled->mannequin);
+    g_free (compiled);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (CompiledFilter, compiled_filter_free)
+
+/* Returns the suffix matched by @pattern if it is of the "*.ext" form, or the
+ * "*.[eE][xX][tT]" form for a case-insensitive suffix. Returns %NULL for
+ * anything else.
+ */
+static char *
+parse_suffix_pattern (const char *pattern,
+                      gboolean   *ignore_case)
+{
+    g_autoptr (GString) suffix = NULL;
+    gboolean has_brackets = FALSE;
+    gboolean has_plain_letters = FALSE;
+
+    if (!g_str_has_prefix (pattern, "*.") || pattern[2] == '\0')
+    {
+        return NULL;
+    }
+
+    suffix = g_string_new (NULL);
+    for (const char *p = pattern + 2; *p != '\0';)
+    {
+        if (*p == '[')
+        {
+            /* Only a pair of the same ASCII letter in both cases. */
+            if (g_ascii_isalpha (p[1]) && g_ascii_isalpha (p[2]) && p[3] == ']' &&
+                p[1] != p[2] && g_ascii_tolower (p[1]) == g_ascii_tolower (p[2]))
+            {
+                g_string_append_c (suffix, g_ascii_tolower (p[1]));
+                has_brackets = TRUE;
+                p += 4;
+                continue;
+            }
+
+            return NULL;
+        }
+
+        if (*p == '*' || *p == '?' || *p == ']' || *p == '\\')
+        {
+            return NULL;
+        }
+
+        has_plain_letters = has_plain_letters || g_ascii_isalpha (*p);
+        g_string_append_c (suffix, *p);
+        p++;
+    }
+
+    /* Partly case-insensitive patterns aren't worth telling apart. */
+    if (has_brackets && has_plain_letters)
+    {
+        return NULL;
+    }
+
+    *ignore_case = has_brackets;
+
+    return g_string_free_and_steal (g_steal_pointer (&suffix));
+}
+
+static CompiledFilter *
+compiled_filter_new (GtkFileFilter *file_filter)
+{
+    g_autoptr (CompiledFilter) compiled = g_new0 (CompiledFilter, 1);
+    g_autoptr (GVariant) serialized = gtk_file_filter_to_gvariant (file_filter);
+    g_autoptr (GVariantIter) iter = NULL;
+    guint32 type;
+    const char *value;
+
+    compiled->rules = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    compiled->suffixes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    compiled->suffixes_ignoring_case = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                              g_free, NULL);
+    compiled->content_types = g_ptr_array_new_with_free_func (g_free);
+    compiled->content_type_matches = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                            g_free, NULL);
+
+    g_variant_get (serialized, "(&sa(us))", NULL, &iter);
+    while (g_variant_iter_next (iter, "(u&s)", &type, &value))
+    {
+        g_hash_table_add (compiled->rules, g_strdup_printf ("%u:%s", type, value));
+
+        if (type == RULE_PATTERN)
+        {
+            g_autofree char *suffix = NULL;
+            gboolean ignore_case;
+
+            if (g_str_equal (value, "*"))
+            {
+                compiled->matches_all = TRUE;
+            }
+            else if ((suffix = parse_suffix_pattern (value, &ignore_case)) != NULL)
+            {
+                g_hash_table_add (ignore_case ?
+                                  compiled->suffixes_ignoring_case :
+                                  compiled->suffixes,
+                                  g_steal_pointer (&suffix));
+            }
+            else
+            {
+                if (compiled->fallback == NULL)
+                {
+                    compiled->fallback = gtk_file_filter_new ();
+                    compiled->mannequin = g_file_info_new ();
+                }
+                gtk_file_filter_add_pattern (compiled->fallback, value);
+            }
+        }
+        else if (type == RULE_MIME_TYPE)
+        {
+            char *content_type = g_content_type_from_mime_type (value);
+
+            g_ptr_array_add (compiled->content_types,
+                             content_type != NULL ? content_type : g_strdup (value));
+        }
+    }
+
+    return g_steal_pointer (&compiled);
+}
+
+static gboolean
+match_suffixes (GHashTable *suffixes,
+                const char *name)
+{
+    for (const char *dot = strchr (name, '.'); dot != NULL; dot = strchr (dot + 1, '.'))
+    {
+        if (g_hash_table_contains (suffixes, dot + 1))
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static gboolean
+match_content_type (CompiledFilter *compiled,
+                    const char     *content_type)
+{
+    gpointer matches;
+
+    if (compiled->content_types->len == 0 || content_type == NULL)
+    {
+        return FALSE;
+    }
+
+    if (!g_hash_table_lookup_extended (compiled->content_type_matches, content_type,
+                                       NULL, &matches))
+    {
+        matches = GINT_TO_POINTER (FALSE);
+        for (guint i = 0; i < compiled->content_types->len; i++)
+        {
+            if (g_content_type_is_a (content_type, g_ptr_array_index (compiled->content_types, i)))
+            {
+                matches = GINT_TO_POINTER (TRUE);
+                break;
+            }
+        }
+
+        g_hash_table_insert (compiled->content_type_matches, g_strdup (content_type), matches);
+    }
+
+    return GPOINTER_TO_INT (matches);
+}
+
+static gboolean
+compiled_filter_match (CompiledFilter *compiled,
+                       NautilusFile   *file)
+{
+    const char *name = nautilus_file_get_display_name (file);
+
+    if (compiled->matches_all || match_suffixes (compiled->suffixes, name))
+    {
+        return TRUE;
+    }
+
+    if (g_hash_table_size (compiled->suffixes_ignoring_case) > 0)
+    {
+        g_autofree char *lowercase_name = g_ascii_strdown (name, -1);
+
+        if (match_suffixes (compiled->suffixes_ignoring_case, lowercase_name))
+        {
+            return TRUE;
+        }
+    }
+
+    if (match_content_type (compiled, nautilus_file_get_mime_type (file)))
+    {
+        return TRUE;
+    }
+
+    if (compiled->fallback != NULL)
+    {
+        g_file_info_set_display_name (compiled->mannequin, name);
+
+        return gtk_filter_match (GTK_FILTER (compiled->fallback), compiled->mannequin);
+    }
+
+    return FALSE;
+}
+
+static gboolean
+rules_contain (GHashTable *rules,
+               GHashTable *other_rules)
+{
+    GHashTableIter iter;
+    const char *rule;
+
+    g_hash_table_iter_init (&iter, other_rules);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &rule, NULL))
+    {
+        if (!g_hash_table_contains (rules, rule))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
 static GtkFilterMatch
 nautilus_view_item_filter_get_strictness (GtkFilter *filter)
 {
@@ -56,12 +330,12 @@ nautilus_view_item_filter_match (GtkFilter *filter,
         return TRUE;
     }
 
-    GFileInfo *info = self->mannequin;
-
-    g_file_info_set_display_name (info, nautilus_file_get_display_name (file));
-    g_file_info_set_content_type (info, nautilus_file_get_mime_type (file));
+    if (self->compiled == NULL)
+    {
+        return TRUE;
+    }
 
-    return gtk_filter_match (GTK_FILTER (self->file_filter), info);
+    return compiled_filter_match (self->compiled, file);
 }
 
 static void
@@ -70,7 +344,7 @@ nautilus_view_item_filter_finalize (GObject *object)
     NautilusViewItemFilter *self = NAUTILUS_VIEW_ITEM_FILTER (object);
 
     g_clear_object (&self->file_filter);
-    g_clear_object (&self->mannequin);
+    g_clear_pointer (&self->compiled, compiled_filter_free);
 
     G_OBJECT_CLASS (nautilus_view_item_filter_parent_class)->finalize (object);
 }
@@ -120,7 +394,6 @@ static void
 nautilus_view_item_filter_init (NautilusViewItemFilter *self)
 {
     self->strictness = GTK_FILTER_MATCH_ALL;
-    self->mannequin = g_file_info_new ();
 }
 
 NautilusViewItemFilter *
@@ -129,32 +402,79 @@ nautilus_view_item_filter_new (void)
     return g_object_new (NAUTILUS_TYPE_VIEW_ITEM_FILTER, NULL);
 }
 
+static void
+update_compiled_filter (NautilusViewItemFilter *self)
+{
+    g_autoptr (CompiledFilter) old_compiled = g_steal_pointer (&self->compiled);
+    gboolean was_matching_all = old_compiled == NULL || old_compiled->matches_all;
+    gboolean matches_all;
+    GtkFilterChange change;
+
+    if (self->file_filter != NULL)
+    {
+        self->compiled = compiled_filter_new (self->file_filter);
+    }
+
+    matches_all = self->compiled == NULL || self->compiled->matches_all;
+    self->strictness = (matches_all ? GTK_FILTER_MATCH_ALL : GTK_FILTER_MATCH_SOME);
+
+    if (was_matching_all && matches_all)
+    {
+        return;
+    }
+    else if (was_matching_all)
+    {
+        change = GTK_FILTER_CHANGE_MORE_STRICT;
+    }
+    else if (matches_all)
+    {
+        change = GTK_FILTER_CHANGE_LESS_STRICT;
+    }
+    else
+    {
+        gboolean has_old_rules = rules_contain (self->compiled->rules, old_compiled->rules);
+        gboolean has_only_old_rules = rules_contain (old_compiled->rules, self->compiled->rules);
+
+        if (has_old_rules && has_only_old_rules)
+        {
+            return;
+        }
+
+        change = (has_old_rules ? GTK_FILTER_CHANGE_LESS_STRICT :
+                  has_only_old_rules ? GTK_FILTER_CHANGE_MORE_STRICT :
+                  GTK_FILTER_CHANGE_DIFFERENT);
+    }
+
+    gtk_filter_changed (GTK_FILTER (self), change);
+}
+
 void
 nautilus_view_item_filter_set_file_filter (NautilusViewItemFilter *self,
                                            GtkFileFilter          *file_filter)
 {
     g_return_if_fail (NAUTILUS_IS_VIEW_ITEM_FILTER (self));
 
-    if (!g_set_object (&self->file_filter, file_filter))
+    if (self->file_filter == file_filter)
     {
         return;
     }
 
-    GtkFilterMatch old_strictness = self->strictness;
-    GtkFilterChange change = GTK_FILTER_CHANGE_DIFFERENT;
+    if (self->file_filter != NULL)
+    {
+        g_signal_handlers_disconnect_by_func (self->file_filter, update_compiled_filter, self);
+    }
 
-    self->strictness = (file_filter != NULL ?
-                        GTK_FILTER_MATCH_SOME :
-                        GTK_FILTER_MATCH_ALL);
+    g_set_object (&self->file_filter, file_filter);
 
-    if (self->strictness != old_strictness)
+    /* Rules may still be added to a filter after it was set. */
+    if (file_filter != NULL)
     {
-        change = (self->strictness == GTK_FILTER_MATCH_ALL ?
-                  GTK_FILTER_CHANGE_LESS_STRICT :
-                  GTK_FILTER_CHANGE_MORE_STRICT);
+        g_signal_connect_object (file_filter, "changed",
+                                 G_CALLBACK (update_compiled_filter), self,
+                                 G_CONNECT_SWAPPED);
     }
 
-    gtk_filter_changed (GTK_FILTER (self), change);
+    update_compiled_filter (self);
 
     g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_FILE_FILTER]);
 }
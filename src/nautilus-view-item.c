@@ -16,6 +16,10 @@ struct _NautilusViewItem
     gboolean loading;
     NautilusFile *file;
     GtkWidget *item_ui;
+
+    /* Computed on first use, dropped whenever the file changes. */
+    NautilusFileSortKey sort_key;
+    gboolean sort_key_valid;
 };
 
 G_DEFINE_TYPE (NautilusViewItem, nautilus_view_item, G_TYPE_OBJECT)
@@ -56,6 +60,7 @@ nautilus_view_item_finalize (GObject *object)
     NautilusViewItem *self = NAUTILUS_VIEW_ITEM (object);
 
     g_clear_object (&self->file);
+    nautilus_file_sort_key_clear (&self->sort_key);
 
     G_OBJECT_CLASS (nautilus_view_item_parent_class)->finalize (object);
 }
@@ -332,11 +337,56 @@ nautilus_view_item_set_item_ui (NautilusViewItem *self,
     g_set_weak_pointer (&self->item_ui, item_ui);
 }
 
+static const NautilusFileSortKey *
+get_sort_key (NautilusViewItem *self,
+              GQuark            attribute)
+{
+    if (!self->sort_key_valid || self->sort_key.attribute != attribute)
+    {
+        nautilus_file_sort_key_clear (&self->sort_key);
+        nautilus_file_get_sort_key (self->file, attribute, &self->sort_key);
+        self->sort_key_valid = TRUE;
+    }
+
+    return &self->sort_key;
+}
+
+/**
+ * nautilus_view_item_compare_for_sort:
+ * @a: a #NautilusViewItem
+ * @b: another #NautilusViewItem
+ * @attribute: the attribute to sort by
+ * @directories_first: put all directories before any non-directories
+ * @reversed: reverse the order, except for @directories_first
+ *
+ * Sorts like nautilus_file_compare_for_sort_by_attribute_q(), using sort keys
+ * that each item keeps until its file changes. Sorting a large model thus
+ * looks at every file once instead of on every comparison.
+ *
+ * Returns: a negative value if @a comes before @b, a positive value if it
+ *   comes after it, 0 if they are equal.
+ */
+int
+nautilus_view_item_compare_for_sort (NautilusViewItem *a,
+                                     NautilusViewItem *b,
+                                     GQuark            attribute,
+                                     gboolean          directories_first,
+                                     gboolean          reversed)
+{
+    return nautilus_file_compare_sort_keys (a->file, get_sort_key (a, attribute),
+                                            b->file, get_sort_key (b, attribute),
+                                            directories_first, reversed);
+}
+
 void
 nautilus_view_item_file_changed (NautilusViewItem *self)
 {
     g_return_if_fail (NAUTILUS_IS_VIEW_ITEM (self));
 
+    /* Drop the key even if no cell shows the item, the model sorts it all the
+     * same. */
+    self->sort_key_valid = FALSE;
+
     /* Safety check: Only emit if the cell UI is still valid.
      * The cell may have been disposed during async operations
      * (e.g., thumbnail completion after view destruction). */
@@ -37,4 +37,10 @@ void               nautilus_view_item_set_item_ui   (NautilusViewItem *self,
 GtkWidget *        nautilus_view_item_get_item_ui   (NautilusViewItem *self);
 void               nautilus_view_item_file_changed  (NautilusViewItem *self);
 
+int                nautilus_view_item_compare_for_sort (NautilusViewItem *a,
+                                                        NautilusViewItem *b,
+                                                        GQuark            attribute,
+                                                        gboolean          directories_first,
+                                                        gboolean          reversed);
+
 G_END_DECLS
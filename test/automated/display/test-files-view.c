@@ -291,6 +291,42 @@ test_selection_actions (void)
     test_clear_tmp_dir ();
 }
 
+/** Check that selected folders get their item counts for the status, even
+ *  with no cells to ask for them */
+static void
+test_selection_item_counts (void)
+{
+    g_autoptr (NautilusWindowSlot) slot = nautilus_window_slot_new (NAUTILUS_MODE_BROWSE);
+    g_autoptr (NautilusFilesView) files_view = nautilus_files_view_new (NAUTILUS_VIEW_GRID_ID, slot);
+    g_autoptr (GFile) tmp_location = g_file_new_for_path (test_get_tmp_dir ());
+    g_autoptr (GFile) folder_location = g_file_get_child (tmp_location, "counted");
+    g_autoptr (NautilusFile) folder = NULL;
+    g_autoptr (NautilusFileList) selection = NULL;
+    guint item_count = 0;
+
+    file_hierarchy_create ((char *[])
+    {
+        "counted/",
+        "counted/file1",
+        "counted/file2",
+        "counted/file3",
+        NULL
+    }, "");
+
+    nautilus_files_view_set_location (files_view, tmp_location);
+    ITER_CONTEXT_WHILE (nautilus_files_view_get_loading (files_view));
+
+    folder = nautilus_file_get (folder_location);
+    selection = g_list_append (selection, nautilus_file_ref (folder));
+    nautilus_files_view_set_selection (files_view, selection);
+
+    ITER_CONTEXT_WHILE (!nautilus_file_get_directory_item_count (folder, &item_count, NULL));
+    g_assert_true (nautilus_file_get_directory_item_count (folder, &item_count, NULL));
+    g_assert_cmpuint (item_count, ==, 3);
+
+    test_clear_tmp_dir ();
+}
+
 static void
 create_hidden_files (void)
 {
@@ -735,6 +771,69 @@ test_remove_files (void)
     test_clear_tmp_dir ();
 }
 
+static gboolean
+view_order_is (NautilusViewModel  *model,
+               const char * const *names)
+{
+    guint n_items = g_list_model_get_n_items (G_LIST_MODEL (model));
+
+    if (n_items != g_strv_length ((GStrv) names))
+    {
+        return FALSE;
+    }
+
+    for (guint i = 0; i < n_items; i++)
+    {
+        g_autoptr (GtkTreeListRow) row = g_list_model_get_item (G_LIST_MODEL (model), i);
+        g_autoptr (NautilusViewItem) item = gtk_tree_list_row_get_item (row);
+        NautilusFile *file = nautilus_view_item_get_file (item);
+
+        if (g_strcmp0 (nautilus_file_get_name (file), names[i]) != 0)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/** Check that the view keeps its items sorted, both as files are added and
+ *  as a file already shown is renamed */
+static void
+test_sort_order (void)
+{
+    g_autoptr (NautilusWindowSlot) slot = nautilus_window_slot_new (NAUTILUS_MODE_BROWSE);
+    g_autoptr (NautilusFilesView) files_view = nautilus_files_view_new (NAUTILUS_VIEW_GRID_ID, slot);
+    NautilusViewModel *model = nautilus_files_view_get_private_model (files_view);
+    g_autoptr (GFile) tmp_location = g_file_new_for_path (test_get_tmp_dir ());
+    g_autoptr (GPtrArray) renamed_files_arr = g_ptr_array_new_with_free_func ((GDestroyNotify) nautilus_file_unref);
+    g_autoptr (GFile) apple_location = g_file_get_child (tmp_location, "apple");
+    g_autoptr (NautilusFile) apple = NULL;
+    const char * const loaded[] = { "apple", "cherry", "elder", NULL };
+    const char * const added[] = { "apple", "banana", "cherry", "date", "elder", NULL };
+    const char * const renamed[] = { "banana", "cherry", "date", "elder", "fig", NULL };
+
+    file_hierarchy_create ((char *[]) { "elder", "apple", "cherry", NULL }, "");
+
+    nautilus_files_view_set_location (files_view, tmp_location);
+    ITER_CONTEXT_WHILE (nautilus_files_view_get_loading (files_view));
+    g_assert_true (view_order_is (model, loaded));
+
+    /* Added files get placed by the sort model. */
+    file_hierarchy_create ((char *[]) { "date", "banana", NULL }, "");
+    ITER_CONTEXT_WHILE (!view_order_is (model, added));
+    g_assert_true (view_order_is (model, added));
+
+    /* A file that changed has to be sorted again. */
+    apple = nautilus_file_get (apple_location);
+    nautilus_file_rename (apple, "fig", collect_renamed_files, renamed_files_arr);
+    ITER_CONTEXT_WHILE (renamed_files_arr->len == 0 || !view_order_is (model, renamed));
+    g_assert_cmpuint (renamed_files_arr->len, ==, 1);
+    g_assert_true (view_order_is (model, renamed));
+
+    test_clear_tmp_dir ();
+}
+
 static void
 collect_added_files_cb (NautilusFilesView *view,
                         GList             *added_files,
@@ -885,12 +984,16 @@ main (int   argc,
                      test_rename_files);
     g_test_add_func ("/view/change_files/replace",
                      test_replace_files);
+    g_test_add_func ("/view/sort_order",
+                     test_sort_order);
     g_test_add_func ("/view/hidden_files/change",
                      test_hidden_files_change);
     g_test_add_func ("/view/hidden_files/rename_files",
                      test_hidden_files_renamed);
     g_test_add_func ("/view/selection/actions",
                      test_selection_actions);
+    g_test_add_func ("/view/selection/item-counts",
+                     test_selection_item_counts);
     g_test_add_func ("/view/actions/zoom",
                      test_zoom_actions);
 
@@ -0,0 +1,108 @@
+#include <glib.h>
+#include <gtk/gtk.h>
+
+#include <nautilus-icon-info.h>
+
+#define ICON_SIZE 64
+
+/* Icons are prewarmed in a thread, so this is bounded by time rather than by
+ * iterations of the main context. */
+static void
+wait_for_content_type_icon (const char *content_type)
+{
+    gint64 deadline = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+
+    while (!nautilus_icon_info_has_content_type_icon (content_type, ICON_SIZE, 1) &&
+           g_get_monotonic_time () < deadline)
+    {
+        g_main_context_iteration (NULL, FALSE);
+        g_usleep (G_USEC_PER_SEC / 100);
+    }
+}
+
+/** Check that only the icon of a content type is remembered for it, not the
+ *  one of a file that stands out */
+static void
+test_icon_info_content_type_generic_icon (void)
+{
+    g_autoptr (GIcon) generic_icon = g_content_type_get_icon ("inode/directory");
+    g_autoptr (GIcon) special_icon = g_themed_icon_new ("folder-documents");
+    g_autoptr (NautilusIconInfo) special = NULL;
+    g_autoptr (NautilusIconInfo) generic = NULL;
+    g_autoptr (NautilusIconInfo) generic_again = NULL;
+    g_autoptr (NautilusIconInfo) special_again = NULL;
+
+    nautilus_icon_info_clear_caches ();
+
+    special = nautilus_icon_info_lookup_for_content_type ("inode/directory", special_icon,
+                                                          ICON_SIZE, 1);
+    g_assert_false (nautilus_icon_info_has_content_type_icon ("inode/directory", ICON_SIZE, 1));
+
+    generic = nautilus_icon_info_lookup_for_content_type ("inode/directory", generic_icon,
+                                                          ICON_SIZE, 1);
+    if (nautilus_icon_info_is_fallback (generic))
+    {
+        g_test_skip ("Icon theme has no icon for folders");
+
+        return;
+    }
+    g_assert_true (nautilus_icon_info_has_content_type_icon ("inode/directory", ICON_SIZE, 1));
+
+    generic_again = nautilus_icon_info_lookup_for_content_type ("inode/directory", generic_icon,
+                                                                ICON_SIZE, 1);
+    g_assert_true (generic_again == generic);
+
+    /* Still looked up as what it is. */
+    special_again = nautilus_icon_info_lookup_for_content_type ("inode/directory", special_icon,
+                                                                ICON_SIZE, 1);
+    g_assert_cmpstr (nautilus_icon_info_get_used_name (special_again), ==,
+                     nautilus_icon_info_get_used_name (special));
+
+    /* Not at other sizes. */
+    g_assert_false (nautilus_icon_info_has_content_type_icon ("inode/directory", 2 * ICON_SIZE, 1));
+}
+
+/** Check that prewarmed content types are found without a lookup, and that
+ *  clearing the caches forgets them */
+static void
+test_icon_info_content_type_prewarm (void)
+{
+    const char * const content_types[] = { "text/plain", "inode/directory", NULL };
+    g_autoptr (GIcon) text_icon = g_content_type_get_icon ("text/plain");
+    g_autoptr (NautilusIconInfo) first = NULL;
+    g_autoptr (NautilusIconInfo) second = NULL;
+
+    nautilus_icon_info_clear_caches ();
+
+    nautilus_icon_info_prewarm_content_types (content_types, ICON_SIZE, 1);
+    wait_for_content_type_icon ("text/plain");
+
+    if (!nautilus_icon_info_has_content_type_icon ("text/plain", ICON_SIZE, 1))
+    {
+        g_test_skip ("Icon theme has no icon for text files");
+
+        return;
+    }
+
+    first = nautilus_icon_info_lookup_for_content_type ("text/plain", text_icon, ICON_SIZE, 1);
+    second = nautilus_icon_info_lookup_for_content_type ("text/plain", text_icon, ICON_SIZE, 1);
+    g_assert_true (first == second);
+
+    nautilus_icon_info_clear_caches ();
+    g_assert_false (nautilus_icon_info_has_content_type_icon ("text/plain", ICON_SIZE, 1));
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+    gtk_test_init (&argc, &argv, NULL);
+    g_test_set_nonfatal_assertions ();
+
+    g_test_add_func ("/icon-info/content-type/generic-icon",
+                     test_icon_info_content_type_generic_icon);
+    g_test_add_func ("/icon-info/content-type/prewarm",
+                     test_icon_info_content_type_prewarm);
+
+    return g_test_run ();
+}
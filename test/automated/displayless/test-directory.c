@@ -1,8 +1,18 @@
 #include <glib.h>
+#include <glib/gstdio.h>
 
 #include <nautilus-directory.h>
 #include <nautilus-directory-private.h>
+#include <nautilus-directory-snapshot.h>
+#include <nautilus-file-changes-queue.h>
+#include <nautilus-file-private.h>
 #include <nautilus-file-utilities.h>
+#include <nautilus-name-index.h>
+#include <nautilus-query.h>
+#include <nautilus-tag-manager.h>
+#include <test-utilities.h>
+
+#include <string.h>
 
 
 static int data_dummy;
@@ -85,16 +95,609 @@ test_directory_call_when_ready (void)
     g_assert_true (got_files_flag);
     /* Every NautilusFile created by call_when_ready must have been
      * unref'd and destroyed after the NautilusDirectoryCallback returns */
-    g_assert_null (directory->details->file_list);
+    g_assert_cmpuint (directory->details->files->len, ==, 0);
+}
+
+/** Check that the file array and the name index agree while monitored */
+static void
+test_directory_file_index (void)
+{
+    g_autoptr (NautilusDirectory) directory = nautilus_directory_get_by_uri ("file:///etc");
+    NautilusDirectoryFileIter iter;
+    NautilusFile * const *files;
+    NautilusFile *file;
+    guint n_files;
+    guint n_iterated = 0;
+
+    got_files_flag = FALSE;
+    nautilus_directory_file_monitor_add (directory, &data_dummy, TRUE, 0,
+                                         got_files_callback, &data_dummy);
+    for (guint i = 0; !got_files_flag && i < 100000; i++)
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_assert_true (got_files_flag);
+
+    files = nautilus_directory_peek_files (directory, &n_files);
+    g_assert_cmpuint (n_files, >, 10);
+    for (guint i = 0; i < n_files; i++)
+    {
+        g_assert_cmpuint (files[i]->details->directory_index, ==, i);
+        g_assert_true (nautilus_directory_find_file_by_name (directory,
+                                                             nautilus_file_get_name (files[i])) == files[i]);
+    }
+
+    nautilus_directory_file_iter_init (&iter, directory);
+    while (nautilus_directory_file_iter_next (&iter, &file))
+    {
+        g_assert_true (files[n_files - 1 - n_iterated] == file);
+        n_iterated++;
+    }
+    g_assert_cmpuint (n_iterated, ==, n_files);
+
+    nautilus_directory_file_monitor_remove (directory, &data_dummy);
+}
+
+static guint
+count_files_containing (NautilusDirectory *directory,
+                        const char        *word)
+{
+    g_autolist (NautilusFile) files = nautilus_directory_get_file_list (directory);
+    guint n_matches = 0;
+
+    for (GList *l = files; l != NULL; l = l->next)
+    {
+        g_autofree char *key = nautilus_query_prepare_string (nautilus_file_get_display_name (l->data));
+
+        n_matches += (strstr (key, word) != NULL);
+    }
+
+    return n_matches;
+}
+
+/* Checks that the name index finds exactly the files that scanning every
+ * display name for all of @words finds. */
+static void
+assert_lookup_complete (NautilusDirectory  *directory,
+                        const char * const *words)
+{
+    g_autolist (NautilusFile) found = nautilus_directory_find_files_containing (directory, words);
+    g_autolist (NautilusFile) files = nautilus_directory_get_file_list (directory);
+    guint n_expected = 0;
+
+    for (GList *l = files; l != NULL; l = l->next)
+    {
+        g_autofree char *key = nautilus_query_prepare_string (nautilus_file_get_display_name (l->data));
+        gboolean matches = TRUE;
+
+        for (guint i = 0; matches && words[i] != NULL; i++)
+        {
+            matches = (strstr (key, words[i]) != NULL);
+        }
+
+        if (matches)
+        {
+            n_expected++;
+            g_assert_nonnull (g_list_find (found, l->data));
+        }
+    }
+
+    g_assert_cmpuint (g_list_length (found), ==, n_expected);
+}
+
+/** Check that name index lookups agree with scanning every file */
+static void
+test_directory_name_index (void)
+{
+    g_autoptr (NautilusDirectory) directory = nautilus_directory_get_by_uri ("file:///etc");
+    const char *words[][3] =
+    {
+        { "pass", NULL },
+        { "co", NULL },
+        { "conf", "re", NULL },
+        { "no such name here", NULL },
+    };
+
+    got_files_flag = FALSE;
+    nautilus_directory_file_monitor_add (directory, &data_dummy, TRUE, 0,
+                                         got_files_callback, &data_dummy);
+    for (guint i = 0; !got_files_flag && i < 100000; i++)
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_assert_true (got_files_flag);
+
+    for (guint i = 0; i < G_N_ELEMENTS (words); i++)
+    {
+        assert_lookup_complete (directory, words[i]);
+    }
+
+    g_autolist (NautilusFile) matched = nautilus_directory_match_pattern (directory, "*pass*");
+    g_autolist (NautilusFile) all_files = nautilus_directory_get_file_list (directory);
+    guint n_expected = 0;
+
+    for (GList *l = all_files; l != NULL; l = l->next)
+    {
+        n_expected += (strstr (nautilus_file_get_display_name (l->data), "pass") != NULL);
+    }
+    g_assert_cmpuint (g_list_length (matched), ==, n_expected);
+
+    nautilus_directory_file_monitor_remove (directory, &data_dummy);
+}
+
+static void
+wait_for_directory_loaded (NautilusDirectory *directory)
+{
+    for (guint i = 0; !directory->details->directory_loaded && i < 100000; i++)
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_assert_true (directory->details->directory_loaded);
+}
+
+/* Creates a folder of @n_files empty files in the test dir, and loads and
+ * monitors it. */
+static NautilusDirectory *
+load_burst_directory (const char *name,
+                      guint       n_files)
+{
+    g_autofree char *path = g_build_filename (test_get_tmp_dir (), name, NULL);
+    g_autoptr (GFile) location = g_file_new_for_path (path);
+    NautilusDirectory *directory;
+
+    g_assert_cmpint (g_mkdir_with_parents (path, 0700), ==, 0);
+    for (guint i = 0; i < n_files; i++)
+    {
+        g_autofree char *file_name = g_strdup_printf ("file-%u", i);
+        g_autofree char *file_path = g_build_filename (path, file_name, NULL);
+
+        g_assert_true (g_file_set_contents (file_path, "", 0, NULL));
+    }
+
+    directory = nautilus_directory_get (location);
+    nautilus_directory_file_monitor_add (directory, &data_dummy, TRUE, 0, NULL, NULL);
+    wait_for_directory_loaded (directory);
+
+    return directory;
+}
+
+static guint
+count_files_found (NautilusDirectory  *directory,
+                   const char * const *words)
+{
+    g_autolist (NautilusFile) found = nautilus_directory_find_files_containing (directory, words);
+
+    return g_list_length (found);
+}
+
+static void
+assert_lookups_complete (NautilusDirectory *directory)
+{
+    const char *words[][3] =
+    {
+        { "alpha", NULL },
+        { "report", NULL },
+        { "alpha", "report", NULL },
+        { "pha", "port", NULL },
+        { "al", NULL },
+        { "delta", NULL },
+    };
+
+    for (guint i = 0; i < G_N_ELEMENTS (words); i++)
+    {
+        assert_lookup_complete (directory, words[i]);
+    }
+}
+
+/** Check that the name index follows files being added, removed and given
+ *  another display name */
+static void
+test_directory_name_index_changes (void)
+{
+    g_autofree char *path = g_build_filename (test_get_tmp_dir (), "named", NULL);
+    g_autofree char *added_path = g_build_filename (path, "alpha report 2", NULL);
+    g_autofree char *removed_path = g_build_filename (path, "alpha notes", NULL);
+    g_autoptr (GFile) location = g_file_new_for_path (path);
+    g_autoptr (NautilusDirectory) directory = NULL;
+    g_autoptr (NautilusFile) renamed = NULL;
+    const char *names[] = { "alpha report", "alpha notes", "beta report", "gamma" };
+
+    g_assert_cmpint (g_mkdir_with_parents (path, 0700), ==, 0);
+    for (guint i = 0; i < G_N_ELEMENTS (names); i++)
+    {
+        g_autofree char *file_path = g_build_filename (path, names[i], NULL);
+
+        g_assert_true (g_file_set_contents (file_path, "", 0, NULL));
+    }
+
+    directory = nautilus_directory_get (location);
+    nautilus_directory_file_monitor_add (directory, &data_dummy, TRUE, 0, NULL, NULL);
+    wait_for_directory_loaded (directory);
+
+    /* The first lookup builds the index. */
+    assert_lookups_complete (directory);
+    g_assert_cmpuint (count_files_found (directory, (const char *[]) { "alpha", "report", NULL }), ==, 1);
+
+    g_assert_true (g_file_set_contents (added_path, "", 0, NULL));
+    for (guint i = 0; count_files_containing (directory, "report 2") == 0 && i < 100000; i++)
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    assert_lookups_complete (directory);
+    g_assert_cmpuint (count_files_found (directory, (const char *[]) { "alpha", "report", NULL }), ==, 2);
+
+    g_assert_cmpint (g_unlink (removed_path), ==, 0);
+    for (guint i = 0; count_files_containing (directory, "notes") > 0 && i < 100000; i++)
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    assert_lookups_complete (directory);
+    g_assert_cmpuint (count_files_found (directory, (const char *[]) { "notes", NULL }), ==, 0);
+    g_assert_cmpuint (count_files_found (directory, (const char *[]) { "alpha", NULL }), ==, 2);
+
+    /* Display names may change without the name, like for desktop files. */
+    renamed = nautilus_directory_get_file_by_name (directory, "gamma");
+    g_assert_nonnull (renamed);
+    g_assert_true (nautilus_file_set_display_name (renamed, "delta report", NULL, TRUE));
+    assert_lookups_complete (directory);
+    g_assert_cmpuint (count_files_found (directory, (const char *[]) { "gamma", NULL }), ==, 0);
+    g_assert_cmpuint (count_files_found (directory, (const char *[]) { "delta", "report", NULL }), ==, 1);
+    g_assert_cmpuint (count_files_found (directory, (const char *[]) { "report", NULL }), ==, 3);
+
+    nautilus_directory_file_monitor_remove (directory, &data_dummy);
+    test_clear_tmp_dir ();
+}
+
+static gboolean
+files_are (GPtrArray  *found,
+           GHashTable *expected)
+{
+    if (found->len != g_hash_table_size (expected))
+    {
+        return FALSE;
+    }
+
+    for (guint i = 0; i < found->len; i++)
+    {
+        if (!g_hash_table_contains (expected, found->pdata[i]))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/** Check that lookups stay complete once removals compact the name index */
+static void
+test_directory_name_index_compaction (void)
+{
+    /* Enough removals, and more than half of the entries, to compact. */
+    const guint n_files = 3000;
+    NautilusNameIndex *index = nautilus_name_index_new ();
+    g_autoptr (GPtrArray) files = g_ptr_array_new_with_free_func ((GDestroyNotify) nautilus_file_unref);
+    g_autoptr (GHashTable) kept = g_hash_table_new (NULL, NULL);
+    g_autoptr (GPtrArray) found = NULL;
+
+    for (guint i = 0; i < n_files; i++)
+    {
+        g_autofree char *uri = g_strdup_printf ("file:///nautilus-name-index-test/item-%04u", i);
+        NautilusFile *file = nautilus_file_get_by_uri (uri);
+
+        g_ptr_array_add (files, file);
+        nautilus_name_index_add (index, file);
+    }
+
+    for (guint i = 0; i < n_files; i++)
+    {
+        if (i % 3 == 0)
+        {
+            g_hash_table_add (kept, files->pdata[i]);
+        }
+        else
+        {
+            nautilus_name_index_remove (index, files->pdata[i]);
+        }
+    }
+
+    found = nautilus_name_index_lookup (index, (const char *[]) { "item-", NULL });
+    g_assert_true (files_are (found, kept));
+    g_clear_pointer (&found, g_ptr_array_unref);
+
+    found = nautilus_name_index_lookup (index, (const char *[]) { "item", "-", NULL });
+    g_assert_true (files_are (found, kept));
+    g_clear_pointer (&found, g_ptr_array_unref);
+
+    found = nautilus_name_index_lookup (index, (const char *[]) { "item-2999", NULL });
+    g_assert_cmpuint (found->len, ==, 1);
+    g_assert_true (found->pdata[0] == files->pdata[2999]);
+    g_clear_pointer (&found, g_ptr_array_unref);
+
+    found = nautilus_name_index_lookup (index, (const char *[]) { "item-2998", NULL });
+    g_assert_cmpuint (found->len, ==, 0);
+    g_clear_pointer (&found, g_ptr_array_unref);
+
+    /* Entries added and updated after compacting are found too. */
+    nautilus_name_index_add (index, files->pdata[2998]);
+    nautilus_name_index_update (index, files->pdata[2997]);
+    g_hash_table_add (kept, files->pdata[2998]);
+    found = nautilus_name_index_lookup (index, (const char *[]) { "item-", NULL });
+    g_assert_true (files_are (found, kept));
+    g_clear_pointer (&found, g_ptr_array_unref);
+
+    nautilus_name_index_free (index);
+}
+    for (guint i = 0; !directory->details->directory_loaded && i < 100000; i++)
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_assert_true (directory->details->directory_loaded);
+}
+
+/** Check that renaming many files into place, as rsync does, rescans the directory */
+static void
+test_directory_burst_of_moves (void)
+{
+    const guint n_files = 600;
+    g_autoptr (NautilusDirectory) directory = load_burst_directory ("burst", n_files);
+    g_autoptr (GFile) location = nautilus_directory_get_location (directory);
+    guint n_listed;
+
+    for (guint i = 0; i < n_files; i++)
+    {
+        g_autofree char *temporary_name = g_strdup_printf (".file-%u.a1b2c3", i);
+        g_autofree char *name = g_strdup_printf ("file-%u", i);
+        g_autoptr (GFile) temporary = g_file_get_child (location, temporary_name);
+        g_autoptr (GFile) file = g_file_get_child (location, name);
+
+        nautilus_file_changes_queue_monitor_file_added (temporary);
+        nautilus_file_changes_queue_monitor_file_changed (temporary);
+        nautilus_file_changes_queue_monitor_file_moved (temporary, file);
+    }
+    nautilus_file_changes_consume_changes ();
+
+    /* Rescanning starts loading the directory again. */
+    g_assert_false (directory->details->directory_loaded);
+    wait_for_directory_loaded (directory);
+
+    nautilus_directory_peek_files (directory, &n_listed);
+    g_assert_cmpuint (n_listed, ==, n_files);
+
+    nautilus_directory_file_monitor_remove (directory, &data_dummy);
+    test_clear_tmp_dir ();
+}
+
+/** Check that the changes of our own file operations never rescan the directory */
+static void
+test_directory_burst_of_operation_changes (void)
+{
+    const guint n_files = 600;
+    g_autoptr (NautilusDirectory) directory = load_burst_directory ("operation-burst", 0);
+    g_autoptr (GFile) location = nautilus_directory_get_location (directory);
+    guint n_listed;
+
+    for (guint i = 0; i < n_files; i++)
+    {
+        g_autofree char *name = g_strdup_printf ("copied-%u", i);
+        g_autoptr (GFile) file = g_file_get_child (location, name);
+        g_autofree char *path = g_file_get_path (file);
+
+        g_assert_true (g_file_set_contents (path, "", 0, NULL));
+        nautilus_file_changes_queue_file_added (file);
+    }
+    nautilus_file_changes_consume_changes ();
+
+    /* Added one by one, rather than by loading everything again. */
+    g_assert_true (directory->details->directory_loaded);
+
+    nautilus_directory_peek_files (directory, &n_listed);
+    for (guint i = 0; n_listed < n_files && i < 100000; i++)
+    {
+        g_main_context_iteration (NULL, TRUE);
+        nautilus_directory_peek_files (directory, &n_listed);
+    }
+    g_assert_cmpuint (n_listed, ==, n_files);
+
+    nautilus_directory_file_monitor_remove (directory, &data_dummy);
+    test_clear_tmp_dir ();
+}
+
+/** Check that folders removed in a burst are let go of, while the rest is rescanned */
+static void
+test_directory_burst_keeps_removals (void)
+{
+    const guint n_files = 600;
+    g_autoptr (NautilusDirectory) directory = load_burst_directory ("removal-burst", n_files);
+    g_autoptr (GFile) location = nautilus_directory_get_location (directory);
+    g_autoptr (GFile) child_location = g_file_get_child (location, "folder");
+    g_autofree char *child_path = g_file_get_path (child_location);
+    g_autoptr (NautilusDirectory) child_directory = NULL;
+    g_autoptr (NautilusFile) child = NULL;
+    guint n_listed;
+
+    g_assert_cmpint (g_mkdir (child_path, 0700), ==, 0);
+    child_directory = nautilus_directory_get (child_location);
+    nautilus_directory_file_monitor_add (child_directory, &data_dummy, TRUE, 0, NULL, NULL);
+    child = nautilus_file_get (child_location);
+
+    for (guint i = 0; i < n_files; i++)
+    {
+        g_autofree char *name = g_strdup_printf ("file-%u", i);
+        g_autoptr (GFile) file = g_file_get_child (location, name);
+
+        nautilus_file_changes_queue_monitor_file_changed (file);
+    }
+    g_assert_cmpint (g_rmdir (child_path), ==, 0);
+    nautilus_file_changes_queue_monitor_file_removed (child_location);
+    nautilus_file_changes_consume_changes ();
+
+    /* Gone right away, not only once the rescan doesn't find it. */
+    g_assert_true (nautilus_file_is_gone (child));
+    g_assert_false (directory->details->directory_loaded);
+    wait_for_directory_loaded (directory);
+
+    nautilus_directory_peek_files (directory, &n_listed);
+    g_assert_cmpuint (n_listed, ==, n_files);
+
+    nautilus_directory_file_monitor_remove (child_directory, &data_dummy);
+    nautilus_directory_file_monitor_remove (directory, &data_dummy);
+    test_clear_tmp_dir ();
+}
+
+static const NautilusDirectorySnapshotStamp snapshot_stamp = { 1, 2, 3, 4 };
+
+/* A snapshot of a few files, and the files it was taken from. */
+static GBytes *
+create_snapshot (GFile      *location,
+                 GPtrArray **out_files)
+{
+    g_autoptr (NautilusDirectory) directory = nautilus_directory_get (location);
+    const struct
+    {
+        const char *name;
+        GFileType type;
+        const char *content_type;
+        goffset size;
+        gboolean is_hidden;
+    } entries[] =
+    {
+        { "notes.txt", G_FILE_TYPE_REGULAR, "text/plain", 120, FALSE },
+        { "photo.jpg", G_FILE_TYPE_REGULAR, "image/jpeg", 2 << 20, FALSE },
+        { "Projects", G_FILE_TYPE_DIRECTORY, "inode/directory", 4096, FALSE },
+        { ".hidden", G_FILE_TYPE_REGULAR, "text/plain", 0, TRUE },
+    };
+    GPtrArray *files = g_ptr_array_new_with_free_func ((GDestroyNotify) nautilus_file_unref);
+
+    for (guint i = 0; i < G_N_ELEMENTS (entries); i++)
+    {
+        g_autoptr (GFileInfo) info = g_file_info_new ();
+        g_autoptr (GIcon) icon = g_content_type_get_icon (entries[i].content_type);
+
+        g_file_info_set_name (info, entries[i].name);
+        g_file_info_set_display_name (info, entries[i].name);
+        g_file_info_set_file_type (info, entries[i].type);
+        g_file_info_set_content_type (info, entries[i].content_type);
+        g_file_info_set_icon (info, icon);
+        g_file_info_set_size (info, entries[i].size);
+        g_file_info_set_is_hidden (info, entries[i].is_hidden);
+        g_file_info_set_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED, 1000 + i);
+
+        g_ptr_array_add (files, nautilus_file_new_from_info (directory, info));
+    }
+
+    *out_files = files;
+
+    return nautilus_directory_snapshot_serialize (location, &snapshot_stamp,
+                                                  (NautilusFile * const *) files->pdata,
+                                                  files->len);
+}
+
+/** Check that a snapshot lists the files it was taken from */
+static void
+test_directory_snapshot_round_trip (void)
+{
+    g_autoptr (GFile) location = g_file_new_for_path ("/nautilus-snapshot-test");
+    g_autoptr (GFile) other_location = g_file_new_for_path ("/nautilus-snapshot-other");
+    g_autoptr (GPtrArray) files = NULL;
+    g_autoptr (GBytes) contents = create_snapshot (location, &files);
+    NautilusDirectorySnapshotStamp changed_stamp = snapshot_stamp;
+    g_autolist (GFileInfo) infos = nautilus_directory_snapshot_parse (contents, location,
+                                                                      &snapshot_stamp);
+    GList *l = infos;
+
+    g_assert_cmpuint (g_list_length (infos), ==, files->len);
+    for (guint i = 0; i < files->len; i++, l = l->next)
+    {
+        NautilusFile *file = files->pdata[i];
+        GFileInfo *info = l->data;
+
+        g_assert_cmpstr (g_file_info_get_name (info), ==, nautilus_file_get_name (file));
+        g_assert_cmpstr (g_file_info_get_content_type (info), ==, nautilus_file_get_mime_type (file));
+        g_assert_cmpint (g_file_info_get_file_type (info), ==, nautilus_file_get_file_type (file));
+        g_assert_cmpint (g_file_info_get_size (info), ==, nautilus_file_get_size (file));
+        g_assert_cmpint (g_file_info_get_is_hidden (info), ==, nautilus_file_is_hidden_file (file));
+        g_assert_cmpuint (g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED),
+                          ==, 1000 + i);
+        g_assert_nonnull (g_file_info_get_icon (info));
+    }
+
+    /* Snapshots of other directories, or of a directory since changed, don't apply. */
+    g_assert_null (nautilus_directory_snapshot_parse (contents, other_location, &snapshot_stamp));
+    changed_stamp.mtime_nsec++;
+    g_assert_null (nautilus_directory_snapshot_parse (contents, location, &changed_stamp));
+}
+
+/** Check that every truncated snapshot is rejected */
+static void
+test_directory_snapshot_truncated (void)
+{
+    g_autoptr (GFile) location = g_file_new_for_path ("/nautilus-snapshot-test");
+    g_autoptr (GPtrArray) files = NULL;
+    g_autoptr (GBytes) contents = create_snapshot (location, &files);
+    gsize length = g_bytes_get_size (contents);
+
+    for (gsize i = 0; i < length; i++)
+    {
+        g_autoptr (GBytes) truncated = g_bytes_new_from_bytes (contents, 0, i);
+
+        g_assert_null (nautilus_directory_snapshot_parse (truncated, location, &snapshot_stamp));
+    }
+}
+
+/** Check that corrupt snapshots are rejected, or at least parsed safely */
+static void
+test_directory_snapshot_corrupt (void)
+{
+    g_autoptr (GFile) location = g_file_new_for_path ("/nautilus-snapshot-test");
+    g_autoptr (GPtrArray) files = NULL;
+    g_autoptr (GBytes) contents = create_snapshot (location, &files);
+    gsize length;
+    const guint8 *data = g_bytes_get_data (contents, &length);
+    g_autofree guint8 *copy = g_memdup2 (data, length + 1);
+
+    /* Trailing garbage */
+    copy[length] = 0;
+    {
+        g_autoptr (GBytes) longer = g_bytes_new_static (copy, length + 1);
+
+        g_assert_null (nautilus_directory_snapshot_parse (longer, location, &snapshot_stamp));
+    }
+
+    /* Bad magic and unknown version */
+    for (gsize i = 0; i < 8; i++)
+    {
+        g_autoptr (GBytes) corrupt = NULL;
+
+        memcpy (copy, data, length);
+        copy[i] ^= 0xff;
+        corrupt = g_bytes_new_static (copy, length);
+        g_assert_null (nautilus_directory_snapshot_parse (corrupt, location, &snapshot_stamp));
+    }
+
+    /* Every other byte flipped in turn. Names, sizes and types may come out
+     * different, but lengths, counts and type indices must not be trusted. */
+    for (gsize i = 8; i < length; i++)
+    {
+        g_autoptr (GBytes) corrupt = NULL;
+
+        memcpy (copy, data, length);
+        copy[i] ^= 0xff;
+        corrupt = g_bytes_new_static (copy, length);
+        g_list_free_full (nautilus_directory_snapshot_parse (corrupt, location, &snapshot_stamp),
+                          g_object_unref);
+    }
 }
 
 int
 main (int   argc,
       char *argv[])
 {
-    g_test_init (&argc, &argv, NULL);
+    g_autoptr (NautilusTagManager) tag_manager = NULL;
+
+    g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
     g_test_set_nonfatal_assertions ();
     nautilus_ensure_extension_points ();
+    tag_manager = nautilus_tag_manager_new_dummy ();
 
     g_test_add_func ("/directory-duplicate-pointers/1.0",
                      test_directory_duplicate_pointers);
@@ -102,6 +705,26 @@ main (int   argc,
                      test_directory_hash_table_cleanup);
     g_test_add_func ("/directory-call-when-ready/1.0",
                      test_directory_call_when_ready);
+    g_test_add_func ("/directory-file-index/1.0",
+                     test_directory_file_index);
+    g_test_add_func ("/directory-name-index/1.0",
+                     test_directory_name_index);
+    g_test_add_func ("/directory-name-index/changes",
+                     test_directory_name_index_changes);
+    g_test_add_func ("/directory-name-index/compaction",
+                     test_directory_name_index_compaction);
+    g_test_add_func ("/directory-changes/burst-of-moves",
+                     test_directory_burst_of_moves);
+    g_test_add_func ("/directory-changes/burst-of-operation-changes",
+                     test_directory_burst_of_operation_changes);
+    g_test_add_func ("/directory-changes/burst-keeps-removals",
+                     test_directory_burst_keeps_removals);
+    g_test_add_func ("/directory-snapshot/round-trip",
+                     test_directory_snapshot_round_trip);
+    g_test_add_func ("/directory-snapshot/truncated",
+                     test_directory_snapshot_truncated);
+    g_test_add_func ("/directory-snapshot/corrupt",
+                     test_directory_snapshot_corrupt);
 
     return g_test_run ();
 }
@@ -1,5 +1,8 @@
 #include <glib.h>
+#include <glib/gstdio.h>
 
+#include <nautilus-deep-count.h>
+#include <nautilus-deep-count-cache.h>
 #include <nautilus-directory-private.h>
 #include <nautilus-file.h>
 #include <nautilus-file-private.h>
@@ -8,6 +11,8 @@
 #include <nautilus-file-undo-manager.h>
 #include <test-utilities.h>
 
+#include <unistd.h>
+
 
 static void
 test_file_refcount_single_file (void)
@@ -90,6 +95,41 @@ test_file_sort_with_self (void)
     g_assert_cmpint (order, ==, 0);
 }
 
+static void
+test_file_sort_keys (void)
+{
+    g_autoptr (NautilusFile) file_1 = nautilus_file_get_by_uri ("file:///etc");
+    g_autoptr (NautilusFile) file_2 = nautilus_file_get_by_uri ("file:///usr");
+    const char *attributes[] = { "name", "size", "type", "date_modified", "permissions" };
+
+    for (guint i = 0; i < G_N_ELEMENTS (attributes); i++)
+    {
+        GQuark attribute_q = g_quark_from_string (attributes[i]);
+        NautilusFileSortKey key_1;
+        NautilusFileSortKey key_2;
+
+        nautilus_file_get_sort_key (file_1, attribute_q, &key_1);
+        nautilus_file_get_sort_key (file_2, attribute_q, &key_2);
+
+        for (guint j = 0; j < 4; j++)
+        {
+            gboolean directories_first = (j & 1) != 0;
+            gboolean reversed = (j & 2) != 0;
+            int expected = nautilus_file_compare_for_sort_by_attribute_q (file_1, file_2, attribute_q,
+                                                                          directories_first, reversed);
+            int order = nautilus_file_compare_sort_keys (file_1, &key_1, file_2, &key_2,
+                                                         directories_first, reversed);
+
+            g_assert_cmpint (CLAMP (order, -1, 1), ==, CLAMP (expected, -1, 1));
+            g_assert_cmpint (nautilus_file_compare_sort_keys (file_1, &key_1, file_1, &key_1,
+                                                              directories_first, reversed), ==, 0);
+        }
+
+        nautilus_file_sort_key_clear (&key_1);
+        nautilus_file_sort_key_clear (&key_2);
+    }
+}
+
 typedef struct
 {
     const gsize len;
@@ -447,13 +487,265 @@ test_directory_counts (void)
     test_clear_tmp_dir ();
 }
 
+static void
+test_file_attributes_for_string_attribute (void)
+{
+    /* Makes sure the attribute quarks are set up. */
+    g_autoptr (NautilusFile) file = nautilus_file_get_by_uri ("file:///home");
+
+    g_assert_cmpint (nautilus_file_get_attributes_for_string_attribute_q (g_quark_from_string ("name")),
+                     ==, 0);
+    g_assert_cmpint (nautilus_file_get_attributes_for_string_attribute_q (g_quark_from_string ("date_modified")),
+                     ==, 0);
+    g_assert_cmpint (nautilus_file_get_attributes_for_string_attribute_q (g_quark_from_string ("size")),
+                     ==, NAUTILUS_FILE_ATTRIBUTE_DIRECTORY_ITEM_COUNT);
+    g_assert_cmpint (nautilus_file_get_attributes_for_string_attribute_q (g_quark_from_string ("some_extension_column")),
+                     ==, NAUTILUS_FILE_ATTRIBUTE_EXTENSION_INFO);
+}
+
+typedef struct
+{
+    NautilusDeepCountTotals totals;
+    gboolean done;
+} DeepCountResult;
+
+static void
+on_deep_count_progress (const NautilusDeepCountTotals *totals,
+                        gboolean                       done,
+                        gpointer                       user_data)
+{
+    DeepCountResult *result = user_data;
+
+    result->totals = *totals;
+    result->done = done;
+}
+
+static NautilusDeepCountTotals
+count_deep (GFile *location)
+{
+    DeepCountResult result = { 0 };
+
+    nautilus_deep_count_start (location, on_deep_count_progress, &result);
+    while (!result.done)
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+    return result.totals;
+}
+
+static void
+test_deep_count_cache (void)
+{
+    const GStrv hierarchy = (char *[])
+    {
+        "deepcache/",
+        "deepcache/file1",
+        "deepcache/dir1/",
+        "deepcache/dir1/file2",
+        NULL
+    };
+    g_autoptr (GFile) location = g_file_new_build_filename (test_get_tmp_dir (), "deepcache", NULL);
+    g_autoptr (GFile) dir1 = g_file_get_child (location, "dir1");
+    g_autoptr (GFile) file2 = g_file_get_child (dir1, "file2");
+    g_autoptr (GFileOutputStream) stream = NULL;
+    NautilusDeepCountTotals first, second, third;
+
+    file_hierarchy_create (hierarchy, "");
+
+    first = count_deep (location);
+    g_assert_cmpuint (first.directory_count, ==, 1);
+    g_assert_cmpuint (first.file_count, ==, 2);
+
+    /* Growing a file leaves its directory as it was... */
+    stream = g_file_append_to (file2, G_FILE_CREATE_NONE, NULL, NULL);
+    g_assert_nonnull (stream);
+    g_assert_true (g_output_stream_write_all (G_OUTPUT_STREAM (stream), "0123456789", 10,
+                                              NULL, NULL, NULL));
+    g_assert_true (g_output_stream_close (G_OUTPUT_STREAM (stream), NULL, NULL));
+
+    /* ...so the cached totals of the directory have to be dropped. */
+    nautilus_deep_count_cache_invalidate (dir1);
+    second = count_deep (location);
+    g_assert_cmpuint (second.file_count, ==, 2);
+    g_assert_cmpint (second.size, ==, first.size + 10);
+
+    /* New entries change the directory, which is enough. */
+    file_hierarchy_create ((char *[]) { "deepcache/dir1/file3", NULL }, "");
+    third = count_deep (location);
+    g_assert_cmpuint (third.directory_count, ==, 1);
+    g_assert_cmpuint (third.file_count, ==, 3);
+
+    test_clear_tmp_dir ();
+}
+
+/* Creates @n_directories directories, each holding @n_files files of
+ * @file_size bytes and the directories below it, @depth levels deep. */
+static void
+create_deep_tree (const char *path,
+                  guint       depth,
+                  guint       n_directories,
+                  guint       n_files,
+                  gsize       file_size)
+{
+    g_autofree char *contents = g_malloc0 (file_size);
+
+    g_assert_cmpint (g_mkdir_with_parents (path, 0700), ==, 0);
+
+    for (guint i = 0; i < n_files; i++)
+    {
+        g_autofree char *name = g_strdup_printf ("file%u", i);
+        g_autofree char *file_path = g_build_filename (path, name, NULL);
+
+        g_assert_true (g_file_set_contents (file_path, contents, file_size, NULL));
+    }
+
+    if (depth == 0)
+    {
+        return;
+    }
+
+    for (guint i = 0; i < n_directories; i++)
+    {
+        g_autofree char *name = g_strdup_printf ("dir%u", i);
+        g_autofree char *directory_path = g_build_filename (path, name, NULL);
+
+        create_deep_tree (directory_path, depth - 1, n_directories, n_files, file_size);
+    }
+}
+
+/** Check that the workers add up a wide and deep tree, every time */
+static void
+test_deep_count_parallel (void)
+{
+    g_autofree char *path = g_build_filename (test_get_tmp_dir (), "deepparallel", NULL);
+    g_autoptr (GFile) location = g_file_new_for_path (path);
+    /* 1 + 6 + 36 + 216 directories, of which all but the root are counted. */
+    const guint n_directories = 6 + 36 + 216;
+    const guint n_files = 3 * (n_directories + 1);
+
+    create_deep_tree (path, 3, 6, 3, 10);
+
+    /* The first count reads every directory, the later ones mostly come
+     * from the cache. Both hand subdirectories between workers. */
+    for (guint i = 0; i < 20; i++)
+    {
+        NautilusDeepCountTotals totals = count_deep (location);
+
+        g_assert_cmpuint (totals.directory_count, ==, n_directories);
+        g_assert_cmpuint (totals.file_count, ==, n_files);
+        g_assert_cmpuint (totals.unreadable_count, ==, 0);
+        g_assert_cmpint (totals.size, >=, 10 * n_files);
+    }
+
+    test_clear_tmp_dir ();
+}
+
+/** Check that a file with several links takes up its size once */
+static void
+test_deep_count_hard_links (void)
+{
+    g_autofree char *path = g_build_filename (test_get_tmp_dir (), "deeplinks", NULL);
+    g_autofree char *file_path = g_build_filename (path, "file", NULL);
+    g_autoptr (GFile) location = g_file_new_for_path (path);
+    NautilusDeepCountTotals totals;
+    goffset directory_size = 0;
+
+    create_deep_tree (path, 1, 2, 0, 0);
+    g_assert_true (g_file_set_contents (file_path, "0123456789", 10, NULL));
+
+    for (guint i = 0; i < 2; i++)
+    {
+        g_autofree char *name = g_strdup_printf ("dir%u/link", i);
+        g_autofree char *link_path = g_build_filename (path, name, NULL);
+
+        g_assert_cmpint (link (file_path, link_path), ==, 0);
+    }
+
+    totals = count_deep (location);
+    g_assert_cmpuint (totals.directory_count, ==, 2);
+    g_assert_cmpuint (totals.file_count, ==, 3);
+
+    /* Directories take up space too. */
+    for (guint i = 0; i < 2; i++)
+    {
+        g_autofree char *name = g_strdup_printf ("dir%u", i);
+        g_autofree char *directory_path = g_build_filename (path, name, NULL);
+        GStatBuf statbuf;
+
+        g_assert_cmpint (g_lstat (directory_path, &statbuf), ==, 0);
+        directory_size += statbuf.st_size;
+    }
+    g_assert_cmpint (totals.size, ==, 10 + directory_size);
+
+    test_clear_tmp_dir ();
+}
+
+static void
+on_deep_count_cancelled (const NautilusDeepCountTotals *totals,
+                         gboolean                       done,
+                         gpointer                       user_data)
+{
+    g_assert_not_reached ();
+}
+
+/** Check that requests for one location share the result, and that a
+ *  cancelled request hears nothing more */
+static void
+test_deep_count_shared (void)
+{
+    g_autofree char *path = g_build_filename (test_get_tmp_dir (), "deepshared", NULL);
+    g_autoptr (GFile) location = g_file_new_for_path (path);
+    DeepCountResult first = { 0 };
+    DeepCountResult second = { 0 };
+    guint cancelled_id;
+
+    create_deep_tree (path, 2, 4, 2, 1);
+
+    nautilus_deep_count_start (location, on_deep_count_progress, &first);
+    cancelled_id = nautilus_deep_count_start (location, on_deep_count_cancelled, NULL);
+    nautilus_deep_count_start (location, on_deep_count_progress, &second);
+    nautilus_deep_count_cancel (cancelled_id);
+
+    while (!first.done || !second.done)
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+    g_assert_cmpuint (first.totals.directory_count, ==, 4 + 16);
+    g_assert_cmpuint (first.totals.file_count, ==, 2 * 21);
+    g_assert_cmpuint (second.totals.directory_count, ==, first.totals.directory_count);
+    g_assert_cmpuint (second.totals.file_count, ==, first.totals.file_count);
+    g_assert_cmpint (second.totals.size, ==, first.totals.size);
+
+    test_clear_tmp_dir ();
+}
+
+/** Check that a count with nothing to hand out to the workers still ends,
+ *  with its totals */
+static void
+test_deep_count_finishes_promptly (void)
+{
+    g_autofree char *path = g_build_filename (test_get_tmp_dir (), "deepprompt", NULL);
+    g_autoptr (GFile) location = g_file_new_for_path (path);
+    NautilusDeepCountTotals totals;
+
+    create_deep_tree (path, 0, 0, 1, 1);
+
+    totals = count_deep (location);
+    g_assert_cmpuint (totals.directory_count, ==, 0);
+    g_assert_cmpuint (totals.file_count, ==, 1);
+
+    test_clear_tmp_dir ();
+}
+
 int
 main (int   argc,
       char *argv[])
 {
     g_autoptr (NautilusFileUndoManager) undo_manager = NULL;
 
-    g_test_init (&argc, &argv, NULL);
+    g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
     g_test_set_nonfatal_assertions ();
     nautilus_ensure_extension_points ();
 
@@ -471,6 +763,8 @@ main (int   argc,
                      test_file_sort_order);
     g_test_add_func ("/file-sort/with-self",
                      test_file_sort_with_self);
+    g_test_add_func ("/file-sort/keys",
+                     test_file_sort_keys);
     g_test_add_func ("/file-batch-rename/cycles",
                      test_file_batch_rename_cycles);
     g_test_add_func ("/file-batch-rename/chains",
@@ -487,6 +781,18 @@ main (int   argc,
                      test_file_permissions_set_same);
     g_test_add_func ("/file/deep-counts/basic",
                      test_directory_counts);
+    g_test_add_func ("/file/deep-counts/cache",
+                     test_deep_count_cache);
+    g_test_add_func ("/file/deep-counts/parallel",
+                     test_deep_count_parallel);
+    g_test_add_func ("/file/deep-counts/hard-links",
+                     test_deep_count_hard_links);
+    g_test_add_func ("/file/deep-counts/shared",
+                     test_deep_count_shared);
+    g_test_add_func ("/file/deep-counts/finishes-promptly",
+                     test_deep_count_finishes_promptly);
+    g_test_add_func ("/file/attributes-for-string-attribute",
+                     test_file_attributes_for_string_attribute);
 
     return g_test_run ();
 }
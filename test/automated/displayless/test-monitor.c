@@ -0,0 +1,241 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <nautilus-directory.h>
+#include <nautilus-directory-private.h>
+#include <nautilus-file.h>
+#include <nautilus-monitor.h>
+#include <nautilus-tag-manager.h>
+#include <test-utilities.h>
+
+#include <unistd.h>
+
+/* Missing watches are retried every few seconds. */
+#define WAIT_SECONDS 30
+
+/* Like ITER_CONTEXT_WHILE, but bounded by time rather than by iterations,
+ * which go by quickly or not at all depending on the events that come. */
+#define WAIT_WHILE(CONDITION) \
+    { \
+        gint64 deadline = g_get_monotonic_time () + WAIT_SECONDS * G_USEC_PER_SEC; \
+        guint wake_up_id = g_timeout_add (100, wake_up, NULL); \
+        while ((CONDITION) && g_get_monotonic_time () < deadline) \
+        { \
+            g_main_context_iteration (NULL, TRUE); \
+        } \
+        g_source_remove (wake_up_id); \
+    }
+
+static int data_dummy;
+
+static gboolean
+wake_up (gpointer user_data)
+{
+    return G_SOURCE_CONTINUE;
+}
+
+static guint
+get_n_watches (void)
+{
+    guint n_watches, watch_limit;
+
+    nautilus_monitor_get_watch_usage (&n_watches, &watch_limit);
+
+    return n_watches;
+}
+
+static gboolean
+directory_is_loaded (NautilusDirectory *directory)
+{
+    return directory->details->directory_loaded;
+}
+
+static gboolean
+directory_has_file (NautilusDirectory *directory,
+                    const char        *name)
+{
+    NautilusFile *file = nautilus_directory_find_file_by_name (directory, name);
+
+    return file != NULL && !nautilus_file_is_gone (file);
+}
+
+/* Iterates until @name is listed in @directory, or isn't, as @expected. */
+static gboolean
+wait_for_file (NautilusDirectory *directory,
+               const char        *name,
+               gboolean           expected)
+{
+    WAIT_WHILE (directory_has_file (directory, name) != expected);
+
+    return directory_has_file (directory, name) == expected;
+}
+
+static NautilusDirectory *
+monitor_directory (const char *path)
+{
+    g_autoptr (GFile) location = g_file_new_for_path (path);
+    NautilusDirectory *directory = nautilus_directory_get (location);
+
+    nautilus_directory_file_monitor_add (directory, &data_dummy, TRUE, 0, NULL, NULL);
+    WAIT_WHILE (!directory_is_loaded (directory));
+    g_assert_true (directory_is_loaded (directory));
+
+    return directory;
+}
+
+static void
+unmonitor_directory (NautilusDirectory *directory)
+{
+    nautilus_directory_file_monitor_remove (directory, &data_dummy);
+    nautilus_directory_unref (directory);
+}
+
+static char *
+create_test_directory (const char *name)
+{
+    char *path = g_build_filename (test_get_tmp_dir (), name, NULL);
+
+    g_assert_cmpint (g_mkdir_with_parents (path, 0700), ==, 0);
+
+    return path;
+}
+
+static void
+touch (const char *directory_path,
+       const char *name)
+{
+    g_autofree char *path = g_build_filename (directory_path, name, NULL);
+
+    g_assert_true (g_file_set_contents (path, "", 0, NULL));
+}
+
+/** Check that additions, renames and removals are seen */
+static void
+test_monitor_inotify_changes (void)
+{
+    g_autofree char *path = create_test_directory ("changes");
+    g_autofree char *old_path = g_build_filename (path, "old", NULL);
+    g_autofree char *new_path = g_build_filename (path, "new", NULL);
+    NautilusDirectory *directory = monitor_directory (path);
+
+    touch (path, "old");
+    g_assert_true (wait_for_file (directory, "old", TRUE));
+
+    g_assert_cmpint (g_rename (old_path, new_path), ==, 0);
+    g_assert_true (wait_for_file (directory, "new", TRUE));
+    g_assert_true (wait_for_file (directory, "old", FALSE));
+
+    g_assert_cmpint (g_unlink (new_path), ==, 0);
+    g_assert_true (wait_for_file (directory, "new", FALSE));
+
+    unmonitor_directory (directory);
+    test_clear_tmp_dir ();
+}
+
+/** Check that a rename is a rename in every path sharing a watch */
+static void
+test_monitor_inotify_shared_watch_moves (void)
+{
+    g_autofree char *path = create_test_directory ("shared");
+    g_autofree char *link_path = g_build_filename (test_get_tmp_dir (), "shared-link", NULL);
+    g_autofree char *old_path = g_build_filename (path, "old", NULL);
+    g_autofree char *new_path = g_build_filename (path, "new", NULL);
+    NautilusDirectory *directory;
+    NautilusDirectory *link_directory;
+
+    g_assert_cmpint (symlink (path, link_path), ==, 0);
+    touch (path, "old");
+    directory = monitor_directory (path);
+    link_directory = monitor_directory (link_path);
+    g_assert_true (directory_has_file (directory, "old"));
+    g_assert_true (directory_has_file (link_directory, "old"));
+
+    g_assert_cmpint (g_rename (old_path, new_path), ==, 0);
+
+    g_assert_true (wait_for_file (directory, "new", TRUE));
+    g_assert_true (wait_for_file (link_directory, "new", TRUE));
+    g_assert_true (wait_for_file (directory, "old", FALSE));
+    g_assert_true (wait_for_file (link_directory, "old", FALSE));
+
+    unmonitor_directory (link_directory);
+    unmonitor_directory (directory);
+    test_clear_tmp_dir ();
+}
+
+/** Check that a deleted and recreated directory is watched again */
+static void
+test_monitor_inotify_recreated (void)
+{
+    g_autofree char *path = create_test_directory ("recreated");
+    NautilusDirectory *directory = monitor_directory (path);
+
+    g_assert_cmpuint (get_n_watches (), ==, 1);
+
+    g_assert_cmpint (g_rmdir (path), ==, 0);
+
+    /* The kernel drops the watch, and its descriptor with it. */
+    WAIT_WHILE (get_n_watches () != 0);
+    g_assert_cmpuint (get_n_watches (), ==, 0);
+
+    g_assert_cmpint (g_mkdir (path, 0700), ==, 0);
+    touch (path, "before");
+    g_assert_true (wait_for_file (directory, "before", TRUE));
+    g_assert_cmpuint (get_n_watches (), ==, 1);
+
+    /* Watched again, rather than rescanned. */
+    touch (path, "after");
+    g_assert_true (wait_for_file (directory, "after", TRUE));
+
+    unmonitor_directory (directory);
+    test_clear_tmp_dir ();
+}
+
+/** Check that a directory moved away stops getting events for its old path */
+static void
+test_monitor_inotify_moved_away (void)
+{
+    g_autofree char *path = create_test_directory ("moved");
+    g_autofree char *moved_path = g_build_filename (test_get_tmp_dir (), "moved-away", NULL);
+    NautilusDirectory *directory = monitor_directory (path);
+    gint64 until;
+
+    g_assert_cmpint (g_rename (path, moved_path), ==, 0);
+
+    WAIT_WHILE (get_n_watches () != 0);
+    g_assert_cmpuint (get_n_watches (), ==, 0);
+
+    /* Not reported as a file of the old path. */
+    touch (moved_path, "elsewhere");
+    until = g_get_monotonic_time () + G_USEC_PER_SEC / 2;
+    WAIT_WHILE (!directory_has_file (directory, "elsewhere") && g_get_monotonic_time () < until);
+    g_assert_false (directory_has_file (directory, "elsewhere"));
+
+    unmonitor_directory (directory);
+    test_clear_tmp_dir ();
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+    g_autoptr (NautilusTagManager) tag_manager = NULL;
+
+    /* Read once, on the first monitor. */
+    g_setenv ("NAUTILUS_MONITOR_BACKEND", "inotify", TRUE);
+
+    g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+    g_test_set_nonfatal_assertions ();
+    nautilus_ensure_extension_points ();
+    tag_manager = nautilus_tag_manager_new_dummy ();
+
+    g_test_add_func ("/monitor/inotify/changes",
+                     test_monitor_inotify_changes);
+    g_test_add_func ("/monitor/inotify/shared-watch-moves",
+                     test_monitor_inotify_shared_watch_moves);
+    g_test_add_func ("/monitor/inotify/recreated",
+                     test_monitor_inotify_recreated);
+    g_test_add_func ("/monitor/inotify/moved-away",
+                     test_monitor_inotify_moved_away);
+
+    return g_test_run ();
+}
@@ -0,0 +1,859 @@
+/*
+ * Copyright © 2025 The Files contributors
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Throughput and latency of the thumbnail pipeline, driven the way a view
+ * drives it: everything in a folder is requested at once, and the few items
+ * on screen are raised to the visible class right after.
+ *
+ * Run with `meson test --benchmark` or `-m perf`. A synthetic corpus of
+ * JPEG, PNG, WebP and GIF files at a few sizes is written to a temporary
+ * directory, or the files of NAUTILUS_TEST_THUMBNAIL_CORPUS are used. Each
+ * benchmark starts by clearing the thumbnails of its corpus, so that it
+ * starts with a cold thumbnail cache either way.
+ *
+ * Decoding JPEGs at thumbnail size is measured on its own too, against a
+ * generated 24 MP image or the files of NAUTILUS_TEST_JPEG_CORPUS. */
+
+#include "test-utilities.h"
+
+#include <nautilus-application.h>
+#include <nautilus-global-preferences.h>
+#include <nautilus-image.h>
+#include <nautilus-thumbnails.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <gtk/gtk.h>
+#include <sys/resource.h>
+
+#define ICON_SIZE 256
+
+/* Copies of each kind and size of image in the synthetic corpus */
+#define N_COPIES 4
+/* Requests raised to the visible class, like the rows of a short window */
+#define N_VISIBLE 8
+/* Generous, as the GIFs go through the sandboxed external thumbnailer */
+#define MAX_WAIT_SECONDS 300
+
+static const struct
+{
+    gint width;
+    gint height;
+} corpus_sizes[] =
+{
+    { 640, 480 },
+    { 1920, 1080 },
+    { 4000, 3000 },
+};
+
+typedef struct
+{
+    gint64 started;
+    gint64 finished;
+    gboolean visible;
+    gboolean failed;
+    guint *n_finished;
+} Request;
+
+static void
+fill_pixels (guchar *pixels,
+             gint    width,
+             gint    height,
+             gint    rowstride,
+             gint    n_channels,
+             guint32 seed)
+{
+    /* A gradient with some noise, so that encoders don't get away with
+     * files much smaller than those of photos. */
+    for (gint y = 0; y < height; y++)
+    {
+        guchar *row = pixels + y * rowstride;
+
+        for (gint x = 0; x < width; x++)
+        {
+            seed = seed * 1103515245 + 12345;
+
+            guchar noise = (seed >> 16) & 0x1f;
+            guchar *pixel = row + x * n_channels;
+
+            pixel[0] = (x * 255 / width) ^ noise;
+            pixel[1] = (y * 255 / height) ^ noise;
+            pixel[2] = ((x + y) & 0xff) ^ noise;
+        }
+    }
+}
+
+static GdkPixbuf *
+make_pixbuf (gint    width,
+             gint    height,
+             guint32 seed)
+{
+    GdkPixbuf *pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+
+    fill_pixels (gdk_pixbuf_get_pixels (pixbuf),
+                 width, height,
+                 gdk_pixbuf_get_rowstride (pixbuf),
+                 gdk_pixbuf_get_n_channels (pixbuf),
+                 seed);
+
+    return pixbuf;
+}
+
+static gboolean
+can_save_format (const char *name)
+{
+    g_autoptr (GSList) formats = gdk_pixbuf_get_formats ();
+
+    for (GSList *l = formats; l != NULL; l = l->next)
+    {
+        GdkPixbufFormat *format = l->data;
+        g_autofree char *format_name = gdk_pixbuf_format_get_name (format);
+
+        if (g_strcmp0 (format_name, name) == 0)
+        {
+            return gdk_pixbuf_format_is_writable (format);
+        }
+    }
+
+    return FALSE;
+}
+
+typedef struct
+{
+    GByteArray *data;
+    GByteArray *block;
+    guint32 bits;
+    guint n_bits;
+} GifWriter;
+
+static void
+gif_flush_block (GifWriter *writer)
+{
+    if (writer->block->len > 0)
+    {
+        guint8 len = writer->block->len;
+
+        g_byte_array_append (writer->data, &len, 1);
+        g_byte_array_append (writer->data, writer->block->data, len);
+        g_byte_array_set_size (writer->block, 0);
+    }
+}
+
+static void
+gif_write_code (GifWriter *writer,
+                guint      code)
+{
+    writer->bits |= code << writer->n_bits;
+    writer->n_bits += 9;
+
+    while (writer->n_bits >= 8)
+    {
+        guint8 byte = writer->bits & 0xff;
+
+        g_byte_array_append (writer->block, &byte, 1);
+        writer->bits >>= 8;
+        writer->n_bits -= 8;
+
+        if (writer->block->len == 255)
+        {
+            gif_flush_block (writer);
+        }
+    }
+}
+
+static void
+gif_write_u16 (GByteArray *data,
+               guint16     value)
+{
+    guint8 bytes[] = { value & 0xff, value >> 8 };
+
+    g_byte_array_append (data, bytes, sizeof (bytes));
+}
+
+/* GdkPixbuf can't write GIF. This writes a grayscale one without any
+ * compression: the LZW table is reset before codes would grow past 9 bits,
+ * so every pixel is a literal code. Big files, but valid ones. */
+static GBytes *
+make_gif (gint    width,
+          gint    height,
+          guint32 seed)
+{
+    enum
+    {
+        CLEAR_CODE = 256,
+        END_CODE = 257,
+        /* Literals after a clear before the table would need 10-bit codes */
+        MAX_LITERALS = 254,
+    };
+    GifWriter writer = { g_byte_array_new (), g_byte_array_new (), 0, 0 };
+    guint n_literals = 0;
+
+    g_byte_array_append (writer.data, (const guint8 *) "GIF89a", 6);
+    gif_write_u16 (writer.data, width);
+    gif_write_u16 (writer.data, height);
+    /* Global color table of 256 entries, background 0, square pixels */
+    g_byte_array_append (writer.data, (const guint8 []) { 0xf7, 0, 0 }, 3);
+    for (guint i = 0; i < 256; i++)
+    {
+        guint8 rgb[] = { i, i, i };
+
+        g_byte_array_append (writer.data, rgb, sizeof (rgb));
+    }
+
+    /* Image descriptor covering the whole screen, no local color table */
+    g_byte_array_append (writer.data, (const guint8 []) { 0x2c }, 1);
+    gif_write_u16 (writer.data, 0);
+    gif_write_u16 (writer.data, 0);
+    gif_write_u16 (writer.data, width);
+    gif_write_u16 (writer.data, height);
+    g_byte_array_append (writer.data, (const guint8 []) { 0, 8 }, 2);
+
+    gif_write_code (&writer, CLEAR_CODE);
+    for (gint y = 0; y < height; y++)
+    {
+        for (gint x = 0; x < width; x++)
+        {
+            seed = seed * 1103515245 + 12345;
+
+            if (n_literals == MAX_LITERALS)
+            {
+                gif_write_code (&writer, CLEAR_CODE);
+                n_literals = 0;
+            }
+
+            gif_write_code (&writer, ((x ^ y) + ((seed >> 16) & 0x1f)) & 0xff);
+            n_literals++;
+        }
+    }
+    gif_write_code (&writer, END_CODE);
+
+    if (writer.n_bits > 0)
+    {
+        guint8 byte = writer.bits & 0xff;
+
+        g_byte_array_append (writer.block, &byte, 1);
+    }
+    gif_flush_block (&writer);
+    g_byte_array_unref (writer.block);
+
+    /* Block terminator and trailer */
+    g_byte_array_append (writer.data, (const guint8 []) { 0, 0x3b }, 2);
+
+    return g_byte_array_free_to_bytes (writer.data);
+}
+
+static void
+write_image (GFile      *dir,
+             const char *format,
+             gint        width,
+             gint        height,
+             guint       copy)
+{
+    g_autoptr (GError) error = NULL;
+    g_autoptr (GBytes) bytes = NULL;
+    const char *extension = g_str_equal (format, "jpeg") ? "jpg" : format;
+    g_autofree char *name = g_strdup_printf ("%s-%dx%d-%u.%s",
+                                             format, width, height, copy, extension);
+    g_autoptr (GFile) file = g_file_get_child (dir, name);
+    guint32 seed = g_str_hash (name);
+
+    if (g_str_equal (format, "gif"))
+    {
+        bytes = make_gif (width, height, seed);
+    }
+    else
+    {
+        g_autoptr (GdkPixbuf) pixbuf = make_pixbuf (width, height, seed);
+        gchar *buffer;
+        gsize buffer_size;
+
+        gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &buffer_size, format, &error, NULL);
+        g_assert_no_error (error);
+        bytes = g_bytes_new_take (buffer, buffer_size);
+    }
+
+    g_file_replace_contents (file,
+                             g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes),
+                             NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL, &error);
+    g_assert_no_error (error);
+}
+
+static GFile *
+create_corpus (const char *name)
+{
+    const char *corpus_path = g_getenv ("NAUTILUS_TEST_THUMBNAIL_CORPUS");
+    g_autoptr (GError) error = NULL;
+
+    if (corpus_path != NULL)
+    {
+        return g_file_new_for_commandline_arg (corpus_path);
+    }
+
+    g_autofree char *path = g_build_filename (test_get_tmp_dir (), name, NULL);
+    g_autoptr (GFile) dir = g_file_new_for_path (path);
+    const char *formats[] = { "jpeg", "png", "webp", "gif" };
+
+    g_file_make_directory_with_parents (dir, NULL, &error);
+    g_assert_no_error (error);
+
+    for (guint i = 0; i < G_N_ELEMENTS (formats); i++)
+    {
+        if (!g_str_equal (formats[i], "gif") && !can_save_format (formats[i]))
+        {
+            g_test_message ("Leaving %s out of the corpus, it can't be written", formats[i]);
+            continue;
+        }
+
+        for (guint j = 0; j < G_N_ELEMENTS (corpus_sizes); j++)
+        {
+            for (guint copy = 0; copy < N_COPIES; copy++)
+            {
+                write_image (dir, formats[i],
+                             corpus_sizes[j].width, corpus_sizes[j].height,
+                             copy);
+            }
+        }
+    }
+
+    return g_steal_pointer (&dir);
+}
+
+/* Infos of the regular files in @dir, each with its #GFile attached. */
+static GPtrArray *
+list_corpus (GFile *dir)
+{
+    g_autoptr (GError) error = NULL;
+    g_autoptr (GFileEnumerator) enumerator = NULL;
+    GPtrArray *infos = g_ptr_array_new_with_free_func (g_object_unref);
+    GFileInfo *info;
+
+    enumerator = g_file_enumerate_children (dir,
+                                            G_FILE_ATTRIBUTE_STANDARD_NAME ","
+                                            G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                                            G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                                            G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE ","
+                                            G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                            G_FILE_QUERY_INFO_NONE, NULL, &error);
+    g_assert_no_error (error);
+
+    while ((info = g_file_enumerator_next_file (enumerator, NULL, &error)) != NULL)
+    {
+        if (g_file_info_get_file_type (info) == G_FILE_TYPE_REGULAR)
+        {
+            g_object_set_data_full (G_OBJECT (info), "file",
+                                    g_file_enumerator_get_child (enumerator, info),
+                                    g_object_unref);
+            g_ptr_array_add (infos, info);
+        }
+        else
+        {
+            g_object_unref (info);
+        }
+    }
+    g_assert_no_error (error);
+
+    return infos;
+}
+
+static GFile *
+info_get_file (GFileInfo *info)
+{
+    return G_FILE (g_object_get_data (G_OBJECT (info), "file"));
+}
+
+static gboolean
+wake_up (gpointer user_data)
+{
+    return G_SOURCE_CONTINUE;
+}
+
+/* Iterates until @is_done returns TRUE, or gives up after a while. Unlike
+ * ITER_CONTEXT_WHILE, this isn't bounded by a number of iterations, which
+ * a large corpus easily goes past. */
+static gboolean
+wait_until (gboolean (*is_done) (gpointer user_data),
+            gpointer   user_data)
+{
+    gint64 deadline = g_get_monotonic_time () + MAX_WAIT_SECONDS * G_USEC_PER_SEC;
+    guint wake_up_id = g_timeout_add (100, wake_up, NULL);
+    gboolean done;
+
+    while (!(done = is_done (user_data)) && g_get_monotonic_time () < deadline)
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+    g_source_remove (wake_up_id);
+
+    return done;
+}
+
+typedef struct
+{
+    GPtrArray *uris;
+    gboolean looking_up;
+    gboolean cleared;
+} ClearProgress;
+
+static void
+thumbnails_looked_up_cb (GObject      *source_object,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+    ClearProgress *progress = user_data;
+    g_autoptr (GArray) entries = nautilus_thumbnail_lookup_finish (result, NULL);
+    guint n_found = 0;
+
+    progress->looking_up = FALSE;
+
+    for (guint i = 0; entries != NULL && i < entries->len; i++)
+    {
+        NautilusThumbnailCacheEntry *entry = &g_array_index (entries,
+                                                             NautilusThumbnailCacheEntry, i);
+
+        if (entry->path != NULL)
+        {
+            g_remove (entry->path);
+            n_found++;
+        }
+    }
+
+    progress->cleared = (n_found == 0);
+}
+
+static gboolean
+thumbnails_are_cleared (gpointer user_data)
+{
+    ClearProgress *progress = user_data;
+
+    if (!progress->cleared && !progress->looking_up)
+    {
+        progress->looking_up = TRUE;
+        nautilus_thumbnail_lookup_async (progress->uris, NULL,
+                                         thumbnails_looked_up_cb, progress);
+    }
+
+    return progress->cleared;
+}
+
+/* Deletes the thumbnails of the files of @infos, until the thumbnail cache
+ * has caught up with that, and forgets the failed ones. */
+static void
+clear_thumbnails (GPtrArray *infos)
+{
+    g_autoptr (GPtrArray) uris = g_ptr_array_new_with_free_func (g_free);
+    ClearProgress progress = { uris, FALSE, FALSE };
+
+    for (guint i = 0; i < infos->len; i++)
+    {
+        g_ptr_array_add (uris, g_file_get_uri (info_get_file (infos->pdata[i])));
+    }
+
+    g_assert_true (wait_until (thumbnails_are_cleared, &progress));
+
+    /* A lookup still running after a timeout points at the progress. */
+    while (progress.looking_up)
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+    nautilus_thumbnail_purge_failures (NULL);
+}
+
+static gint
+compare_gint64 (gconstpointer a,
+                gconstpointer b)
+{
+    gint64 value_a = *(const gint64 *) a;
+    gint64 value_b = *(const gint64 *) b;
+
+    return (value_a > value_b) - (value_a < value_b);
+}
+
+static gdouble
+percentile_msec (GArray *sorted_usec,
+                 guint   percent)
+{
+    if (sorted_usec->len == 0)
+    {
+        return 0.0;
+    }
+
+    guint index = (sorted_usec->len - 1) * percent / 100;
+
+    return g_array_index (sorted_usec, gint64, index) / 1000.0;
+}
+
+static glong
+get_peak_rss_kib (void)
+{
+    struct rusage usage;
+
+    if (getrusage (RUSAGE_SELF, &usage) != 0)
+    {
+        return 0;
+    }
+
+    /* Kilobytes on Linux */
+    return usage.ru_maxrss;
+}
+
+/* Reports the latencies of @requests, measured from @start. */
+static void
+report_requests (const char *name,
+                 Request    *requests,
+                 guint       n_requests,
+                 gint64      start)
+{
+    g_autoptr (GArray) latencies = g_array_sized_new (FALSE, FALSE, sizeof (gint64), n_requests);
+    gint64 first_visible = G_MAXINT64;
+    gint64 all_visible = 0;
+    gint64 last = start;
+    guint n_failed = 0;
+    guint n_unfinished = 0;
+
+    for (guint i = 0; i < n_requests; i++)
+    {
+        Request *request = &requests[i];
+
+        if (request->finished == 0)
+        {
+            n_unfinished++;
+            continue;
+        }
+
+        gint64 latency = request->finished - request->started;
+
+        g_array_append_val (latencies, latency);
+        last = MAX (last, request->finished);
+        n_failed += request->failed;
+
+        if (request->visible)
+        {
+            first_visible = MIN (first_visible, request->finished - start);
+            all_visible = MAX (all_visible, request->finished - start);
+        }
+    }
+
+    g_array_sort (latencies, compare_gint64);
+
+    gdouble seconds = (last - start) / (gdouble) G_USEC_PER_SEC;
+    gdouble per_second = (seconds > 0) ? latencies->len / seconds : 0.0;
+
+    g_test_message ("%s: %u of %u finished (%u failed, %u unfinished) in %.2f s, "
+                    "%.1f thumbnails/s",
+                    name, latencies->len, n_requests, n_failed, n_unfinished,
+                    seconds, per_second);
+    g_test_message ("%s: latency p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms",
+                    name,
+                    percentile_msec (latencies, 50),
+                    percentile_msec (latencies, 90),
+                    percentile_msec (latencies, 99),
+                    percentile_msec (latencies, 100));
+    if (first_visible != G_MAXINT64)
+    {
+        g_test_message ("%s: first visible thumbnail after %.1f ms, all visible after %.1f ms",
+                        name, first_visible / 1000.0, all_visible / 1000.0);
+        g_test_minimized_result (first_visible / 1000.0,
+                                 "%.1f ms to the first visible thumbnail",
+                                 first_visible / 1000.0);
+    }
+    g_test_maximized_result (per_second, "%.1f thumbnails/s", per_second);
+    g_test_minimized_result (percentile_msec (latencies, 99),
+                             "%.1f ms p99 latency", percentile_msec (latencies, 99));
+    g_test_message ("%s: peak RSS %ld KiB", name, get_peak_rss_kib ());
+}
+
+static void
+thumbnail_ready_cb (GObject      *source_object,
+                    GAsyncResult *res,
+                    gpointer      user_data)
+{
+    Request *request = user_data;
+    g_autoptr (GdkPixbuf) pixbuf = nautilus_create_thumbnail_finish (res, NULL);
+
+    request->finished = g_get_monotonic_time ();
+    request->failed = (pixbuf == NULL);
+    *request->n_finished += 1;
+}
+
+typedef struct
+{
+    guint n_finished;
+    guint n_requests;
+} PipelineProgress;
+
+static gboolean
+pipeline_is_done (gpointer user_data)
+{
+    PipelineProgress *progress = user_data;
+
+    return progress->n_finished == progress->n_requests;
+}
+
+static void
+test_thumbnail_pipeline_benchmark (void)
+{
+    if (!g_test_perf ())
+    {
+        g_test_skip ("Benchmarks only run in perf mode (-m perf)");
+
+        return;
+    }
+
+    g_autoptr (GFile) dir = create_corpus ("pipeline");
+    g_autoptr (GPtrArray) infos = list_corpus (dir);
+    g_autofree Request *requests = g_new0 (Request, infos->len);
+    PipelineProgress progress = { 0, infos->len };
+    NautilusThumbnailStats stats;
+    gint64 start;
+
+    clear_thumbnails (infos);
+    start = g_get_monotonic_time ();
+
+    for (guint i = 0; i < infos->len; i++)
+    {
+        GFileInfo *info = infos->pdata[i];
+        g_autofree char *uri = g_file_get_uri (info_get_file (info));
+        g_autoptr (GDateTime) mtime = g_file_info_get_modification_date_time (info);
+
+        requests[i].n_finished = &progress.n_finished;
+        requests[i].started = g_get_monotonic_time ();
+        nautilus_create_thumbnail_async (uri,
+                                         g_file_info_get_content_type (info),
+                                         g_date_time_to_unix (mtime),
+                                         g_file_info_get_size (info),
+                                         NAUTILUS_THUMBNAIL_PRIORITY_PREFETCH,
+                                         NULL,
+                                         thumbnail_ready_cb,
+                                         &requests[i]);
+    }
+
+    /* The view comes to the last rows once all of them are requested. */
+    for (guint i = infos->len - MIN (N_VISIBLE, infos->len); i < infos->len; i++)
+    {
+        g_autofree char *uri = g_file_get_uri (info_get_file (infos->pdata[i]));
+
+        requests[i].visible = TRUE;
+        nautilus_thumbnail_set_priority (uri, NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE);
+    }
+
+    nautilus_thumbnail_get_stats (&stats);
+    g_test_message ("Queued %u visible, %u prefetch and %u background requests",
+                    stats.queued[NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE],
+                    stats.queued[NAUTILUS_THUMBNAIL_PRIORITY_PREFETCH],
+                    stats.queued[NAUTILUS_THUMBNAIL_PRIORITY_BACKGROUND]);
+
+    g_assert_true (wait_until (pipeline_is_done, &progress));
+
+    report_requests ("Pipeline", requests, infos->len, start);
+
+    nautilus_thumbnail_get_stats (&stats);
+    g_test_message ("Pipeline: %" G_GUINT64_FORMAT " generated, %" G_GUINT64_FORMAT " failed, "
+                    "%" G_GUINT64_FORMAT " timed out",
+                    stats.generated, stats.failed, stats.timed_out);
+}
+
+typedef struct
+{
+    GPtrArray *images;
+    Request *requests;
+    guint n_finished;
+} ImageProgress;
+
+static gboolean
+images_are_done (gpointer user_data)
+{
+    ImageProgress *progress = user_data;
+    gint64 now = g_get_monotonic_time ();
+
+    for (guint i = 0; i < progress->images->len; i++)
+    {
+        Request *request = &progress->requests[i];
+
+        if (request->finished == 0 &&
+            gtk_widget_has_css_class (progress->images->pdata[i], "thumbnail"))
+        {
+            request->finished = now;
+            progress->n_finished++;
+        }
+    }
+
+    return progress->n_finished == progress->images->len;
+}
+
+static void
+test_image_loading_benchmark (void)
+{
+    if (!g_test_perf ())
+    {
+        g_test_skip ("Benchmarks only run in perf mode (-m perf)");
+
+        return;
+    }
+
+    g_autoptr (GFile) dir = create_corpus ("image");
+    g_autoptr (GPtrArray) infos = list_corpus (dir);
+    g_autoptr (GPtrArray) images = g_ptr_array_new_with_free_func (g_object_unref);
+    g_autofree Request *requests = g_new0 (Request, infos->len);
+    ImageProgress progress = { images, requests, 0 };
+    NautilusImageCacheStats stats;
+    gint64 start;
+
+    clear_thumbnails (infos);
+    start = g_get_monotonic_time ();
+
+    for (guint i = 0; i < infos->len; i++)
+    {
+        NautilusImage *image = g_object_ref_sink (nautilus_image_new ());
+
+        requests[i].started = g_get_monotonic_time ();
+        requests[i].visible = (i < N_VISIBLE);
+
+        nautilus_image_set_size (image, ICON_SIZE);
+        nautilus_image_set_source (image, info_get_file (infos->pdata[i]));
+        g_ptr_array_add (images, image);
+    }
+
+    /* Images report failures only by not showing a thumbnail, so a failed
+     * one shows up here as unfinished. */
+    wait_until (images_are_done, &progress);
+
+    report_requests ("Image", requests, infos->len, start);
+
+    nautilus_image_get_cache_stats (&stats);
+    g_test_message ("Image: cache holds %" G_GSIZE_FORMAT " KiB of textures and "
+                    "%" G_GSIZE_FORMAT " KiB of thumbnail files, "
+                    "%" G_GUINT64_FORMAT " misses",
+                    stats.texture_bytes / 1024, stats.compressed_bytes / 1024,
+                    stats.misses);
+
+    g_assert_cmpuint (progress.n_finished, ==, infos->len);
+}
+
+/* Compares decoding a corpus of 24 MP JPEGs at thumbnail size against decoding
+ * them fully and scaling afterwards. Set NAUTILUS_TEST_JPEG_CORPUS to a folder
+ * of real photos to measure those instead of generated images. */
+static void
+test_thumbnail_decode_benchmark (void)
+{
+    const char *corpus_path = g_getenv ("NAUTILUS_TEST_JPEG_CORPUS");
+    g_autoptr (GPtrArray) images = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+    /* The x-large thumbnail size, used on HiDPI displays */
+    const gint max_size = 512;
+    gdouble full_time = 0, at_size_time = 0;
+
+    if (!g_test_perf ())
+    {
+        g_test_skip ("Benchmarks only run in perf mode (-m perf)");
+
+        return;
+    }
+
+    if (corpus_path != NULL)
+    {
+        g_autoptr (GDir) dir = g_dir_open (corpus_path, 0, NULL);
+        const char *name;
+
+        while (dir != NULL && (name = g_dir_read_name (dir)) != NULL)
+        {
+            g_autofree char *path = g_build_filename (corpus_path, name, NULL);
+            gchar *contents;
+            gsize length;
+
+            if (g_str_has_suffix (name, ".jpg") || g_str_has_suffix (name, ".JPG") ||
+                g_str_has_suffix (name, ".jpeg"))
+            {
+                if (g_file_get_contents (path, &contents, &length, NULL))
+                {
+                    g_ptr_array_add (images, g_bytes_new_take (contents, length));
+                }
+            }
+        }
+    }
+
+    if (images->len == 0)
+    {
+        g_autoptr (GdkPixbuf) pixbuf = make_pixbuf (6000, 4000, 0);
+        gchar *buffer;
+        gsize size;
+
+        g_assert_true (gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &size, "jpeg", NULL,
+                                                  "quality", "90", NULL));
+        for (guint i = 0; i < 8; i++)
+        {
+            g_ptr_array_add (images, g_bytes_new (buffer, size));
+        }
+        g_free (buffer);
+    }
+
+    for (guint i = 0; i < images->len; i++)
+    {
+        g_autoptr (GInputStream) full_stream = g_memory_input_stream_new_from_bytes (images->pdata[i]);
+        g_autoptr (GInputStream) at_size_stream = g_memory_input_stream_new_from_bytes (images->pdata[i]);
+
+        g_test_timer_start ();
+        g_autoptr (GdkPixbuf) full = gdk_pixbuf_new_from_stream (full_stream, NULL, NULL);
+        gint width = gdk_pixbuf_get_width (full), height = gdk_pixbuf_get_height (full);
+        double scale = (double) max_size / MAX (width, height);
+        g_autoptr (GdkPixbuf) scaled = gdk_pixbuf_scale_simple (full,
+                                                                MAX (width * scale, 1),
+                                                                MAX (height * scale, 1),
+                                                                GDK_INTERP_BILINEAR);
+        full_time += g_test_timer_elapsed ();
+
+        g_test_timer_start ();
+        g_autoptr (GdkPixbuf) at_size = nautilus_thumbnail_decode_stream (at_size_stream, max_size,
+                                                                          NULL, NULL);
+        at_size_time += g_test_timer_elapsed ();
+
+        g_assert_nonnull (at_size);
+        g_assert_cmpint (MAX (gdk_pixbuf_get_width (at_size), gdk_pixbuf_get_height (at_size)),
+                         <=, max_size);
+    }
+
+    g_test_message ("Decoding %u images at %d px: full decode and scale %.1f ms/image, "
+                    "decode at size %.1f ms/image",
+                    images->len, max_size,
+                    1000 * full_time / images->len,
+                    1000 * at_size_time / images->len);
+    g_test_minimized_result (1000 * at_size_time / images->len,
+                             "%.1f ms per image decoded at size",
+                             1000 * at_size_time / images->len);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+    nautilus_ensure_extension_points ();
+
+    gtk_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+    g_test_set_nonfatal_assertions ();
+
+    if (nautilus_application_is_sandboxed () || !can_run_bwrap ())
+    {
+        /* Can't thumbnail in flatpak-builder sandbox. */
+        return 77;
+    }
+
+    nautilus_global_preferences_init ();
+
+    g_test_add_func ("/thumbnail/benchmark/pipeline",
+                     test_thumbnail_pipeline_benchmark);
+    g_test_add_func ("/thumbnail/benchmark/image",
+                     test_image_loading_benchmark);
+    g_test_add_func ("/thumbnail/benchmark/decode",
+                     test_thumbnail_decode_benchmark);
+
+    int ret = g_test_run ();
+
+    test_clear_tmp_dir ();
+
+    return ret;
+}
@@ -8,11 +8,15 @@
 
 #include "test-utilities.h"
 
+#include <nautilus-animated-thumbnail.h>
 #include <nautilus-application.h>
 #include <nautilus-file-utilities.h>
+#include <nautilus-global-preferences.h>
+#include <nautilus-image.h>
 #include <nautilus-thumbnails.h>
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
@@ -129,7 +133,8 @@ test_thumbnail_test_queue (void)
             return;
         }
 
-        nautilus_create_thumbnail_async (uri, mime_type, mtime,
+        nautilus_create_thumbnail_async (uri, mime_type, mtime, -1,
+                                         NAUTILUS_THUMBNAIL_PRIORITY_PREFETCH,
                                          cancellable, NULL, NULL);
 
         g_ptr_array_add (cancellables_array, cancellable);
@@ -153,6 +158,8 @@ test_thumbnail_test_queue (void)
         nautilus_create_thumbnail_async (uri,
                                          mime_type,
                                          mtime,
+                                         -1,
+                                         NAUTILUS_THUMBNAIL_PRIORITY_PREFETCH,
                                          NULL, NULL, NULL);
     }
 
@@ -210,6 +217,8 @@ test_thumbnail_image (void)
     nautilus_create_thumbnail_async (uri,
                                      mime_type,
                                      mtime,
+                                     -1,
+                                     NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE,
                                      NULL,
                                      thumbnailing_done_cb,
                                      &thumbnailing_data);
@@ -280,6 +289,8 @@ test_thumbnail_text (void)
     nautilus_create_thumbnail_async (uri,
                                      mime_type,
                                      mtime,
+                                     -1,
+                                     NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE,
                                      NULL,
                                      thumbnailing_done_cb,
                                      &thumbnailing_data);
@@ -294,6 +305,1114 @@ test_thumbnail_text (void)
     test_clear_tmp_dir ();
 }
 
+static void
+set_mtime (GFile   *location,
+           guint64  mtime)
+{
+    g_autoptr (GError) error = NULL;
+
+    g_file_set_attribute_uint64 (location, G_FILE_ATTRIBUTE_TIME_MODIFIED, mtime,
+                                 G_FILE_QUERY_INFO_NONE, NULL, &error);
+    g_assert_no_error (error);
+}
+
+/* Asks for a thumbnail of @uri, and returns how many thumbnails were made or
+ *  failed to be made for it: 0 when the failure was remembered. */
+static guint
+try_failing_thumbnail (const char *uri,
+                       guint64     mtime,
+                       goffset     size)
+{
+    g_auto (ThumbnailCallbackData) data = { NULL, FALSE, NULL };
+    NautilusThumbnailStats before, after;
+
+    nautilus_thumbnail_get_stats (&before);
+    nautilus_create_thumbnail_async (uri, "image/png", mtime, size,
+                                     NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE, NULL,
+                                     thumbnailing_done_cb, &data);
+    g_assert_false (data.done);
+    ITER_CONTEXT_WHILE (!data.done);
+    nautilus_thumbnail_get_stats (&after);
+
+    g_assert_null (data.pixbuf);
+    g_assert_nonnull (data.error);
+
+    return (after.generated + after.failed) - (before.generated + before.failed);
+}
+
+static void
+test_thumbnail_failure_cache (void)
+{
+    g_autoptr (GFile) location = g_file_new_build_filename (test_get_tmp_dir (),
+                                                            "Broken.png",
+                                                            NULL);
+    g_autofree gchar *uri = g_file_get_uri (location);
+    g_autoptr (GError) error = NULL;
+    g_autoptr (GFileInfo) info = NULL;
+    g_autofree gchar *other_uri = NULL;
+    const gchar *mime_type = "image/png";
+    static const char contents[] = "\x89PNG\r\n\x1a\nnot really";
+    static const char longer_contents[] = "\x89PNG\r\n\x1a\nnot really, still";
+    /* Old enough not to be held back as recently modified. */
+    guint64 mtime = g_get_real_time () / G_USEC_PER_SEC - 3600;
+    goffset size;
+
+    g_file_replace_contents (location, contents, sizeof (contents) - 1, NULL, FALSE,
+                             G_FILE_CREATE_NONE, NULL, NULL, &error);
+    g_assert_no_error (error);
+    set_mtime (location, mtime);
+
+    info = g_file_query_info (location, "standard::*,time::*", G_FILE_QUERY_INFO_NONE, NULL, NULL);
+    size = g_file_info_get_size (info);
+
+    if (!nautilus_can_thumbnail (uri, mime_type, mtime))
+    {
+        g_test_skip ("System has no thumbnailer for images, but this test is meant to test "
+                     "thumbnailing an image.");
+        test_clear_tmp_dir ();
+
+        return;
+    }
+
+    g_assert_cmpuint (try_failing_thumbnail (uri, mtime, size), ==, 1);
+
+    /* Remembered, and answered without trying again */
+    g_assert_false (nautilus_can_thumbnail (uri, mime_type, mtime));
+    g_assert_cmpuint (try_failing_thumbnail (uri, mtime, size), ==, 0);
+
+    /* Tried again once the file changed, even behind the same mtime */
+    g_file_replace_contents (location, longer_contents, sizeof (longer_contents) - 1, NULL,
+                             FALSE, G_FILE_CREATE_NONE, NULL, NULL, &error);
+    g_assert_no_error (error);
+    set_mtime (location, mtime);
+    size = sizeof (longer_contents) - 1;
+    g_assert_cmpuint (try_failing_thumbnail (uri, mtime, size), ==, 1);
+    g_assert_cmpuint (try_failing_thumbnail (uri, mtime, size), ==, 0);
+
+    mtime -= 60;
+    set_mtime (location, mtime);
+    g_assert_true (nautilus_can_thumbnail (uri, mime_type, mtime));
+    g_assert_cmpuint (try_failing_thumbnail (uri, mtime, size), ==, 1);
+    g_assert_cmpuint (try_failing_thumbnail (uri, mtime, size), ==, 0);
+
+    /* Purging other files keeps it */
+    other_uri = g_strconcat (uri, "-other", NULL);
+    nautilus_thumbnail_purge_failures (other_uri);
+    g_assert_false (nautilus_can_thumbnail (uri, mime_type, mtime));
+
+    nautilus_thumbnail_purge_failures (NULL);
+
+    test_clear_tmp_dir ();
+}
+
+typedef struct
+{
+    guint index;
+    GArray *finished;
+    gboolean done;
+    gboolean has_pixbuf;
+    GError *error;
+} QueuedRequest;
+
+static void
+queued_request_clear (QueuedRequest *request)
+{
+    g_clear_error (&request->error);
+}
+
+static void
+queued_request_done_cb (GObject      *source_object,
+                        GAsyncResult *res,
+                        gpointer      data)
+{
+    QueuedRequest *request = data;
+    g_autoptr (GdkPixbuf) pixbuf = nautilus_create_thumbnail_finish (res, &request->error);
+
+    request->has_pixbuf = pixbuf != NULL;
+    request->done = TRUE;
+    if (request->finished != NULL)
+    {
+        g_array_append_val (request->finished, request->index);
+    }
+}
+
+/* Old enough not to be held back as recently modified. */
+static void
+make_file_old (GFile *location)
+{
+    guint64 an_hour_ago = g_get_real_time () / G_USEC_PER_SEC - 3600;
+    g_autoptr (GError) error = NULL;
+
+    g_file_set_attribute_uint64 (location, G_FILE_ATTRIBUTE_TIME_MODIFIED, an_hour_ago,
+                                 G_FILE_QUERY_INFO_NONE, NULL, &error);
+    g_assert_no_error (error);
+}
+
+static GPtrArray *
+make_old_image_files (const char *prefix,
+                      guint       n_images)
+{
+    GPtrArray *locations = g_ptr_array_new_with_free_func (g_object_unref);
+
+    for (guint i = 0; i < n_images; i++)
+    {
+        g_autofree char *name = g_strdup_printf ("%s_%u.png", prefix, i);
+        GFile *location = g_file_new_build_filename (test_get_tmp_dir (), name, NULL);
+
+        make_image_file (location, NULL);
+        make_file_old (location);
+
+        g_ptr_array_add (locations, location);
+    }
+
+    return locations;
+}
+
+static void
+request_thumbnail (GFile                     *location,
+                   NautilusThumbnailPriority  priority,
+                   GCancellable              *cancellable,
+                   QueuedRequest             *request)
+{
+    g_autofree char *uri = g_file_get_uri (location);
+    g_autoptr (GFileInfo) info = g_file_query_info (location, "standard::*,time::*",
+                                                    G_FILE_QUERY_INFO_NONE, NULL, NULL);
+
+    nautilus_create_thumbnail_async (uri, g_file_info_get_content_type (info),
+                                     g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED),
+                                     g_file_info_get_size (info),
+                                     priority, cancellable,
+                                     queued_request_done_cb, request);
+}
+
+static gboolean
+all_requests_done (QueuedRequest *requests,
+                   guint          n_requests)
+{
+    for (guint i = 0; i < n_requests; i++)
+    {
+        if (!requests[i].done)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/** Check that requests are made class by class, and that asking again for a
+ *  queued file in a more urgent class moves it there */
+static void
+test_thumbnail_queue_priority (void)
+{
+    const guint n_images = 5;
+    g_autoptr (GPtrArray) locations = make_old_image_files ("priority", n_images);
+    g_autoptr (GArray) finished = g_array_new (FALSE, FALSE, sizeof (guint));
+    QueuedRequest requests[5] = { { 0 } };
+    QueuedRequest again = { .index = 1 };
+    const guint expected[] = { 4, 1, 1, 0, 2, 3 };
+
+    /* One at a time, so they finish in the order they are started. */
+    nautilus_thumbnail_set_max_threads (1);
+
+    for (guint i = 0; i < n_images; i++)
+    {
+        requests[i].index = i;
+        requests[i].finished = finished;
+        request_thumbnail (locations->pdata[i],
+                           i < 4 ? NAUTILUS_THUMBNAIL_PRIORITY_BACKGROUND :
+                           NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE,
+                           NULL, &requests[i]);
+    }
+    again.finished = finished;
+    request_thumbnail (locations->pdata[1], NAUTILUS_THUMBNAIL_PRIORITY_PREFETCH, NULL, &again);
+
+    while (!all_requests_done (requests, n_images) || !again.done)
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+    g_assert_cmpuint (finished->len, ==, G_N_ELEMENTS (expected));
+    for (guint i = 0; i < finished->len && i < G_N_ELEMENTS (expected); i++)
+    {
+        g_assert_cmpuint (g_array_index (finished, guint, i), ==, expected[i]);
+    }
+    for (guint i = 0; i < n_images; i++)
+    {
+        g_assert_no_error (requests[i].error);
+        g_assert_true (requests[i].has_pixbuf);
+        queued_request_clear (&requests[i]);
+    }
+    queued_request_clear (&again);
+
+    nautilus_thumbnail_set_max_threads (0);
+    test_clear_tmp_dir ();
+}
+
+/** Check that a slow mount gets one thread, however many are free */
+static void
+test_thumbnail_queue_slow_mount (void)
+{
+    const char * const hosts[] = { "nautilus-test-a.invalid", "nautilus-test-b.invalid" };
+    const guint n_per_host = 3;
+    QueuedRequest requests[6] = { { 0 } };
+    NautilusThumbnailStats stats;
+    guint max_running = 0;
+
+    nautilus_thumbnail_set_max_threads (4);
+
+    for (guint i = 0; i < G_N_ELEMENTS (requests); i++)
+    {
+        g_autofree char *uri = g_strdup_printf ("sftp://%s/image-%u.png",
+                                                hosts[i / n_per_host], i);
+
+        /* Not reachable, so they fail, but only after taking a thread. */
+        nautilus_create_thumbnail_async (uri, "image/png", 1000, -1,
+                                         NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE, NULL,
+                                         queued_request_done_cb, &requests[i]);
+    }
+
+    while (!all_requests_done (requests, G_N_ELEMENTS (requests)))
+    {
+        g_main_context_iteration (NULL, TRUE);
+
+        nautilus_thumbnail_get_stats (&stats);
+        max_running = MAX (max_running, stats.running);
+    }
+
+    g_assert_cmpuint (max_running, >=, 1);
+    g_assert_cmpuint (max_running, <=, G_N_ELEMENTS (hosts));
+    for (guint i = 0; i < G_N_ELEMENTS (requests); i++)
+    {
+        g_assert_false (requests[i].has_pixbuf);
+        g_assert_nonnull (requests[i].error);
+        queued_request_clear (&requests[i]);
+    }
+
+    nautilus_thumbnail_purge_failures (NULL);
+    nautilus_thumbnail_set_max_threads (0);
+}
+
+/** Check that cancelled requests are answered as such and never made */
+static void
+test_thumbnail_queue_cancellation (void)
+{
+    const guint n_images = 6;
+    g_autoptr (GPtrArray) locations = make_old_image_files ("cancelled", n_images);
+    g_autoptr (GPtrArray) cancellables = g_ptr_array_new_with_free_func (g_object_unref);
+    QueuedRequest requests[6] = { { 0 } };
+    NautilusThumbnailStats before, after;
+
+    nautilus_thumbnail_set_max_threads (1);
+    nautilus_thumbnail_get_stats (&before);
+
+    for (guint i = 0; i < n_images; i++)
+    {
+        GCancellable *cancellable = g_cancellable_new ();
+
+        g_ptr_array_add (cancellables, cancellable);
+        request_thumbnail (locations->pdata[i], NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE,
+                           cancellable, &requests[i]);
+    }
+
+    /* Every other one, while still queued. */
+    for (guint i = 1; i < n_images; i += 2)
+    {
+        g_cancellable_cancel (cancellables->pdata[i]);
+    }
+
+    while (!all_requests_done (requests, n_images))
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+    nautilus_thumbnail_get_stats (&after);
+    g_assert_cmpuint (after.generated - before.generated, ==, n_images / 2);
+    for (NautilusThumbnailPriority p = 0; p < NAUTILUS_THUMBNAIL_N_PRIORITIES; p++)
+    {
+        g_assert_cmpuint (after.queued[p], ==, 0);
+    }
+
+    for (guint i = 0; i < n_images; i++)
+    {
+        g_autofree char *uri = g_file_get_uri (locations->pdata[i]);
+        g_autofree char *thumbnail_path = nautilus_thumbnail_get_path_for_uri (uri);
+
+        if (i % 2 == 1)
+        {
+            g_assert_error (requests[i].error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+            g_assert_false (requests[i].has_pixbuf);
+            g_assert_false (g_file_test (thumbnail_path, G_FILE_TEST_EXISTS));
+        }
+        else
+        {
+            g_assert_no_error (requests[i].error);
+            g_assert_true (requests[i].has_pixbuf);
+            g_assert_true (g_file_test (thumbnail_path, G_FILE_TEST_EXISTS));
+            g_unlink (thumbnail_path);
+        }
+        queued_request_clear (&requests[i]);
+    }
+
+    nautilus_thumbnail_set_max_threads (0);
+    test_clear_tmp_dir ();
+}
+
+/* Made up, so that nothing but the thumbnailer below claims it. */
+#define TEST_VIDEO_MIME_TYPE "video/x-nautilus-test"
+
+/* Takes longer than the videos are given, and can't be cancelled. */
+#define TEST_VIDEO_THUMBNAILER_SECS 3
+
+/* Installs a video thumbnailer that never makes anything, and returns whether
+ *  the thumbnail factory picked it up, which it only does on creation. */
+static gboolean
+install_slow_video_thumbnailer (void)
+{
+    g_autofree char *directory = g_build_filename (g_get_user_data_dir (), "thumbnailers", NULL);
+    g_autofree char *path = g_build_filename (directory, "nautilus-test.thumbnailer", NULL);
+    g_autofree char *contents = g_strdup_printf ("[Thumbnailer Entry]\n"
+                                                 "TryExec=sleep\n"
+                                                 "Exec=sleep %d\n"
+                                                 "MimeType=%s;\n",
+                                                 TEST_VIDEO_THUMBNAILER_SECS,
+                                                 TEST_VIDEO_MIME_TYPE);
+
+    g_assert_cmpint (g_mkdir_with_parents (directory, 0700), ==, 0);
+    g_assert_true (g_file_set_contents (path, contents, -1, NULL));
+
+    return nautilus_can_thumbnail ("file:///video.nautilus-test", TEST_VIDEO_MIME_TYPE, 1000);
+}
+
+/** Check that videos get their threads while the image ones are taken, and
+ *  give them up on timing out, whether or not the thumbnailer stops, without
+ *  being remembered as failed */
+static void
+test_thumbnail_video_timeout (void)
+{
+    const guint n_images = 3;
+    const guint n_videos = 3;
+    g_autoptr (GPtrArray) image_locations = NULL;
+    QueuedRequest images[3] = { { 0 } };
+    QueuedRequest videos[3] = { { 0 } };
+    QueuedRequest late_videos[3] = { { 0 } };
+    g_autoptr (GPtrArray) video_uris = g_ptr_array_new_with_free_func (g_free);
+    NautilusThumbnailStats before, stats;
+    gboolean video_beside_images = FALSE;
+
+    if (!install_slow_video_thumbnailer ())
+    {
+        g_test_skip ("Thumbnail factory was created before the test thumbnailer was installed.");
+        test_clear_tmp_dir ();
+
+        return;
+    }
+
+    image_locations = make_old_image_files ("beside_videos", n_images);
+    nautilus_thumbnail_set_max_threads (1);
+    nautilus_thumbnail_set_video_timeout (1);
+    nautilus_thumbnail_get_stats (&before);
+
+    for (guint i = 0; i < n_images; i++)
+    {
+        request_thumbnail (image_locations->pdata[i], NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE,
+                           NULL, &images[i]);
+    }
+    for (guint i = 0; i < n_videos; i++)
+    {
+        g_autofree char *name = g_strdup_printf ("video_%u.nautilus-test", i);
+        g_autoptr (GFile) location = g_file_new_build_filename (test_get_tmp_dir (), name, NULL);
+        g_autofree char *uri = g_file_get_uri (location);
+
+        g_assert_true (g_file_replace_contents (location, "", 0, NULL, FALSE,
+                                                G_FILE_CREATE_NONE, NULL, NULL, NULL));
+        nautilus_create_thumbnail_async (uri, TEST_VIDEO_MIME_TYPE, 1000, 0,
+                                         NAUTILUS_THUMBNAIL_PRIORITY_BACKGROUND, NULL,
+                                         queued_request_done_cb, &videos[i]);
+        g_ptr_array_add (video_uris, g_steal_pointer (&uri));
+    }
+
+    while (!all_requests_done (videos, n_videos))
+    {
+        g_main_context_iteration (NULL, TRUE);
+
+        nautilus_thumbnail_get_stats (&stats);
+        g_assert_cmpuint (stats.running_videos, <=, 2);
+        if (stats.running_videos > 0 && stats.queued[NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE] > 0)
+        {
+            video_beside_images = TRUE;
+        }
+    }
+
+    /* Two videos at a time, but the last one didn't wait for the thumbnailers
+     *  of the first two to give up. */
+    g_assert_true (video_beside_images);
+    for (guint i = 0; i < n_videos; i++)
+    {
+        g_assert_error (videos[i].error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT);
+        g_assert_false (videos[i].has_pixbuf);
+        queued_request_clear (&videos[i]);
+    }
+    nautilus_thumbnail_get_stats (&stats);
+    g_assert_cmpuint (stats.timed_out - before.timed_out, ==, n_videos);
+
+    /* Asking again while the thumbnailers still run waits for their late
+     *  results, which aren't remembered as failures. */
+    for (guint i = 0; i < n_videos; i++)
+    {
+        nautilus_create_thumbnail_async (video_uris->pdata[i], TEST_VIDEO_MIME_TYPE, 1000, 0,
+                                         NAUTILUS_THUMBNAIL_PRIORITY_BACKGROUND, NULL,
+                                         queued_request_done_cb, &late_videos[i]);
+    }
+    while (!all_requests_done (images, n_images) ||
+           !all_requests_done (late_videos, n_videos))
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    nautilus_thumbnail_get_stats (&stats);
+    g_assert_cmpuint (stats.running_videos, ==, 0);
+    g_assert_cmpuint (stats.running, ==, 0);
+    g_assert_cmpuint (stats.failed - before.failed, ==, 0);
+    for (guint i = 0; i < n_videos; i++)
+    {
+        g_autofree char *path = g_filename_from_uri (video_uris->pdata[i], NULL, NULL);
+        GStatBuf stat_buf;
+
+        g_assert_cmpint (g_stat (path, &stat_buf), ==, 0);
+        g_assert_error (late_videos[i].error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT);
+        g_assert_true (nautilus_can_thumbnail (video_uris->pdata[i], TEST_VIDEO_MIME_TYPE,
+                                               stat_buf.st_mtime));
+        queued_request_clear (&late_videos[i]);
+    }
+    for (guint i = 0; i < n_images; i++)
+    {
+        queued_request_clear (&images[i]);
+    }
+
+    nautilus_thumbnail_set_video_timeout (0);
+    nautilus_thumbnail_set_max_threads (0);
+    nautilus_thumbnail_purge_failures (NULL);
+    test_clear_tmp_dir ();
+}
+
+static GInputStream *
+make_jpeg_stream (gint width,
+                  gint height)
+{
+    g_autoptr (GdkPixbuf) pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+    g_autoptr (GError) error = NULL;
+    gchar *buffer;
+    gsize size;
+
+    gdk_pixbuf_fill (pixbuf, 0x3070b000);
+    g_assert_true (gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &size, "jpeg", &error, NULL));
+    g_assert_no_error (error);
+
+    return g_memory_input_stream_new_from_data (buffer, size, g_free);
+}
+
+/* A JPEG whose header claims @width×@height, but holding just a few pixels. */
+static GBytes *
+make_jpeg_claiming_size (guint width,
+                         guint height)
+{
+    g_autoptr (GdkPixbuf) pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, 16, 16);
+    gchar *buffer;
+    gsize size;
+
+    gdk_pixbuf_fill (pixbuf, 0x3070b000);
+    g_assert_true (gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &size, "jpeg", NULL, NULL));
+
+    /* The start of frame: marker, length, precision, height and width. */
+    for (gsize i = 0; i + 9 <= size; i++)
+    {
+        if ((guchar) buffer[i] == 0xff && (guchar) buffer[i + 1] == 0xc0)
+        {
+            buffer[i + 5] = height >> 8;
+            buffer[i + 6] = height & 0xff;
+            buffer[i + 7] = width >> 8;
+            buffer[i + 8] = width & 0xff;
+
+            return g_bytes_new_take (buffer, size);
+        }
+    }
+
+    g_assert_not_reached ();
+
+    return NULL;
+}
+
+/** Check that images with too many pixels are refused before being decoded */
+static void
+test_thumbnail_decode_too_many_pixels (void)
+{
+    g_autoptr (GBytes) huge = make_jpeg_claiming_size (10000, 10000);
+    g_autoptr (GInputStream) stream = g_memory_input_stream_new_from_bytes (huge);
+    g_autoptr (GError) error = NULL;
+    g_autoptr (GdkPixbuf) pixbuf = nautilus_thumbnail_decode_stream (stream, ICON_SIZE,
+                                                                     NULL, &error);
+
+    g_assert_null (pixbuf);
+    g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED);
+}
+
+/** Check that common images are decoded in process */
+static void
+test_thumbnail_in_process (void)
+{
+    g_autoptr (GPtrArray) locations = make_old_image_files ("in_process", 1);
+    g_autofree char *uri = g_file_get_uri (locations->pdata[0]);
+    g_autofree char *thumbnail_path = nautilus_thumbnail_get_path_for_uri (uri);
+    QueuedRequest request = { 0 };
+    NautilusThumbnailStats before, after;
+
+    nautilus_thumbnail_get_stats (&before);
+    request_thumbnail (locations->pdata[0], NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE, NULL, &request);
+    while (!request.done)
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    nautilus_thumbnail_get_stats (&after);
+
+    g_assert_no_error (request.error);
+    g_assert_true (request.has_pixbuf);
+    g_assert_true (g_file_test (thumbnail_path, G_FILE_TEST_EXISTS));
+    g_assert_cmpuint (after.generated_in_process - before.generated_in_process, ==, 1);
+    g_assert_cmpuint (after.in_process_fallbacks, ==, before.in_process_fallbacks);
+
+    queued_request_clear (&request);
+    g_unlink (thumbnail_path);
+    test_clear_tmp_dir ();
+}
+
+/** Check that an image too large to decode in process goes to a thumbnailer */
+static void
+test_thumbnail_in_process_fallback (void)
+{
+    g_autoptr (GFile) location = g_file_new_build_filename (test_get_tmp_dir (), "Huge.jpg", NULL);
+    g_autofree char *uri = g_file_get_uri (location);
+    g_autoptr (GBytes) huge = make_jpeg_claiming_size (10000, 10000);
+    g_autoptr (GError) error = NULL;
+    QueuedRequest request = { 0 };
+    NautilusThumbnailStats before, after;
+
+    g_file_replace_contents (location, g_bytes_get_data (huge, NULL), g_bytes_get_size (huge),
+                             NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL, &error);
+    g_assert_no_error (error);
+    make_file_old (location);
+
+    if (!nautilus_can_thumbnail (uri, "image/jpeg", 1000))
+    {
+        g_test_skip ("System has no thumbnailer for images, but this test is meant to test "
+                     "thumbnailing an image.");
+        test_clear_tmp_dir ();
+
+        return;
+    }
+
+    nautilus_thumbnail_get_stats (&before);
+    request_thumbnail (location, NAUTILUS_THUMBNAIL_PRIORITY_VISIBLE, NULL, &request);
+    while (!request.done)
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    nautilus_thumbnail_get_stats (&after);
+
+    /* Whether the thumbnailer makes anything of it is up to the thumbnailer. */
+    g_assert_cmpuint (after.in_process_fallbacks - before.in_process_fallbacks, ==, 1);
+    g_assert_cmpuint (after.generated_in_process, ==, before.generated_in_process);
+    g_assert_cmpuint ((after.generated + after.failed) - (before.generated + before.failed), ==, 1);
+
+    queued_request_clear (&request);
+    nautilus_thumbnail_purge_failures (NULL);
+    test_clear_tmp_dir ();
+}
+
+static gboolean
+probe_bytes (const guchar *data,
+             gsize         size)
+{
+    g_autoptr (GInputStream) stream = g_memory_input_stream_new_from_data (data, size, NULL);
+    g_autoptr (GError) error = NULL;
+    gboolean is_animated = nautilus_animated_thumbnail_probe_stream (stream, NULL, &error);
+
+    g_assert_no_error (error);
+
+    return is_animated;
+}
+
+static void
+test_thumbnail_animated_probe (void)
+{
+    /* 1×1 GIF with a 2 color table, then one frame. */
+    const guchar gif_header[] =
+    {
+        'G', 'I', 'F', '8', '9', 'a', 1, 0, 1, 0, 0x80, 0, 0,
+        0, 0, 0, 0xff, 0xff, 0xff,
+    };
+    const guchar gif_frame[] =
+    {
+        0x2c, 0, 0, 0, 0, 1, 0, 1, 0, 0, 2, 2, 0x4c, 0x01, 0,
+    };
+    const guchar png_header[] =
+    {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+        0, 0, 0, 13, 'I', 'H', 'D', 'R', 0, 0, 0, 1, 0, 0, 0, 1, 8, 6, 0, 0, 0, 0, 0, 0, 0,
+    };
+    const guchar png_actl[] =
+    {
+        0, 0, 0, 8, 'a', 'c', 'T', 'L', 0, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0,
+    };
+    const guchar png_idat[] =
+    {
+        0, 0, 0, 0, 'I', 'D', 'A', 'T', 0, 0, 0, 0,
+    };
+    guchar webp[] =
+    {
+        'R', 'I', 'F', 'F', 22, 0, 0, 0, 'W', 'E', 'B', 'P',
+        'V', 'P', '8', 'X', 10, 0, 0, 0, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    };
+    g_autoptr (GByteArray) gif = g_byte_array_new ();
+    g_autoptr (GByteArray) png = g_byte_array_new ();
+    g_autoptr (GByteArray) apng = g_byte_array_new ();
+
+    g_byte_array_append (gif, gif_header, sizeof (gif_header));
+    g_byte_array_append (gif, gif_frame, sizeof (gif_frame));
+    g_assert_false (probe_bytes (gif->data, gif->len));
+    g_byte_array_append (gif, gif_frame, sizeof (gif_frame));
+    g_assert_true (probe_bytes (gif->data, gif->len));
+
+    g_byte_array_append (png, png_header, sizeof (png_header));
+    g_byte_array_append (png, png_idat, sizeof (png_idat));
+    g_assert_false (probe_bytes (png->data, png->len));
+
+    g_byte_array_append (apng, png_header, sizeof (png_header));
+    g_byte_array_append (apng, png_actl, sizeof (png_actl));
+    g_byte_array_append (apng, png_idat, sizeof (png_idat));
+    g_assert_true (probe_bytes (apng->data, apng->len));
+
+    g_assert_true (probe_bytes (webp, sizeof (webp)));
+    webp[20] = 0;
+    g_assert_false (probe_bytes (webp, sizeof (webp)));
+
+    /* Truncated and unknown data are just not animated. */
+    g_assert_false (probe_bytes (gif_header, 4));
+    g_assert_false (probe_bytes ((const guchar *) "Hello, world!", 13));
+}
+
+/* A looping 1×1 GIF, with a frame of 100 ms for each of @pixels, which are
+ *  0 for black and 1 for white. */
+static GBytes *
+make_gif (const guint *pixels,
+          guint        n_frames)
+{
+    const guchar header[] =
+    {
+        'G', 'I', 'F', '8', '9', 'a', 1, 0, 1, 0, 0x80, 0, 0,
+        0, 0, 0, 0xff, 0xff, 0xff,
+        0x21, 0xff, 11, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 3, 1, 0, 0, 0,
+    };
+    const guchar control[] = { 0x21, 0xf9, 4, 0, 10, 0, 0, 0 };
+    const guchar descriptor[] = { 0x2c, 0, 0, 0, 0, 1, 0, 1, 0, 0, 2, 2 };
+    /* Clear code, the pixel, end of information */
+    const guchar black[] = { 0x44, 0x01, 0 };
+    const guchar white[] = { 0x4c, 0x01, 0 };
+    GByteArray *gif = g_byte_array_new ();
+
+    g_byte_array_append (gif, header, sizeof (header));
+    for (guint i = 0; i < n_frames; i++)
+    {
+        g_byte_array_append (gif, control, sizeof (control));
+        g_byte_array_append (gif, descriptor, sizeof (descriptor));
+        g_byte_array_append (gif, pixels[i] == 0 ? black : white, sizeof (black));
+    }
+    g_byte_array_append (gif, (const guchar *) ";", 1);
+
+    return g_byte_array_free_to_bytes (gif);
+}
+
+static guint
+count_frames (GBytes *bytes)
+{
+    g_autoptr (GInputStream) stream = g_memory_input_stream_new_from_bytes (bytes);
+    g_autoptr (GError) error = NULL;
+    guint n_frames = nautilus_animated_thumbnail_count_frames (stream, NULL, &error);
+
+    g_assert_no_error (error);
+
+    return n_frames;
+}
+
+static guint
+count_frames_in_data (const guchar *data,
+                      gsize         size)
+{
+    g_autoptr (GBytes) bytes = g_bytes_new (data, size);
+
+    return count_frames (bytes);
+}
+
+/** Check that frames are counted from the headers of every format */
+static void
+test_thumbnail_animated_count_frames (void)
+{
+    const guint pixels[] = { 0, 1, 0, 1, 1 };
+    const guchar png_header[] =
+    {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+        0, 0, 0, 13, 'I', 'H', 'D', 'R', 0, 0, 0, 1, 0, 0, 0, 1, 8, 6, 0, 0, 0, 0, 0, 0, 0,
+    };
+    const guchar png_actl[] =
+    {
+        0, 0, 0, 8, 'a', 'c', 'T', 'L', 0, 0, 0, 7, 0, 0, 0, 0, 0, 0, 0, 0,
+    };
+    const guchar png_idat[] =
+    {
+        0, 0, 0, 0, 'I', 'D', 'A', 'T', 0, 0, 0, 0,
+    };
+    guchar webp[] =
+    {
+        'R', 'I', 'F', 'F', 62, 0, 0, 0, 'W', 'E', 'B', 'P',
+        'V', 'P', '8', 'X', 10, 0, 0, 0, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        'A', 'N', 'I', 'M', 6, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        'A', 'N', 'M', 'F', 1, 0, 0, 0, 0, 0,
+        'A', 'N', 'M', 'F', 0, 0, 0, 0,
+        'A', 'N', 'M', 'F', 0, 0, 0, 0,
+    };
+    g_autoptr (GByteArray) png = g_byte_array_new ();
+    g_autoptr (GByteArray) apng = g_byte_array_new ();
+
+    for (guint n_frames = 1; n_frames <= G_N_ELEMENTS (pixels); n_frames++)
+    {
+        g_autoptr (GBytes) gif = make_gif (pixels, n_frames);
+
+        g_assert_cmpuint (count_frames (gif), ==, n_frames);
+    }
+
+    g_byte_array_append (png, png_header, sizeof (png_header));
+    g_byte_array_append (png, png_idat, sizeof (png_idat));
+    g_assert_cmpuint (count_frames_in_data (png->data, png->len), ==, 1);
+
+    g_byte_array_append (apng, png_header, sizeof (png_header));
+    g_byte_array_append (apng, png_actl, sizeof (png_actl));
+    g_byte_array_append (apng, png_idat, sizeof (png_idat));
+    g_assert_cmpuint (count_frames_in_data (apng->data, apng->len), ==, 7);
+
+    /* Padded, odd sized chunks included. */
+    g_assert_cmpuint (count_frames_in_data (webp, sizeof (webp)), ==, 3);
+    webp[20] = 0;
+    g_assert_cmpuint (count_frames_in_data (webp, sizeof (webp)), ==, 1);
+
+    g_assert_cmpuint (count_frames_in_data ((const guchar *) "Hello, world!", 13), ==, 0);
+}
+
+static NautilusAnimatedPaintable *
+make_paintable (GBytes *gif)
+{
+    g_autoptr (GInputStream) stream = g_memory_input_stream_new_from_bytes (gif);
+    g_autoptr (GError) error = NULL;
+    g_autoptr (GdkPixbufAnimation) animation = gdk_pixbuf_animation_new_from_stream (stream,
+                                                                                     NULL,
+                                                                                     &error);
+
+    g_assert_no_error (error);
+    if (animation == NULL)
+    {
+        return NULL;
+    }
+
+    return nautilus_animated_paintable_new (animation, count_frames (gif), 0);
+}
+
+/** Check that every frame of a loop is kept, even ones that look the same as
+ *  the loop so far */
+static void
+test_thumbnail_animated_paintable_frames (void)
+{
+    /* Black, black and white would look like a loop of one black frame. */
+    const guint pixels[] = { 0, 0, 1, 0, 0, 1, 1 };
+    g_autoptr (GBytes) gif = make_gif (pixels, G_N_ELEMENTS (pixels));
+    g_autoptr (NautilusAnimatedPaintable) paintable = make_paintable (gif);
+    g_autoptr (NautilusAnimatedPaintable) copy = NULL;
+
+    g_assert_nonnull (paintable);
+    g_assert_cmpuint (nautilus_animated_paintable_get_n_frames (paintable), ==,
+                      G_N_ELEMENTS (pixels));
+    g_assert_cmpint (gdk_paintable_get_intrinsic_width (GDK_PAINTABLE (paintable)), ==, 1);
+
+    /* Copies share the frames. */
+    copy = nautilus_animated_paintable_copy (paintable);
+    g_assert_cmpuint (nautilus_animated_paintable_get_n_frames (copy), ==,
+                      G_N_ELEMENTS (pixels));
+    g_assert_cmpuint (nautilus_animated_paintable_get_frame_bytes (copy), ==,
+                      nautilus_animated_paintable_get_frame_bytes (paintable));
+}
+
+static void
+count_invalidations (GdkPaintable *paintable,
+                     guint        *n_invalidations)
+{
+    *n_invalidations += 1;
+}
+
+static gboolean
+set_flag (gpointer user_data)
+{
+    gboolean *flag = user_data;
+
+    *flag = TRUE;
+
+    return G_SOURCE_REMOVE;
+}
+
+/** Check that playing waits for a widget to drive it */
+static void
+test_thumbnail_animated_paintable_playback (void)
+{
+    const guint pixels[] = { 0, 1 };
+    g_autoptr (GBytes) gif = make_gif (pixels, G_N_ELEMENTS (pixels));
+    g_autoptr (NautilusAnimatedPaintable) paintable = make_paintable (gif);
+    guint n_invalidations = 0;
+    gboolean timed_out = FALSE;
+
+    g_assert_nonnull (paintable);
+    g_signal_connect (paintable, "invalidate-contents",
+                      G_CALLBACK (count_invalidations), &n_invalidations);
+
+    g_assert_false (nautilus_animated_paintable_is_playing (paintable));
+    nautilus_animated_paintable_start (paintable);
+    g_assert_true (nautilus_animated_paintable_is_playing (paintable));
+
+    /* Several frames long, without anything to tick it. */
+    g_timeout_add (300, set_flag, &timed_out);
+    while (!timed_out)
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_assert_cmpuint (n_invalidations, ==, 0);
+
+    nautilus_animated_paintable_set_widget (paintable, NULL);
+    nautilus_animated_paintable_stop (paintable);
+    g_assert_false (nautilus_animated_paintable_is_playing (paintable));
+}
+
+/* A still animation whose frame takes about @frame_bytes. */
+static NautilusAnimatedPaintable *
+make_sized_paintable (gsize frame_bytes)
+{
+    const int width = 1024;
+    g_autoptr (GdkPixbuf) pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8,
+                                                   width, frame_bytes / (4 * width));
+    g_autoptr (GdkPixbufAnimation) animation = NULL;
+
+    gdk_pixbuf_fill (pixbuf, 0);
+    animation = gdk_pixbuf_non_anim_new (pixbuf);
+
+    return nautilus_animated_paintable_new (animation, 1, 0);
+}
+
+/** Check that the cache keeps animations within its default size, evicting
+ *  the least recently used */
+static void
+test_thumbnail_animation_cache_eviction (void)
+{
+    NautilusAnimatedPaintable *paintables[3];
+    NautilusAnimationCacheStats before, stats;
+    gsize frame_bytes;
+
+    nautilus_animated_thumbnail_cache_clear ();
+    nautilus_animated_thumbnail_cache_get_stats (&before);
+    g_assert_cmpuint (before.max_size, ==, 64 * 1024 * 1024);
+    g_assert_cmpuint (before.size, ==, 0);
+
+    /* Two of them fit, three don't. */
+    for (guint i = 0; i < G_N_ELEMENTS (paintables); i++)
+    {
+        paintables[i] = make_sized_paintable (before.max_size * 2 / 5);
+    }
+    frame_bytes = nautilus_animated_paintable_get_frame_bytes (paintables[0]);
+    g_assert_cmpuint (2 * frame_bytes, <=, before.max_size);
+    g_assert_cmpuint (3 * frame_bytes, >, before.max_size);
+
+    nautilus_animated_thumbnail_cache_add ("file:///a.gif", paintables[0]);
+    nautilus_animated_thumbnail_cache_add ("file:///b.gif", paintables[1]);
+    nautilus_animated_thumbnail_cache_get_stats (&stats);
+    g_assert_cmpuint (stats.n_animations, ==, 2);
+    g_assert_cmpuint (stats.size, ==, 2 * frame_bytes);
+    g_assert_cmpuint (stats.evictions, ==, before.evictions);
+
+    /* Used last, so b.gif goes first. */
+    g_clear_object (&paintables[0]);
+    paintables[0] = nautilus_animated_thumbnail_cache_get ("file:///a.gif", 0);
+    g_assert_nonnull (paintables[0]);
+    g_assert_false (nautilus_animated_paintable_is_playing (paintables[0]));
+
+    nautilus_animated_thumbnail_cache_add ("file:///c.gif", paintables[2]);
+    nautilus_animated_thumbnail_cache_get_stats (&stats);
+    g_assert_cmpuint (stats.n_animations, ==, 2);
+    g_assert_cmpuint (stats.size, ==, 2 * frame_bytes);
+    g_assert_cmpuint (stats.evictions - before.evictions, ==, 1);
+
+    g_assert_null (nautilus_animated_thumbnail_cache_get ("file:///b.gif", 0));
+    for (guint i = 0; i < G_N_ELEMENTS (paintables); i++)
+    {
+        g_clear_object (&paintables[i]);
+        paintables[i] = nautilus_animated_thumbnail_cache_get (i == 0 ? "file:///a.gif" :
+                                                               "file:///c.gif", 0);
+    }
+
+    /* Only at the size they were decoded at. */
+    g_assert_null (nautilus_animated_thumbnail_cache_get ("file:///a.gif", ICON_SIZE));
+
+    nautilus_animated_thumbnail_cache_get_stats (&stats);
+    g_assert_cmpuint (stats.hits - before.hits, ==, 4);
+    g_assert_cmpuint (stats.misses - before.misses, ==, 2);
+
+    for (guint i = 0; i < G_N_ELEMENTS (paintables); i++)
+    {
+        g_clear_object (&paintables[i]);
+    }
+    nautilus_animated_thumbnail_cache_clear ();
+    nautilus_animated_thumbnail_cache_get_stats (&stats);
+    g_assert_cmpuint (stats.n_animations, ==, 0);
+    g_assert_cmpuint (stats.size, ==, 0);
+}
+
+/** Check that changing the cache size trims it, and that animations larger
+ *  than the cache are not kept */
+static void
+test_thumbnail_animation_cache_max_size (void)
+{
+    g_autoptr (NautilusAnimatedPaintable) small = make_sized_paintable (64 * 1024);
+    g_autoptr (NautilusAnimatedPaintable) large = make_sized_paintable (1024 * 1024);
+    gsize small_bytes = nautilus_animated_paintable_get_frame_bytes (small);
+    gsize large_bytes = nautilus_animated_paintable_get_frame_bytes (large);
+    NautilusAnimationCacheStats before, stats;
+
+    nautilus_animated_thumbnail_cache_clear ();
+    nautilus_animated_thumbnail_cache_get_stats (&before);
+
+    for (guint i = 0; i < 4; i++)
+    {
+        g_autofree char *uri = g_strdup_printf ("file:///small-%u.gif", i);
+
+        nautilus_animated_thumbnail_cache_add (uri, small);
+    }
+    nautilus_animated_thumbnail_cache_add ("file:///large.gif", large);
+    nautilus_animated_thumbnail_cache_get_stats (&stats);
+    g_assert_cmpuint (stats.size, ==, 4 * small_bytes + large_bytes);
+
+    /* Down to the newest ones that fit. */
+    nautilus_animated_thumbnail_cache_set_max_size (large_bytes + small_bytes);
+    nautilus_animated_thumbnail_cache_get_stats (&stats);
+    g_assert_cmpuint (stats.max_size, ==, large_bytes + small_bytes);
+    g_assert_cmpuint (stats.n_animations, ==, 1);
+    g_assert_cmpuint (stats.size, ==, large_bytes);
+    g_assert_cmpuint (stats.evictions - before.evictions, ==, 4);
+
+    /* Too large to be worth evicting everything else for. */
+    nautilus_animated_thumbnail_cache_set_max_size (large_bytes / 2);
+    nautilus_animated_thumbnail_cache_add ("file:///small-0.gif", small);
+    nautilus_animated_thumbnail_cache_add ("file:///large.gif", large);
+    nautilus_animated_thumbnail_cache_get_stats (&stats);
+    g_assert_cmpuint (stats.n_animations, ==, 1);
+    g_assert_cmpuint (stats.size, ==, small_bytes);
+    g_assert_null (nautilus_animated_thumbnail_cache_get ("file:///large.gif", 0));
+
+    /* Nothing at all. */
+    nautilus_animated_thumbnail_cache_set_max_size (0);
+    nautilus_animated_thumbnail_cache_get_stats (&stats);
+    g_assert_cmpuint (stats.n_animations, ==, 0);
+    g_assert_cmpuint (stats.size, ==, 0);
+
+    nautilus_animated_thumbnail_cache_set_max_size (before.max_size);
+}
+
+/** Check that images load the frames of animated sources, at their size */
+static void
+test_thumbnail_animated_image (void)
+{
+    const guint pixels[] = { 0, 1, 0 };
+    g_autoptr (GBytes) gif = make_gif (pixels, G_N_ELEMENTS (pixels));
+    g_autofree char *path = g_build_filename (test_get_tmp_dir (), "animated.gif", NULL);
+    g_autoptr (GFile) location = g_file_new_for_path (path);
+    g_autofree char *uri = g_file_get_uri (location);
+    g_autoptr (NautilusImage) image = g_object_ref_sink (nautilus_image_new ());
+    g_autoptr (NautilusAnimatedPaintable) cached = NULL;
+    NautilusAnimationCacheStats stats;
+    gboolean timed_out = FALSE;
+    guint timeout_id;
+
+    nautilus_animated_thumbnail_cache_clear ();
+    g_assert_true (g_file_set_contents (path, g_bytes_get_data (gif, NULL),
+                                        g_bytes_get_size (gif), NULL));
+
+    nautilus_image_set_size (image, 64);
+    nautilus_image_set_source (image, location);
+
+    timeout_id = g_timeout_add_seconds (10, set_flag, &timed_out);
+    nautilus_animated_thumbnail_cache_get_stats (&stats);
+    while (stats.n_animations == 0 && !timed_out)
+    {
+        g_main_context_iteration (NULL, TRUE);
+        nautilus_animated_thumbnail_cache_get_stats (&stats);
+    }
+    if (!timed_out)
+    {
+        g_source_remove (timeout_id);
+    }
+    g_assert_cmpuint (stats.n_animations, ==, 1);
+
+    cached = nautilus_animated_thumbnail_cache_get (uri, 64);
+    g_assert_nonnull (cached);
+    if (cached != NULL)
+    {
+        g_assert_cmpuint (nautilus_animated_paintable_get_n_frames (cached), ==,
+                          G_N_ELEMENTS (pixels));
+    }
+
+    nautilus_image_set_source (image, NULL);
+    nautilus_animated_thumbnail_cache_clear ();
+    test_clear_tmp_dir ();
+}
+
+static void
+test_thumbnail_decode_at_size (void)
+{
+    g_autoptr (GInputStream) large_stream = make_jpeg_stream (2000, 1000);
+    g_autoptr (GInputStream) small_stream = make_jpeg_stream (100, 50);
+    g_autoptr (GError) error = NULL;
+    g_autoptr (GdkPixbuf) large = nautilus_thumbnail_decode_stream (large_stream, ICON_SIZE,
+                                                                    NULL, &error);
+
+    g_assert_no_error (error);
+    g_assert_cmpint (gdk_pixbuf_get_width (large), ==, ICON_SIZE);
+    g_assert_cmpint (gdk_pixbuf_get_height (large), ==, ICON_SIZE / 2);
+
+    /* Smaller images are never scaled up. */
+    g_autoptr (GdkPixbuf) small = nautilus_thumbnail_decode_stream (small_stream, ICON_SIZE,
+                                                                    NULL, &error);
+
+    g_assert_no_error (error);
+    g_assert_cmpint (gdk_pixbuf_get_width (small), ==, 100);
+    g_assert_cmpint (gdk_pixbuf_get_height (small), ==, 50);
+
+    /* Sizes whose scaled longest side comes out just below the limit in
+     * floating point, and whose shortest side rounds up. */
+    for (guint i = 0; i < 2; i++)
+    {
+        gboolean portrait = (i == 1);
+        g_autoptr (GInputStream) odd_stream = make_jpeg_stream (portrait ? 162 : 322,
+                                                                portrait ? 322 : 162);
+        g_autoptr (GdkPixbuf) odd = nautilus_thumbnail_decode_stream (odd_stream, ICON_SIZE,
+                                                                      NULL, &error);
+
+        g_assert_no_error (error);
+        g_assert_cmpint (gdk_pixbuf_get_width (odd), ==, portrait ? 129 : ICON_SIZE);
+        g_assert_cmpint (gdk_pixbuf_get_height (odd), ==, portrait ? ICON_SIZE : 129);
+    }
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -302,6 +1421,7 @@ main (int   argc,
 
     gtk_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
     g_test_set_nonfatal_assertions ();
+    nautilus_global_preferences_init ();
 
     if (nautilus_application_is_sandboxed () || !can_run_bwrap ())
     {
@@ -309,12 +1429,45 @@ main (int   argc,
         return 77;
     }
 
+    /* First, as the thumbnail factory only looks for thumbnailers once. */
+    g_test_add_func ("/thumbnail/video/timeout",
+                     test_thumbnail_video_timeout);
     g_test_add_func ("/thumbnail/invalid/text",
                      test_thumbnail_text);
     g_test_add_func ("/thumbnail/single/image",
                      test_thumbnail_image);
     g_test_add_func ("/thumbnail/queue/deprioritize",
                      test_thumbnail_test_queue);
+    g_test_add_func ("/thumbnail/queue/priority",
+                     test_thumbnail_queue_priority);
+    g_test_add_func ("/thumbnail/queue/slow-mount",
+                     test_thumbnail_queue_slow_mount);
+    g_test_add_func ("/thumbnail/queue/cancellation",
+                     test_thumbnail_queue_cancellation);
+    g_test_add_func ("/thumbnail/invalid/failure-cache",
+                     test_thumbnail_failure_cache);
+    g_test_add_func ("/thumbnail/animated/probe",
+                     test_thumbnail_animated_probe);
+    g_test_add_func ("/thumbnail/animated/count-frames",
+                     test_thumbnail_animated_count_frames);
+    g_test_add_func ("/thumbnail/animated/paintable/frames",
+                     test_thumbnail_animated_paintable_frames);
+    g_test_add_func ("/thumbnail/animated/paintable/playback",
+                     test_thumbnail_animated_paintable_playback);
+    g_test_add_func ("/thumbnail/animated/cache/eviction",
+                     test_thumbnail_animation_cache_eviction);
+    g_test_add_func ("/thumbnail/animated/cache/max-size",
+                     test_thumbnail_animation_cache_max_size);
+    g_test_add_func ("/thumbnail/animated/image",
+                     test_thumbnail_animated_image);
+    g_test_add_func ("/thumbnail/decode/at-size",
+                     test_thumbnail_decode_at_size);
+    g_test_add_func ("/thumbnail/decode/too-many-pixels",
+                     test_thumbnail_decode_too_many_pixels);
+    g_test_add_func ("/thumbnail/in-process/image",
+                     test_thumbnail_in_process);
+    g_test_add_func ("/thumbnail/in-process/fallback",
+                     test_thumbnail_in_process_fallback);
 
     return g_test_run ();
 }
@@ -0,0 +1,185 @@
+#include <glib.h>
+#include <gtk/gtk.h>
+
+#include <nautilus-directory.h>
+#include <nautilus-file-private.h>
+#include <nautilus-file-utilities.h>
+#include <nautilus-view-item.h>
+#include <nautilus-view-item-filter.h>
+
+typedef struct
+{
+    const char *name;
+    GFileType type;
+    const char *content_type;
+} Entry;
+
+static const Entry entries[] =
+{
+    { "notes.txt", G_FILE_TYPE_REGULAR, "text/plain" },
+    { "NOTES.TXT", G_FILE_TYPE_REGULAR, "text/plain" },
+    { "README", G_FILE_TYPE_REGULAR, "text/plain" },
+    { "main.c", G_FILE_TYPE_REGULAR, "text/x-csrc" },
+    { "photo.jpg", G_FILE_TYPE_REGULAR, "image/jpeg" },
+    { "photo.JPG", G_FILE_TYPE_REGULAR, "image/jpeg" },
+    { "photo.Jpg", G_FILE_TYPE_REGULAR, "image/jpeg" },
+    { "picture.png", G_FILE_TYPE_REGULAR, "image/png" },
+    { "archive.tar.gz", G_FILE_TYPE_REGULAR, "application/x-compressed-tar" },
+    { "Projects", G_FILE_TYPE_DIRECTORY, "inode/directory" },
+};
+
+static GFileInfo *
+create_info (const Entry *entry)
+{
+    GFileInfo *info = g_file_info_new ();
+
+    g_file_info_set_name (info, entry->name);
+    g_file_info_set_display_name (info, entry->name);
+    g_file_info_set_file_type (info, entry->type);
+    g_file_info_set_content_type (info, entry->content_type);
+
+    return info;
+}
+
+static GPtrArray *
+create_items (void)
+{
+    g_autoptr (GFile) location = g_file_new_for_uri ("file:///nautilus-view-item-filter-test");
+    g_autoptr (NautilusDirectory) directory = nautilus_directory_get (location);
+    GPtrArray *items = g_ptr_array_new_with_free_func (g_object_unref);
+
+    for (guint i = 0; i < G_N_ELEMENTS (entries); i++)
+    {
+        g_autoptr (GFileInfo) info = create_info (&entries[i]);
+        g_autoptr (NautilusFile) file = nautilus_file_new_from_info (directory, info);
+
+        g_ptr_array_add (items, nautilus_view_item_new (file));
+    }
+
+    return items;
+}
+
+/* Checks @file_filter against every entry, both compiled and as GTK matches
+ * it, and returns the names it lets through, folders aside. */
+static char *
+match_entries (GtkFileFilter *file_filter)
+{
+    g_autoptr (NautilusViewItemFilter) filter = nautilus_view_item_filter_new ();
+    g_autoptr (GPtrArray) items = create_items ();
+    g_autoptr (GString) matched = g_string_new (NULL);
+
+    nautilus_view_item_filter_set_file_filter (filter, file_filter);
+
+    for (guint i = 0; i < G_N_ELEMENTS (entries); i++)
+    {
+        gboolean matches = gtk_filter_match (GTK_FILTER (filter), items->pdata[i]);
+
+        if (entries[i].type == G_FILE_TYPE_DIRECTORY)
+        {
+            /* Folders are never hidden. */
+            g_assert_true (matches);
+            continue;
+        }
+
+        if (file_filter != NULL)
+        {
+            g_autoptr (GFileInfo) info = create_info (&entries[i]);
+
+            g_assert_cmpint (matches, ==, gtk_filter_match (GTK_FILTER (file_filter), info));
+        }
+
+        if (matches)
+        {
+            g_string_append_printf (matched, "%s%s", matched->len > 0 ? " " : "", entries[i].name);
+        }
+    }
+
+    return g_string_free_and_steal (g_steal_pointer (&matched));
+}
+
+/** Check that plain patterns match case-sensitively, as GTK does */
+static void
+test_view_item_filter_case_sensitive_patterns (void)
+{
+    g_autoptr (GtkFileFilter) file_filter = gtk_file_filter_new ();
+    g_autofree char *matched = NULL;
+
+    gtk_file_filter_add_pattern (file_filter, "*.txt");
+    gtk_file_filter_add_pattern (file_filter, "*.JPG");
+    gtk_file_filter_add_pattern (file_filter, "*.tar.gz");
+
+    matched = match_entries (file_filter);
+    g_assert_cmpstr (matched, ==, "notes.txt photo.JPG archive.tar.gz");
+}
+
+/** Check that suffixes match in any case, and other patterns still match */
+static void
+test_view_item_filter_suffixes (void)
+{
+    g_autoptr (GtkFileFilter) file_filter = gtk_file_filter_new ();
+    g_autofree char *matched = NULL;
+
+    gtk_file_filter_add_suffix (file_filter, "jpg");
+    gtk_file_filter_add_pattern (file_filter, "READ*");
+
+    matched = match_entries (file_filter);
+    g_assert_cmpstr (matched, ==, "README photo.jpg photo.JPG photo.Jpg");
+}
+
+/** Check that MIME types match their subtypes, and wildcards their media type */
+static void
+test_view_item_filter_mime_types (void)
+{
+    g_autoptr (GtkFileFilter) text_filter = gtk_file_filter_new ();
+    g_autoptr (GtkFileFilter) image_filter = gtk_file_filter_new ();
+    g_autofree char *text_matched = NULL;
+    g_autofree char *image_matched = NULL;
+
+    /* C source is a subclass of plain text. */
+    g_assert_true (g_content_type_is_a ("text/x-csrc", "text/plain"));
+
+    gtk_file_filter_add_mime_type (text_filter, "text/plain");
+    text_matched = match_entries (text_filter);
+    g_assert_cmpstr (text_matched, ==, "notes.txt NOTES.TXT README main.c");
+
+    gtk_file_filter_add_mime_type (image_filter, "image/*");
+    image_matched = match_entries (image_filter);
+    g_assert_cmpstr (image_matched, ==, "photo.jpg photo.JPG photo.Jpg picture.png");
+}
+
+/** Check that a filter without rules hides every file, and no filter none */
+static void
+test_view_item_filter_empty (void)
+{
+    g_autoptr (GtkFileFilter) file_filter = gtk_file_filter_new ();
+    g_autofree char *matched = NULL;
+    g_autofree char *unfiltered = NULL;
+
+    matched = match_entries (file_filter);
+    g_assert_cmpstr (matched, ==, "");
+
+    unfiltered = match_entries (NULL);
+    g_assert_cmpstr (unfiltered, ==,
+                     "notes.txt NOTES.TXT README main.c photo.jpg photo.JPG photo.Jpg "
+                     "picture.png archive.tar.gz");
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+    g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+    g_test_set_nonfatal_assertions ();
+    nautilus_ensure_extension_points ();
+
+    g_test_add_func ("/view-item-filter/case-sensitive-patterns",
+                     test_view_item_filter_case_sensitive_patterns);
+    g_test_add_func ("/view-item-filter/suffixes",
+                     test_view_item_filter_suffixes);
+    g_test_add_func ("/view-item-filter/mime-types",
+                     test_view_item_filter_mime_types);
+    g_test_add_func ("/view-item-filter/empty",
+                     test_view_item_filter_empty);
+
+    return g_test_run ();
+}
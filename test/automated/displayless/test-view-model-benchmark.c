@@ -0,0 +1,146 @@
+/* Adding a directory load to the view model in batches, the way the files
+ * view does, against sorting everything again after each batch, which the
+ * view did before.
+ *
+ * Run with `meson test --benchmark` or `-m perf`. */
+
+#include <glib.h>
+#include <gtk/gtk.h>
+
+#include <nautilus-file.h>
+#include <nautilus-file-utilities.h>
+#include <nautilus-view-item.h>
+#include <nautilus-view-model.h>
+
+static int
+compare_names (gconstpointer a,
+               gconstpointer b,
+               gpointer      user_data)
+{
+    NautilusFile *file_a = nautilus_view_item_get_file ((NautilusViewItem *) a);
+    NautilusFile *file_b = nautilus_view_item_get_file ((NautilusViewItem *) b);
+
+    return gtk_ordering_from_cmpfunc (g_strcmp0 (nautilus_file_get_name (file_a),
+                                                 nautilus_file_get_name (file_b)));
+}
+
+static NautilusViewModel *
+create_model (void)
+{
+    NautilusViewModel *model = nautilus_view_model_new (FALSE);
+    g_autoptr (GtkSorter) sorter = GTK_SORTER (gtk_custom_sorter_new (compare_names, NULL, NULL));
+
+    nautilus_view_model_set_sorter (model, sorter);
+
+    return model;
+}
+
+/* Items for the files numbered @first, @first + @step, ... in random order,
+ * as a directory load delivers them. */
+static GList *
+create_shuffled_items (guint first,
+                       guint n_items,
+                       guint step)
+{
+    g_autoptr (GPtrArray) items = g_ptr_array_new ();
+    GList *list = NULL;
+
+    for (guint i = 0; i < n_items; i++)
+    {
+        g_autofree char *uri = g_strdup_printf ("file:///nautilus-view-model-test/file-%06u",
+                                                first + i * step);
+        g_autoptr (NautilusFile) file = nautilus_file_get_by_uri (uri);
+
+        g_ptr_array_add (items, nautilus_view_item_new (file));
+    }
+
+    for (guint i = items->len; i > 1; i--)
+    {
+        guint j = g_test_rand_int_range (0, i);
+        gpointer swap = items->pdata[i - 1];
+
+        items->pdata[i - 1] = items->pdata[j];
+        items->pdata[j] = swap;
+    }
+
+    for (guint i = 0; i < items->len; i++)
+    {
+        list = g_list_prepend (list, items->pdata[i]);
+    }
+
+    return list;
+}
+
+static gdouble
+time_adding_batches (guint    n_batches,
+                     guint    batch_size,
+                     gboolean sort_after_each)
+{
+    g_autoptr (NautilusViewModel) model = create_model ();
+    g_autoptr (GPtrArray) batches = g_ptr_array_new ();
+    g_autoptr (GTimer) timer = NULL;
+
+    for (guint batch = 0; batch < n_batches; batch++)
+    {
+        g_ptr_array_add (batches, create_shuffled_items (batch, batch_size, n_batches));
+    }
+
+    timer = g_timer_new ();
+    for (guint batch = 0; batch < n_batches; batch++)
+    {
+        nautilus_view_model_add_items (model, batches->pdata[batch]);
+
+        if (sort_after_each)
+        {
+            nautilus_view_model_sort (model);
+        }
+    }
+    g_timer_stop (timer);
+
+    for (guint batch = 0; batch < n_batches; batch++)
+    {
+        g_list_free_full (batches->pdata[batch], g_object_unref);
+    }
+
+    return g_timer_elapsed (timer, NULL);
+}
+
+/** Compare adding a directory load in batches with sorting it after each batch */
+static void
+test_view_model_add_items_benchmark (void)
+{
+    const guint n_batches = 200;
+    const guint batch_size = 100;
+    gdouble merged_time, resorted_time;
+
+    if (!g_test_perf ())
+    {
+        g_test_skip ("Benchmarks only run in perf mode (-m perf)");
+
+        return;
+    }
+
+    merged_time = time_adding_batches (n_batches, batch_size, FALSE);
+    resorted_time = time_adding_batches (n_batches, batch_size, TRUE);
+
+    g_test_message ("Adding %u items in batches of %u: %.1f ms, "
+                    "%.1f ms when sorting everything after each batch",
+                    n_batches * batch_size, batch_size,
+                    1000 * merged_time, 1000 * resorted_time);
+    g_test_minimized_result (1000 * merged_time, "%.1f ms to add %u items",
+                             1000 * merged_time, n_batches * batch_size);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+    g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+    g_test_set_nonfatal_assertions ();
+    nautilus_ensure_extension_points ();
+
+    g_test_add_func ("/view-model/benchmark/add-items",
+                     test_view_model_add_items_benchmark);
+
+    return g_test_run ();
+}